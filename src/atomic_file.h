@@ -0,0 +1,139 @@
+//! File descriptor based output: complete writes of large (vectored) chunks and files that appear atomically
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <filesystem>
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "byte_view.h"
+
+/**
+ * Write all given buffers to the file descriptor with as few writev calls as possible.
+ * Partial writes are continued, interrupted calls repeated. The iovec array is modified.
+ * @return Returns false with errno set on an error
+ */
+inline bool write_fully(int fd, iovec *buffers, std::size_t count) noexcept {
+    while (count) {
+        auto written = ::writev(fd, buffers, int(std::min<std::size_t>(count, IOV_MAX)));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        // skip the completely written buffers, advance into a partially written one
+        auto left = std::size_t(written);
+        for (; count && left >= buffers->iov_len; count--, buffers++) left -= buffers->iov_len;
+        if (count) {
+            buffers->iov_base = static_cast<char *>(buffers->iov_base) + left;
+            buffers->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+/// Write the whole byte range to the file descriptor, see write_fully(int, iovec*, std::size_t)
+inline bool write_fully(int fd, ByteView data) noexcept {
+    iovec buffer{const_cast<std::uint8_t *>(data.ptr_), data.size_};
+    return write_fully(fd, &buffer, 1);
+}
+
+/**
+ * A file that appears under its name only once it is complete: the content is written to a temporary file next to
+ * the target (same file system), commit() renames it over the target. A file that is not committed is removed.
+ *
+ * Readers (and a crashed or interrupted writer) never see half written files, so "exists" means "complete".
+ * Writes go straight to the file descriptor, without a stream buffer in between: hand over large chunks.
+ * Move-only. Errors are reported by the return values, like {@link MappedFile}.
+ */
+class AtomicFile {
+public:
+    /**
+     * @param target The final file name, replaced by commit()
+     * @param durable Flush the content to the disk (fdatasync) before the rename, for content that must survive a
+     *        power loss. Costly, off by default.
+     */
+    explicit AtomicFile(std::filesystem::path target, bool durable = false)
+            : target_(std::move(target)), temporary_(temporary_name(target_)), durable_(durable) {
+        fd_ = ::open(temporary_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    }
+
+    AtomicFile(AtomicFile &&other) noexcept
+            : target_(std::move(other.target_)), temporary_(std::move(other.temporary_)),
+              durable_(other.durable_), fd_(std::exchange(other.fd_, -1)) {}
+
+    AtomicFile &operator=(AtomicFile &&other) noexcept {
+        std::swap(target_, other.target_);
+        std::swap(temporary_, other.temporary_);
+        std::swap(durable_, other.durable_);
+        std::swap(fd_, other.fd_);
+        return *this;
+    }
+
+    AtomicFile(AtomicFile const &) = delete;
+
+    AtomicFile &operator=(AtomicFile const &) = delete;
+
+    /// Removes the temporary file if it has not been committed
+    ~AtomicFile() { discard(); }
+
+    /// Returns true if the temporary file is open for writing
+    [[nodiscard]] bool is_valid() const noexcept { return fd_ >= 0; }
+
+    /// The file descriptor of the temporary file, eg for splice(2) or an {@link TooJpeg17::FdSink}
+    [[nodiscard]] int fd() const noexcept { return fd_; }
+
+    [[nodiscard]] const std::filesystem::path &target() const noexcept { return target_; }
+
+    /// Append data. Returns false on errors.
+    bool write(ByteView data) noexcept { return is_valid() && write_fully(fd_, data); }
+
+    /// Append several buffers with one system call (writev). Returns false on errors.
+    bool write(std::initializer_list<ByteView> parts) {
+        std::vector<iovec> buffers;
+        buffers.reserve(parts.size());
+        for (auto &part: parts) buffers.push_back({const_cast<std::uint8_t *>(part.ptr_), part.size_});
+        return is_valid() && write_fully(fd_, buffers.data(), buffers.size());
+    }
+
+    /**
+     * Close the file and rename it to the target, an existing target is replaced atomically.
+     * @return Returns false if a write or the rename failed, the temporary file is removed then.
+     */
+    bool commit() noexcept {
+        if (!is_valid()) return false;
+        bool ok = !durable_ || ::fdatasync(fd_) == 0;
+        ok = ::close(std::exchange(fd_, -1)) == 0 && ok;
+        if (ok) ok = ::rename(temporary_.c_str(), target_.c_str()) == 0;
+        if (!ok) ::unlink(temporary_.c_str());
+        return ok;
+    }
+
+    /// Close and remove the temporary file, the target is not touched
+    void discard() noexcept {
+        if (!is_valid()) return;
+        ::close(std::exchange(fd_, -1));
+        ::unlink(temporary_.c_str());
+    }
+
+    /// A name next to the target that no other thread or process uses
+    static std::filesystem::path temporary_name(const std::filesystem::path &target) {
+        static std::atomic<unsigned> counter{0};
+        auto name = target;
+        name += ".tmp" + std::to_string(::getpid()) + "_" + std::to_string(counter++);
+        return name;
+    }
+
+private:
+    std::filesystem::path target_, temporary_;
+    bool durable_;
+    int fd_ = -1;
+};
@@ -0,0 +1,372 @@
+//! A work-stealing thread pool for batches of encode jobs, eg converting all images of a directory.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "toojpeg_17.h"
+
+namespace TooJpeg17 {
+
+/**
+ * Runs encode jobs on a fixed set of worker threads.
+ *
+ * Each worker owns a job queue. Jobs are distributed round-robin, an idle worker steals from the front of the
+ * other queues, so a few huge images do not stall jobs queued behind them.
+ * Each worker also owns a Scratch object with the image and output buffers. Those are reused across jobs,
+ * which means a steady state batch run does not allocate per image.
+ *
+ * Not copyable and not movable (the workers refer to it).
+ */
+class BatchEncoder {
+public:
+    /// Per worker buffers, kept across jobs
+    struct Scratch {
+        /// Index of the worker that runs the job
+        unsigned worker = 0;
+        /// Decoded image buffer, eg for a loader that decodes into caller provided memory
+        std::vector<std::uint8_t> pixels;
+        /// Encoded output of the last encode() call
+        std::vector<std::uint8_t> output;
+        /// Pixels encoded by the current job, used for the throughput statistics
+        std::uint64_t pixelsEncoded = 0;
+        /// Output bytes of all encodes of the current job (output only holds the last one), see pixelsEncoded
+        std::uint64_t bytesEncoded = 0;
+
+        /// Encode into output (the previous content is discarded, the capacity is kept). See writeJpegQuality().
+        bool encode(const std::uint8_t *image, uint32_t width, uint32_t height, bool downsample,
+                    bool isRGB, unsigned char quality, std::string_view comment = "",
+                    const EncodeOptions &options = {}) {
+            output.clear();
+            auto ok = writeJpegQuality(VectorSink(output), image, width, height, downsample, isRGB, quality,
+                                       comment, options);
+            if (ok) {
+                pixelsEncoded += std::uint64_t(width) * height;
+                bytesEncoded += output.size();
+            }
+            return ok;
+        }
+    };
+
+    /// A job returns false (or throws) if it failed. It should use the Scratch buffers for its data.
+    using Job = std::function<bool(Scratch &)>;
+
+    /// Batch statistics, see statistics()
+    struct Statistics {
+        std::size_t jobs = 0, failed = 0;
+        std::uint64_t pixels = 0, bytes = 0;
+        /// Time the pool has been busy (from the first submit of a batch until it became idle again)
+        std::chrono::nanoseconds wall{0};
+        std::chrono::nanoseconds minLatency{0}, meanLatency{0}, p50Latency{0}, p99Latency{0}, maxLatency{0};
+
+        [[nodiscard]] double seconds() const { return std::chrono::duration<double>(wall).count(); }
+
+        [[nodiscard]] double jobsPerSecond() const { return wall.count() ? double(jobs) / seconds() : 0; }
+
+        [[nodiscard]] double megapixelsPerSecond() const { return wall.count() ? double(pixels) / 1e6 / seconds() : 0; }
+
+        [[nodiscard]] double bytesPerSecond() const { return wall.count() ? double(bytes) / seconds() : 0; }
+    };
+
+    /// @param threads Number of workers, 0 for std::thread::hardware_concurrency()
+    explicit BatchEncoder(unsigned threads = 0) {
+        if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < threads; i++) {
+            workers_.emplace_back(std::make_unique<Worker>());
+            workers_.back()->scratch.worker = i;
+        }
+        for (unsigned i = 0; i < threads; i++) workers_[i]->thread = std::thread([this, i] { run(i); });
+    }
+
+    BatchEncoder(BatchEncoder const &) = delete;
+
+    BatchEncoder &operator=(BatchEncoder const &) = delete;
+
+    /// Finishes all queued jobs and joins the workers
+    ~BatchEncoder() {
+        wait();
+        {
+            std::lock_guard lock(idleMutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker: workers_) worker->thread.join();
+    }
+
+    [[nodiscard]] unsigned threads() const { return unsigned(workers_.size()); }
+
+    /// Queue a job. May be called from any thread, including from within a job.
+    void submit(Job job) {
+        {
+            std::lock_guard lock(idleMutex_);
+            if (pending_++ == 0) busySince_ = std::chrono::steady_clock::now();
+        }
+        enqueue(std::move(job));
+    }
+
+    /**
+     * Queue a job, but block while `capacity` or more jobs are pending. Backpressure for producers that are faster
+     * than the encoder, eg downloads: the memory held by queued jobs stays bounded.
+     * Must not be called from within a job (the job would wait for itself).
+     */
+    void submit_bounded(Job job, std::size_t capacity) {
+        {
+            std::unique_lock lock(idleMutex_);
+            space_.wait(lock, [this, capacity] { return pending_ < std::max<std::size_t>(1, capacity); });
+            if (pending_++ == 0) busySince_ = std::chrono::steady_clock::now();
+        }
+        enqueue(std::move(job));
+    }
+
+    /// Blocks until all submitted jobs are done
+    void wait() {
+        std::unique_lock lock(idleMutex_);
+        idle_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    /**
+     * Statistics of all jobs finished so far. Minimum, mean and maximum latency are exact, the percentiles are
+     * interpolated within the power of two buckets of a histogram (see Metrics::Buckets).
+     */
+    [[nodiscard]] Statistics statistics() const {
+        Statistics result;
+        LatencyHistogram latencies;
+        for (auto &worker: workers_) {
+            std::lock_guard lock(worker->mutex);
+            result.jobs += worker->jobsDone;
+            result.failed += worker->jobsFailed;
+            result.pixels += worker->pixels;
+            result.bytes += worker->bytes;
+            latencies.merge(worker->latencies);
+        }
+        {
+            std::lock_guard lock(idleMutex_);
+            result.wall = busy_ + (pending_ ? std::chrono::steady_clock::now() - busySince_ : std::chrono::nanoseconds(0));
+        }
+        if (!latencies.count) return result;
+
+        result.minLatency = std::chrono::nanoseconds(latencies.min);
+        result.maxLatency = std::chrono::nanoseconds(latencies.max);
+        result.meanLatency = std::chrono::nanoseconds(latencies.sum / latencies.count);
+        result.p50Latency = latencies.percentile(0.5);
+        result.p99Latency = latencies.percentile(0.99);
+        return result;
+    }
+
+private:
+    /// Job latencies in a fixed number of buckets: a long running pool (eg a daemon) needs no memory per job
+    struct LatencyHistogram {
+        std::array<std::uint64_t, Metrics::Buckets> buckets{};
+        std::uint64_t count = 0, sum = 0, min = 0, max = 0;
+
+        void add(std::chrono::nanoseconds latency) {
+            auto nanoseconds = std::uint64_t(std::max<std::chrono::nanoseconds::rep>(latency.count(), 0));
+            buckets[Metrics::detail::bucket(nanoseconds)]++;
+            min = count ? std::min(min, nanoseconds) : nanoseconds;
+            max = std::max(max, nanoseconds);
+            sum += nanoseconds;
+            count++;
+        }
+
+        void merge(const LatencyHistogram &other) {
+            if (!other.count) return;
+            for (std::size_t b = 0; b < buckets.size(); b++) buckets[b] += other.buckets[b];
+            min = count ? std::min(min, other.min) : other.min;
+            max = std::max(max, other.max);
+            sum += other.sum;
+            count += other.count;
+        }
+
+        /// The latency below which the given fraction of the jobs finished, linear within its bucket
+        [[nodiscard]] std::chrono::nanoseconds percentile(double fraction) const {
+            auto rank = std::min(double(count - 1), fraction * double(count));
+            double below = 0;
+            std::size_t b = 0;
+            while (b + 1 < buckets.size() && below + double(buckets[b]) <= rank) below += double(buckets[b++]);
+            // bucket b holds [2^(b-1), 2^b) ns
+            double low = b ? double(1ull << (b - 1)) : 0, high = double(1ull << b);
+            auto estimate = low + (high - low) * (rank - below + 0.5) / double(std::max<std::uint64_t>(buckets[b], 1));
+            return std::chrono::nanoseconds(std::clamp(std::uint64_t(estimate), min, max));
+        }
+    };
+
+    struct Worker {
+        std::thread thread;
+        /// Guards jobs and the statistics below
+        mutable std::mutex mutex;
+        std::deque<Job> jobs;
+        Scratch scratch;
+
+        std::size_t jobsDone = 0, jobsFailed = 0;
+        std::uint64_t pixels = 0, bytes = 0;
+        LatencyHistogram latencies;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<std::size_t> nextQueue_{0};
+
+    /// Guards all of the following members
+    mutable std::mutex idleMutex_;
+    std::condition_variable wake_, idle_, space_;
+    /// Jobs waiting in a queue
+    long queued_ = 0;
+    /// Jobs submitted but not finished yet
+    std::size_t pending_ = 0;
+    bool stop_ = false;
+    std::chrono::steady_clock::time_point busySince_;
+    std::chrono::nanoseconds busy_{0};
+
+    /// Distribute a job round-robin, pending_ has been incremented already
+    void enqueue(Job job) {
+        auto &worker = *workers_[nextQueue_++ % workers_.size()];
+        {
+            std::lock_guard lock(worker.mutex);
+            worker.jobs.push_back(std::move(job));
+        }
+        {
+            std::lock_guard lock(idleMutex_);
+            queued_++;
+        }
+        wake_.notify_one();
+    }
+
+    /// Take a job from the back of the own queue (most recently queued, still warm) or steal from another one
+    bool take(unsigned self, Job &job) {
+        for (std::size_t i = 0; i < workers_.size(); i++) {
+            auto &worker = *workers_[(self + i) % workers_.size()];
+            std::lock_guard lock(worker.mutex);
+            if (worker.jobs.empty()) continue;
+            if (i == 0) {
+                job = std::move(worker.jobs.back());
+                worker.jobs.pop_back();
+            } else {
+                job = std::move(worker.jobs.front());
+                worker.jobs.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void run(unsigned self) {
+        auto &worker = *workers_[self];
+        while (true) {
+            Job job;
+            if (!take(self, job)) {
+                std::unique_lock lock(idleMutex_);
+                wake_.wait(lock, [this] { return stop_ || queued_ > 0; });
+                if (stop_ && queued_ <= 0) return;
+                continue;
+            }
+            {
+                std::lock_guard lock(idleMutex_);
+                queued_--;
+            }
+
+            auto &scratch = worker.scratch;
+            scratch.pixelsEncoded = 0;
+            scratch.bytesEncoded = 0;
+            scratch.output.clear();
+            auto start = std::chrono::steady_clock::now();
+            bool ok = false;
+            try {
+                ok = job(scratch);
+            } catch (...) {
+                ok = false;
+            }
+            auto latency = std::chrono::steady_clock::now() - start;
+            {
+                std::lock_guard lock(worker.mutex);
+                worker.jobsDone++;
+                if (!ok) worker.jobsFailed++;
+                worker.pixels += scratch.pixelsEncoded;
+                worker.bytes += scratch.bytesEncoded;
+                worker.latencies.add(latency);
+            }
+            {
+                std::lock_guard lock(idleMutex_);
+                if (--pending_ == 0) {
+                    busy_ += std::chrono::steady_clock::now() - busySince_;
+                    idle_.notify_all();
+                }
+            }
+            space_.notify_one();
+        }
+    }
+};
+
+/**
+ * Counts the jobs of one caller, eg of one crawled page or one daemon request, so that the caller can wait for its
+ * own jobs while the encoder keeps running the jobs of others (BatchEncoder::wait() waits for all of them).
+ * Copies share the count. Thread safe.
+ */
+class JobGroup {
+public:
+    /// The job, counted until it has finished (or thrown). Submit the result to a BatchEncoder.
+    BatchEncoder::Job add(BatchEncoder::Job job) {
+        {
+            std::lock_guard lock(state_->mutex);
+            state_->pending++;
+        }
+        return [state = state_, job = std::move(job)](BatchEncoder::Scratch &scratch) {
+            // also counted down if the job throws
+            struct Done {
+                State &state;
+                bool ok = false;
+
+                ~Done() {
+                    std::lock_guard lock(state.mutex);
+                    if (!ok) state.failed++;
+                    if (--state.pending == 0) state.idle.notify_all();
+                }
+            } done{*state};
+            done.ok = job(scratch);
+            return done.ok;
+        };
+    }
+
+    /// Blocks until all added jobs are done. Must not be called from within a job of the group.
+    void wait() const {
+        std::unique_lock lock(state_->mutex);
+        state_->idle.wait(lock, [this] { return state_->pending == 0; });
+    }
+
+    /// Jobs of the group that failed so far
+    [[nodiscard]] std::size_t failed() const {
+        std::lock_guard lock(state_->mutex);
+        return state_->failed;
+    }
+
+private:
+    struct State {
+        std::mutex mutex;
+        std::condition_variable idle;
+        std::size_t pending = 0, failed = 0;
+    };
+
+    std::shared_ptr<State> state_ = std::make_shared<State>();
+};
+
+/// Print a one-line summary of the batch statistics
+inline std::ostream &operator<<(std::ostream &out, const BatchEncoder::Statistics &stats) {
+    using std::chrono::duration;
+    auto ms = [](std::chrono::nanoseconds ns) { return duration<double, std::milli>(ns).count(); };
+    return out << stats.jobs << " jobs (" << stats.failed << " failed) in " << stats.seconds() << " s: "
+               << stats.jobsPerSecond() << " jobs/s, " << stats.megapixelsPerSecond() << " MP/s, "
+               << stats.bytesPerSecond() / 1e6 << " MB/s out. Latency ms min/mean/p50/p99/max: "
+               << ms(stats.minLatency) << "/" << ms(stats.meanLatency) << "/" << ms(stats.p50Latency) << "/"
+               << ms(stats.p99Latency) << "/" << ms(stats.maxLatency);
+}
+
+} // namespace TooJpeg17
@@ -0,0 +1,164 @@
+//! Minimal benchmark harness: warmup, repetition until a time budget, robust statistics, table and JSON reports
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Bench {
+
+/// One benchmark case, identified by its name "<stage>/<variant>/<image>/<parameters>"
+struct Result {
+    std::string name, stage, variant, image;
+    /// Pixels and bytes processed per run: input pixels and output bytes (input bytes for stages without output)
+    std::uint64_t pixels = 0, bytes = 0;
+    unsigned repetitions = 0;
+    /// Run times in nanoseconds
+    double min = 0, median = 0, mean = 0, stddev = 0;
+    /// Median speed of the baseline case (the original TooJpeg) with the same input divided by this one, 0 if none
+    double relative = 0;
+
+    [[nodiscard]] double megapixelsPerSecond() const noexcept { return median > 0 ? pixels / median * 1e3 : 0; }
+
+    [[nodiscard]] double bytesPerSecond() const noexcept { return median > 0 ? bytes / median * 1e9 : 0; }
+};
+
+struct Options {
+    /// Runs before the measurement: caches, branch predictors, page faults of the output buffers
+    unsigned warmup = 2;
+    /// Each case runs at least minRepetitions times and at least minSeconds, but at most maxRepetitions times
+    unsigned minRepetitions = 5, maxRepetitions = 1000;
+    double minSeconds = 0.3;
+    /// Only cases whose name contains this text run
+    std::string filter;
+};
+
+/**
+ * Runs the benchmark cases and collects their results.
+ * The median is reported as the speed: it is robust against outliers due to other processes or frequency scaling.
+ */
+class Suite {
+public:
+    explicit Suite(Options options = {}) : options_(std::move(options)) {}
+
+    [[nodiscard]] bool selected(std::string_view name) const {
+        return options_.filter.empty() || name.find(options_.filter) != std::string_view::npos;
+    }
+
+    /**
+     * Measure a case. run() is called once per repetition and returns the bytes it produced (or processed).
+     * @param baseline Name of the case this one is compared to, see Result::relative. Measured before, if selected.
+     * @return The result, nullptr if the case is filtered out
+     */
+    const Result *measure(std::string stage, std::string variant, std::string image, std::string_view parameters,
+                          std::uint64_t pixels, const std::function<std::uint64_t()> &run,
+                          std::string_view baseline = {}) {
+        using clock = std::chrono::steady_clock;
+        Result result{stage + "/" + variant + "/" + image + (parameters.empty() ? "" : "/") + std::string(parameters),
+                      std::move(stage), std::move(variant), std::move(image), pixels};
+        if (!selected(result.name)) return nullptr;
+
+        for (unsigned i = 0; i < options_.warmup; i++) result.bytes = run();
+        std::vector<double> times;
+        double total = 0;
+        while (times.size() < options_.maxRepetitions &&
+               (times.size() < options_.minRepetitions || total < options_.minSeconds * 1e9)) {
+            auto start = clock::now();
+            result.bytes = run();
+            auto time = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+            times.push_back(time);
+            total += time;
+        }
+
+        std::sort(times.begin(), times.end());
+        auto count = times.size();
+        result.repetitions = unsigned(count);
+        result.min = times.front();
+        result.median = count % 2 ? times[count / 2] : (times[count / 2 - 1] + times[count / 2]) / 2;
+        result.mean = total / double(count);
+        double variance = 0;
+        for (auto time: times) variance += (time - result.mean) * (time - result.mean);
+        result.stddev = count > 1 ? std::sqrt(variance / double(count - 1)) : 0;
+        if (!baseline.empty()) {
+            auto reference = std::find_if(results_.begin(), results_.end(), [&](auto &r) { return r.name == baseline; });
+            if (reference != results_.end()) result.relative = reference->median / result.median;
+        }
+        results_.push_back(std::move(result));
+        return &results_.back();
+    }
+
+    [[nodiscard]] const std::vector<Result> &results() const noexcept { return results_; }
+
+private:
+    Options options_;
+    std::vector<Result> results_;
+};
+
+/// One human readable line per result
+inline std::ostream &print_row(std::ostream &out, const Result &result) {
+    auto flags = out.flags();
+    out << std::left << std::setw(56) << result.name << std::right << std::fixed
+        << std::setw(11) << std::setprecision(1) << result.median / 1e3 << " us" << std::setw(8)
+        << (result.mean > 0 ? 100 * result.stddev / result.mean : 0) << " %" << std::setw(10) << std::setprecision(2)
+        << result.megapixelsPerSecond() << " MP/s" << std::setw(10) << result.bytesPerSecond() / 1e6 << " MB/s";
+    if (result.relative > 0) out << std::setw(7) << result.relative << "x";
+    out.flags(flags);
+    return out << "\n";
+}
+
+inline std::ostream &print_header(std::ostream &out) {
+    return out << std::left << std::setw(56) << "case" << std::right << std::setw(14) << "median" << std::setw(10)
+               << "stddev" << std::setw(15) << "pixels" << std::setw(15) << "bytes" << std::setw(8) << "speedup"
+               << "\n";
+}
+
+/// Escape a string for a JSON document
+inline std::string json_string(std::string_view text) {
+    std::string escaped = "\"";
+    for (char c: text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) {
+            const char hex[] = "0123456789abcdef";
+            escaped += "\\u00";
+            escaped += hex[(c >> 4) & 0xF];
+            escaped += hex[c & 0xF];
+            continue;
+        }
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+/**
+ * Write all results as a JSON document: `{"suite": ..., "context": {...}, "results": [{...}, ...]}`.
+ * Times are in nanoseconds. The context holds free-form key/value pairs, eg the selected DCT kernel.
+ */
+inline void write_json(std::ostream &out, const std::vector<Result> &results,
+                       const std::vector<std::pair<std::string, std::string>> &context) {
+    auto flags = out.flags();
+    out << std::setprecision(10) << "{\n  \"suite\": \"TooJpeg17\",\n  \"version\": 1,\n  \"context\": {";
+    for (std::size_t i = 0; i < context.size(); i++)
+        out << (i ? ", " : "") << json_string(context[i].first) << ": " << json_string(context[i].second);
+    out << "},\n  \"results\": [";
+    for (std::size_t i = 0; i < results.size(); i++) {
+        auto &r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"name\": " << json_string(r.name) << ", \"stage\": "
+            << json_string(r.stage) << ", \"variant\": " << json_string(r.variant) << ", \"image\": "
+            << json_string(r.image) << ", \"pixels\": " << r.pixels << ", \"bytes\": " << r.bytes
+            << ", \"repetitions\": " << r.repetitions << ", \"min_ns\": " << r.min << ", \"median_ns\": "
+            << r.median << ", \"mean_ns\": " << r.mean << ", \"stddev_ns\": " << r.stddev
+            << ", \"megapixels_per_second\": " << r.megapixelsPerSecond() << ", \"bytes_per_second\": "
+            << r.bytesPerSecond() << ", \"relative_to_baseline\": " << r.relative << "}";
+    }
+    out << "\n  ]\n}\n";
+    out.flags(flags);
+}
+
+} // namespace Bench
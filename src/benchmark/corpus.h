@@ -0,0 +1,77 @@
+//! Generated benchmark images: the same pixels on every machine and every run, no downloads
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Bench {
+
+struct Image {
+    /// eg "rgb_1280x720"
+    std::string name;
+    std::uint32_t width = 0, height = 0;
+    bool isRGB = true;
+    std::vector<std::uint8_t> pixels;
+
+    [[nodiscard]] std::uint64_t pixelCount() const noexcept { return std::uint64_t(width) * height; }
+};
+
+/**
+ * A photo-like test image: smooth gradients (cheap to encode), hard edged shapes (expensive AC coefficients) and
+ * a little noise (film grain), so that all Huffman code lengths occur.
+ * Deterministic: the pixels only depend on the parameters.
+ */
+inline Image synthetic_image(std::uint32_t width, std::uint32_t height, bool isRGB, std::uint32_t seed = 1) {
+    Image image{(isRGB ? "rgb_" : "gray_") + std::to_string(width) + "x" + std::to_string(height), width, height,
+                isRGB, {}};
+    const unsigned channels = isRGB ? 3 : 1;
+    image.pixels.resize(std::size_t(width) * height * channels);
+    // xorshift32, never zero
+    std::uint32_t state = seed * 2654435761u | 1u;
+    auto noise = [&state] {
+        state ^= state << 13u;
+        state ^= state >> 17u;
+        state ^= state << 5u;
+        return int(state & 15u) - 8;
+    };
+    auto *out = image.pixels.data();
+    for (std::uint32_t y = 0; y < height; y++)
+        for (std::uint32_t x = 0; x < width; x++) {
+            auto u = float(x) / float(width), v = float(y) / float(height);
+            // a checkerboard of 64x64 tiles, every third square with a disc
+            bool tile = ((x / 64) + (y / 64)) % 3 == 0;
+            auto dx = int(x % 64) - 32, dy = int(y % 64) - 32;
+            bool disc = tile && dx * dx + dy * dy < 24 * 24;
+            for (unsigned c = 0; c < channels; c++) {
+                auto value = 128 + 90 * std::sin(6.2831853f * (u * float(c + 1) + v * 0.5f));
+                if (disc) value = c == 1 ? 40.f : 220.f;
+                *out++ = std::uint8_t(std::clamp(int(value) + noise(), 0, 255));
+            }
+        }
+    return image;
+}
+
+/**
+ * The generated corpus: grayscale and RGB images from tiny (border handling dominates, not a multiple of the MCU size)
+ * over a thumbnail (per image costs such as table building show) to 4K UHD. Huge adds a 8192x8192 pair (200 MB RGB),
+ * quick keeps the three smallest sizes.
+ */
+inline std::vector<Image> synthetic_corpus(bool quick, bool huge) {
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> sizes{{17, 13}, {160, 120}, {320, 240}};
+    if (!quick) {
+        sizes.emplace_back(1280, 720);
+        sizes.emplace_back(3840, 2160);
+    }
+    if (huge) sizes.emplace_back(8192, 8192);
+    std::vector<Image> corpus;
+    for (auto[width, height]: sizes) {
+        corpus.push_back(synthetic_image(width, height, false));
+        corpus.push_back(synthetic_image(width, height, true));
+    }
+    return corpus;
+}
+
+} // namespace Bench
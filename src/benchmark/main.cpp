@@ -1,107 +1,409 @@
-//! Benchmarks the Cpp17 variant of toojpeg with the original one
+//! Benchmark suite of TooJpeg17: the encoder stages one by one and whole encodes, compared to the original TooJpeg
 
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
 #include "toojpeg_17.h"
-#include "http.h"
+#include "toojpeg_17_dct.h"
+#include "atomic_file.h"
+#include "io_engine.h"
+#include "image_loader.h"
+#include "image_resize.h"
 
 #include "toojpeg.h"
 
-#include <fstream>
-#include <filesystem>
-#include <chrono>
-#include <image_loader.h>
+#include "benchmark_suite.h"
+#include "corpus.h"
 
-int main() {
-    std::ios_base::sync_with_stdio(false);
-    using std::cout;
-    using std::endl;
-    using namespace std::filesystem;
-    using namespace std::chrono;
-    using namespace std::chrono_literals;
-
-    // Benchmark: Download benchmark file
-    auto benchmark_file = current_path().append("world.jpg");
-    if (!exists(benchmark_file)) {
-        cout << "Download benchmark file" << endl;
-        auto benchmark_file_tmp = current_path().append("world.jpg.tmp");
-        std::ofstream benchmark_file_stream("world.jpg.tmp",
-                                            std::ios_base::trunc | std::ios_base::out | std::ios_base::binary);
-
-        auto res = Socket::writeHttpResponseTo(benchmark_file_stream,
-                                               Socket::Url(
-                                                       "https://upload.wikimedia.org/wikipedia/commons/3/3d/Eckert4.jpg"));
-        if (res) {
-            rename(benchmark_file_tmp, benchmark_file);
-        } else {
-            remove(benchmark_file_tmp);
-            std::cerr << "failed to download benchmark file" << endl;
-        }
+using namespace TooJpeg17;
+
+namespace {
+
+const std::string_view Comment = "Benchmark image";
+
+std::string_view kernel_name(DctKernel kernel) {
+    switch (kernel) {
+        case DctKernel::Scalar:
+            return "scalar";
+        case DctKernel::SSE2:
+            return "sse2";
+        case DctKernel::AVX2:
+            return "avx2";
+        case DctKernel::NEON:
+            return "neon";
     }
+    return "unknown";
+}
 
-    // Load benchmark file
-    ImageLoader loader{benchmark_file.native().c_str()};
-    if (!loader.is_valid()) {
-        throw std::runtime_error("Failed to load benchmark image file");
+/// Level shifted 8x8 blocks of the first channel of the image
+std::vector<float> image_blocks(const Bench::Image &image) {
+    const auto channels = image.isRGB ? 3u : 1u;
+    std::vector<float> blocks;
+    for (std::uint32_t blockY = 0; blockY + 8 <= image.height; blockY += 8)
+        for (std::uint32_t blockX = 0; blockX + 8 <= image.width; blockX += 8)
+            for (std::uint32_t y = 0; y < 8; y++)
+                for (std::uint32_t x = 0; x < 8; x++)
+                    blocks.push_back(
+                            float(image.pixels[((blockY + y) * std::size_t(image.width) + blockX + x) * channels]) -
+                            128.f);
+    return blocks;
+}
+
+/// Colour conversion of each image, 4:4:4 and 4:2:0
+void color_stage(Bench::Suite &suite, const Bench::Image &image) {
+    for (bool downsample: {false, true}) {
+        if (downsample && !image.isRGB) continue;
+        volatile double checksum = 0;
+        suite.measure("color", "toojpeg17", image.name, downsample ? "420" : "444", image.pixelCount(), [&] {
+            checksum = convertColors(image.pixels.data(), image.width, image.height, downsample, image.isRGB);
+            return std::uint64_t(image.pixels.size());
+        });
     }
+}
 
-    // Convert with original (20x)
-    {
-        // Reserve output buffer capacity
-        std::vector<char> output{};
-        output.reserve(300'000);
-        auto sum = 0ms;
-        for (auto i = 0; i < 20; ++i) {
-            output.clear();
-            auto start = steady_clock::now();
-            if (!TooJpeg::writeJpeg(
-                    [&output](ByteView v) { output.insert(output.end(), &v.ptr_[0], &v.ptr_[v.size_]); }, *loader, 800,
-                    600, true, 90, false,
-                    "Benchmark image")) {
-                throw std::runtime_error("Failed to benchmark original TooJpeg");
+/// Forward DCT + quantisation of the same blocks with every kernel this CPU supports
+void dct_stage(Bench::Suite &suite, const Bench::Image &image, const std::vector<float> &blocks) {
+    const auto scaled = scaled_luminance(quant_table(DefaultQuantLuminance_A, 200 - 90 * 2));
+    const auto count = blocks.size() / 64;
+    for (auto kind: {DctKernel::Scalar, DctKernel::SSE2, DctKernel::AVX2, DctKernel::NEON}) {
+        auto kernel = dct_quantize_kernel(kind);
+        if (!kernel) continue;
+        std::vector<float> block(64);
+        std::vector<int16_t> quantized(blocks.size());
+        suite.measure("dct", std::string(kernel_name(kind)), image.name, "q90", count * 64, [&] {
+            for (std::size_t i = 0; i < count; i++) {
+                // the kernels clobber their input
+                std::memcpy(block.data(), blocks.data() + i * 64, 64 * sizeof(float));
+                kernel(block.data(), scaled.data(), quantized.data() + i * 64);
             }
-            auto end = steady_clock::now();
-            sum += duration_cast<milliseconds>(end - start);
-        }
-        cout << "Original TooJpeg : " << sum.count() << " ms. Bytes: " << output.size() << endl;
+            return std::uint64_t(count * 64);
+        });
+    }
+}
+
+/**
+ * Bit packing of the entropy coder: the BitWriter with byte stuffing, without any sink calls. Writes the codewords of
+ * the quantized coefficients of real blocks, each preceded by a fixed 4 bit code in place of its Huffman symbol.
+ */
+void bitwriter_stage(Bench::Suite &suite, const Bench::Image &image, const std::vector<float> &blocks) {
+    static constexpr auto codewords = codewords_for_quantized_dct();
+    const auto scaled = scaled_luminance(quant_table(DefaultQuantLuminance_A, 200 - 90 * 2));
+    const auto count = blocks.size() / 64;
+    std::vector<int16_t> quantized(blocks.size());
+    std::vector<float> block(64);
+    for (std::size_t i = 0; i < count; i++) {
+        std::memcpy(block.data(), blocks.data() + i * 64, 64 * sizeof(float));
+        dct_quantize_scalar(block.data(), scaled.data(), quantized.data() + i * 64);
     }
+    // a generous upper bound: 64 * (4 + 11 bits) per block, stuffing doubles at most
+    std::vector<std::uint8_t> memory(count * 64 * 4 + 1024);
+    suite.measure("bitwriter", "toojpeg17", image.name, "q90", count * 64, [&] {
+        MemorySink sink(memory.data(), memory.size());
+        BitWriter<MemorySink> writer(sink);
+        for (auto coefficient: quantized) {
+            if (!coefficient) continue;
+            writer.writeCodes(BitCode(0x0A, 4), codewords[coefficient + CodeWordLimit]);
+        }
+        writer.flush();
+        writer.drain();
+        return std::uint64_t(sink.size);
+    });
+}
 
-    // Convert with toojpeg17 (20x)
-    {
-        std::vector<std::uint8_t> output{};
-        output.reserve(300'000);
-        auto sum = 0ms;
-        for (auto i = 0; i < 20; ++i) {
-            output.clear();
-            auto start = steady_clock::now();
-            if (!TooJpeg17::writeJpeg<90>(
-                    [&output](ByteView v) { output.insert(output.end(), &v.ptr_[0], &v.ptr_[v.size_]); }, *loader,
-                    800, 600, false, true, "Benchmark image")) {
-                throw std::runtime_error("Failed to benchmark original TooJpeg");
+/// Whole encodes into memory. The original TooJpeg is the baseline of every image, subsampling and quality.
+void encode_stage(Bench::Suite &suite, const Bench::Image &image, const std::vector<unsigned> &qualities) {
+    std::vector<std::uint8_t> output;
+    output.reserve(image.pixels.size() + 64 * 1024);
+    auto *pixels = image.pixels.data();
+    for (bool downsample: {false, true}) {
+        if (downsample && !image.isRGB) continue;
+        std::string subsampling = downsample ? "420" : "444";
+        for (auto quality: qualities) {
+            auto parameters = subsampling + "/q" + std::to_string(quality);
+            std::string baseline;
+            if (image.width <= 0xFFFF && image.height <= 0xFFFF) {
+                if (auto *result = suite.measure("encode", "toojpeg", image.name, parameters, image.pixelCount(), [&] {
+                        output.clear();
+                        if (!TooJpeg::writeJpeg([&output](ByteView v) { output.insert(output.end(), v.ptr_,
+                                                                                      v.ptr_ + v.size_); },
+                                                pixels, (unsigned short) image.width, (unsigned short) image.height,
+                                                image.isRGB, (unsigned char) quality, downsample, Comment.data()))
+                            throw std::runtime_error("Failed to encode with the original TooJpeg");
+                        return std::uint64_t(output.size());
+                    }))
+                    baseline = result->name;
             }
-            auto end = steady_clock::now();
-            sum += duration_cast<milliseconds>(end - start);
+
+            auto encode = [&](const EncodeOptions &options) {
+                return [&, options] {
+                    output.clear();
+                    if (!writeJpegQuality(VectorSink(output), pixels, image.width, image.height, downsample,
+                                          image.isRGB, (unsigned char) quality, Comment, options))
+                        throw std::runtime_error("Failed to encode with TooJpeg17");
+                    return std::uint64_t(output.size());
+                };
+            };
+            suite.measure("encode", "toojpeg17", image.name, parameters, image.pixelCount(), encode({}), baseline);
+            if (quality != 90) continue;
+
+            // the variants at the default quality only
+            suite.measure("encode", "toojpeg17_fixed", image.name, parameters, image.pixelCount(), [&] {
+                output.clear();
+                if (!writeJpeg<90>(VectorSink(output), pixels, image.width, image.height, downsample, image.isRGB,
+                                   Comment))
+                    throw std::runtime_error("Failed to encode with TooJpeg17");
+                return std::uint64_t(output.size());
+            }, baseline);
+            EncodeOptions optimized;
+            optimized.optimizeHuffman = true;
+            suite.measure("encode", "toojpeg17_optimized", image.name, parameters, image.pixelCount(),
+                          encode(optimized), baseline);
+            EncodeOptions progressive;
+            progressive.progressive = true;
+            suite.measure("encode", "toojpeg17_progressive", image.name, parameters, image.pixelCount(),
+                          encode(progressive), baseline);
+            EncodeOptions parallel;
+            parallel.restartRows = 4;
+            parallel.threads = 0;
+            suite.measure("encode", "toojpeg17_threads", image.name, parameters, image.pixelCount(),
+                          encode(parallel), baseline);
+
+            // a byte budget of the q90 size: the quality searched from outside (a full encode per probe) vs
+            // writeJpegTargetSize() (colour conversion and DCT once)
+            const TargetSize budget{std::size_t(encode({})())};
+            std::string search;
+            if (auto *result = suite.measure("encode", "toojpeg17_search", image.name, parameters + "/budget",
+                                             image.pixelCount(), [&] {
+                        unsigned low = budget.minQuality, high = budget.maxQuality;
+                        std::size_t size = 0;
+                        while (low <= high) {
+                            auto probe = (low + high) / 2;
+                            output.clear();
+                            writeJpegQuality(VectorSink(output), pixels, image.width, image.height, downsample,
+                                             image.isRGB, (unsigned char) probe, Comment);
+                            if (output.size() <= budget.maxBytes) {
+                                size = output.size();
+                                low = probe + 1;
+                            } else {
+                                high = probe - 1;
+                            }
+                        }
+                        return std::uint64_t(size);
+                    }))
+                search = result->name;
+            suite.measure("encode", "toojpeg17_target", image.name, parameters + "/budget", image.pixelCount(), [&] {
+                output.clear();
+                auto result = writeJpegTargetSize(VectorSink(output), pixels, image.width, image.height, downsample,
+                                                  image.isRGB, budget, Comment);
+                if (!result) throw std::runtime_error("Failed to encode with TooJpeg17");
+                return std::uint64_t(output.size());
+            }, search);
         }
-        cout << "TooJpeg17 (Fixed Quality) : " << sum.count() << " ms. Bytes: " << output.size() << endl;
     }
+}
 
-    // Convert with toojpeg17 (20x)
-    {
-        std::vector<std::uint8_t> output{};
-        output.reserve(300'000);
-        auto sum = 0ms;
-        for (auto i = 0; i < 20; ++i) {
-            output.clear();
-            auto start = steady_clock::now();
-            if (!TooJpeg17::writeJpegQuality(
-                    [&output](ByteView v) { output.insert(output.end(), &v.ptr_[0], &v.ptr_[v.size_]); }, *loader,
-                    800, 600, false, true, 90, "Benchmark image")) {
-                throw std::runtime_error("Failed to benchmark original TooJpeg");
-            }
-            auto end = steady_clock::now();
-            sum += duration_cast<milliseconds>(end - start);
+/// stb_image decoding of the q90 JPEG of each image: malloc'ed by stb, and into a reused buffer from the thread arena
+void decode_stage(Bench::Suite &suite, const Bench::Image &image) {
+    std::vector<std::uint8_t> jpeg;
+    writeJpegQuality(VectorSink(jpeg), image.pixels.data(), image.width, image.height, false, image.isRGB, 90);
+    auto *baseline = suite.measure("decode", "stb_malloc", image.name, "q90", image.pixelCount(), [&] {
+        ImageLoader loader(jpeg.data(), jpeg.size());
+        if (!loader.is_valid()) throw std::runtime_error("Failed to decode " + image.name);
+        return std::uint64_t(jpeg.size());
+    });
+    std::vector<std::uint8_t> pixels;
+    suite.measure("decode", "arena", image.name, "q90", image.pixelCount(), [&] {
+        ImageLoader loader(jpeg.data(), jpeg.size(), pixels);
+        if (!loader.is_valid()) throw std::runtime_error("Failed to decode " + image.name);
+        return std::uint64_t(jpeg.size());
+    }, baseline ? baseline->name : std::string());
+}
+
+/**
+ * Three thumbnail sizes of each image with all filters: resized one after the other at full resolution (the
+ * baseline), all at once in a single pass, and single pass from the box pyramid (the default reducingGap)
+ */
+void resize_stage(Bench::Suite &suite, const Bench::Image &image) {
+    const std::pair<ResizeFilter, std::string_view> filters[] = {
+            {ResizeFilter::Box,      "box"},
+            {ResizeFilter::Bilinear, "bilinear"},
+            {ResizeFilter::Lanczos3, "lanczos3"}};
+    const unsigned channels = image.isRGB ? 3 : 1;
+    for (auto[filter, name]: filters) {
+        std::vector<ResizeTarget> targets;
+        for (std::uint32_t size: {1024u, 320u, 160u})
+            if (image.width > size || image.height > size)
+                targets.push_back(ResizeTarget::fit(image.width, image.height, size, size, filter));
+        if (targets.empty()) return;
+        auto exact = targets;
+        for (auto &target: exact) target.reducingGap = 0;
+        const auto parameters = std::string(name) + "x" + std::to_string(targets.size());
+        auto bytes = [](const std::vector<ResizedImage> &images) {
+            std::uint64_t sum = 0;
+            for (auto &resized: images) sum += resized.pixels.size();
+            return sum;
+        };
+        auto *baseline = suite.measure("resize", "separate", image.name, parameters, image.pixelCount(), [&] {
+            std::uint64_t sum = 0;
+            for (auto &target: exact)
+                sum += bytes(resize_image(image.pixels.data(), image.width, image.height, channels, {target}));
+            return sum;
+        });
+        auto baselineName = baseline ? baseline->name : std::string();
+        suite.measure("resize", "single_pass", image.name, parameters, image.pixelCount(), [&] {
+            return bytes(resize_image(image.pixels.data(), image.width, image.height, channels, exact));
+        }, baselineName);
+        suite.measure("resize", "reduced", image.name, parameters, image.pixelCount(), [&] {
+            return bytes(resize_image(image.pixels.data(), image.width, image.height, channels, targets));
+        }, baselineName);
+    }
+}
+
+/// Writing encoded files: one AtomicFile after the other, and a batch of 16 files through the IoEngine
+void io_stage(Bench::Suite &suite, const Bench::Image &image, const std::filesystem::path &directory) {
+    std::vector<std::uint8_t> jpeg;
+    writeJpegQuality(VectorSink(jpeg), image.pixels.data(), image.width, image.height, true, image.isRGB, 90,
+                     Comment);
+    const auto target = directory / (image.name + ".jpg");
+    suite.measure("io", "atomic_file", image.name, "q90", image.pixelCount(), [&] {
+        AtomicFile file(target);
+        if (!file.write(ByteView(jpeg.data(), jpeg.size())) || !file.commit())
+            throw std::runtime_error("Failed to write " + target.native());
+        return std::uint64_t(jpeg.size());
+    });
+
+    IoEngine engine;
+    constexpr unsigned Files = 16;
+    suite.measure("io", engine.uses_io_uring() ? "io_engine_uring" : "io_engine_threads", image.name, "q90x16",
+                  image.pixelCount() * Files, [&] {
+                std::atomic<int> failed{0};
+                for (unsigned i = 0; i < Files; i++)
+                    engine.write(directory / (image.name + "_" + std::to_string(i) + ".jpg"), jpeg,
+                                 [&failed](int error) { if (error) failed = error; });
+                engine.wait();
+                if (failed) throw std::runtime_error("Failed to write a benchmark file: " + std::to_string(failed));
+                return std::uint64_t(jpeg.size()) * Files;
+            });
+}
+
+void usage() {
+    std::cout << "Usage: benchmark [options]\n"
+                 "  --quick          Small images, few repetitions: a smoke test\n"
+                 "  --huge           Add 8192x8192 images to the corpus\n"
+                 "  --image=FILE     Add an image file to the corpus (repeatable)\n"
+                 "  --filter=TEXT    Only run cases whose name contains TEXT, eg encode/ or /rgb_1280x720/\n"
+                 "  --repetitions=N  Minimum measured runs per case (default 5)\n"
+                 "  --warmup=N       Unmeasured runs per case (default 2)\n"
+                 "  --min-time=S     Minimum measured seconds per case (default 0.3)\n"
+                 "  --json=FILE      Write the results as JSON, - for stdout\n";
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    std::ios_base::sync_with_stdio(false);
+    Bench::Options options;
+    bool quick = false, huge = false;
+    std::string json;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        auto value = [&](std::string_view flag) { return std::string(arg.substr(flag.size())); };
+        if (arg == "--quick") {
+            quick = true;
+            options.warmup = 1;
+            options.minRepetitions = 3;
+            options.minSeconds = 0.02;
+        } else if (arg == "--huge") huge = true;
+        else if (utils::startsWith(arg, "--image=")) files.push_back(value("--image="));
+        else if (utils::startsWith(arg, "--filter=")) options.filter = value("--filter=");
+        else if (utils::startsWith(arg, "--repetitions=")) options.minRepetitions = std::stoul(value("--repetitions="));
+        else if (utils::startsWith(arg, "--warmup=")) options.warmup = std::stoul(value("--warmup="));
+        else if (utils::startsWith(arg, "--min-time=")) options.minSeconds = std::stod(value("--min-time="));
+        else if (utils::startsWith(arg, "--json=")) json = value("--json=");
+        else {
+            usage();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    auto corpus = Bench::synthetic_corpus(quick, huge);
+    for (auto &file: files) {
+        ImageLoader loader{file.c_str()};
+        if (!loader.is_valid()) {
+            std::cerr << "Failed to load " << file << std::endl;
+            return 1;
+        }
+        Bench::Image image{std::filesystem::path(file).stem().string(), std::uint32_t(loader.width),
+                           std::uint32_t(loader.height), loader.is_rgb(), {}};
+        image.pixels.assign(*loader, *loader + image.pixelCount() * loader.channels);
+        corpus.push_back(std::move(image));
+    }
+    const std::vector<unsigned> qualities = quick ? std::vector<unsigned>{50, 90} : std::vector<unsigned>{50, 75, 90, 95};
+
+    // the human readable table goes to stderr if the JSON document is written to stdout
+    std::ostream &out = json == "-" ? std::cerr : std::cout;
+    Bench::Suite suite(options);
+    auto directory = std::filesystem::temp_directory_path() / ("toojpeg17_benchmark_" + std::to_string(::getpid()));
+    std::filesystem::create_directories(directory);
+
+    Bench::print_header(out);
+    auto report = [&](std::size_t from) {
+        for (auto i = from; i < suite.results().size(); i++) Bench::print_row(out, suite.results()[i]);
+        out.flush();
+        return suite.results().size();
+    };
+    std::size_t reported = 0;
+    try {
+        // stage kernels on the largest grayscale image that is not huge
+        const Bench::Image *blockSource = nullptr;
+        for (auto &image: corpus)
+            if (!image.isRGB && image.pixelCount() <= 1280 * 720 &&
+                (!blockSource || image.pixelCount() > blockSource->pixelCount()))
+                blockSource = &image;
+        if (blockSource) {
+            auto blocks = image_blocks(*blockSource);
+            dct_stage(suite, *blockSource, blocks);
+            bitwriter_stage(suite, *blockSource, blocks);
+            reported = report(reported);
         }
-        cout << "TooJpeg17 (Dynamic Quality): " << sum.count() << " ms. Bytes: " << output.size() << endl;
+        for (auto &image: corpus) {
+            color_stage(suite, image);
+            encode_stage(suite, image, qualities);
+            decode_stage(suite, image);
+            resize_stage(suite, image);
+            io_stage(suite, image, directory);
+            reported = report(reported);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        std::filesystem::remove_all(directory);
+        return 1;
     }
+    std::filesystem::remove_all(directory);
 
+    const std::vector<std::pair<std::string, std::string>> context{
+            {"dct_kernel", std::string(kernel_name(dct_kernel_kind()))},
+            {"hardware_threads", std::to_string(std::thread::hardware_concurrency())},
+            {"corpus", quick ? "quick" : huge ? "huge" : "default"}};
+    if (json == "-") {
+        Bench::write_json(std::cout, suite.results(), context);
+    } else if (!json.empty()) {
+        std::ofstream file(json, std::ios_base::trunc | std::ios_base::out);
+        Bench::write_json(file, suite.results(), context);
+        if (!file) {
+            std::cerr << "Failed to write " << json << std::endl;
+            return 1;
+        }
+    }
     return 0;
 }
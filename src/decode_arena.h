@@ -0,0 +1,181 @@
+//! Per-thread arena for the working memory of the image decoder (the stb_image allocation hooks)
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * A bump allocator for the buffers of one decode at a time, released all at once by reset().
+ *
+ * stb_image allocates a handful of buffers per image (zlib output that grows by realloc, JPEG component planes,
+ * the output image) and frees them in reverse: freeing or growing the latest block works in place, everything else
+ * is only released by reset(). After a reset the memory is kept, merged into one chunk of the size of all chunks, so
+ * a steady stream of similar images does not allocate at all and never takes the lock of the global allocator.
+ *
+ * Use one arena per thread (see current_thread()) and route the stb hooks of the thread to it with a Scope.
+ * Not thread safe, not copyable.
+ */
+class DecodeArena {
+public:
+    /// @param retain Memory kept by reset() at most, bigger chunks (after a huge image) are returned to the system
+    explicit DecodeArena(std::size_t retain = std::size_t(256) << 20u) noexcept: retain_(retain) {}
+
+    DecodeArena(DecodeArena const &) = delete;
+
+    DecodeArena &operator=(DecodeArena const &) = delete;
+
+    /// The arena of the calling thread
+    static DecodeArena &current_thread() {
+        static thread_local DecodeArena arena;
+        return arena;
+    }
+
+    /// Routes the stb_image allocations of this thread to the arena while it lives, resets the arena at the end
+    class Scope {
+    public:
+        explicit Scope(DecodeArena &arena) noexcept: previous_(active_) { active_ = &arena; }
+
+        Scope(Scope const &) = delete;
+
+        Scope &operator=(Scope const &) = delete;
+
+        ~Scope() {
+            active_->reset();
+            active_ = previous_;
+        }
+
+    private:
+        DecodeArena *previous_;
+    };
+
+    /// @return 16 byte aligned memory, nullptr if out of memory
+    void *allocate(std::size_t size) noexcept {
+        size = round(size);
+        if (chunks_.empty() || chunks_.back().available() < Header + size) {
+            auto capacity = std::max({MinChunk, Header + size, chunks_.empty() ? 0 : 2 * chunks_.back().size});
+            Chunk chunk{std::unique_ptr<std::byte[]>(new(std::nothrow) std::byte[capacity]), capacity};
+            if (!chunk.data) return nullptr;
+            chunks_.push_back(std::move(chunk));
+            systemAllocations_++;
+        }
+        auto &chunk = chunks_.back();
+        auto *block = chunk.data.get() + chunk.used;
+        std::memcpy(block, &size, sizeof(size));
+        chunk.used += Header + size;
+        return block + Header;
+    }
+
+    /// Grows or shrinks the latest block in place, other blocks are copied. Like realloc(), nullptr allocates.
+    void *reallocate(void *pointer, std::size_t size) noexcept {
+        if (!pointer) return allocate(size);
+        auto old = block_size(pointer);
+        auto &chunk = chunks_.back();
+        if (is_latest(pointer) && chunk.used - old + round(size) <= chunk.size) {
+            chunk.used = chunk.used - old + round(size);
+            set_size(pointer, round(size));
+            return pointer;
+        }
+        auto *moved = allocate(size);
+        if (moved) std::memcpy(moved, pointer, std::min(old, size));
+        return moved;
+    }
+
+    /// Only the latest block is released before reset()
+    void release(void *pointer) noexcept {
+        if (pointer && is_latest(pointer)) chunks_.back().used -= Header + block_size(pointer);
+    }
+
+    /// True for memory allocated by this arena
+    [[nodiscard]] bool owns(const void *pointer) const noexcept {
+        auto *byte = static_cast<const std::byte *>(pointer);
+        std::less<const std::byte *> less;
+        return std::any_of(chunks_.begin(), chunks_.end(), [byte, less](const Chunk &chunk) {
+            return !less(byte, chunk.data.get()) && less(byte, chunk.data.get() + chunk.size);
+        });
+    }
+
+    /// Release all blocks. The chunks are merged into one, up to the retained size.
+    void reset() noexcept {
+        std::size_t capacity = 0;
+        for (auto &chunk: chunks_) capacity += chunk.size;
+        if (chunks_.size() > 1 || capacity > retain_) {
+            chunks_.clear();
+            if (capacity <= retain_) {
+                Chunk chunk{std::unique_ptr<std::byte[]>(new(std::nothrow) std::byte[capacity]), capacity};
+                if (chunk.data) {
+                    chunks_.push_back(std::move(chunk));
+                    systemAllocations_++;
+                }
+            }
+        }
+        for (auto &chunk: chunks_) chunk.used = 0;
+    }
+
+    /// Bytes held, used or not
+    [[nodiscard]] std::size_t capacity() const noexcept {
+        std::size_t capacity = 0;
+        for (auto &chunk: chunks_) capacity += chunk.size;
+        return capacity;
+    }
+
+    /// Chunks allocated from the system so far: constant in the steady state
+    [[nodiscard]] std::size_t system_allocations() const noexcept { return systemAllocations_; }
+
+    /// @{
+    /// The STBI_MALLOC, STBI_REALLOC and STBI_FREE hooks: the arena of an active Scope, malloc() otherwise
+    static void *stb_malloc(std::size_t size) noexcept {
+        return active_ ? active_->allocate(size) : std::malloc(size);
+    }
+
+    static void *stb_realloc(void *pointer, std::size_t size) noexcept {
+        if (active_ && (!pointer || active_->owns(pointer))) return active_->reallocate(pointer, size);
+        return std::realloc(pointer, size);
+    }
+
+    static void stb_free(void *pointer) noexcept {
+        if (active_ && active_->owns(pointer)) active_->release(pointer);
+        else std::free(pointer);
+    }
+    /// @}
+
+private:
+    /// Each block is preceded by its (rounded) size, which keeps the blocks 16 byte aligned
+    static constexpr std::size_t Header = 16;
+    static constexpr std::size_t MinChunk = std::size_t(1) << 20u;
+
+    struct Chunk {
+        std::unique_ptr<std::byte[]> data;
+        std::size_t size = 0, used = 0;
+
+        [[nodiscard]] std::size_t available() const noexcept { return size - used; }
+    };
+
+    static std::size_t round(std::size_t size) noexcept { return (size + Header - 1) / Header * Header; }
+
+    static std::size_t block_size(const void *pointer) noexcept {
+        std::size_t size;
+        std::memcpy(&size, static_cast<const std::byte *>(pointer) - Header, sizeof(size));
+        return size;
+    }
+
+    static void set_size(void *pointer, std::size_t size) noexcept {
+        std::memcpy(static_cast<std::byte *>(pointer) - Header, &size, sizeof(size));
+    }
+
+    [[nodiscard]] bool is_latest(const void *pointer) const noexcept {
+        if (chunks_.empty()) return false;
+        auto &chunk = chunks_.back();
+        return static_cast<const std::byte *>(pointer) + block_size(pointer) == chunk.data.get() + chunk.used;
+    }
+
+    std::vector<Chunk> chunks_;
+    std::size_t retain_;
+    std::size_t systemAllocations_ = 0;
+    static inline thread_local DecodeArena *active_ = nullptr;
+};
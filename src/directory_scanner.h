@@ -0,0 +1,292 @@
+//! Fast, optionally recursive and parallel listing of image files, size-balanced work chunks and manifest sharding
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "stream_utils.h"
+
+/// A file found by {@link DirectoryScanner}
+struct ScannedFile {
+    std::filesystem::path path;
+    std::uint64_t size = 0;
+};
+
+struct ScanOptions {
+    /// Descend into subdirectories (except hidden ones, eg the crawler's ".http_cache")
+    bool recursive = false;
+    /// Lower case extensions of the listed files, compared case-insensitively. Empty to list all files.
+    std::vector<std::string> extensions{"jpg", "jpeg", "png", "bmp", "gif", "pnm", "ppm", "pgm", "tga", "psd", "hdr"};
+    /// Files ending with this suffix and files with a "<name><suffix>" sibling (converted already) are not listed
+    std::string convertedSuffix = ".new.jpg";
+    /// Threads for recursive scans, 0 for std::thread::hardware_concurrency() (at most 8)
+    unsigned threads = 0;
+};
+
+/**
+ * Lists the files of a directory tree that need a conversion, with their sizes.
+ *
+ * Directories are read in large batches (getdents64 with a 1 MB buffer on Linux, readdir elsewhere). Names are
+ * filtered by extension and converted siblings before any stat, only the remaining files are stat'ed (relative to
+ * the directory, fstatat). Subdirectories of recursive scans are read in parallel.
+ * The result is sorted by path, so that it is the same for every run.
+ *
+ * Exceptions: Throws if the directory can't be read. Unreadable subdirectories are skipped.
+ */
+class DirectoryScanner {
+public:
+    explicit DirectoryScanner(ScanOptions options = {}) : options_(std::move(options)) {
+        for (auto &extension: options_.extensions)
+            for (auto &c: extension) c = char(std::tolower(static_cast<unsigned char>(c)));
+    }
+
+    [[nodiscard]] std::vector<ScannedFile> scan(const std::filesystem::path &directory) {
+        if (!read_directory(directory, true))
+            throw std::runtime_error(utils::from_parts("DirectoryScanner::", __func__, ": Can't read", directory));
+        if (!queue_.empty()) {
+            auto threads = options_.threads ? options_.threads : std::min(8u, std::thread::hardware_concurrency());
+            std::vector<std::thread> workers;
+            for (unsigned i = 0; i < std::max(1u, threads); i++) workers.emplace_back([this] { work(); });
+            for (auto &worker: workers) worker.join();
+        }
+        std::sort(files_.begin(), files_.end(), [](auto &a, auto &b) { return a.path < b.path; });
+        return std::move(files_);
+    }
+
+    /// Returns true if the name ends with one of the extensions (case-insensitive), or if no extensions are given
+    [[nodiscard]] bool matches(std::string_view name) const noexcept {
+        if (options_.extensions.empty()) return true;
+        auto dot = name.rfind('.');
+        if (dot == std::string_view::npos) return false;
+        auto extension = name.substr(dot + 1);
+        return std::any_of(options_.extensions.begin(), options_.extensions.end(), [extension](auto &candidate) {
+            return candidate.size() == extension.size() &&
+                   std::equal(candidate.begin(), candidate.end(), extension.begin(), [](char a, char b) {
+                       return a == std::tolower(static_cast<unsigned char>(b));
+                   });
+        });
+    }
+
+private:
+    ScanOptions options_;
+    /// Guards all of the following members
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::filesystem::path> queue_;
+    /// Directories queued or being read
+    std::size_t pending_ = 0;
+    std::vector<ScannedFile> files_;
+
+    struct Entry {
+        std::string_view name;
+        unsigned char type;
+    };
+
+    void work() {
+        while (true) {
+            std::filesystem::path directory;
+            {
+                std::unique_lock lock(mutex_);
+                wake_.wait(lock, [this] { return !queue_.empty() || pending_ == 0; });
+                if (queue_.empty()) return;
+                directory = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            read_directory(directory, false);
+            std::lock_guard lock(mutex_);
+            if (--pending_ == 0) wake_.notify_all();
+        }
+    }
+
+    /// Reads all entries of an open directory into names (one buffer) and entries (views into it)
+    static bool list(int fd, std::string &names, std::vector<Entry> &entries) {
+        std::vector<std::size_t> offsets;
+        auto add = [&](const char *name, unsigned char type) {
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) return;
+            offsets.push_back(names.size());
+            names.append(name);
+            names.push_back('\0');
+            entries.push_back({{}, type});
+        };
+#ifdef SYS_getdents64
+        /// The kernel structure, not declared by the C library headers
+        struct linux_dirent64 {
+            ino64_t d_ino;
+            off64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[];
+        };
+        std::vector<char> buffer(1u << 20u);
+        while (true) {
+            auto read = ::syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+            if (read < 0 && errno == EINTR) continue;
+            if (read < 0) return false;
+            if (read == 0) break;
+            for (long pos = 0; pos < read;) {
+                auto *entry = reinterpret_cast<linux_dirent64 *>(buffer.data() + pos);
+                add(entry->d_name, entry->d_type);
+                pos += entry->d_reclen;
+            }
+        }
+#else
+        // the stream owns its descriptor, the caller keeps the given one
+        auto *dir = ::fdopendir(::dup(fd));
+        if (!dir) return false;
+        while (auto *entry = ::readdir(dir)) add(entry->d_name, entry->d_type);
+        ::closedir(dir);
+#endif
+        // names may have been reallocated while appending
+        for (std::size_t i = 0; i < entries.size(); i++)
+            entries[i].name = std::string_view(names.data() + offsets[i]);
+        return true;
+    }
+
+    bool read_directory(const std::filesystem::path &directory, bool root) {
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return false;
+        std::string names;
+        std::vector<Entry> entries;
+        if (!list(fd, names, entries)) {
+            ::close(fd);
+            return false;
+        }
+
+        const std::string_view suffix = options_.convertedSuffix;
+        std::unordered_set<std::string_view> all;
+        if (!suffix.empty()) for (auto &entry: entries) all.insert(entry.name);
+
+        std::vector<ScannedFile> found;
+        std::vector<std::filesystem::path> subdirectories;
+        std::string converted;
+        for (auto &entry: entries) {
+            bool maybeDirectory = options_.recursive && entry.name[0] != '.' &&
+                                  (entry.type == DT_DIR || entry.type == DT_UNKNOWN);
+            bool maybeFile = entry.type == DT_REG || entry.type == DT_UNKNOWN || entry.type == DT_LNK;
+            if (maybeFile && (!matches(entry.name) || (!suffix.empty() && utils::endsWith(entry.name, suffix))))
+                maybeFile = false;
+            if (maybeFile && !suffix.empty()) {
+                converted.assign(entry.name);
+                converted += suffix;
+                if (all.count(converted)) maybeFile = false;
+            }
+            if (!maybeFile && !maybeDirectory) continue;
+
+            // symbolic links to files are followed, like std::filesystem::is_regular_file. Links to directories
+            // are not, they could form a cycle.
+            struct stat info{};
+            if (::fstatat(fd, entry.name.data(), &info, entry.type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW) != 0) continue;
+            if (maybeFile && S_ISREG(info.st_mode))
+                found.push_back({directory / entry.name, std::uint64_t(info.st_size)});
+            else if (maybeDirectory && entry.type != DT_LNK && S_ISDIR(info.st_mode))
+                subdirectories.push_back(directory / entry.name);
+        }
+        ::close(fd);
+
+        std::lock_guard lock(mutex_);
+        files_.insert(files_.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+        if (subdirectories.empty()) return true;
+        pending_ += subdirectories.size();
+        for (auto &subdirectory: subdirectories) queue_.push_back(std::move(subdirectory));
+        if (!root) wake_.notify_all();
+        return true;
+    }
+};
+
+/// Files of the same size-balanced work chunk, see balance_chunks()
+struct WorkChunk {
+    /// Index range into the reordered files
+    std::size_t begin = 0, end = 0;
+    std::uint64_t bytes = 0;
+};
+
+/**
+ * Groups the files into chunks of about targetBytes (a file bigger than that gets a chunk of its own) with at most
+ * maxFiles files each. One chunk is one job of the encoder pool: millions of tiny files do not become millions of
+ * jobs, and huge files do not end up in the same job.
+ * The files are sorted by size, largest first: the long running jobs start first and the small ones fill the gaps at
+ * the end (longest processing time first).
+ */
+inline std::vector<WorkChunk>
+balance_chunks(std::vector<ScannedFile> &files, std::uint64_t targetBytes, std::size_t maxFiles = 256) {
+    std::stable_sort(files.begin(), files.end(), [](auto &a, auto &b) { return a.size > b.size; });
+    std::vector<WorkChunk> chunks;
+    for (std::size_t i = 0; i < files.size(); i++) {
+        if (chunks.empty() || chunks.back().bytes + files[i].size > targetBytes ||
+            chunks.back().end - chunks.back().begin >= std::max<std::size_t>(1, maxFiles))
+            chunks.push_back({i, i, 0});
+        chunks.back().end = i + 1;
+        chunks.back().bytes += files[i].size;
+    }
+    return chunks;
+}
+
+/**
+ * The part of the files that shard `index` of `count` processes (eg on several nodes of a cluster that share the
+ * directory). Every shard gets about the same number of bytes: the files are assigned largest first to the shard
+ * with the fewest bytes so far. Deterministic: all shards compute the same assignment from the same file list,
+ * see write_manifest().
+ */
+inline std::vector<ScannedFile> shard(std::vector<ScannedFile> files, unsigned index, unsigned count) {
+    if (count <= 1) return files;
+    if (index >= count)
+        throw std::invalid_argument(utils::from_parts("shard: Invalid shard", index, "of", count));
+    std::sort(files.begin(), files.end(),
+              [](auto &a, auto &b) { return a.size != b.size ? a.size > b.size : a.path < b.path; });
+    std::vector<std::uint64_t> load(count, 0);
+    std::vector<ScannedFile> mine;
+    for (auto &file: files) {
+        auto least = std::size_t(std::min_element(load.begin(), load.end()) - load.begin());
+        load[least] += std::max<std::uint64_t>(1, file.size);
+        if (least == index) mine.push_back(std::move(file));
+    }
+    return mine;
+}
+
+/**
+ * Write the file list, so that several processes work on the same snapshot of the directory without scanning it
+ * again. One "<size>\t<path>" line per file. Paths with a line break can't be listed and are left out.
+ * @return Returns false if the manifest could not be written
+ */
+inline bool write_manifest(const std::filesystem::path &manifest, const std::vector<ScannedFile> &files) {
+    std::ofstream out(manifest, std::ios_base::trunc | std::ios_base::out | std::ios_base::binary);
+    out << "TooJpeg17 manifest 1\n";
+    for (auto &file: files)
+        if (file.path.native().find('\n') == std::string::npos) out << file.size << '\t' << file.path.native() << '\n';
+    return bool(out);
+}
+
+/// Exceptions: Throws if the manifest can't be read or is invalid.
+inline std::vector<ScannedFile> read_manifest(const std::filesystem::path &manifest) {
+    std::ifstream in(manifest, std::ios_base::binary);
+    std::string line;
+    if (!std::getline(in, line) || line != "TooJpeg17 manifest 1")
+        throw std::runtime_error(utils::from_parts("read_manifest: Not a manifest:", manifest));
+    std::vector<ScannedFile> files;
+    while (std::getline(in, line)) {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos)
+            throw std::runtime_error(utils::from_parts("read_manifest: Invalid line:", line));
+        files.push_back({line.substr(tab + 1), std::stoull(line.substr(0, tab))});
+    }
+    return files;
+}
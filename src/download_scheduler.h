@@ -0,0 +1,136 @@
+//! Runs downloads concurrently, bounded by a global and a per-host limit
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "url.h"
+
+namespace Socket {
+
+/// Concurrency limits of a {@link DownloadScheduler}
+struct DownloadLimits {
+    /// Downloads running at the same time
+    unsigned global = 8;
+    /// Downloads running at the same time per protocol and host
+    unsigned perHost = 4;
+};
+
+/**
+ * Runs download jobs on up to `global` threads, with at most `perHost` jobs per protocol and host at a time.
+ *
+ * The sockets are blocking (see {@link HttpSocket}), so each running download occupies a thread. For the few dozen
+ * concurrent downloads of a crawler that is cheaper than an event loop, and the jobs can hand their result straight
+ * to the encoder. Jobs of a host at its limit stay queued, later jobs of other hosts overtake them.
+ * Combine it with a {@link ConnectionPool} that keeps at least `perHost` idle connections per host.
+ *
+ * Not copyable and not movable (the workers refer to it).
+ */
+class DownloadScheduler {
+public:
+    using Limits = DownloadLimits;
+
+    /// A job performs one download. Exceptions are caught and dropped, a job should report errors itself.
+    using Job = std::function<void()>;
+
+    explicit DownloadScheduler(Limits limits = {}) : limits_{std::max(1u, limits.global), std::max(1u, limits.perHost)} {
+        for (unsigned i = 0; i < limits_.global; i++) workers_.emplace_back([this] { run(); });
+    }
+
+    DownloadScheduler(DownloadScheduler const &) = delete;
+
+    DownloadScheduler &operator=(DownloadScheduler const &) = delete;
+
+    /// Finishes all queued jobs and joins the workers
+    ~DownloadScheduler() {
+        wait();
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker: workers_) worker.join();
+    }
+
+    [[nodiscard]] const Limits &limits() const { return limits_; }
+
+    /// Queue a download of the given url. May be called from any thread, including from within a job.
+    void submit(const Url &url, Job job) {
+        {
+            std::lock_guard lock(mutex_);
+            queue_.push_back({std::string(url.protocol_) + "://" + std::string(url.host_), std::move(job)});
+            pending_++;
+        }
+        wake_.notify_one();
+    }
+
+    /// Blocks until all submitted jobs are done
+    void wait() {
+        std::unique_lock lock(mutex_);
+        idle_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    /// Highest number of downloads of a single host that ran at the same time
+    [[nodiscard]] unsigned maxActivePerHost() const {
+        std::lock_guard lock(mutex_);
+        return maxActivePerHost_;
+    }
+
+private:
+    struct Queued {
+        std::string host;
+        Job job;
+    };
+
+    const Limits limits_;
+    std::vector<std::thread> workers_;
+
+    /// Guards all of the following members
+    mutable std::mutex mutex_;
+    std::condition_variable wake_, idle_;
+    std::deque<Queued> queue_;
+    /// Running downloads per host
+    std::map<std::string, unsigned, std::less<>> active_;
+    /// Jobs submitted but not finished yet
+    std::size_t pending_ = 0;
+    unsigned maxActivePerHost_ = 0;
+    bool stop_ = false;
+
+    /// The first queued job whose host is below its limit, or queue_.end()
+    std::deque<Queued>::iterator runnable() {
+        return std::find_if(queue_.begin(), queue_.end(),
+                            [this](const Queued &queued) { return active_[queued.host] < limits_.perHost; });
+    }
+
+    void run() {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            auto next = queue_.end();
+            wake_.wait(lock, [&] { return (next = runnable()) != queue_.end() || stop_; });
+            if (next == queue_.end()) return;
+
+            auto queued = std::move(*next);
+            queue_.erase(next);
+            maxActivePerHost_ = std::max(maxActivePerHost_, ++active_[queued.host]);
+            lock.unlock();
+            try {
+                queued.job();
+            } catch (...) {
+            }
+            lock.lock();
+            active_[queued.host]--;
+            // a slot of this host is free again, a job that waited for it can run now
+            wake_.notify_all();
+            if (--pending_ == 0) idle_.notify_all();
+        }
+    }
+};
+
+} // namespace Socket
@@ -1,5 +1,6 @@
 /*!
- * Standalone HTTP Downloader with a simple URL parser, HTTP response parser, ByteView type and internal 16kb buffer.
+ * Standalone HTTP Downloader with a simple URL parser, HTTP response parser, ByteView type and internal 16kb buffer
+ * per connection.
  * Requires C++17: Uses fold expressions, std::array, std::byte, std::string_view.
  * No C-isms like C-casts have been used.
  *
@@ -9,11 +10,14 @@
  * Limitations:
  * * Uses exceptions for error reporting. C++ exceptions may allocate and will perform a costly stack unwind.
  * * Requires a well-formed HTTP-like response (eg requires a \n\r sequence to detect the http status line).
- *   The 16kb buffer size is the maximum for this impl to try to parse an HTTP header though.
+ *   The buffer grows for bigger headers, up to 1 MB. Bodies need a content-length or chunked transfer-encoding.
  */
+#pragma once
+
 #include <stdexcept>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <cstdio>
 
@@ -26,6 +30,12 @@
 #include <functional>
 #include <string_view>
 #include <algorithm>
+#include <optional>
+#include <iostream>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
 
 // Socket/IP headers (linux/mac)
 #include <arpa/inet.h>
@@ -46,6 +56,7 @@
 
 #else
 using SSL = void*;
+using SSL_SESSION = void*;
 #endif
 
 #ifdef WITH_HTTPS
@@ -59,6 +70,9 @@ using SSL = void*;
 #include "url.h"
 #include "stream_utils.h"
 #include "byte_view.h"
+#include "resolver.h"
+#include "atomic_file.h"
+#include "metrics.h"
 
 namespace Socket {
 using namespace utils;
@@ -67,8 +81,11 @@ using namespace utils;
  * HttpSocket allows to query a given URL via HTTP (and HTTPS via openSSL) and receive the response.
  *
  * Encapsulates the C-Socket POSIX API in a RAII fashion.
- * HttpSocket is not movable (buffer array is part of the type) and not copyable (socket fd).
+ * HttpSocket is not movable (the pool keeps it in a unique_ptr) and not copyable (socket fd).
  * For demonstrational purposes, boost_asio ip::tcp::socket is the more sophisticated choice.
+ *
+ * Connections are persistent (HTTP/1.1 keep-alive): several requests to the same host can be sent one after another,
+ * see reusable() and {@link ConnectionPool}. All https connections share one SSL_CTX.
  */
 template<bool with_https>
 class HttpSocket {
@@ -77,8 +94,15 @@ class HttpSocket {
     Url url_;
     static constexpr int invalidSocketId = -1;
     static constexpr std::size_t bufferSize = 16096;
-    std::array<std::byte, bufferSize> buffer_;
+    /// Status line and headers must fit into the buffer, it grows up to this size
+    static constexpr std::size_t maxHeaderSize = 1u << 20u;
+    /// Receive buffer. Grows for big headers and keeps its size, so reused connections do not reallocate.
+    std::vector<std::byte> buffer_;
     std::string used_ip_;
+    /// The last response was received completely and the server did not ask to close the connection
+    bool reusable_ = false;
+    /// Kernel buffer between the socket and the file of splice_body(), created on first use
+    int pipe_[2] = {-1, -1};
 public:
     HttpSocket(HttpSocket const &) = delete;
 
@@ -89,14 +113,43 @@ public:
     [[nodiscard]] int getSocketId() const { return socketId_; }
 
     /**
-     * Create a new http socket. Parses the url and resolves the host to an IP addr.
+     * Create a new http socket. Parses the url, resolves the host (see {@link Resolver}) and connects to the first
+     * reachable address (see connect_happy_eyeballs()).
      * @param url A valid URL.
+     * @param session A TLS session of a previous connection to the same host, for an abbreviated handshake.
+     *        Only used for https urls, may be nullptr.
      *
      * Exceptions: Throws if the url does not contain a host part, if the IP resolution failed
      * or connecting to the destination failed.
      */
-    explicit HttpSocket(const Url &url)
-            : socketId_(::socket(PF_INET, SOCK_STREAM, 0)), cSSL_(nullptr), url_(url), buffer_{} {
+    explicit HttpSocket(const Url &url, SSL_SESSION *session = nullptr)
+            : socketId_(invalidSocketId), cSSL_(nullptr), url_(url), buffer_(bufferSize) {
+        if (url_.host_.empty())
+            throw std::runtime_error(from_parts("HttpSocket::", __func__, ": URL invalid"));
+        // An explicit port (host:port) overrides the protocol default
+        auto [host, port] = split_host_port(url_.host_, url_.protocol_ == "https" ? 443 : 80);
+
+        // Cached, thread-safe resolution (IPv6 and IPv4), the addresses race for the connection
+        Resolver::Addresses addresses;
+        {
+            Metrics::ScopedTimer timer(Metrics::Timer::Dns);
+            addresses = Resolver::shared().resolve(host, port);
+        }
+        {
+            Metrics::ScopedTimer timer(Metrics::Timer::Connect);
+            socketId_ = connect_happy_eyeballs(addresses);
+        }
+        if (socketId_ == invalidSocketId) {
+            auto error = errno;
+            // the cached addresses may be stale
+            Resolver::shared().invalidate(host);
+            throw std::runtime_error(from_parts("HttpSocket::", __func__, ": connect: ", host, strerror(error)));
+        }
+        Address peer;
+        peer.length = sizeof(peer.storage);
+        if (::getpeername(socketId_, reinterpret_cast<sockaddr *>(&peer.storage), &peer.length) == 0)
+            used_ip_ = peer.ip();
+        Metrics::add(Metrics::Counter::HttpConnections);
 
         // Receive timeout of 2 seconds
         struct timeval tv;
@@ -104,67 +157,68 @@ public:
         tv.tv_usec = 0;
         setsockopt(socketId_, SOL_SOCKET, SO_RCVTIMEO, (const char *) &tv, sizeof tv);
 
-        if (url_.host_.empty())
-            throw std::runtime_error(from_parts("HttpSocket::", __func__, ": URL invalid"));
-        auto host_str = std::string(url_.host_);
-        const char *host = host_str.c_str();
-        struct hostent *he = gethostbyname(host);
-
-        if (he == nullptr) {
-            switch (h_errno) {
-                case NO_ADDRESS:
-                    throw std::runtime_error(
-                            from_parts("HttpSocket::", __func__, "The name is valid but it has no address",
-                                       strerror(h_errno)));
-                case NO_RECOVERY:
-                    throw std::runtime_error(
-                            from_parts("HttpSocket::", __func__,
-                                       "A non-recoverable name server error occurred",
-                                       strerror(h_errno)));
-                case TRY_AGAIN:
-                    throw std::runtime_error(
-                            from_parts("HttpSocket::", __func__,
-                                       "The name server is temporarily unavailable",
-                                       strerror(h_errno)));
-                case HOST_NOT_FOUND:
-                default:
-                    throw std::runtime_error(
-                            from_parts("HttpSocket::", __func__, "The host was not found",
-                                       strerror(h_errno)));
-            }
-        }
-
-        auto ip_addr = (struct in_addr *) he->h_addr_list[0];
-        auto ip_addr_str = inet_ntoa(*(ip_addr));
-        used_ip_ = ip_addr_str;
-
-        struct sockaddr_in serverAddr{};
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(url_.protocol_ == "https" ? 443 : 80);
-        serverAddr.sin_addr.s_addr = ip_addr->s_addr;
-
-        if (::connect(getSocketId(), (struct sockaddr *) &serverAddr, sizeof(serverAddr)) != 0) {
-            close();
-            throw std::runtime_error(from_parts("HttpSocket::", __func__, ": connect: ", strerror(errno)));
-        }
-
         if (url_.protocol_ == "https") {
             if constexpr (with_https) {
-                init_ssl();
-                init_ssl_session();
+                // the destructor does not run for a throwing constructor
+                try {
+                    Metrics::ScopedTimer timer(Metrics::Timer::TlsHandshake);
+                    init_ssl_session(session);
+                }
+                catch (...) {
+                    close();
+                    throw;
+                }
             } else throw std::runtime_error("OpenSSL not compiled in, but https url requested");
         }
     }
 
     [[nodiscard]] HttpParsedResponse requestURL(HttpHeaderParser::Callback write_back) {
+        return requestURL(url_, std::move(write_back));
+    }
+
+    /**
+     * Request another resource of the same host on this connection. Only valid while reusable() returns true
+     * (or for the first request).
+     * @param conditional Validators of a cached copy: sent as If-None-Match/If-Modified-Since, the server responds
+     *        with 304 (and no body) if the resource did not change. May be nullptr.
+     * @param validators Receives the ETag and Last-Modified headers of the response. May be nullptr.
+     * @param splice_to A file descriptor for the body of a 200 response, or -1. For http connections and
+     *        content-length bodies, the body bytes after the first received block are moved from the socket to the
+     *        file by the kernel (splice(2)) and bypass write_back. The first block is still handed to write_back,
+     *        which must write it to the same file.
+     */
+    [[nodiscard]] HttpParsedResponse requestURL(const Url &url, HttpHeaderParser::Callback write_back,
+                                                const HttpValidators *conditional = nullptr,
+                                                HttpValidators *validators = nullptr, int splice_to = -1) {
+        Metrics::ScopedTimer timer(Metrics::Timer::Transfer);
+        Metrics::add(Metrics::Counter::HttpRequests);
+        reusable_ = false;
         std::stringstream msg;
-        msg << "GET " << url_.path_and_query_ << " HTTP/1.1\r\n" << "host: " << url_.host_ << "\r\n"
-            << "user-agent: Mozilla/5.0 (X11; Fedora; Linux x86_64)\r\n" << "accept: */*\r\n" << "\r\n";
+        msg << "GET " << url.path_and_query_ << " HTTP/1.1\r\n" << "host: " << url.host_ << "\r\n"
+            << "user-agent: Mozilla/5.0 (X11; Fedora; Linux x86_64)\r\n" << "accept: */*\r\n";
+        if (conditional && !conditional->etag.empty()) msg << "if-none-match: " << conditional->etag << "\r\n";
+        if (conditional && !conditional->last_modified.empty())
+            msg << "if-modified-since: " << conditional->last_modified << "\r\n";
+        msg << "\r\n";
         auto str = msg.str();
         putMessageData(str.data(), str.size());
-        return receive(std::move(write_back));
+        return receive(std::move(write_back), validators, splice_to);
     }
 
+    /// Returns true if the last response was read completely and the connection may be used for another request
+    [[nodiscard]] bool reusable() const noexcept { return reusable_ && socketId_ != invalidSocketId; }
+
+    /**
+     * Returns the TLS session for resumption by a later connection (the caller owns a reference, free it with
+     * SSL_SESSION_free), or nullptr for http connections.
+     */
+    template<bool with_https_ = with_https, typename = std::enable_if_t<with_https_, std::size_t>>
+    [[nodiscard]] SSL_SESSION *session() const noexcept { return cSSL_ ? SSL_get1_session(cSSL_) : nullptr; }
+
+    /// Returns true if the TLS handshake resumed a previous session
+    template<bool with_https_ = with_https, typename = std::enable_if_t<with_https_, std::size_t>>
+    [[nodiscard]] bool session_reused() const noexcept { return cSSL_ && SSL_session_reused(cSSL_) == 1; }
+
     ~HttpSocket() {
         // This object has been closed or moved.
         if (socketId_ == invalidSocketId) { return; }
@@ -186,12 +240,13 @@ private:
      * This method is only available if https is enabled.
      */
     template<bool with_https_ = with_https, typename = std::enable_if_t<with_https_, std::size_t>>
-    [[nodiscard]] std::size_t read_from_socket(std::enable_if_t<with_https_, std::size_t> dataRead) noexcept {
+    [[nodiscard]] std::size_t
+    read_from_socket(std::enable_if_t<with_https_, std::size_t> dataRead, std::size_t size) noexcept {
         if (cSSL_) {
             std::size_t r = 0;
             while (true) {
                 // See https://www.openssl.org/docs/man1.0.2/man3/SSL_get_error.html. The read operation may have to be repeated.
-                r = SSL_read(cSSL_, this->buffer_.data() + dataRead, this->buffer_.size() - dataRead);
+                r = SSL_read(cSSL_, this->buffer_.data() + dataRead, int(size));
                 if (r < 0) {
                     int e = SSL_get_error(cSSL_, r);
                     if (e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE) break;
@@ -200,7 +255,7 @@ private:
             }
             return r;
         }
-        return read(getSocketId(), this->buffer_.data() + dataRead, this->buffer_.size() - dataRead);
+        return read(getSocketId(), this->buffer_.data() + dataRead, size);
     }
 
     /**
@@ -208,22 +263,42 @@ private:
      * This method is only available if http is not enabled.
      */
     template<bool with_https_ = with_https, typename = std::enable_if_t<!with_https_, std::size_t>>
-    [[nodiscard]] std::size_t read_from_socket(std::size_t dataRead) noexcept {
-        return read(getSocketId(), this->buffer_.data() + dataRead, this->buffer_.size() - dataRead);
+    [[nodiscard]] std::size_t read_from_socket(std::size_t dataRead, std::size_t size) noexcept {
+        return read(getSocketId(), this->buffer_.data() + dataRead, size);
     }
 
+    /**
+     * The SSL_CTX shared by all connections. Created on first use, freed at exit.
+     * Client side session caching is enabled, so that sessions can be resumed, see session().
+     */
     template<bool with_https_ = with_https, typename = std::enable_if_t<with_https_, std::size_t>>
-    void init_ssl_session() {
-        SSL_CTX *ctx = nullptr;
-
-        const SSL_METHOD *method = TLS_client_method();
-        if (method == nullptr) throw std::runtime_error(from_parts("HttpSocket::SSL", strerror(errno)));
-
-        ctx = SSL_CTX_new(method);
-        if (ctx == nullptr) throw std::runtime_error(from_parts("HttpSocket::SSL", strerror(errno)));
+    static SSL_CTX *ssl_context() {
+        // CPP11: thread-safe, one time initialisation of function local statics
+        static const std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> context{[] {
+            SSL_library_init();
+            OPENSSL_add_all_algorithms_noconf();
+            SSL_load_error_strings();
+
+            const SSL_METHOD *method = TLS_client_method();
+            if (method == nullptr) throw std::runtime_error(from_parts("HttpSocket::SSL", strerror(errno)));
+            SSL_CTX *ctx = SSL_CTX_new(method);
+            if (ctx == nullptr) throw std::runtime_error(from_parts("HttpSocket::SSL", strerror(errno)));
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+            return ctx;
+        }(), SSL_CTX_free};
+        return context.get();
+    }
 
-        cSSL_ = SSL_new(ctx);
+    template<bool with_https_ = with_https, typename = std::enable_if_t<with_https_, std::size_t>>
+    void init_ssl_session(SSL_SESSION *session) {
+        cSSL_ = SSL_new(ssl_context());
+        if (cSSL_ == nullptr) throw std::runtime_error(from_parts("HttpSocket::SSL", strerror(errno)));
         SSL_set_fd(cSSL_, this->socketId_);
+        // SNI: required by most virtual hosts
+        auto host = split_host_port(url_.host_, 443).first;
+        SSL_set_tlsext_host_name(cSSL_, host.c_str());
+        // abbreviated handshake if the server still knows the session
+        if (session) SSL_set_session(cSSL_, session);
         int err_connect = SSL_connect(cSSL_);
         if (err_connect != 1) {
             int err = SSL_get_error(cSSL_, err_connect);
@@ -244,37 +319,36 @@ private:
         // std::cout << "SSL connection using " << SSL_get_cipher (cSSL_) << std::endl;
     }
 
-    template<bool with_https_ = with_https, typename = std::enable_if_t<with_https_, std::size_t>>
-    static void init_ssl() {
-        SSL_library_init();
-        OPENSSL_add_all_algorithms_noconf();
-        SSL_load_error_strings();
-    }
-
     /**
      * Receives data and calls the given callback method for each new, received chunk.
      * The http status line and headers are not handed to the callback, but parsed first.
      * @param write_back A method that handles received data.
+     * @param validators Receives the ETag and Last-Modified headers, may be nullptr
+     * @param splice_to See requestURL()
+     * Exceptions: Throws if the connection ends after the headers but before the body is complete.
      */
-    inline HttpParsedResponse receive(HttpHeaderParser::Callback write_back) {
+    inline HttpParsedResponse receive(HttpHeaderParser::Callback write_back, HttpValidators *validators,
+                                      int splice_to) {
         if (socketId_ == 0) {
             throw std::logic_error(from_parts("HttpSocket::", __func__,
                                               ": accept called on a bad socket object"));
         }
 
-        // Closes the write half of the TCP stream socket (if not using SSL)
-        if (!cSSL_) {
-            if (::shutdown(getSocketId(), SHUT_WR) != 0) {
-                throw std::domain_error(
-                        from_parts("HTTPProtocol::", __func__, ": shutdown: critical error: ", strerror(errno)));
-            }
-        }
-
-        HttpHeaderParser parser;
+        // The connection stays open for further requests (keep-alive), so the response ends after content-length
+        // bytes and not with EOF. Never read beyond the body, the connection must stay in sync.
+        HttpHeaderParser parser(validators);
         std::size_t dataRead = 0;
-        while (dataRead < this->buffer_.size()) {
-            // Append to the internal buffer until EOF or the buffer is full
-            std::size_t get = read_from_socket(dataRead);
+        while (true) {
+            // Append to the internal buffer until the body is complete. Only incomplete headers fill the buffer.
+            if (dataRead == this->buffer_.size()) {
+                if (this->buffer_.size() >= maxHeaderSize)
+                    throw std::runtime_error(
+                            from_parts("HttpSocket::", __func__, ": Did not receive HTTP status line and headers"));
+                this->buffer_.resize(std::min(maxHeaderSize, 2 * this->buffer_.size()));
+            }
+            auto size = this->buffer_.size() - dataRead;
+            if (parser.has_parsed()) size = std::min(size, parser.remaining());
+            std::size_t get = read_from_socket(dataRead, size);
             if (get == static_cast<std::size_t>(-1)) {
                 switch (errno) {
                     case 0:
@@ -309,8 +383,7 @@ private:
                     case ECONNRESET:
                     case ENOTCONN: {
                         // Connection broken.
-                        // Return the data we have available and exit
-                        // as if the connection was closed correctly.
+                        // Handled like a closed connection below.
                         get = 0;
                         break;
                     }
@@ -322,40 +395,86 @@ private:
                 }
             }
             if (get == 0) {
+                // A response without a complete body must not pass for a successful one
+                if (parser.has_parsed() && !parser.receive_done())
+                    throw std::runtime_error(
+                            from_parts("HttpSocket::", __func__, ": Connection closed before the body was complete"));
                 break;
             }
             dataRead += get;
+            Metrics::add(Metrics::Counter::HttpBytes, get);
             if (parser.parse(this->buffer_.data(), dataRead, write_back)) {
                 dataRead = 0;
             }
-            if (parser.receive_done()) break;
-            if (!parser.has_parsed() && this->buffer_.size() <= dataRead) {
-                throw std::runtime_error(
-                        from_parts("HttpSocket::", __func__,
-                                   ": Did not receive HTTP status line and headers",
-                                   strerror(errno)));
+            if (splice_to >= 0 && !cSSL_ && parser.has_parsed() && !parser.parsed_header().chunked &&
+                parser.parsed_header().status_code == 200 && !parser.receive_done()) {
+                // falls back to reading through the buffer if the file does not support splicing
+                if (!splice_body(splice_to, parser)) splice_to = -1;
             }
+            if (parser.receive_done()) break;
         }
+        reusable_ = parser.has_parsed() && parser.receive_done() && parser.parsed_header().keep_alive;
         return parser.parsed_header();
     }
 
+    /**
+     * Move the rest of a content-length body from the socket to the file through a pipe, without copying it to user
+     * space (Linux only).
+     * @return Returns false if splicing is not supported (nothing has been moved then), true if the body is complete
+     *
+     * Exceptions: Throws if the connection broke or the file could not be written.
+     */
+    bool splice_body(int fd, HttpHeaderParser &parser) {
+#ifdef SPLICE_F_MOVE
+        if (pipe_[0] < 0 && ::pipe2(pipe_, O_CLOEXEC) != 0) return false;
+        bool moved = false;
+        while (auto remaining = parser.remaining()) {
+            auto in = ::splice(socketId_, nullptr, pipe_[1], nullptr, std::min<std::size_t>(remaining, 1u << 16u),
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (in < 0 && !moved && (errno == EINVAL || errno == ENOSYS)) return false;
+            if (in <= 0)
+                throw std::runtime_error(from_parts("HttpSocket::", __func__, ": Connection closed during body",
+                                                    in < 0 ? strerror(errno) : ""));
+            moved = true;
+            for (auto pending = std::size_t(in); pending;) {
+                auto out = ::splice(pipe_[0], nullptr, fd, nullptr, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (out < 0 && errno == EINTR) continue;
+                if (out <= 0)
+                    throw std::runtime_error(from_parts("HttpSocket::", __func__, ": Writing the body failed",
+                                                        out < 0 ? strerror(errno) : ""));
+                pending -= std::size_t(out);
+            }
+            parser.skip(std::size_t(in));
+            Metrics::add(Metrics::Counter::HttpBytes, std::size_t(in));
+        }
+        return true;
+#else
+        (void) fd;
+        (void) parser;
+        return false;
+#endif
+    }
+
     /**
      * Close socket connections. Write and read attempts will result in an exception.
      */
     void close() {
         if (socketId_ == invalidSocketId) { return; }
+        reusable_ = false;
+        for (auto &end: pipe_) if (end >= 0) ::close(std::exchange(end, -1));
         /// Cpp17: If constexpr to selectively execute the openSSL shutdown sequence
         if constexpr (with_https) {
             if (cSSL_) {
                 SSL_shutdown(cSSL_);
+                SSL_free(cSSL_);
                 cSSL_ = nullptr;
-                socketId_ = invalidSocketId;
-                return;
             }
         }
         while (true) {
             int state = ::close(socketId_);
-            if (state == invalidSocketId) {
+            // the descriptor is released even if close was interrupted, never retry (see close(2))
+            if (state == 0 || errno == EINTR) {
                 break;
             }
             switch (errno) {
@@ -367,10 +486,6 @@ private:
                     throw std::runtime_error(
                             from_parts("HttpSocket::", __func__, ": close: EIO:", socketId_, " ",
                                        strerror(errno)));
-                case EINTR: {
-                    // Usually: Check for user interrupt flags.
-                    break;
-                }
                 default:
                     throw std::runtime_error(
                             from_parts("HttpSocket::", __func__, ": close: ???:", socketId_, " ",
@@ -385,12 +500,13 @@ private:
     write_to_socket(std::enable_if_t<with_https_, std::size_t> dataWritten, char const *buffer, std::size_t size) {
         return cSSL_ ?//
                SSL_write(cSSL_, buffer + dataWritten, size - dataWritten) :
-               write(getSocketId(), buffer + dataWritten, size - dataWritten);
+               ::send(getSocketId(), buffer + dataWritten, size - dataWritten, MSG_NOSIGNAL);
     }
 
     template<bool with_https_ = with_https, typename = std::enable_if_t<!with_https_, std::size_t>>
     std::size_t write_to_socket(std::size_t dataWritten, char const *buffer, std::size_t size) {
-        return write(getSocketId(), buffer + dataWritten, size - dataWritten);
+        // a connection closed by the peer must not raise SIGPIPE
+        return ::send(getSocketId(), buffer + dataWritten, size - dataWritten, MSG_NOSIGNAL);
     }
 
     void putMessageData(char const *buffer, std::size_t size) {
@@ -443,17 +559,141 @@ private:
 };
 
 /**
- * Downloads data from a http URL and writes it to the given output stream.
+ * Keeps idle, persistent connections per protocol and host, for many downloads from the same server
+ * (eg all images of a web page).
+ *
+ * request() takes an idle connection of the url's host (or connects) and returns it to the pool afterwards if the
+ * response was complete and the server did not close the connection. A reused connection may have been closed by the
+ * server in the meantime, such a request is repeated once on a new connection.
+ * For https the TLS session of the last handshake with a host is kept, so new connections resume it (abbreviated
+ * handshake) instead of a full handshake.
+ *
+ * Thread-safe: the lock is only held while taking or returning a connection, never during a request.
+ */
+template<bool with_https>
+class ConnectionPool {
+public:
+    using Connection = HttpSocket<with_https>;
+
+    /// @param maxIdlePerHost Idle connections kept per host, further connections are closed after their request
+    explicit ConnectionPool(std::size_t maxIdlePerHost = 4) : maxIdlePerHost_(maxIdlePerHost) {}
+
+    ConnectionPool(ConnectionPool const &) = delete;
+
+    ConnectionPool &operator=(ConnectionPool const &) = delete;
+
+    ~ConnectionPool() {
+        if constexpr (with_https) {
+            for (auto &[key, host]: hosts_)
+                if (host.session) SSL_SESSION_free(host.session);
+        }
+    }
+
+    /**
+     * GET the given url on a pooled connection, see HttpSocket::requestURL().
+     * Exceptions: Throws if connecting fails or the response is invalid.
+     */
+    [[nodiscard]] HttpParsedResponse request(const Url &url, HttpHeaderParser::Callback write_back,
+                                             const HttpValidators *conditional = nullptr,
+                                             HttpValidators *validators = nullptr, int splice_to = -1) {
+        auto key = std::string(url.protocol_) + "://" + std::string(url.host_);
+        if (auto connection = take(key)) {
+            // The server may have closed an idle connection. Retry on a new one, unless data has been delivered.
+            bool delivered = false;
+            try {
+                auto parsed = connection->requestURL(url, [&](HttpParsedResponse header, ByteView data) {
+                    delivered = true;
+                    write_back(header, data);
+                }, conditional, validators, splice_to);
+                if (parsed.status_code != 0) {
+                    give_back(key, std::move(connection));
+                    return parsed;
+                }
+            } catch (const std::exception &) {
+                if (delivered) throw;
+            }
+        }
+        auto connection = connect(key, url);
+        auto parsed = connection->requestURL(url, std::move(write_back), conditional, validators, splice_to);
+        give_back(key, std::move(connection));
+        return parsed;
+    }
+
+    /// Number of connections opened so far
+    [[nodiscard]] std::size_t connections() const {
+        std::lock_guard lock(mutex_);
+        return connections_;
+    }
+
+    /// Number of https connections that resumed a TLS session
+    [[nodiscard]] std::size_t resumed() const {
+        std::lock_guard lock(mutex_);
+        return resumed_;
+    }
+
+private:
+    struct Host {
+        std::vector<std::unique_ptr<Connection>> idle;
+        /// The TLS session of the last handshake, one reference owned by the pool
+        SSL_SESSION *session = nullptr;
+    };
+
+    const std::size_t maxIdlePerHost_;
+    /// Guards all of the following members
+    mutable std::mutex mutex_;
+    std::map<std::string, Host, std::less<>> hosts_;
+    std::size_t connections_ = 0, resumed_ = 0;
+
+    std::unique_ptr<Connection> take(const std::string &key) {
+        std::lock_guard lock(mutex_);
+        auto &idle = hosts_[key].idle;
+        if (idle.empty()) return nullptr;
+        auto connection = std::move(idle.back());
+        idle.pop_back();
+        return connection;
+    }
+
+    std::unique_ptr<Connection> connect(const std::string &key, const Url &url) {
+        SSL_SESSION *session = nullptr;
+        if constexpr (with_https) {
+            std::lock_guard lock(mutex_);
+            // the connection gets its own reference, the cached one may be replaced meanwhile
+            session = hosts_[key].session;
+            if (session) SSL_SESSION_up_ref(session);
+        }
+        auto connection = std::make_unique<Connection>(url, session);
+        std::lock_guard lock(mutex_);
+        connections_++;
+        if constexpr (with_https) {
+            if (session) SSL_SESSION_free(session);
+            if (connection->session_reused()) resumed_++;
+            if (auto latest = connection->session()) {
+                auto &cached = hosts_[key].session;
+                if (cached) SSL_SESSION_free(cached);
+                cached = latest;
+            }
+        }
+        return connection;
+    }
+
+    void give_back(const std::string &key, std::unique_ptr<Connection> connection) {
+        if (!connection->reusable()) return;
+        std::lock_guard lock(mutex_);
+        auto &idle = hosts_[key].idle;
+        if (idle.size() < maxIdlePerHost_) idle.push_back(std::move(connection));
+    }
+};
+
+/**
+ * Downloads data from a http URL via a pooled connection and writes it to the given output stream.
  *
  * @param stream Output stream for the received data
  * @param url A valid URL.
+ * @param pool Connections of earlier downloads from the same host are reused, see {@link ConnectionPool}.
  * @return Returns an option resolving to the received size if successful and resolving to false otherwise.
  */
-std::optional<std::size_t> writeHttpResponseTo(std::ostream &stream, const Url &url) {
-    Socket::HttpSocket<WITH_HTTPS> connect(url);
-
-    std::cout << "Resolved IP " << connect.remote_ip() << std::endl;
-
+inline std::optional<std::size_t>
+writeHttpResponseTo(std::ostream &stream, const Url &url, ConnectionPool<WITH_HTTPS> &pool) {
     std::string error_string;
     auto write_back = [&stream, &error_string](HttpParsedResponse header, ByteView data) {
         if (data.size_ == 0) return;
@@ -467,7 +707,7 @@ std::optional<std::size_t> writeHttpResponseTo(std::ostream &stream, const Url &
         }
     };
 
-    auto parsed = connect.requestURL(write_back);
+    auto parsed = pool.request(url, write_back);
 
     if (parsed.status_code == 200) {
         std::cout << std::endl;
@@ -478,4 +718,104 @@ std::optional<std::size_t> writeHttpResponseTo(std::ostream &stream, const Url &
     return parsed.received_bytes ? std::make_optional(parsed.received_bytes) : false;
 }
 
-}
\ No newline at end of file
+/**
+ * Downloads data from a http URL via a pooled connection and writes it to the given file descriptor.
+ *
+ * No stream buffer is involved: each received block is written as a whole. For http urls, the body is moved from the
+ * socket to the file by the kernel (splice(2)), if the file supports it.
+ *
+ * @param fd Output file (or pipe) for the received data
+ * @param url A valid URL.
+ * @param pool Connections of earlier downloads from the same host are reused, see {@link ConnectionPool}.
+ * @return Returns an option resolving to the received size if successful (status 200) and resolving to false otherwise.
+ */
+inline std::optional<std::size_t> writeHttpResponseTo(int fd, const Url &url, ConnectionPool<WITH_HTTPS> &pool) {
+    bool written = true;
+    auto write_back = [fd, &written](HttpParsedResponse header, ByteView data) {
+        if (header.status_code == 200 && data.size_ && written) written = write_fully(fd, data);
+    };
+
+    auto parsed = pool.request(url, write_back, nullptr, nullptr, fd);
+    if (parsed.status_code != 200 || !written) {
+        std::cerr << "Failed to GET http response " << parsed.status_code << " " << url.full() << std::endl;
+        return std::nullopt;
+    }
+    return parsed.received_bytes ? std::make_optional(parsed.received_bytes) : std::nullopt;
+}
+
+/**
+ * Downloads data from a http URL into a file, see writeHttpResponseTo(int, const Url &, ConnectionPool &).
+ * The file appears only once the download is complete (see {@link AtomicFile}), a failed download leaves an
+ * existing file untouched.
+ * @return Returns an option resolving to the received size if successful and resolving to false otherwise.
+ * Exceptions: Throws if connecting fails or the connection ends before the body is complete.
+ */
+inline std::optional<std::size_t>
+downloadToFile(const std::filesystem::path &target, const Url &url, ConnectionPool<WITH_HTTPS> &pool) {
+    AtomicFile file(target);
+    if (!file.is_valid()) return std::nullopt;
+    auto size = writeHttpResponseTo(file.fd(), url, pool);
+    if (!size || !file.commit()) return std::nullopt;
+    return size;
+}
+
+/**
+ * Conditional download into memory, see readHttpResponse() and HttpSocket::requestURL().
+ * @return The status code and the received size if the status is 200 and the body is complete. A 304 (not modified)
+ *         has no size, it only means "not modified" if conditional was given.
+ * Exceptions: Throws if connecting fails or the connection ends before the body is complete.
+ */
+inline std::pair<int, std::optional<std::size_t>>
+readHttpResponse(std::vector<std::uint8_t> &body, const Url &url, ConnectionPool<WITH_HTTPS> &pool,
+                 const HttpValidators *conditional, HttpValidators *validators) {
+    body.clear();
+    auto write_back = [&body](HttpParsedResponse header, ByteView data) {
+        if (header.status_code != 200) return;
+        if (body.capacity() < header.length) body.reserve(header.length);
+        body.insert(body.end(), data.ptr_, data.ptr_ + data.size_);
+    };
+
+    auto parsed = pool.request(url, write_back, conditional, validators);
+    // without validators, a 304 is just a failed request
+    if (parsed.status_code == 304 && conditional) return {304, std::nullopt};
+    if (parsed.status_code != 200) {
+        std::cerr << "Failed to GET http response " << parsed.status_code << " " << url.full() << std::endl;
+        body.clear();
+        return {parsed.status_code, std::nullopt};
+    }
+    if (!parsed.chunked && parsed.received_bytes != parsed.length) {
+        std::cerr << "Incomplete http response " << parsed.received_bytes << " of " << parsed.length << " bytes "
+                  << url.full() << std::endl;
+        body.clear();
+        return {parsed.status_code, std::nullopt};
+    }
+    return {parsed.status_code, body.empty() ? std::nullopt : std::make_optional(body.size())};
+}
+
+/**
+ * Downloads data from a http URL into memory, eg for decoding it without a temporary file.
+ * The buffer is sized once from the content-length header.
+ *
+ * @param body Receives the response body (the previous content is discarded)
+ * @param url A valid URL.
+ * @param pool Connections of earlier downloads from the same host are reused, see {@link ConnectionPool}.
+ * @return Returns an option resolving to the received size if successful (status 200) and resolving to false otherwise.
+ */
+inline std::optional<std::size_t>
+readHttpResponse(std::vector<std::uint8_t> &body, const Url &url, ConnectionPool<WITH_HTTPS> &pool) {
+    return readHttpResponse(body, url, pool, nullptr, nullptr).second;
+}
+
+/**
+ * Downloads data from a http URL and writes it to the given output stream.
+ *
+ * @param stream Output stream for the received data
+ * @param url A valid URL.
+ * @return Returns an option resolving to the received size if successful and resolving to false otherwise.
+ */
+inline std::optional<std::size_t> writeHttpResponseTo(std::ostream &stream, const Url &url) {
+    ConnectionPool<WITH_HTTPS> pool(0);
+    return writeHttpResponseTo(stream, url, pool);
+}
+
+}
@@ -0,0 +1,110 @@
+//! On-disk cache for crawled images: validators per url for conditional requests, outputs by content hash
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "atomic_file.h"
+#include "byte_view.h"
+#include "http_header_parser.h"
+#include "vendor/sha2.h"
+
+namespace Socket {
+
+/**
+ * Remembers the validators (ETag, Last-Modified) and the content hash (SHA-256) of each downloaded url, and keeps
+ * the converted output of each content hash.
+ *
+ * A re-crawl sends the validators with a conditional request: a 304 (not modified) response skips the transfer and
+ * the encode, the output is restored from the cache if it is missing. Changed validators with known content (eg the
+ * same image under another url) skip the encode.
+ *
+ * Layout: `<directory>/urls/<sha256 of the url>` holds the entry, `<directory>/objects/<content hash>.jpg`
+ * the output (a hard link if possible). Entries are replaced atomically.
+ * Thread-safe for concurrent jobs. Errors are reported by return values, a broken cache costs a download only.
+ */
+class HttpCache {
+public:
+    struct Entry {
+        HttpValidators validators;
+        /// SHA-256 (hex) of the downloaded content
+        std::string content;
+    };
+
+    /// @param directory Created if it does not exist
+    explicit HttpCache(std::filesystem::path directory) : directory_(std::move(directory)) {
+        std::error_code error;
+        std::filesystem::create_directories(directory_ / "urls", error);
+        std::filesystem::create_directories(directory_ / "objects", error);
+    }
+
+    /// SHA-256 (hex) of data
+    static std::string content_hash(ByteView data) {
+        return picosha2::hash256_hex_string(data.ptr_, data.ptr_ + data.size());
+    }
+
+    [[nodiscard]] std::optional<Entry> lookup(std::string_view url) const {
+        std::ifstream in(entry_path(url));
+        std::string version;
+        Entry entry;
+        if (!std::getline(in, version) || version != Version || !std::getline(in, entry.validators.etag) ||
+            !std::getline(in, entry.validators.last_modified) || !std::getline(in, entry.content) ||
+            entry.content.empty())
+            return std::nullopt;
+        return entry;
+    }
+
+    bool store(std::string_view url, const Entry &entry) const {
+        AtomicFile file(entry_path(url));
+        auto text = std::string(Version) + "\n" + entry.validators.etag + "\n" + entry.validators.last_modified + "\n" +
+                    entry.content + "\n";
+        return file.write(ByteView(text.data(), text.size())) && file.commit();
+    }
+
+    [[nodiscard]] bool has_object(std::string_view content) const {
+        std::error_code error;
+        return std::filesystem::is_regular_file(object_path(content), error);
+    }
+
+    /// Keep the converted output of the content
+    bool add_object(std::string_view content, const std::filesystem::path &output) const {
+        return place(output, object_path(content));
+    }
+
+    /// Write the cached output of the content to the given file
+    bool restore(std::string_view content, const std::filesystem::path &output) const {
+        return place(object_path(content), output);
+    }
+
+private:
+    static constexpr std::string_view Version = "HttpCache 1";
+    std::filesystem::path directory_;
+
+    [[nodiscard]] std::filesystem::path entry_path(std::string_view url) const {
+        return directory_ / "urls" / picosha2::hash256_hex_string(url.begin(), url.end());
+    }
+
+    [[nodiscard]] std::filesystem::path object_path(std::string_view content) const {
+        return directory_ / "objects" / (std::string(content) + ".jpg");
+    }
+
+    /// Hard link (or copy) source to target and replace target atomically
+    static bool place(const std::filesystem::path &source, const std::filesystem::path &target) {
+        auto tmp = AtomicFile::temporary_name(target);
+        std::error_code error;
+        std::filesystem::create_hard_link(source, tmp, error);
+        if (error) std::filesystem::copy_file(source, tmp, error);
+        if (!error) std::filesystem::rename(tmp, target, error);
+        if (error) {
+            std::error_code ignored;
+            std::filesystem::remove(tmp, ignored);
+        }
+        return !error;
+    }
+};
+
+} // namespace Socket
@@ -1,5 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
 #include "byte_view.h"
 #include "stream_utils.h"
 
@@ -11,19 +22,137 @@ namespace Socket {
      */
     struct HttpParsedResponse {
         int status_code = 0;
+        /// Content-length, 0 for chunked responses
         std::size_t length = 0;
+        /// Body bytes received so far (decoded, without the chunk framing)
         std::size_t received_bytes = 0;
+        /// False if the server announced to close the connection after this response ("connection: close")
+        bool keep_alive = true;
+        /// The body is sent with "transfer-encoding: chunked"
+        bool chunked = false;
+    };
+
+    /// Cache validators of a response (RFC 7232): sent back with a conditional request, see {@link HttpCache}
+    struct HttpValidators {
+        std::string etag, last_modified;
+
+        [[nodiscard]] bool empty() const { return etag.empty() && last_modified.empty(); }
     };
 
+    /**
+     * Returns the value of a header line if its name matches (case-insensitive, see RFC 7230 3.2), without the
+     * surrounding whitespace and the trailing \r.
+     */
+    inline std::optional<std::string_view> header_value(std::string_view line, std::string_view name) {
+        if (line.size() <= name.size() || line[name.size()] != ':') return std::nullopt;
+        for (std::size_t i = 0; i < name.size(); i++)
+            if (std::tolower(static_cast<unsigned char>(line[i])) != std::tolower(static_cast<unsigned char>(name[i])))
+                return std::nullopt;
+        auto value = line.substr(name.size() + 1);
+        auto begin = value.find_first_not_of(" \t");
+        auto end = value.find_last_not_of(" \t\r");
+        if (begin == std::string_view::npos) return std::string_view{};
+        return value.substr(begin, end - begin + 1);
+    }
+
+    /// Case-insensitive comparison of ASCII strings
+    inline bool iequals(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+            return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+        });
+    }
+
     /**
      * Parses a block of incoming data for the HTTP response line and HTTP headers
      * and forwards everything after to a callback function.
+     *
+     * Bodies are either delimited by a content-length or sent with chunked transfer-encoding. Chunked bodies are
+     * decoded incrementally, chunk data is handed to the callback without copying it.
      */
     class HttpHeaderParser {
+    public:
+        using Callback = std::function<void(HttpParsedResponse, ByteView)>;
+
+    private:
         HttpParsedResponse parsed = {};
+        /// Receives the ETag and Last-Modified headers, if set
+        HttpValidators *validators = nullptr;
+
+        /// States of the chunked transfer-encoding decoder, see RFC 7230 4.1
+        enum class Chunked {
+            Size, SizeLine, Data, DataEnd, Trailer, Done
+        };
+        Chunked chunkState = Chunked::Size;
+        std::size_t chunkRemaining = 0;
+        bool chunkSizeDigits = false;
+        std::size_t trailerLineLength = 0;
+
+        /// Decode the next block of a chunked body, forwards the chunk data to the callback
+        void decode_chunked(const std::byte *data, std::size_t size, const Callback &write_back) {
+            std::size_t pos = 0;
+            while (pos < size && chunkState != Chunked::Done) {
+                auto c = std::to_integer<char>(data[pos]);
+                switch (chunkState) {
+                    case Chunked::Size: {
+                        // hex chunk size, optionally followed by extensions (";name=value") that are ignored
+                        auto digit = std::isxdigit(static_cast<unsigned char>(c))
+                                     ? (std::isdigit(static_cast<unsigned char>(c)) ? c - '0' : (c | 0x20) - 'a' + 10)
+                                     : -1;
+                        if (digit >= 0) {
+                            if (chunkRemaining > (std::numeric_limits<std::size_t>::max() >> 4u))
+                                throw std::runtime_error(from_parts("HttpHeaderParser::", __func__, ": Chunk too big"));
+                            chunkRemaining = chunkRemaining * 16 + std::size_t(digit);
+                            chunkSizeDigits = true;
+                            pos++;
+                            break;
+                        }
+                        if (!chunkSizeDigits)
+                            throw std::runtime_error(from_parts("HttpHeaderParser::", __func__, ": Invalid chunk size"));
+                        chunkState = Chunked::SizeLine;
+                        break;
+                    }
+                    case Chunked::SizeLine:
+                        pos++;
+                        if (c != '\n') break;
+                        chunkSizeDigits = false;
+                        trailerLineLength = 0;
+                        chunkState = chunkRemaining ? Chunked::Data : Chunked::Trailer;
+                        break;
+                    case Chunked::Data: {
+                        auto n = std::min(chunkRemaining, size - pos);
+                        parsed.received_bytes += n;
+                        write_back(parsed, ByteView(data + pos, n));
+                        pos += n;
+                        chunkRemaining -= n;
+                        if (!chunkRemaining) chunkState = Chunked::DataEnd;
+                        break;
+                    }
+                    case Chunked::DataEnd:
+                        // CRLF after the chunk data
+                        pos++;
+                        if (c == '\n') chunkState = Chunked::Size;
+                        else if (c != '\r')
+                            throw std::runtime_error(from_parts("HttpHeaderParser::", __func__, ": Chunk not terminated"));
+                        break;
+                    case Chunked::Trailer:
+                        // trailer fields after the last chunk, up to an empty line
+                        pos++;
+                        if (c == '\n') {
+                            if (!trailerLineLength) chunkState = Chunked::Done;
+                            trailerLineLength = 0;
+                        } else if (c != '\r') trailerLineLength++;
+                        break;
+                    case Chunked::Done:
+                        break;
+                }
+            }
+        }
 
     public:
-        using Callback = std::function<void(HttpParsedResponse, ByteView)>;
+        HttpHeaderParser() = default;
+
+        /// @param validators Receives the ETag and Last-Modified headers of the response
+        explicit HttpHeaderParser(HttpValidators *validators) : validators(validators) {}
 
         /**
          * Parses an incoming buffer for the HTTP status line and headers if not done yet.
@@ -34,6 +163,10 @@ namespace Socket {
          */
         bool parse(std::byte *data, std::size_t received_len, Callback write_back) {
             if (parsed.status_code > 0) {
+                if (parsed.chunked) {
+                    decode_chunked(data, received_len, write_back);
+                    return true;
+                }
                 parsed.received_bytes += received_len;
                 write_back(parsed, ByteView(data, received_len));
                 return true;
@@ -70,6 +203,9 @@ namespace Socket {
                 }
 
                 std::size_t content_length = 0;
+                bool has_content_length = false;
+                bool keep_alive = true;
+                bool chunked = false;
 
                 while (true) {
                     advance(line_end, 1);
@@ -93,8 +229,20 @@ namespace Socket {
                         throw std::domain_error(
                                 from_parts("HttpParsedResponse::", __func__, ": Identity encoding not supported"));
                     }
-                    if (std::sscanf(next_line.begin(), "Content-Length : %lu%c", &content_length, &backslashR) == 2 &&
-                        backslashR == '\r') {
+                    if (auto value = header_value(next_line, "content-length")) {
+                        content_length = std::strtoul(std::string(*value).c_str(), nullptr, 10);
+                        has_content_length = true;
+                    }
+                    if (validators) {
+                        if (auto value = header_value(next_line, "etag")) validators->etag = *value;
+                        if (auto value = header_value(next_line, "last-modified")) validators->last_modified = *value;
+                    }
+                    if (auto value = header_value(next_line, "connection")) {
+                        keep_alive = !iequals(*value, "close");
+                    }
+                    if (auto value = header_value(next_line, "transfer-encoding")) {
+                        // chunked is always the last coding
+                        chunked = value->size() >= 7 && iequals(value->substr(value->size() - 7), "chunked");
                     }
                     if (std::sscanf(next_line.begin(), "Content-Type : multipart/byteranges%c", &backslashR) == 1 &&
                         backslashR == '\r') {
@@ -103,17 +251,32 @@ namespace Socket {
                     }
                 }
 
-                // We require a content length header
-                if (content_length == 0) {
+                // 1xx, 204 and 304 responses never have a body (RFC 7230 3.3.3)
+                if (status_code < 200 || status_code == 204 || status_code == 304) {
+                    has_content_length = true;
+                    content_length = 0;
+                    chunked = false;
+                }
+                // We require a content length header or a chunked body (a body delimited by the connection end
+                // is not supported)
+                if (!has_content_length && !chunked) {
                     throw std::domain_error(
-                            from_parts("HttpParsedResponse::", __func__, ": Mult-Part encoding not supported"));
+                            from_parts("HttpParsedResponse::", __func__,
+                                       ": Content-Length or chunked transfer-encoding required"));
                 }
 
                 if (line_end != all_received.end()) advance(line_end, 1);
                 auto consumed_len = distance(all_received.begin(), line_end);
                 auto data_bytes_len = received_len - consumed_len;
 
-                parsed = HttpParsedResponse{status_code, content_length, data_bytes_len};
+                if (chunked) {
+                    // signal the parsed headers, then decode the chunks received so far
+                    parsed = HttpParsedResponse{status_code, 0, 0, keep_alive, true};
+                    write_back(parsed, ByteView(data + consumed_len, 0));
+                    decode_chunked(data + consumed_len, data_bytes_len, write_back);
+                    return true;
+                }
+                parsed = HttpParsedResponse{status_code, content_length, data_bytes_len, keep_alive};
 
                 // The rest of the received data block is handed over to the callback
                 write_back(parsed, ByteView(data + consumed_len, data_bytes_len));
@@ -129,9 +292,29 @@ namespace Socket {
             return parsed.status_code != 0;
         }
 
-        /// Returns true if all bytes (according to the http header content-length) have been received
+        /// Returns true if all bytes (according to the http header content-length or the last chunk) have been received
         bool receive_done() {
-            return parsed.length == parsed.received_bytes;
+            if (!has_parsed()) return false;
+            return parsed.chunked ? chunkState == Chunked::Done : parsed.length == parsed.received_bytes;
+        }
+
+        /**
+         * Bytes that may still be read without reading into the next response. Only valid once has_parsed() returns true.
+         * Unknown for chunked responses (the server sends nothing after the last chunk though).
+         */
+        [[nodiscard]] std::size_t remaining() const {
+            if (parsed.chunked) return chunkState == Chunked::Done ? 0 : std::numeric_limits<std::size_t>::max();
+            return parsed.length > parsed.received_bytes ? parsed.length - parsed.received_bytes : 0;
+        }
+
+        /**
+         * Account for body bytes that bypassed the parser, eg moved from the socket into a file by splice(2).
+         * Only valid for content-length delimited bodies, at most remaining() bytes.
+         */
+        void skip(std::size_t bytes) {
+            if (!has_parsed() || parsed.chunked || bytes > remaining())
+                throw std::logic_error(from_parts("HttpHeaderParser::", __func__, ": Not a content-length body"));
+            parsed.received_bytes += bytes;
         }
 
         HttpParsedResponse parsed_header() {
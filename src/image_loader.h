@@ -1,31 +1,101 @@
 //! CPP Api Wrapper around stbi (image loader header-only library)
 #pragma once
 
+#include <memory>
+#include <limits>
+#include <vector>
+
+#include "decode_arena.h"
+#include "mapped_file.h"
+
 namespace {
 #define STB_IMAGE_IMPLEMENTATION
+#define STBI_MALLOC(size) DecodeArena::stb_malloc(size)
+#define STBI_REALLOC(pointer, size) DecodeArena::stb_realloc(pointer, size)
+#define STBI_FREE(pointer) DecodeArena::stb_free(pointer)
 
 #include "vendor/stb_image.h"
 }
 
 /**
  * CPP Api Wrapper around stbi (image loader header-only library)
+ *
+ * Images are decoded with their native channel count, alpha channels are stripped in place. The pixels are therefore
+ * either grayscale (channels == 1) or RGB (channels == 3), ready for the encoder.
+ * The decoded image is owned by a unique_ptr with stbi_image_free as deleter, or it is in a caller provided buffer.
+ * Move-only.
  */
 struct ImageLoader {
-    int width, height, channels;
-    unsigned char *image;
+    /// channels of the decoded pixels: 1 (grayscale) or 3 (RGB)
+    int width = 0, height = 0, channels = 0;
+    /// channels stored in the file, 2 and 4 have an alpha channel
+    int sourceChannels = 0;
+    std::unique_ptr<unsigned char, void (*)(void *)> image{nullptr, stbi_image_free};
 
-    explicit ImageLoader(char const *filename) noexcept: width(0), height(0), channels(0) {
+    /// Load via stdio, stb reads the file into its own buffers
+    explicit ImageLoader(char const *filename) noexcept {
         stbi_set_flip_vertically_on_load(false);
-        image = stbi_load(filename, &width, &height, &channels, STBI_rgb);
+        image.reset(stbi_load(filename, &width, &height, &sourceChannels, 0));
+        strip_alpha();
     }
 
-    ~ImageLoader() { stbi_image_free(image); }
+    /// Decode an image that is already in memory, eg a mapped file or a download buffer (not copied)
+    ImageLoader(const std::uint8_t *data, std::size_t size) noexcept {
+        if (!data || size > std::size_t(std::numeric_limits<int>::max())) return;
+        stbi_set_flip_vertically_on_load(false);
+        image.reset(stbi_load_from_memory(data, int(size), &width, &height, &sourceChannels, 0));
+        strip_alpha();
+    }
+
+    /**
+     * Decode an image that is in memory into a caller provided buffer, eg the reused pixels of a
+     * {@link TooJpeg17::BatchEncoder::Scratch}. pixels keeps its capacity, so a steady stream of images does not
+     * allocate: the working memory of stb comes from the {@link DecodeArena} of this thread, which is reset afterwards,
+     * and the decoded image is copied into pixels (without alpha channel). operator* points into pixels.
+     */
+    ImageLoader(const std::uint8_t *data, std::size_t size, std::vector<std::uint8_t> &pixels) noexcept {
+        if (!data || size > std::size_t(std::numeric_limits<int>::max())) return;
+        stbi_set_flip_vertically_on_load(false);
+        DecodeArena::Scope scope(DecodeArena::current_thread());
+        std::unique_ptr<unsigned char, void (*)(void *)> decoded{
+                stbi_load_from_memory(data, int(size), &width, &height, &sourceChannels, 0), stbi_image_free};
+        if (!decoded) return;
+        channels = sourceChannels == 2 || sourceChannels == 4 ? sourceChannels - 1 : sourceChannels;
+        const auto count = std::size_t(width) * std::size_t(height);
+        try { pixels.resize(count * channels); }
+        catch (const std::bad_alloc &) { return; }
+        if (channels == sourceChannels) std::copy_n(decoded.get(), pixels.size(), pixels.data());
+        else
+            for (std::size_t i = 0, in = 0, out = 0; i < count; i++, in += sourceChannels)
+                for (auto c = 0; c < channels; c++) pixels[out++] = decoded.get()[in + c];
+        // borrowed: not freed by the loader
+        image = {pixels.data(), [](void *) {}};
+    }
+
+    /// Decode a memory mapped file, see {@link MappedFile}. The mapping may be released afterwards.
+    explicit ImageLoader(const MappedFile &file) noexcept: ImageLoader(file.data(), file.size()) {}
 
     /// Return true if the image data is valid
     bool is_valid() { return image != nullptr; }
 
+    /// Return true for RGB pixels, false for grayscale
+    [[nodiscard]] bool is_rgb() const noexcept { return channels == 3; }
+
     /// Dereference operator returns the raw image data pointer
     unsigned char *operator*() {
-        return image;
+        return image.get();
+    }
+
+private:
+    /// Drop the alpha channel of gray+alpha and RGBA pixels in a single pass. Compacts the buffer in place.
+    void strip_alpha() noexcept {
+        channels = sourceChannels;
+        if (!image || (sourceChannels != 2 && sourceChannels != 4)) return;
+        channels = sourceChannels - 1;
+        auto *pixels = image.get();
+        const auto count = std::size_t(width) * std::size_t(height);
+        // the write position never overtakes the read position
+        for (std::size_t i = 0, in = 0, out = 0; i < count; i++, in += sourceChannels)
+            for (auto c = 0; c < channels; c++) pixels[out++] = pixels[in + c];
     }
 };
@@ -0,0 +1,403 @@
+//! Resize stage between the decoder and the encoder: separable box, bilinear and Lanczos filters, several output
+//! sizes (eg thumbnails) from a single pass over the decoded image
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "metrics.h"
+#include "stream_utils.h"
+
+namespace TooJpeg17 {
+
+enum class ResizeFilter {
+    /// Average of the covered input pixels, the fastest filter
+    Box,
+    /// Triangle filter, scaled by the reduction factor when downscaling
+    Bilinear,
+    /// Windowed sinc with 3 lobes: the sharpest filter, and the most expensive one
+    Lanczos3
+};
+
+/// One output size of a {@link Resizer}
+struct ResizeTarget {
+    std::uint32_t width = 0, height = 0;
+    ResizeFilter filter = ResizeFilter::Lanczos3;
+    /**
+     * Downscales by 2, 4 or 8 average 2x2 pixels first (like the scaled DCT decoding of libjpeg), as long as the
+     * filter still reduces by at least this factor afterwards. 0 filters the full resolution image.
+     * The default is indistinguishable from the exact filter in practice, and a multiple faster for thumbnails.
+     */
+    float reducingGap = 3;
+
+    /// The largest size with the aspect ratio of the image that fits into maxWidth x maxHeight, never upscaled
+    static ResizeTarget fit(std::uint32_t width, std::uint32_t height, std::uint32_t maxWidth,
+                            std::uint32_t maxHeight, ResizeFilter filter = ResizeFilter::Lanczos3) noexcept {
+        ResizeTarget target{width, height, filter};
+        if (!width || !height || (width <= maxWidth && height <= maxHeight)) return target;
+        auto scale = std::min(double(maxWidth) / width, double(maxHeight) / height);
+        target.width = std::max<std::uint32_t>(1, std::uint32_t(std::lround(width * scale)));
+        target.height = std::max<std::uint32_t>(1, std::uint32_t(std::lround(height * scale)));
+        return target;
+    }
+};
+
+/// A box that a thumbnail fits into, see ResizeTarget::fit()
+struct ThumbnailSize {
+    std::uint32_t width = 0, height = 0;
+};
+
+/**
+ * Parse a comma separated list of thumbnail sizes, eg "160x120,1024x1024".
+ * @return Returns nullopt if an entry is not <width>x<height> with both between 1 and 65535 (the jpeg limit)
+ */
+inline std::optional<std::vector<ThumbnailSize>> parse_thumbnail_sizes(std::string_view list) {
+    std::vector<ThumbnailSize> sizes;
+    auto number = [](std::string_view text, std::uint32_t &value) {
+        auto end = text.data() + text.size();
+        auto [last, error] = std::from_chars(text.data(), end, value);
+        return error == std::errc() && last == end && value >= 1 && value <= 65535;
+    };
+    while (true) {
+        auto entry = list.substr(0, list.find(','));
+        auto x = entry.find('x');
+        ThumbnailSize size;
+        if (x == std::string_view::npos || !number(entry.substr(0, x), size.width) ||
+            !number(entry.substr(x + 1), size.height))
+            return std::nullopt;
+        sizes.push_back(size);
+        if (entry.size() == list.size()) return sizes;
+        list.remove_prefix(entry.size() + 1);
+    }
+}
+
+/// Pixels of a resized image, interleaved like the input (1 or 3 channels)
+struct ResizedImage {
+    std::uint32_t width = 0, height = 0;
+    unsigned channels = 0;
+    std::vector<std::uint8_t> pixels;
+};
+
+namespace detail {
+
+/**
+ * Filter weights of one dimension. Every output sample has the same number of taps, zero padded, and its window
+ * [first, first + taps) lies within the input, so that the inner loops have a fixed trip count.
+ * The first samples never decrease, which lets the vertical pass keep only the last `taps` rows.
+ */
+struct FilterWeights {
+    std::vector<std::uint32_t> first;
+    std::vector<float> weights;
+    std::uint32_t taps = 0;
+};
+
+inline float filter_support(ResizeFilter filter) noexcept {
+    switch (filter) {
+        case ResizeFilter::Box:
+            return 0.5f;
+        case ResizeFilter::Bilinear:
+            return 1.f;
+        default:
+            return 3.f;
+    }
+}
+
+inline double filter_kernel(ResizeFilter filter, double x) noexcept {
+    switch (filter) {
+        case ResizeFilter::Box:
+            return x >= -0.5 && x < 0.5 ? 1 : 0;
+        case ResizeFilter::Bilinear:
+            x = std::abs(x);
+            return x < 1 ? 1 - x : 0;
+        default: {
+            constexpr double Pi = 3.14159265358979323846;
+            if (x == 0) return 1;
+            if (x <= -3 || x >= 3) return 0;
+            return 3 * std::sin(Pi * x) * std::sin(Pi * x / 3) / (Pi * Pi * x * x);
+        }
+    }
+}
+
+/**
+ * Weights to resample `in` samples to `out` samples, the filter is widened by the reduction factor when downscaling.
+ * @param multiple Taps are rounded up to a multiple of it, the window may then extend up to multiple - 1 samples
+ *                 beyond the input (with zero weights)
+ */
+inline FilterWeights filter_weights(std::uint32_t in, std::uint32_t out, ResizeFilter filter,
+                                    std::uint32_t multiple = 1) {
+    FilterWeights result;
+    const double scale = double(in) / out, filterScale = std::max(1.0, scale);
+    const double support = filter_support(filter) * filterScale;
+    result.taps = std::min<std::uint32_t>(in, std::uint32_t(std::ceil(support)) * 2 + 1);
+    result.taps = (result.taps + multiple - 1) / multiple * multiple;
+    result.first.resize(out);
+    result.weights.assign(std::size_t(out) * result.taps, 0.f);
+    std::vector<double> window(result.taps);
+    const auto last = std::max(in, result.taps) - result.taps;
+    for (std::uint32_t x = 0; x < out; x++) {
+        const double center = (x + 0.5) * scale;
+        auto begin = std::uint32_t(std::max(0.0, std::floor(center - support + 0.5)));
+        auto end = std::uint32_t(std::min(double(in), std::floor(center + support + 0.5)));
+        auto first = std::min(begin, last);
+        double sum = 0;
+        for (auto i = begin; i < end; i++) {
+            window[i - begin] = filter_kernel(filter, (i + 0.5 - center) / filterScale);
+            sum += window[i - begin];
+        }
+        // a box narrower than a pixel may miss all centers: take the nearest pixel
+        if (sum == 0) {
+            window[0] = sum = 1;
+            end = begin + 1;
+        }
+        result.first[x] = first;
+        auto *weights = &result.weights[std::size_t(x) * result.taps + (begin - first)];
+        for (auto i = begin; i < end; i++) weights[i - begin] = float(window[i - begin] / sum);
+    }
+    return result;
+}
+
+/// Taps of the horizontal pass, a multiple of the SIMD width
+constexpr std::uint32_t HorizontalTaps = 4;
+
+/**
+ * The horizontal pass of a channel of an output row, from the vertically filtered input row.
+ * Four partial sums, so that the compiler turns the dot products into vector multiply-adds.
+ */
+inline void filter_row(const float *in, const FilterWeights &h, std::uint8_t *out, unsigned channels) noexcept {
+    const auto taps = h.taps;
+    for (std::size_t x = 0; x < h.first.size(); x++) {
+        const float *pixel = in + h.first[x];
+        const float *weights = &h.weights[x * taps];
+        float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+        for (std::uint32_t t = 0; t < taps; t += HorizontalTaps) {
+            sum0 += weights[t] * pixel[t];
+            sum1 += weights[t + 1] * pixel[t + 1];
+            sum2 += weights[t + 2] * pixel[t + 2];
+            sum3 += weights[t + 3] * pixel[t + 3];
+        }
+        out[x * channels] = std::uint8_t(std::clamp((sum0 + sum1) + (sum2 + sum3) + 0.5f, 0.f, 255.f));
+    }
+}
+
+} // namespace detail
+
+/**
+ * Resizes an image, fed row by row, to one or more sizes.
+ *
+ * Each input row is converted to float once for all targets. A target adds it, weighted, to the output rows whose
+ * vertical window contains it, and filters an output row horizontally as soon as its window is complete. Only the
+ * few rows that are being accumulated are kept: the full resolution image needs not be kept around, eg when rows
+ * come from a streaming decoder.
+ *
+ * Targets with a reducingGap read from a 2x2 box pyramid instead (1/2, 1/4 and 1/8 of the size), built on the fly
+ * and shared by all targets. It plays the role of the DCT-domain scaled decoding of JPEG decoders: a 1/8 thumbnail
+ * filters 64 times fewer pixels than the original.
+ *
+ * Both passes have a fixed number of taps per sample and work on channel planes. The vertical pass comes first: it is
+ * a multiply-add of contiguous float rows, and the horizontal pass on output rows only are dot products of 4 taps
+ * at a time. Both compile to SIMD instructions without intrinsics.
+ * Throws std::invalid_argument for empty sizes and channels other than 1 and 3.
+ */
+class Resizer {
+public:
+    Resizer(std::uint32_t width, std::uint32_t height, unsigned channels, const std::vector<ResizeTarget> &targets)
+            : width_(width), height_(height), channels_(channels) {
+        if (!width || !height || (channels != 1 && channels != 3))
+            throw std::invalid_argument(utils::from_parts("Resizer: Invalid image", width, "x", height, "x", channels));
+        levels_.emplace_back();
+        levels_[0].width = width;
+        levels_[0].height = height;
+        for (auto &target: targets) {
+            if (!target.width || !target.height)
+                throw std::invalid_argument(
+                        utils::from_parts("Resizer: Invalid size", target.width, "x", target.height));
+            // the highest level that still leaves a reduction of reducingGap to the filter
+            std::size_t level = 0;
+            while (level < 3 && target.reducingGap > 0) {
+                auto w = (levels_[0].width + (2u << level) - 1) >> (level + 1);
+                auto h = (levels_[0].height + (2u << level) - 1) >> (level + 1);
+                if (w < target.reducingGap * target.width || h < target.reducingGap * target.height) break;
+                level++;
+            }
+            while (levels_.size() <= level) {
+                Level next;
+                next.width = (levels_.back().width + 1) / 2;
+                next.height = (levels_.back().height + 1) / 2;
+                next.pairs.resize(std::size_t(next.width) * channels);
+                next.row.resize(std::size_t(next.width) * channels);
+                levels_.push_back(std::move(next));
+            }
+            auto &input = levels_[level];
+            Output output;
+            output.level = level;
+            output.horizontal = detail::filter_weights(input.width, target.width, target.filter,
+                                                       detail::HorizontalTaps);
+            output.vertical = detail::filter_weights(input.height, target.height, target.filter);
+            // at most as many output rows are being accumulated as windows overlap
+            auto &first = output.vertical.first;
+            std::size_t end = 0, begin = 0;
+            for (std::uint32_t row = 0; row < input.height; row++) {
+                while (end < first.size() && first[end] <= row) end++;
+                while (first[begin] + output.vertical.taps <= row) begin++;
+                output.slots = std::max(output.slots, end - begin);
+            }
+            output.accumulators.resize(output.slots * input.pitch() * channels);
+            input.samples.resize(input.pitch() * channels);
+            output.image = {target.width, target.height, channels,
+                            std::vector<std::uint8_t>(std::size_t(target.width) * target.height * channels)};
+            outputs_.push_back(std::move(output));
+        }
+    }
+
+    /// Feed the next input row (width * channels samples), top to bottom
+    void push_row(const std::uint8_t *row) {
+        if (rows_ == height_) throw std::logic_error("Resizer::push_row: All rows pushed already");
+        push(0, row);
+        if (++rows_ < height_) return;
+        // an odd row at the bottom of a level is paired with itself
+        for (std::size_t level = 1; level < levels_.size(); level++)
+            if (levels_[level].pending) reduce(level, nullptr);
+    }
+
+    /// Feed all rows of an image with width * channels samples per row
+    void push_image(const std::uint8_t *pixels) {
+        for (std::uint32_t y = rows_; y < height_; y++) push_row(pixels + std::size_t(y) * width_ * channels_);
+    }
+
+    /// The resized images in the order of the targets, after all rows have been pushed
+    std::vector<ResizedImage> finish() {
+        if (rows_ != height_) throw std::logic_error("Resizer::finish: Rows missing");
+        std::vector<ResizedImage> images;
+        for (auto &output: outputs_) images.push_back(std::move(output.image));
+        outputs_.clear();
+        return images;
+    }
+
+private:
+    /// A level of the box pyramid, level 0 is the input
+    struct Level {
+        std::uint32_t width = 0, height = 0;
+        /// Horizontal pair sums of the upper row of the next 2x2 block row, valid if pending
+        std::vector<std::uint16_t> pairs;
+        std::vector<std::uint8_t> row;
+        bool pending = false;
+        /// The current row as floats in channel planes of pitch() samples, if an output reads from this level
+        std::vector<float> samples;
+
+        /// Plane size: the padding is read by the last horizontal taps, and is always zero
+        [[nodiscard]] std::size_t pitch() const noexcept { return width + detail::HorizontalTaps; }
+    };
+
+    struct Output {
+        std::size_t level = 0;
+        detail::FilterWeights horizontal, vertical;
+        /// Vertically filtered rows of the input (in planes, like Level::samples), output row y in slot (y % slots)
+        std::vector<float> accumulators;
+        std::size_t slots = 0;
+        std::uint32_t rows = 0, written = 0;
+        ResizedImage image;
+    };
+
+    void push(std::size_t level, const std::uint8_t *row) {
+        auto &samples = levels_[level].samples;
+        if (!samples.empty()) {
+            const auto width = levels_[level].width;
+            const auto pitch = levels_[level].pitch();
+            if (channels_ == 1) std::copy_n(row, width, samples.data());
+            else
+                for (std::uint32_t x = 0; x < width; x++) {
+                    samples[x] = row[3 * x];
+                    samples[pitch + x] = row[3 * x + 1];
+                    samples[2 * pitch + x] = row[3 * x + 2];
+                }
+            for (auto &output: outputs_)
+                if (output.level == level) filter(output, samples.data());
+        }
+        if (level + 1 < levels_.size()) reduce(level + 1, row);
+    }
+
+    /// Add a row of the level below to the pyramid level. Null pairs the pending row with itself (odd heights).
+    void reduce(std::size_t level, const std::uint8_t *row) {
+        auto &next = levels_[level];
+        if (row) {
+            const auto width = levels_[level - 1].width;
+            if (channels_ == 3) reduce_row<3>(row, width, next);
+            else reduce_row<1>(row, width, next);
+            next.pending = !next.pending;
+            if (next.pending) return;
+        } else {
+            for (std::size_t i = 0; i < next.row.size(); i++) next.row[i] = std::uint8_t((next.pairs[i] + 1) >> 1);
+            next.pending = false;
+        }
+        push(level, next.row.data());
+    }
+
+    /// Sum the horizontal pixel pairs of the upper row of a block row, or average the 2x2 blocks with the lower one
+    template<unsigned Channels>
+    static void reduce_row(const std::uint8_t *row, std::uint32_t width, Level &next) noexcept {
+        auto *pairs = next.pairs.data();
+        auto *out = next.row.data();
+        const std::size_t full = width / 2;
+        if (next.pending)
+            for (std::size_t x = 0; x < full; x++, row += 2 * Channels)
+                for (unsigned c = 0; c < Channels; c++) {
+                    auto i = x * Channels + c;
+                    out[i] = std::uint8_t((pairs[i] + row[c] + row[Channels + c] + 2) >> 2);
+                }
+        else
+            for (std::size_t x = 0; x < full; x++, row += 2 * Channels)
+                for (unsigned c = 0; c < Channels; c++)
+                    pairs[x * Channels + c] = std::uint16_t(row[c] + row[Channels + c]);
+        // an odd last pixel is paired with itself
+        if (width % 2)
+            for (unsigned c = 0; c < Channels; c++) {
+                auto i = full * Channels + c;
+                if (next.pending) out[i] = std::uint8_t((pairs[i] + 2 * row[c] + 2) >> 2);
+                else pairs[i] = std::uint16_t(2 * row[c]);
+            }
+    }
+
+    /// Add an input row of the output's level to the output rows it contributes to, write the completed ones
+    void filter(Output &output, const float *row) {
+        const auto taps = output.vertical.taps;
+        const std::size_t stride = output.accumulators.size() / output.slots;
+        const auto r = output.rows++;
+        for (auto y = output.written; y < output.image.height && output.vertical.first[y] <= r; y++) {
+            const auto first = output.vertical.first[y];
+            const float weight = output.vertical.weights[std::size_t(y) * taps + (r - first)];
+            float *sum = &output.accumulators[(y % output.slots) * stride];
+            if (r == first) for (std::size_t i = 0; i < stride; i++) sum[i] = weight * row[i];
+            else if (weight != 0) for (std::size_t i = 0; i < stride; i++) sum[i] += weight * row[i];
+            if (r + 1 < first + taps) continue;
+            // windows end in the order of the output rows: this is the first one that has not been written
+            auto *out = &output.image.pixels[std::size_t(y) * output.image.width * channels_];
+            const auto pitch = stride / channels_;
+            for (unsigned c = 0; c < channels_; c++)
+                detail::filter_row(sum + c * pitch, output.horizontal, out + c, channels_);
+            output.written++;
+        }
+    }
+
+    std::uint32_t width_, height_;
+    unsigned channels_;
+    std::uint32_t rows_ = 0;
+    std::vector<Level> levels_;
+    std::vector<Output> outputs_;
+};
+
+/// Resize an image to several sizes at once, see {@link Resizer}
+inline std::vector<ResizedImage> resize_image(const std::uint8_t *pixels, std::uint32_t width, std::uint32_t height,
+                                              unsigned channels, const std::vector<ResizeTarget> &targets) {
+    Metrics::ScopedTimer timer(Metrics::Timer::Resize);
+    Resizer resizer(width, height, channels, targets);
+    resizer.push_image(pixels);
+    return resizer.finish();
+}
+
+} // namespace TooJpeg17
@@ -0,0 +1,124 @@
+//! Incremental scanner for image urls in src="..." attributes of a html page
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+
+namespace Socket {
+
+/**
+ * Finds all src="..." and src='...' attribute values that end with an image extension
+ * (jpg, png, bmp, gif, pnm in lower or upper case), just like the regex
+ * `src=["']([^"']*?(?:jpg|png|bmp|gif|pnm|JPG|PNG|BMP|GIF|PNM))["']`.
+ *
+ * The page is fed in chunks as it is received, eg from a {@link HttpHeaderParser::Callback}. Every byte is looked at
+ * once and nothing is allocated: an attribute value that spans two chunks is carried over in a fixed buffer, values
+ * longer than MaxUrlLength are dropped. A value is not searched for further src= attributes.
+ */
+class ImageUrlScanner {
+public:
+    static constexpr std::size_t MaxUrlLength = 4096;
+
+    /**
+     * Scan the next chunk of the page.
+     * @param on_url Called with each found url. The view is only valid during the call.
+     */
+    template<typename Callback>
+    void feed(std::string_view chunk, Callback &&on_url) {
+        constexpr std::string_view attribute = "src=";
+        std::size_t pos = 0;
+        while (pos < chunk.size()) {
+            switch (state_) {
+                case State::Search: {
+                    if (matched_ == 0) {
+                        pos = chunk.find(attribute[0], pos);
+                        if (pos == std::string_view::npos) return;
+                    }
+                    // "src=" does not overlap with itself: a mismatch restarts with the current character
+                    auto c = chunk[pos++];
+                    if (c == attribute[matched_]) matched_++;
+                    else matched_ = c == attribute[0] ? 1 : 0;
+                    if (matched_ == attribute.size()) {
+                        matched_ = 0;
+                        state_ = State::Quote;
+                    }
+                    break;
+                }
+                case State::Quote:
+                    if (chunk[pos] == '"' || chunk[pos] == '\'') {
+                        pos++;
+                        carried_ = 0;
+                        state_ = State::Value;
+                    } else state_ = State::Search;
+                    break;
+                case State::Value: {
+                    auto end = chunk.find_first_of("\"'", pos);
+                    auto value = chunk.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+                    if (end == std::string_view::npos) {
+                        // continued in the next chunk
+                        carry(value);
+                        return;
+                    }
+                    pos = end + 1;
+                    state_ = State::Search;
+                    if (carried_) {
+                        if (!carry(value)) continue;
+                        value = std::string_view(carry_.data(), carried_);
+                    }
+                    if (value.size() <= MaxUrlLength && is_image(value)) on_url(value);
+                    break;
+                }
+                case State::Overlong:
+                    // skip the rest of a value that did not fit into the carry buffer
+                    pos = chunk.find_first_of("\"'", pos);
+                    if (pos == std::string_view::npos) return;
+                    pos++;
+                    state_ = State::Search;
+                    break;
+            }
+        }
+    }
+
+    /// Forget a partial match, eg to scan another page
+    void reset() noexcept {
+        state_ = State::Search;
+        matched_ = carried_ = 0;
+    }
+
+    /// Returns true if the url ends with one of the supported image extensions
+    static bool is_image(std::string_view url) noexcept {
+        constexpr std::array<std::string_view, 10> extensions{"jpg", "png", "bmp", "gif", "pnm",
+                                                              "JPG", "PNG", "BMP", "GIF", "PNM"};
+        if (url.size() < 3) return false;
+        auto tail = url.substr(url.size() - 3);
+        for (auto extension: extensions) if (tail == extension) return true;
+        return false;
+    }
+
+private:
+    enum class State {
+        Search, Quote, Value, Overlong
+    };
+
+    State state_ = State::Search;
+    /// Characters of "src=" matched so far
+    std::size_t matched_ = 0;
+    /// The beginning of an attribute value of previous chunks
+    std::array<char, MaxUrlLength> carry_{};
+    std::size_t carried_ = 0;
+
+    /// Append to the carry buffer. Returns false (and skips the value) if it does not fit.
+    bool carry(std::string_view part) noexcept {
+        if (carried_ + part.size() > carry_.size()) {
+            carried_ = 0;
+            state_ = state_ == State::Value ? State::Overlong : state_;
+            return false;
+        }
+        part.copy(carry_.data() + carried_, part.size());
+        carried_ += part.size();
+        return true;
+    }
+};
+
+} // namespace Socket
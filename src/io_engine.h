@@ -0,0 +1,563 @@
+//! Asynchronous whole-file reads and atomic writes for batch jobs: io_uring on Linux, a thread pool elsewhere
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// C++17: Conditional include. The raw system calls are used, liburing is not required.
+#if __has_include(<linux/io_uring.h>)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define TOOJPEG17_IO_URING 1
+#else
+#define TOOJPEG17_IO_URING 0
+#endif
+
+#include "atomic_file.h"
+
+/**
+ * Reads whole files into memory and writes files atomically (see {@link AtomicFile}), without blocking the caller:
+ * each operation completes with a callback. Meant for batch jobs like the directory conversion, which read the next
+ * inputs and write the finished outputs while the workers decode and encode (see {@link ReadAhead}).
+ *
+ * Backends:
+ * * io_uring (Linux 5.6+): open, read and write are submitted to the kernel, completions are reaped by one thread.
+ * * A small thread pool with blocking calls, used where io_uring is not available (not compiled in, not supported by
+ *   the kernel or not permitted, eg by a seccomp filter) or if requested.
+ *
+ * At most `depth` operations are in flight, further calls block until one completes. The callbacks run on an engine
+ * thread: they must be short and must not submit operations themselves.
+ * Thread-safe. The destructor waits for all operations.
+ */
+class IoEngine {
+public:
+    enum class Backend {
+        /// io_uring if available, threads otherwise
+        Auto,
+        Threads
+    };
+
+    struct File {
+        std::vector<std::uint8_t> data;
+        /// errno of the failed operation, 0 on success
+        int error = 0;
+
+        [[nodiscard]] bool ok() const noexcept { return error == 0; }
+    };
+
+    using ReadCallback = std::function<void(File &&)>;
+    /// Receives 0 on success, errno otherwise
+    using WriteCallback = std::function<void(int error)>;
+    /// Receives the written data back (eg for a {@link BufferPool}) and the error like a WriteCallback
+    using WrittenCallback = std::function<void(File &&written)>;
+
+    /**
+     * @param depth Operations in flight at most
+     * @param threads Threads of the thread pool backend
+     */
+    explicit IoEngine(unsigned depth = 64, Backend backend = Backend::Auto, unsigned threads = 4)
+            : depth_(std::max(1u, depth)) {
+        if (backend == Backend::Auto) ring_ = Ring::create(depth_);
+        if (ring_) reaper_ = std::thread([this] { reap(); });
+        else for (unsigned i = 0; i < std::max(1u, threads); i++) pool_.emplace_back([this] { serve(); });
+    }
+
+    IoEngine(IoEngine const &) = delete;
+
+    IoEngine &operator=(IoEngine const &) = delete;
+
+    ~IoEngine() {
+        wait();
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        if (ring_) stop_reaper();
+        work_.notify_all();
+        if (reaper_.joinable()) reaper_.join();
+        for (auto &thread: pool_) thread.join();
+    }
+
+    /// Returns true if the io_uring backend is used
+    [[nodiscard]] bool uses_io_uring() const noexcept { return ring_ != nullptr; }
+
+    /// Read the whole file
+    void read(std::filesystem::path file, ReadCallback done) {
+        auto operation = std::make_unique<Operation>(Operation::Read, std::move(file));
+        operation->on_read = std::move(done);
+        start(std::move(operation));
+    }
+
+    /// Read the whole file, the future is ready once the file has been read
+    std::future<File> read(std::filesystem::path file) {
+        auto promise = std::make_shared<std::promise<File>>();
+        auto result = promise->get_future();
+        read(std::move(file), [promise](File &&read) { promise->set_value(std::move(read)); });
+        return result;
+    }
+
+    /**
+     * Write the data to a temporary file and rename it to the target, see {@link AtomicFile}.
+     * @param done Called once the target has been replaced or the write failed, may be empty
+     */
+    void write(std::filesystem::path target, std::vector<std::uint8_t> data, WriteCallback done = {}) {
+        WrittenCallback written;
+        if (done) written = [done = std::move(done)](File &&file) { done(file.error); };
+        write(std::move(target), std::move(data), std::move(written));
+    }
+
+    /// Write like write(), the callback gets the buffer back once it is no longer needed
+    void write(std::filesystem::path target, std::vector<std::uint8_t> data, WrittenCallback done) {
+        auto operation = std::make_unique<Operation>(Operation::Write, std::move(target));
+        operation->data = std::move(data);
+        operation->on_write = std::move(done);
+        start(std::move(operation));
+    }
+
+    /// Blocks until all operations completed (and their callbacks returned)
+    void wait() {
+        std::unique_lock lock(mutex_);
+        space_.wait(lock, [this] { return active_ == 0; });
+    }
+
+private:
+    struct Operation {
+        enum Kind {
+            Read, Write
+        } kind;
+        std::filesystem::path path, temporary;
+        std::vector<std::uint8_t> data;
+        int fd = -1;
+        /// Bytes read or written so far
+        std::size_t done = 0;
+        bool opening = true;
+        ReadCallback on_read;
+        WrittenCallback on_write;
+
+        Operation(Kind kind_, std::filesystem::path path_) : kind(kind_), path(std::move(path_)) {
+            if (kind == Write) temporary = AtomicFile::temporary_name(path);
+        }
+
+        [[nodiscard]] const std::filesystem::path &opened_path() const { return kind == Write ? temporary : path; }
+
+        [[nodiscard]] int open_flags() const {
+            return kind == Write ? O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+        }
+
+        /// The file is open: size the read buffer. Returns false with errno set on errors.
+        bool opened(int fd_) {
+            fd = fd_;
+            opening = false;
+            if (kind == Write) return true;
+            struct stat info{};
+            if (::fstat(fd, &info) != 0) return false;
+            data.resize(std::size_t(info.st_size));
+            return true;
+        }
+
+        [[nodiscard]] bool complete() const { return !opening && done == data.size(); }
+
+        /// Close the file, commit a write and call the callback
+        void finish(int error) {
+            if (fd >= 0 && ::close(std::exchange(fd, -1)) != 0 && !error) error = errno;
+            if (kind == Write) {
+                if (!error && ::rename(temporary.c_str(), path.c_str()) != 0) error = errno;
+                if (error && !opening) ::unlink(temporary.c_str());
+                if (on_write) on_write(File{std::move(data), error});
+            } else {
+                if (error) data.clear();
+                on_read(File{std::move(data), error});
+            }
+        }
+    };
+
+#if TOOJPEG17_IO_URING
+
+    /// The submission and completion queues shared with the kernel, see io_uring(7)
+    class Ring {
+    public:
+        static std::unique_ptr<Ring> create(unsigned entries) {
+            std::unique_ptr<Ring> ring(new Ring);
+            io_uring_params params{};
+            ring->fd_ = int(::syscall(__NR_io_uring_setup, entries, &params));
+            if (ring->fd_ < 0 || !ring->map(params) || !ring->supported()) return nullptr;
+            return ring;
+        }
+
+        Ring(Ring const &) = delete;
+
+        Ring &operator=(Ring const &) = delete;
+
+        ~Ring() {
+            if (sqes_) ::munmap(sqes_, sqesSize_);
+            if (cq_ && cq_ != sq_) ::munmap(cq_, cqSize_);
+            if (sq_) ::munmap(sq_, sqSize_);
+            if (fd_ >= 0) ::close(fd_);
+        }
+
+        /// Queue and submit one entry. Not thread-safe: the caller holds the engine lock.
+        template<typename Prepare>
+        void submit(Prepare &&prepare, Operation *operation) {
+            auto tail = *sqTail_;
+            auto index = tail & *sqMask_;
+            auto &sqe = sqes_[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            prepare(sqe);
+            sqe.user_data = reinterpret_cast<std::uint64_t>(operation);
+            sqArray_[index] = index;
+            __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+            while (::syscall(__NR_io_uring_enter, fd_, 1, 0, 0, nullptr, 0) < 0 && errno == EINTR) {}
+        }
+
+        /// Wait for at least one completion
+        void wait() const {
+            ::syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        }
+
+        /// Hand each completion to the handler: `void(Operation *, int result)`
+        template<typename Handler>
+        void reap(Handler &&handler) {
+            auto head = *cqHead_;
+            auto tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                auto &cqe = cqes_[head & *cqMask_];
+                auto *operation = reinterpret_cast<Operation *>(cqe.user_data);
+                auto result = cqe.res;
+                // free the entry before handling it, the handler may submit the next step
+                __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+                handler(operation, result);
+            }
+        }
+
+    private:
+        int fd_ = -1;
+        void *sq_ = nullptr, *cq_ = nullptr;
+        std::size_t sqSize_ = 0, cqSize_ = 0, sqesSize_ = 0;
+        io_uring_sqe *sqes_ = nullptr;
+        unsigned *sqTail_ = nullptr, *sqMask_ = nullptr, *sqArray_ = nullptr;
+        unsigned *cqHead_ = nullptr, *cqTail_ = nullptr, *cqMask_ = nullptr;
+        io_uring_cqe *cqes_ = nullptr;
+
+        Ring() = default;
+
+        bool map(const io_uring_params &params) {
+            sqSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single) sqSize_ = cqSize_ = std::max(sqSize_, cqSize_);
+            auto sq = ::mmap(nullptr, sqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                             IORING_OFF_SQ_RING);
+            if (sq == MAP_FAILED) return false;
+            sq_ = sq;
+            auto cq = single ? sq : ::mmap(nullptr, cqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                                           IORING_OFF_CQ_RING);
+            if (cq == MAP_FAILED) return false;
+            cq_ = cq;
+            sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+            auto sqes = ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                               IORING_OFF_SQES);
+            if (sqes == MAP_FAILED) return false;
+            sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+            auto *sqBase = static_cast<char *>(sq_), *cqBase = static_cast<char *>(cq_);
+            sqTail_ = reinterpret_cast<unsigned *>(sqBase + params.sq_off.tail);
+            sqMask_ = reinterpret_cast<unsigned *>(sqBase + params.sq_off.ring_mask);
+            sqArray_ = reinterpret_cast<unsigned *>(sqBase + params.sq_off.array);
+            cqHead_ = reinterpret_cast<unsigned *>(cqBase + params.cq_off.head);
+            cqTail_ = reinterpret_cast<unsigned *>(cqBase + params.cq_off.tail);
+            cqMask_ = reinterpret_cast<unsigned *>(cqBase + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe *>(cqBase + params.cq_off.cqes);
+            return true;
+        }
+
+        /// Returns true if the kernel supports all operations the engine submits
+        [[nodiscard]] bool supported() const {
+            constexpr unsigned ops = 64;
+            std::vector<std::uint8_t> memory(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op));
+            auto *probe = reinterpret_cast<io_uring_probe *>(memory.data());
+            if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, ops) < 0) return false;
+            for (auto op: {IORING_OP_NOP, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE})
+                if (op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+            return true;
+        }
+    };
+
+#else
+    /// Not available on this platform
+    struct Ring {
+        static std::unique_ptr<Ring> create(unsigned) { return nullptr; }
+    };
+#endif
+
+    const unsigned depth_;
+    std::unique_ptr<Ring> ring_;
+    std::thread reaper_;
+    std::vector<std::thread> pool_;
+
+    /// Guards all of the following members and the submission queue
+    std::mutex mutex_;
+    std::condition_variable space_, work_;
+    /// Operations submitted but not completed yet
+    unsigned active_ = 0;
+    bool stop_ = false;
+    /// Operations waiting for a thread of the thread pool backend
+    std::deque<std::unique_ptr<Operation>> queue_;
+
+    void start(std::unique_ptr<Operation> operation) {
+        std::unique_lock lock(mutex_);
+        space_.wait(lock, [this] { return active_ < depth_; });
+        active_++;
+        if (!ring_) {
+            queue_.push_back(std::move(operation));
+            lock.unlock();
+            work_.notify_one();
+            return;
+        }
+        // the operation is owned by the ring until its completion
+        submit_next(operation.release());
+    }
+
+    void completed(Operation *operation, int error) {
+        std::unique_ptr<Operation> owned(operation);
+        owned->finish(error);
+        {
+            std::lock_guard lock(mutex_);
+            active_--;
+        }
+        space_.notify_all();
+    }
+
+#if TOOJPEG17_IO_URING
+
+    /// Submit the next step of the operation: open, then read or write until all data is transferred
+    void submit_next(Operation *operation) {
+        ring_->submit([operation](io_uring_sqe &sqe) {
+            if (operation->opening) {
+                sqe.opcode = IORING_OP_OPENAT;
+                sqe.fd = AT_FDCWD;
+                sqe.addr = reinterpret_cast<std::uint64_t>(operation->opened_path().c_str());
+                sqe.open_flags = std::uint32_t(operation->open_flags());
+                sqe.len = 0644;
+                return;
+            }
+            sqe.opcode = operation->kind == Operation::Write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe.fd = operation->fd;
+            sqe.addr = reinterpret_cast<std::uint64_t>(operation->data.data() + operation->done);
+            sqe.len = std::uint32_t(std::min<std::size_t>(operation->data.size() - operation->done, 1u << 30u));
+            sqe.off = operation->done;
+        }, operation);
+    }
+
+    /// A no-op without an operation ends the reaper thread
+    void stop_reaper() {
+        std::lock_guard lock(mutex_);
+        ring_->submit([](io_uring_sqe &sqe) { sqe.opcode = IORING_OP_NOP; }, nullptr);
+    }
+
+    /// The reaper thread: advance each operation with its completion
+    void reap() {
+        bool stopping = false;
+        while (!stopping) {
+            ring_->wait();
+            {
+                // The entries were submitted with the lock held: taking it orders the operations written by the
+                // submitting threads before their completions (the kernel does that already, the thread sanitizer
+                // can't see it)
+                std::lock_guard lock(mutex_);
+            }
+            ring_->reap([&](Operation *operation, int result) {
+                if (!operation) {
+                    stopping = true;
+                    return;
+                }
+                if (result < 0) return completed(operation, -result);
+                if (operation->opening) {
+                    if (!operation->opened(result)) return completed(operation, errno);
+                } else {
+                    // a read of 0 bytes: the file was truncated meanwhile
+                    if (result == 0) return completed(operation, EIO);
+                    operation->done += std::size_t(result);
+                }
+                if (operation->complete()) return completed(operation, 0);
+                std::lock_guard lock(mutex_);
+                submit_next(operation);
+            });
+        }
+    }
+
+#else
+
+    void submit_next(Operation *) {}
+
+    void stop_reaper() {}
+
+    void reap() {}
+
+#endif
+
+    /// A thread of the thread pool backend: blocking calls
+    void serve() {
+        while (true) {
+            std::unique_ptr<Operation> operation;
+            {
+                std::unique_lock lock(mutex_);
+                work_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                operation = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            auto error = transfer(*operation);
+            completed(operation.release(), error);
+        }
+    }
+
+    /// Returns 0 or errno
+    static int transfer(Operation &operation) {
+        int fd = ::open(operation.opened_path().c_str(), operation.open_flags(), 0644);
+        if (fd < 0 || !operation.opened(fd)) return errno;
+        while (!operation.complete()) {
+            auto size = operation.data.size() - operation.done;
+            auto transferred = operation.kind == Operation::Write
+                               ? ::pwrite(fd, operation.data.data() + operation.done, size, off_t(operation.done))
+                               : ::pread(fd, operation.data.data() + operation.done, size, off_t(operation.done));
+            if (transferred < 0 && errno == EINTR) continue;
+            if (transferred < 0) return errno;
+            if (transferred == 0) return EIO;
+            operation.done += std::size_t(transferred);
+        }
+        return 0;
+    }
+};
+
+/**
+ * Reads a list of files in the background, a few files ahead of the consumers: the files are read while the previous
+ * ones are processed. Files may be taken in any order (eg by the jobs of a work stealing pool). Each take() reads the
+ * files following the taken one ahead, up to the end of the caller's range (eg the chunk of a job), so the reads
+ * follow the order in which the jobs actually take the files. At most `window` files are read ahead (in flight or
+ * read but not taken yet), which bounds the memory to about `window` files.
+ *
+ * Thread-safe. Each file can be taken once.
+ */
+class ReadAhead {
+public:
+    ReadAhead(IoEngine &engine, std::vector<std::filesystem::path> files, std::size_t window)
+            : engine_(engine), files_(std::move(files)), reads_(files_.size()), taken_(files_.size()),
+              window_(std::max<std::size_t>(1, window)) {}
+
+    [[nodiscard]] std::size_t size() const noexcept { return files_.size(); }
+
+    [[nodiscard]] const std::filesystem::path &path(std::size_t index) const { return files_.at(index); }
+
+    /// Files read ahead, at most `window`
+    [[nodiscard]] std::size_t ahead() const {
+        std::lock_guard lock(mutex_);
+        return ahead_;
+    }
+
+    /**
+     * Wait for the given file (read now if it has not been read ahead), and read the next files before `end` ahead
+     * @param end End of the files the caller takes next, eg of its chunk
+     */
+    IoEngine::File take(std::size_t index, std::size_t end) {
+        std::vector<std::pair<std::size_t, std::shared_ptr<std::promise<IoEngine::File>>>> submits;
+        auto claim = [this, &submits](std::size_t file) {
+            submits.emplace_back(file, std::make_shared<std::promise<IoEngine::File>>());
+            return submits.back().second->get_future();
+        };
+        std::future<IoEngine::File> read;
+        {
+            std::lock_guard lock(mutex_);
+            if (index >= files_.size() || taken_[index]) return IoEngine::File{{}, EINVAL};
+            taken_[index] = true;
+            if (reads_[index].valid()) {
+                read = std::move(reads_[index]);
+                ahead_--;
+            } else read = claim(index);
+            end = std::min({end, files_.size(), index + 1 + window_});
+            for (auto next = index + 1; next < end && ahead_ < window_; next++) {
+                if (taken_[next] || reads_[next].valid()) continue;
+                reads_[next] = claim(next);
+                ahead_++;
+            }
+        }
+        // the engine blocks while its queue is full: without the lock, other takers are not held up
+        for (auto &[file, promise]: submits)
+            engine_.read(files_[file], [promise = promise](IoEngine::File &&done) {
+                promise->set_value(std::move(done));
+            });
+        return read.get();
+    }
+
+    /// Take a file, the files after it are read ahead
+    IoEngine::File take(std::size_t index) { return take(index, files_.size()); }
+
+private:
+    IoEngine &engine_;
+    const std::vector<std::filesystem::path> files_;
+    /// Guards the following members
+    mutable std::mutex mutex_;
+    /// The reads ahead, not taken yet
+    std::vector<std::future<IoEngine::File>> reads_;
+    std::vector<bool> taken_;
+    std::size_t ahead_ = 0;
+    const std::size_t window_;
+};
+
+/**
+ * Buffers for background writes, so that a steady state batch run does not allocate an output buffer per file: a worker
+ * swaps its output for a pooled buffer, hands the output to IoEngine::write() and the write callback gives it back.
+ * Keeps at most `capacity` buffers (with their capacity), further ones are freed.
+ *
+ * Thread-safe.
+ */
+class BufferPool {
+public:
+    explicit BufferPool(std::size_t capacity) : capacity_(capacity) {}
+
+    /// An empty buffer, with the capacity of an earlier one if the pool has any
+    [[nodiscard]] std::vector<std::uint8_t> take() {
+        std::lock_guard lock(mutex_);
+        if (buffers_.empty()) return {};
+        auto buffer = std::move(buffers_.back());
+        buffers_.pop_back();
+        return buffer;
+    }
+
+    void give_back(std::vector<std::uint8_t> &&buffer) {
+        buffer.clear();
+        std::lock_guard lock(mutex_);
+        if (buffers_.size() < capacity_) buffers_.push_back(std::move(buffer));
+    }
+
+    /// Buffers kept for take()
+    [[nodiscard]] std::size_t size() const {
+        std::lock_guard lock(mutex_);
+        return buffers_.size();
+    }
+
+private:
+    /// Guards the buffers
+    mutable std::mutex mutex_;
+    std::vector<std::vector<std::uint8_t>> buffers_;
+    const std::size_t capacity_;
+};
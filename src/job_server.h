@@ -0,0 +1,372 @@
+//! Daemon mode transport: conversion jobs over a Unix domain socket, results handed back in shared memory
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "byte_view.h"
+#include "mapped_file.h"
+#include "stream_utils.h"
+
+/**
+ * Accepts jobs on a Unix domain socket, for a long running process that keeps its worker pool, connections,
+ * DNS cache and buffers warm across jobs.
+ *
+ * The protocol is line based: a request is `<id> <command> [<argument> ...]` (separated by single spaces, so
+ * arguments can't contain spaces), and each request gets exactly one reply `<id> <status> [<text>]`, in the order
+ * the replies are ready. Clients may pipeline any number of requests. A reply can carry a result in shared
+ * memory: a sealed memfd is passed with the reply (SCM_RIGHTS) and its size is the first word of the text, so the
+ * encoded bytes are written once and mapped by the client instead of being copied through the socket.
+ *
+ * The handler gets all requests that arrived in one poll round at once, so that it can batch small jobs.
+ * It runs on the thread of run() and must not block: replies may be sent later from any thread.
+ */
+class JobServer {
+public:
+    /// Reply side of a client connection, shared by its pending requests. Closed when the last one is gone.
+    class Connection {
+    public:
+        explicit Connection(int fd) noexcept: fd_(fd) {}
+
+        Connection(Connection const &) = delete;
+
+        Connection &operator=(Connection const &) = delete;
+
+        ~Connection() { ::close(fd_); }
+
+        /// Send a line with an optional file descriptor attached. Returns false if the client is gone.
+        bool send(std::string_view line, int fd = -1) noexcept {
+            std::lock_guard lock(mutex_);
+            iovec data{const_cast<char *>(line.data()), line.size()};
+            msghdr message{};
+            message.msg_iov = &data;
+            message.msg_iovlen = 1;
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+            if (fd >= 0) {
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+                auto *header = CMSG_FIRSTHDR(&message);
+                header->cmsg_level = SOL_SOCKET;
+                header->cmsg_type = SCM_RIGHTS;
+                header->cmsg_len = CMSG_LEN(sizeof(int));
+                std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+            }
+            // the descriptor goes with the first byte, the rest of the line may need more calls
+            while (!line.empty()) {
+                auto sent = ::sendmsg(fd_, &message, MSG_NOSIGNAL);
+                if (sent < 0 && errno == EINTR) continue;
+                if (sent <= 0) return false;
+                line.remove_prefix(std::size_t(sent));
+                data = {const_cast<char *>(line.data()), line.size()};
+                message.msg_control = nullptr;
+                message.msg_controllen = 0;
+            }
+            return true;
+        }
+
+    private:
+        int fd_;
+        std::mutex mutex_;
+    };
+
+    struct Request {
+        std::string id, command;
+        std::vector<std::string> arguments;
+        std::shared_ptr<Connection> connection;
+
+        void ok(std::string_view text = {}) const { reply("ok", text); }
+
+        void error(std::string_view text) const { reply("error", text); }
+
+        /// Reply ok with the bytes in shared memory: the text is `<size> [<text>]`
+        void ok_shared(ByteView bytes, std::string_view text = {}) const {
+            auto fd = ::memfd_create("toojpeg17_result", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (fd < 0) return error(std::string("memfd_create: ") + strerror(errno));
+            auto ok = true;
+            for (std::size_t offset = 0; ok && offset < bytes.size();) {
+                auto written = ::write(fd, bytes.ptr_ + offset, bytes.size() - offset);
+                if (written < 0 && errno == EINTR) continue;
+                ok = written > 0;
+                if (ok) offset += std::size_t(written);
+            }
+            // the client may rely on the content: nobody can change it after the reply
+            if (ok) ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+            if (ok) reply("ok", std::to_string(bytes.size()) + (text.empty() ? "" : " ") + std::string(text), fd);
+            else error(std::string("write: ") + strerror(errno));
+            ::close(fd);
+        }
+
+    private:
+        void reply(std::string_view status, std::string_view text, int fd = -1) const {
+            auto line = id + " " + std::string(status) + (text.empty() ? "" : " ") + std::string(text);
+            // a reply is a single line
+            std::replace(line.begin(), line.end(), '\n', ' ');
+            connection->send(line + "\n", fd);
+        }
+    };
+
+    using Handler = std::function<void(std::vector<Request> &&)>;
+
+    /**
+     * Listen on the given socket path, a stale socket file is replaced.
+     * Exceptions: Throws if the socket can't be created or bound.
+     */
+    JobServer(std::filesystem::path path, Handler handler) : path_(std::move(path)), handler_(std::move(handler)) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path_.native().size() >= sizeof(address.sun_path))
+            throw std::runtime_error(utils::from_parts("JobServer: Socket path too long:", path_));
+        std::memcpy(address.sun_path, path_.c_str(), path_.native().size());
+        listen_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (::pipe2(wake_, O_CLOEXEC | O_NONBLOCK) != 0 || listen_ < 0) {
+            auto error = errno;
+            close_all();
+            throw std::runtime_error(utils::from_parts("JobServer: socket:", strerror(error)));
+        }
+        ::unlink(path_.c_str());
+        if (::bind(listen_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(listen_, SOMAXCONN) != 0) {
+            auto error = errno;
+            close_all();
+            throw std::runtime_error(utils::from_parts("JobServer: bind", path_, strerror(error)));
+        }
+    }
+
+    JobServer(JobServer const &) = delete;
+
+    JobServer &operator=(JobServer const &) = delete;
+
+    ~JobServer() {
+        close_all();
+        ::unlink(path_.c_str());
+    }
+
+    /// Serve until stop() is called. Connections of pending requests stay open until those are replied.
+    void run() {
+        struct Client {
+            std::shared_ptr<Connection> connection;
+            int fd;
+            std::string buffer;
+        };
+        std::vector<Client> clients;
+        std::vector<pollfd> polled;
+        char data[64 * 1024];
+        while (!stopped_) {
+            polled.assign({{listen_, POLLIN, 0}, {wake_[0], POLLIN, 0}});
+            for (auto &client: clients) polled.push_back({client.fd, POLLIN, 0});
+            if (::poll(polled.data(), polled.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(utils::from_parts("JobServer: poll:", strerror(errno)));
+            }
+            if (polled[0].revents & POLLIN) {
+                auto fd = ::accept4(listen_, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd >= 0) clients.push_back({std::make_shared<Connection>(fd), fd, {}});
+            }
+
+            std::vector<Request> requests;
+            for (std::size_t i = 2; i < polled.size(); i++) {
+                if (!polled[i].revents) continue;
+                auto &client = clients[i - 2];
+                auto size = ::recv(client.fd, data, sizeof(data), 0);
+                if (size < 0 && errno == EINTR) continue;
+                if (size <= 0) {
+                    // a request without a line end is complete at the end of stream
+                    if (!client.buffer.empty()) parse(client.buffer, client.connection, requests);
+                    client.fd = -1;
+                    continue;
+                }
+                client.buffer.append(data, std::size_t(size));
+                auto end = client.buffer.rfind('\n');
+                if (end == std::string::npos) {
+                    // not a request, but the memory of the daemon must stay bounded
+                    if (client.buffer.size() > MaxLine) {
+                        client.connection->send("- error Request line too long\n");
+                        client.fd = -1;
+                    }
+                    continue;
+                }
+                parse(std::string_view(client.buffer).substr(0, end), client.connection, requests);
+                client.buffer.erase(0, end + 1);
+            }
+            // the reading side is done, the connection lives on in its requests
+            clients.erase(std::remove_if(clients.begin(), clients.end(), [](auto &c) { return c.fd < 0; }),
+                          clients.end());
+            if (!requests.empty()) handler_(std::move(requests));
+        }
+    }
+
+    /// Make run() return. May be called from any thread, eg from the handler of a shutdown request.
+    void stop() noexcept {
+        stopped_ = true;
+        char byte = 0;
+        (void) !::write(wake_[1], &byte, 1);
+    }
+
+    [[nodiscard]] const std::filesystem::path &path() const noexcept { return path_; }
+
+    /// Longest accepted request line, a client sending more without line end is disconnected
+    static constexpr std::size_t MaxLine = 64 * 1024;
+
+private:
+    /// Split the lines into requests, malformed lines are replied to right away
+    static void parse(std::string_view lines, const std::shared_ptr<Connection> &connection,
+                      std::vector<Request> &requests) {
+        while (!lines.empty()) {
+            auto line = lines.substr(0, lines.find('\n'));
+            lines.remove_prefix(std::min(lines.size(), line.size() + 1));
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (line.empty()) continue;
+            Request request;
+            request.connection = connection;
+            for (std::size_t field = 0; !line.empty(); field++) {
+                auto word = line.substr(0, line.find(' '));
+                line.remove_prefix(std::min(line.size(), word.size() + 1));
+                if (word.empty()) continue;
+                if (field == 0) request.id = word;
+                else if (field == 1) request.command = word;
+                else request.arguments.emplace_back(word);
+            }
+            if (request.command.empty()) {
+                if (request.id.empty()) request.id = "-";
+                request.error("Malformed request, expected: <id> <command> [<argument> ...]");
+                continue;
+            }
+            requests.push_back(std::move(request));
+        }
+    }
+
+    void close_all() noexcept {
+        for (auto *fd: {&listen_, &wake_[0], &wake_[1]}) {
+            if (*fd >= 0) ::close(*fd);
+            *fd = -1;
+        }
+    }
+
+    std::filesystem::path path_;
+    Handler handler_;
+    int listen_ = -1;
+    int wake_[2] = {-1, -1};
+    std::atomic<bool> stopped_{false};
+};
+
+/**
+ * Client of a {@link JobServer}: sends requests, receives replies with their shared memory results.
+ * Blocking, for a single thread.
+ */
+class JobClient {
+public:
+    struct Reply {
+        std::string id, status, text;
+        /// The result in shared memory, invalid if the reply has none
+        MappedFile shared{-1};
+
+        [[nodiscard]] bool ok() const noexcept { return status == "ok"; }
+    };
+
+    /// Exceptions: Throws if the server can't be reached
+    explicit JobClient(const std::filesystem::path &path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.native().size() >= sizeof(address.sun_path))
+            throw std::runtime_error(utils::from_parts("JobClient: Socket path too long:", path));
+        std::memcpy(address.sun_path, path.c_str(), path.native().size());
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0 || ::connect(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            auto error = errno;
+            if (fd_ >= 0) ::close(fd_);
+            throw std::runtime_error(utils::from_parts("JobClient: connect", path, strerror(error)));
+        }
+    }
+
+    JobClient(JobClient const &) = delete;
+
+    JobClient &operator=(JobClient const &) = delete;
+
+    ~JobClient() {
+        for (auto fd: fds_) ::close(fd);
+        ::close(fd_);
+    }
+
+    /// Send a request line (without line end). Returns false if the server is gone.
+    bool send(std::string_view request) {
+        auto line = std::string(request) + "\n";
+        for (std::string_view rest(line); !rest.empty();) {
+            auto sent = ::send(fd_, rest.data(), rest.size(), MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) return false;
+            rest.remove_prefix(std::size_t(sent));
+        }
+        return true;
+    }
+
+    /// The next reply, nullopt if the server closed the connection
+    std::optional<Reply> receive() {
+        std::size_t end;
+        while ((end = buffer_.find('\n')) == std::string::npos) {
+            char data[4096];
+            iovec vector{data, sizeof(data)};
+            msghdr message{};
+            message.msg_iov = &vector;
+            message.msg_iovlen = 1;
+            alignas(cmsghdr) char control[CMSG_SPACE(4 * sizeof(int))];
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            auto size = ::recvmsg(fd_, &message, MSG_CMSG_CLOEXEC);
+            if (size < 0 && errno == EINTR) continue;
+            if (size <= 0) return std::nullopt;
+            buffer_.append(data, std::size_t(size));
+            // the kernel ends a read after the segment with descriptors: they belong to the line of the last byte
+            auto line = lines_ + std::size_t(std::count(buffer_.begin(), buffer_.end(), '\n')) -
+                        (buffer_.back() == '\n' ? 1 : 0);
+            for (auto *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+                if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+                    for (std::size_t i = 0; i < (header->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+                        int fd;
+                        std::memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+                        fds_.push_back(fd);
+                        fdLines_.push_back(line);
+                    }
+        }
+        auto line = std::string_view(buffer_).substr(0, end);
+        Reply reply;
+        reply.id = line.substr(0, line.find(' '));
+        line.remove_prefix(std::min(line.size(), reply.id.size() + 1));
+        reply.status = line.substr(0, line.find(' '));
+        line.remove_prefix(std::min(line.size(), reply.status.size() + 1));
+        reply.text = line;
+        if (!fdLines_.empty() && fdLines_.front() == lines_) {
+            reply.shared = MappedFile(fds_.front());
+            fds_.erase(fds_.begin());
+            fdLines_.erase(fdLines_.begin());
+        }
+        buffer_.erase(0, end + 1);
+        lines_++;
+        return reply;
+    }
+
+private:
+    int fd_ = -1;
+    std::string buffer_;
+    /// Received descriptors and the number of the line each one belongs to
+    std::vector<int> fds_;
+    std::vector<std::size_t> fdLines_;
+    std::size_t lines_ = 0;
+};
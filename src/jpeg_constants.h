@@ -4,6 +4,8 @@
  * In its own file to compare the original implementation with a C++17 constexpr adapted one.
  */
 
+#pragma once
+
 #include <cstdint>
 #include <array>
 
@@ -0,0 +1,164 @@
+//! Fast path for JPEG inputs: inspect the headers, and copy a baseline file through with a new comment
+//! instead of decoding and re-encoding it.
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <string_view>
+
+#include "toojpeg_17.h"
+
+namespace TooJpeg17 {
+
+/// Frame and quantisation infos of a JPEG file, see inspect_jpeg()
+struct JpegInfo {
+    /// All segments up to the start of scan could be parsed
+    bool valid = false;
+    /// Baseline DCT (SOF0): 8 bit samples, Huffman coding, a single sequential scan
+    bool baseline = false;
+    unsigned width = 0, height = 0, components = 0;
+    /// DQT tables in zigzag order, as stored in the file
+    std::array<std::array<uint16_t, 8 * 8>, 4> quant{};
+    std::array<bool, 4> hasQuant{};
+    /// DQT table of the first component (luminance), -1 if unknown
+    int lumaTable = -1;
+    /// Estimated quality in [1..100] of the luminance table, 0 if unknown. See estimate_quality().
+    unsigned quality = 0;
+    /// Offset of the first segment that is not an APPn or COM segment
+    std::size_t headerEnd = 0;
+
+    /**
+     * Returns true if a copy of the file does not exceed the target quality: a baseline jpeg of a known quality. The
+     * quality of a stream without the luminance table (eg an abbreviated one) is unknown.
+     */
+    [[nodiscard]] bool within_quality(unsigned target) const noexcept {
+        return valid && baseline && quality > 0 && quality <= target;
+    }
+};
+
+/**
+ * Estimate the quality of a luminance quantisation table by finding the closest table
+ * the libjpeg formula (which writeJpeg() uses as well) produces.
+ * @param table DQT table in zigzag order
+ * @return The quality in [1..100], tables that are not scaled standard tables get the closest match
+ */
+inline unsigned estimate_quality(const std::array<uint16_t, 8 * 8> &table) noexcept {
+    unsigned best = 0;
+    auto bestError = std::numeric_limits<long>::max();
+    for (unsigned quality_ = 1; quality_ <= 100; quality_++) {
+        auto &candidate = quant_tables((unsigned char) quality_).luminance;
+        long error = 0;
+        for (auto i = 0; i < 8 * 8; i++) error += std::labs(long(table[i]) - candidate[i]);
+        // the higher quality wins a tie, eg for tables clamped to 1
+        if (error <= bestError) {
+            bestError = error;
+            best = quality_;
+        }
+    }
+    return best;
+}
+
+/**
+ * Parse all segments of a JPEG file up to the start of scan (SOS).
+ * Never reads beyond the given range, truncated or malformed files are reported as invalid.
+ */
+inline JpegInfo inspect_jpeg(ByteView jpeg) noexcept {
+    JpegInfo info;
+    const auto *data = jpeg.ptr_;
+    const std::size_t size = jpeg.size();
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return info;
+
+    auto readU16 = [data](std::size_t pos) { return unsigned(data[pos] << 8u | data[pos + 1]); };
+    int componentTables[4] = {-1, -1, -1, -1};
+    std::size_t pos = 2;
+    bool sawFrame = false;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return info;
+        // fill bytes (0xFF 0xFF ...) are not supported, such files are rejected
+        auto marker = data[pos + 1];
+        auto length = readU16(pos + 2);
+        if (length < 2 || pos + 2 + length > size) return info;
+        const auto *payload = data + pos + 4;
+        const auto payloadSize = length - 2u;
+
+        auto isAppOrComment = (marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE;
+        if (!isAppOrComment && !info.headerEnd) info.headerEnd = pos;
+
+        if (marker == 0xDB) {
+            // DQT: one or more tables, each 1 byte precision/id + 64 or 128 bytes
+            std::size_t offset = 0;
+            while (offset < payloadSize) {
+                unsigned precision = payload[offset] >> 4u, id = payload[offset] & 0x0Fu;
+                auto tableSize = precision ? 128u : 64u;
+                if (id > 3 || offset + 1 + tableSize > payloadSize) return info;
+                for (auto i = 0; i < 8 * 8; i++)
+                    info.quant[id][i] = precision ? uint16_t(payload[offset + 1 + 2 * i] << 8u |
+                                                             payload[offset + 2 + 2 * i])
+                                                  : payload[offset + 1 + i];
+                info.hasQuant[id] = true;
+                offset += 1 + tableSize;
+            }
+        } else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            // SOFn: precision, height, width, components (id, sampling, quantisation table)
+            if (payloadSize < 6) return info;
+            info.baseline = marker == 0xC0 && payload[0] == 8;
+            info.height = readU16(pos + 5);
+            info.width = readU16(pos + 7);
+            info.components = payload[5];
+            if (payloadSize < 6 + 3 * info.components) return info;
+            for (unsigned c = 0; c < info.components && c < 4; c++) componentTables[c] = payload[6 + 3 * c + 2] & 0x03;
+            sawFrame = true;
+        } else if (marker == 0xDA) {
+            // start of scan: the entropy coded data follows
+            if (!sawFrame) return info;
+            info.lumaTable = componentTables[0];
+            if (info.lumaTable >= 0 && info.hasQuant[info.lumaTable])
+                info.quality = estimate_quality(info.quant[info.lumaTable]);
+            info.valid = info.width > 0 && info.height > 0;
+            return info;
+        }
+        pos += 2 + length;
+    }
+    return info;
+}
+
+/**
+ * Copy a JPEG file to the sink, but replace all comment (COM) segments with the given comment.
+ * All other segments and the entropy coded data are copied unchanged, in chunks.
+ * @param comment New comment, empty to strip comments. Must be shorter than 65534 bytes.
+ * @return False if the file can't be parsed (see inspect_jpeg()) or the comment is too long
+ */
+template<typename Sink, typename = std::enable_if_t<is_sink_v<Sink>>>
+bool rewriteJpegComment(Sink &&output, ByteView jpeg, std::string_view comment) {
+    auto info = inspect_jpeg(jpeg);
+    if (!info.valid || comment.size() > 0xFFFF - 2) return false;
+
+    BitWriter<std::decay_t<Sink>> bitWriter(output);
+    const auto *data = jpeg.ptr_;
+    // SOI and all APPn segments stay in front, so that JFIF/Exif remain the first segment
+    std::size_t pos = 2;
+    bitWriter << 0xFF_bn << 0xD8_bn;
+    auto copySegments = [&](std::size_t end) {
+        while (pos < end) {
+            auto length = std::size_t(data[pos + 2] << 8u | data[pos + 3]);
+            if (data[pos + 1] != 0xFE) bitWriter << ByteView(data + pos, 2 + length);
+            pos += 2 + length;
+        }
+    };
+    copySegments(info.headerEnd);
+    if (!comment.empty()) {
+        bitWriter.addMarker(0xFE_bn, uint16_t(2 + comment.size()));
+        bitWriter << comment;
+    }
+    // comments between the tables are dropped as well, the scan and everything after it is copied as-is
+    auto scan = pos;
+    while (!(data[scan] == 0xFF && data[scan + 1] == 0xDA)) scan += 2 + (data[scan + 2] << 8u | data[scan + 3]);
+    copySegments(scan);
+    bitWriter << ByteView(data + pos, jpeg.size() - pos);
+    bitWriter.drain();
+    return true;
+}
+
+} // namespace TooJpeg17
@@ -3,107 +3,676 @@
 //! Example usage:
 //! modern_cpp_features https://create.stephan-brumme.com/toojpeg/ output
 //! modern_cpp_features image_input_dir output
+//! modern_cpp_features image_input_dir output --thumbnails=160x120,1024x768 --optimize-huffman
+//! modern_cpp_features --daemon=/tmp/toojpeg17.socket
 
 #include <iostream>
 #include "toojpeg_17.h"
 #include "http.h"
 #include "image_loader.h"
+#include "image_resize.h"
+#include "batch_encoder.h"
+#include "jpeg_passthrough.h"
+#include "download_scheduler.h"
+#include "image_url_scanner.h"
+#include "http_cache.h"
+#include "atomic_file.h"
+#include "io_engine.h"
+#include "directory_scanner.h"
+#include "metrics.h"
+#include "job_server.h"
 
-#include <fstream>
+#include <csignal>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <memory>
+#include <optional>
+#include <set>
+#include <sstream>
 #include <algorithm>
-#include <execution>
 #include <string>
+#include <thread>
+#include <vector>
 
 using std::cout;
 using std::cerr;
 using std::endl;
 using namespace std::filesystem;
 
+/// Result of encode_image()
+enum class Conversion {
+    Failed, Encoded, Copied
+};
+
+using ThumbnailSizes = std::vector<TooJpeg17::ThumbnailSize>;
+
+/// Settings of each conversion, from the options of the command line (or of a daemon request), see encode_image()
+struct ConvertOptions {
+    /// Thumbnails of each converted image (--thumbnails=WxH,...)
+    ThumbnailSizes thumbnails;
+    /// Per image Huffman tables (--optimize-huffman): smaller files, but each image is coded twice
+    bool optimizeHuffman = false;
+};
+
 /**
- * If the given directory entry is a file, load it with {@link ImageLoader}, compute the jpeg and write it to disk with a ".new.jpg" suffix.
- * @param file
+ * The thumbnail file of a converted file: the size is inserted before ".new.jpg", so that the directory scan skips
+ * thumbnails like converted files, or else before the extension. Eg "a.png.new.jpg" -> "a.png.160x120.new.jpg".
  */
-void process_file(const directory_entry &file) {
-    if (!file.is_regular_file()) return;
+path thumbnail_file(const path &target, TooJpeg17::ThumbnailSize size) {
+    constexpr std::string_view converted = ".new.jpg";
+    auto name = target.filename().string();
+    auto end = utils::endsWith(name, converted) ? name.size() - converted.size()
+                                                : std::min(name.rfind('.'), name.size());
+    name.insert(end, "." + std::to_string(size.width) + "x" + std::to_string(size.height));
+    return target.parent_path() / name;
+}
 
-    // Load image and put it into a unique_ptr with a deleter (stbi_image_free) for RAII
-    ImageLoader image{file.path().c_str()};
+/**
+ * Encode a thumbnail of the decoded image per size, all of them in one pass over the image (see
+ * {@link TooJpeg17::Resizer}). The pixels and bytes count for the statistics of the job.
+ * @return Returns false if a thumbnail could not be encoded
+ */
+bool encode_thumbnails(ImageLoader &image, const ConvertOptions &convert,
+                       std::vector<std::vector<std::uint8_t>> &thumbnails, TooJpeg17::BatchEncoder::Scratch &scratch) {
+    std::vector<TooJpeg17::ResizeTarget> targets;
+    for (auto size: convert.thumbnails)
+        targets.push_back(TooJpeg17::ResizeTarget::fit(image.width, image.height, size.width, size.height));
+    auto resized = TooJpeg17::resize_image(*image, image.width, image.height, image.channels, targets);
 
-    auto file_path = file.path();
-    auto filename_ = std::prev(file_path.end());
-    std::string_view filename(filename_->native());
+    TooJpeg17::EncodeOptions options;
+    options.optimizeHuffman = convert.optimizeHuffman;
+    thumbnails.resize(resized.size());
+    for (std::size_t i = 0; i < resized.size(); i++) {
+        auto &thumbnail = resized[i];
+        thumbnails[i].clear();
+        if (!TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(thumbnails[i]), thumbnail.pixels.data(), thumbnail.width,
+                                         thumbnail.height, true, image.is_rgb(), 85, "", options))
+            return false;
+        scratch.pixelsEncoded += std::uint64_t(thumbnail.width) * thumbnail.height;
+        scratch.bytesEncoded += thumbnails[i].size();
+    }
+    return true;
+}
 
-    if (utils::endsWith(filename, ".new.jpg")) { return; }
+/**
+ * Compute the jpeg of an encoded image (any format {@link ImageLoader} supports) into scratch.output.
+ * Baseline jpeg files up to the target quality are copied with a new comment instead, see {@link TooJpeg17::rewriteJpegComment}.
+ * @param input The encoded image, eg a read file or a download buffer
+ * @param scratch Per worker buffers of the {@link TooJpeg17::BatchEncoder}
+ * @param convert The settings, thumbnails are encoded as well (a copied jpeg is decoded for them), see
+ *                encode_thumbnails()
+ * @param thumbnails Receives the thumbnail jpegs in the order of convert.thumbnails
+ */
+Conversion encode_image(ByteView input, TooJpeg17::BatchEncoder::Scratch &scratch, const ConvertOptions &convert,
+                        std::vector<std::vector<std::uint8_t>> &thumbnails) {
+    thumbnails.clear();
+    // Baseline jpegs that do not exceed the target quality would not get any better by re-encoding them:
+    // copy them through and only replace the comment
+    constexpr unsigned char quality = 90;
+    constexpr std::string_view comment = "TooJpeg17 converted image";
+    auto info = TooJpeg17::inspect_jpeg(input);
+    bool copy = info.within_quality(quality);
+    if (copy) {
+        if (!TooJpeg17::rewriteJpegComment(TooJpeg17::VectorSink(scratch.output), input, comment))
+            return Conversion::Failed;
+        scratch.bytesEncoded += scratch.output.size();
+        if (convert.thumbnails.empty()) return Conversion::Copied;
+    }
+
+    // Decode straight from memory into the pixel buffer of the worker, the decoder allocates from a per-thread arena
+    auto image = [input, &scratch] {
+        Metrics::ScopedTimer timer(Metrics::Timer::Decode);
+        return ImageLoader{input.ptr_, input.size(), scratch.pixels};
+    }();
+    if (!image.is_valid()) return Conversion::Failed;
+
+    // grayscale images are encoded with a single component, per image Huffman tables (if enabled) shrink the output
+    TooJpeg17::EncodeOptions options;
+    options.optimizeHuffman = convert.optimizeHuffman;
+    if (!copy && !scratch.encode(*image, image.width, image.height, false, image.is_rgb(), quality, comment, options))
+        return Conversion::Failed;
+    if (!convert.thumbnails.empty() && !encode_thumbnails(image, convert, thumbnails, scratch))
+        return Conversion::Failed;
+    return copy ? Conversion::Copied : Conversion::Encoded;
+}
 
-    file_path.concat(".new.jpg");
+/// Write the whole file at once: it appears complete or not at all (see {@link AtomicFile})
+bool write_file(const path &target, ByteView data) {
+    Metrics::ScopedTimer timer(Metrics::Timer::Write);
+    AtomicFile outfile(target);
+    return outfile.write(data) && outfile.commit();
+}
 
-    if (exists(file_path)) {
-        cout << "Already converted file skipped: " << file_path << endl;
-        return;
+/// Write the thumbnails of encode_image() next to the converted file, see thumbnail_file()
+bool write_thumbnails(const path &target, const ThumbnailSizes &sizes,
+                      const std::vector<std::vector<std::uint8_t>> &thumbnails) {
+    for (std::size_t i = 0; i < thumbnails.size(); i++) {
+        if (!write_file(thumbnail_file(target, sizes[i]), ByteView(thumbnails[i].data(), thumbnails[i].size())))
+            return false;
+        Metrics::add(Metrics::Counter::OutputBytes, thumbnails[i].size());
     }
+    return true;
+}
+
+void report(Conversion conversion, const path &target, std::size_t bytes) {
+    Metrics::add(Metrics::Counter::Converted);
+    Metrics::add(Metrics::Counter::OutputBytes, bytes);
+    cout << (conversion == Conversion::Copied ? "File copied: " : "File converted: ") << target << endl;
+}
 
-    if (image.is_valid()) {
-        std::ofstream outfile(file_path,
-                              std::ios_base::trunc | std::ios_base::out |
-                              std::ios_base::binary);
-        bool ok = TooJpeg17::writeJpeg<90>([&outfile](ByteView v) { outfile.write(v.data(), v.size_); }, *image,
-                                           image.width, image.height, false, image.channels != 2,
-                                           "TooJpeg17 converted image");
-        if (ok) cout << "File converted: " << file_path << endl;
+/**
+ * Convert an encoded image with encode_image() and write it (and its thumbnails) to the given file.
+ * @param input The encoded image, eg a download buffer
+ * @param target The output file, replaced atomically
+ * @param scratch Per worker buffers of the {@link TooJpeg17::BatchEncoder}
+ * @param convert See encode_image()
+ * @return Returns false if the image could not be converted
+ */
+bool convert_image(ByteView input, const path &target, TooJpeg17::BatchEncoder::Scratch &scratch,
+                   const ConvertOptions &convert) {
+    std::vector<std::vector<std::uint8_t>> encoded;
+    auto conversion = encode_image(input, scratch, convert, encoded);
+    if (conversion == Conversion::Failed) {
+        Metrics::add(Metrics::Counter::Failed);
+        return false;
     }
+
+    // One write of the whole output. The file appears complete or not at all, so an interrupted run does not
+    // leave truncated files that the next run would skip as "already converted". The thumbnails are written first.
+    if (!write_thumbnails(target, convert.thumbnails, encoded) ||
+        !write_file(target, ByteView(scratch.output.data(), scratch.output.size())))
+        return false;
+    report(conversion, target, scratch.output.size());
+    return true;
+}
+
+/**
+ * Convert a file of the batch with encode_image() to a file with a ".new.jpg" suffix.
+ * The file has been read ahead by the engine and the output is written in the background, the worker does not wait
+ * for the disk (unless the reads fall behind).
+ * @param inputs The files of the batch, see {@link DirectoryScanner}
+ * @param index The file to convert
+ * @param end End of the chunk of the job, the files before are read ahead
+ * @param io Writes the output
+ * @param buffers The output buffers in flight are returned to it after the write
+ * @param scratch Per worker buffers of the {@link TooJpeg17::BatchEncoder}
+ * @param convert See encode_image()
+ * @return Returns false if the file could not be converted
+ */
+bool process_file(ReadAhead &inputs, std::size_t index, std::size_t end, IoEngine &io, BufferPool &buffers,
+                  TooJpeg17::BatchEncoder::Scratch &scratch, const ConvertOptions &convert) {
+    Metrics::ScopedTimer timer(Metrics::Timer::ProcessFile);
+    auto file = inputs.take(index, end);
+    std::vector<std::vector<std::uint8_t>> encoded;
+    auto conversion = file.ok() ? encode_image(ByteView(file.data.data(), file.data.size()), scratch, convert,
+                                               encoded)
+                                : Conversion::Failed;
+    if (conversion == Conversion::Failed) {
+        Metrics::add(Metrics::Counter::Failed);
+        return false;
+    }
+
+    auto target = inputs.path(index);
+    target.concat(".new.jpg");
+    for (std::size_t i = 0; i < encoded.size(); i++) {
+        auto thumbnail = thumbnail_file(target, convert.thumbnails[i]);
+        auto bytes = encoded[i].size();
+        io.write(thumbnail, std::move(encoded[i]), [thumbnail, bytes](int error) {
+            if (error) {
+                Metrics::add(Metrics::Counter::Failed);
+                cerr << "\tFailed to write " << thumbnail << ": " << strerror(error) << endl;
+            } else Metrics::add(Metrics::Counter::OutputBytes, bytes);
+        });
+    }
+    // no copy: the output is written from its buffer, the worker continues with a pooled one
+    auto bytes = scratch.output.size();
+    io.write(target, std::exchange(scratch.output, buffers.take()), [&buffers, target, conversion, bytes,
+            submitted = Metrics::Clock::now()](IoEngine::File &&written) {
+        Metrics::record(Metrics::Timer::Write, submitted, Metrics::Clock::now());
+        buffers.give_back(std::move(written.data));
+        if (!written.ok()) {
+            Metrics::add(Metrics::Counter::Failed);
+            cerr << "\tFailed to write " << target << ": " << strerror(written.error) << endl;
+        } else report(conversion, target, bytes);
+    });
+    return true;
 }
 
 /**
  * Given a url, the page will be downloaded and all supported images found in <img src=".."> tags
- * will be downloaded to the given output directory.
+ * will be downloaded and converted to jpeg files in the given output directory.
+ *
+ * This is a pipeline without temporary files: images are downloaded concurrently (see {@link Socket::DownloadScheduler})
+ * into memory and each finished download is handed to the encoder, which writes the final ".new.jpg" file.
+ * At most encoderBacklog downloaded images wait for the encoder, further downloads stall until the encoder catches up.
+ *
+ * A re-crawl revalidates the images with conditional requests (see {@link Socket::HttpCache}, in `.http_cache` of the
+ * output directory): unchanged images are neither downloaded nor encoded again, known content is not encoded again.
  *
  * @param url A URL
  * @param output An existing output directory
+ * @param limits Concurrent downloads, in total and per host
+ * @param pool The page and all images share its persistent connections (and TLS sessions) per host, eg across the
+ *             crawls of a daemon
+ * @param encoder Converts the downloaded images, see convert_image(). The crawler returns when its images are done,
+ *                the encoder may be shared with other crawls.
+ * @param encoderBacklog Downloaded images queued for the encoder at most
+ * @param convert The settings of the conversions, see encode_image(). Images restored from the cache keep the
+ *                thumbnails of their conversion.
  * @return Returns true on success and false otherwise. May throw on unexpected IO errors.
  */
-bool webpage_crawler(const Socket::Url &url, const path &output) {
-    // Download given URL page
-    std::stringstream page_stream{};
-    auto res = Socket::writeHttpResponseTo(page_stream, url);
-    if (!res) {
-        cerr << "Failed to download page at given url " << url.full() << endl;
+bool webpage_crawler(const Socket::Url &url, const path &output, Socket::DownloadScheduler::Limits limits,
+                     Socket::ConnectionPool<WITH_HTTPS> &pool, TooJpeg17::BatchEncoder &encoder,
+                     std::size_t encoderBacklog, const ConvertOptions &convert) {
+    const Socket::HttpCache cache(output / ".http_cache");
+    // the encoder jobs refer to the cache: wait for them (see WaitForJobs), but not for the jobs of others
+    TooJpeg17::JobGroup converted;
+    Socket::DownloadScheduler downloads(limits);
+    // Waits on every path out of the crawler, also if the page request throws: the jobs refer to the locals
+    struct WaitForJobs {
+        Socket::DownloadScheduler &downloads;
+        TooJpeg17::JobGroup &converted;
+
+        ~WaitForJobs() {
+            // downloads submit the encoder jobs
+            downloads.wait();
+            converted.wait();
+        }
+    } waitForJobs{downloads, converted};
+    // An image referenced twice is downloaded once, jobs must not write to the same file
+    std::set<std::string> file_names;
+    auto on_image = [&](std::string_view src) {
+        std::optional<Socket::Url> image_url;
+        try { image_url = Socket::Url::from_relative(url, src); }
+        catch (const std::runtime_error &) {
+            cerr << "\tUnsupported image url: " << src << endl;
+            return;
+        }
+
+        std::string file_name(image_url->path_);
+        std::replace(file_name.begin(), file_name.end(), '/', '_');
+        utils::replace_all(file_name, "%2", "&");
+        if (!file_names.insert(file_name).second) return;
+
+        auto target = output;
+        target.append(file_name + ".new.jpg");
+        // Outputs of a previous run without cache entry can't be revalidated
+        auto cached = cache.lookup(image_url->full());
+        if (!cached && exists(target)) {
+            cout << "Already converted file skipped: " << target << endl;
+            return;
+        }
+        downloads.submit(*image_url, [&, image_url = *image_url, target, cached] {
+            std::cout << "Downloading " << target.filename() << std::endl;
+            // revalidate only if the cached output is still there
+            auto conditional = cached && !cached->validators.empty() && cache.has_object(cached->content)
+                               ? &cached->validators : nullptr;
+            // shared: std::function requires copyable jobs
+            auto body = std::make_shared<std::vector<std::uint8_t>>();
+            Socket::HttpValidators validators;
+            auto begin = Metrics::Clock::now();
+            int status = 0;
+            std::optional<std::size_t> size;
+            try {
+                std::tie(status, size) = Socket::readHttpResponse(*body, image_url, pool, conditional, &validators);
+            } catch (const std::runtime_error &error) {
+                // eg the connection ended within the body
+                std::cerr << "\tFailed to download: " << image_url.full() << " " << error.what() << endl;
+                return;
+            }
+            Metrics::record(Metrics::Timer::Download, begin, Metrics::Clock::now());
+            // Not modified only answers a conditional request, any other 304 is a failed download below
+            if (status == 304 && conditional) {
+                if (!exists(target) && !cache.restore(cached->content, target)) {
+                    std::cerr << "\tFailed to restore the cached output: " << target << endl;
+                    return;
+                }
+                Metrics::add(Metrics::Counter::CacheHits);
+                cout << "Not modified: " << target << endl;
+                return;
+            }
+            // Only complete bodies are hashed, converted and cached with their validators
+            if (status != 200 || !size || *size != body->size()) {
+                std::cerr << "\tFailed to download: " << image_url.full() << endl;
+                return;
+            }
+
+            Socket::HttpCache::Entry entry{validators, Socket::HttpCache::content_hash(ByteView(body->data(), *size))};
+            if (cache.has_object(entry.content) && cache.restore(entry.content, target)) {
+                Metrics::add(Metrics::Counter::CacheHits);
+                cache.store(image_url.full(), entry);
+                cout << "Known content restored: " << target << endl;
+                return;
+            }
+            auto job = [&cache, &convert, body, target, url = std::string(image_url.full()), entry](
+                    TooJpeg17::BatchEncoder::Scratch &scratch) {
+                if (!convert_image(ByteView(body->data(), body->size()), target, scratch, convert)) return false;
+                // the entry refers to the object, so it is stored last
+                if (cache.add_object(entry.content, target)) cache.store(url, entry);
+                return true;
+            };
+            // Blocks while the encoder is behind: backpressure for the downloads
+            encoder.submit_bounded(converted.add(std::move(job)), encoderBacklog);
+        });
+    };
+
+    // Download the given URL page. Image urls are extracted from each received chunk, so the image downloads start
+    // while the page is still being received.
+    Socket::ImageUrlScanner scanner;
+    auto begin = Metrics::Clock::now();
+    auto page = pool.request(url, [&](Socket::HttpParsedResponse header, ByteView data) {
+        if (header.status_code != 200) return;
+        scanner.feed(std::string_view(reinterpret_cast<const char *>(data.ptr_), data.size_), on_image);
+    });
+    Metrics::record(Metrics::Timer::CrawlPage, begin, Metrics::Clock::now());
+    if (page.status_code != 200) {
+        cerr << "Failed to download page at given url " << url.full() << " " << page.status_code << endl;
         return false;
     }
+    return true;
+}
 
-    // Perform regex search
-    auto page = page_stream.str();
-    static std::regex url_regex(R"(.*src=["']([^"']*?(?:jpg|png|bmp|gif|pnm|JPG|PNG|BMP|GIF|PNM))["'].*)");
-    std::match_results<std::string::const_iterator> match;
+/// Options of the directory conversion
+struct DirectoryOptions {
+    ScanOptions scan;
+    /// Convert the files of this manifest instead of scanning the directory
+    std::optional<path> manifest;
+    /// Only write the list of files to convert, see write_manifest()
+    std::optional<path> writeManifest;
+    /// Convert the part `shard` of `shards`, see shard()
+    unsigned shard = 0, shards = 1;
+    /// Settings of each conversion
+    ConvertOptions convert;
+};
 
-    while (std::regex_search(page, match, url_regex)) {
-        auto image_url = Socket::Url::from_relative(url, match[1].str());
+/**
+ * Convert the files of the directory (or of a manifest) in size-balanced chunks, see {@link DirectoryScanner}.
+ * @return Returns the process exit code
+ */
+int convert_directory(const path &input, const DirectoryOptions &options, TooJpeg17::BatchEncoder &encoder) {
+    auto files = options.manifest ? read_manifest(*options.manifest) : DirectoryScanner(options.scan).scan(input);
 
-        std::string file_name(image_url.path_);
-        std::replace(file_name.begin(), file_name.end(), '/', '_');
-        utils::replace_all(file_name, "%2", "&");
-        std::cout << "Downloading " << file_name << std::endl;
-
-        auto result_file = output;
-        result_file.append(file_name);
-        auto tmp_file = result_file;
-        tmp_file += ".tmp";
-        std::ofstream outfile(tmp_file, std::ios_base::trunc | std::ios_base::out | std::ios_base::binary);
-        res = Socket::writeHttpResponseTo(outfile, image_url);
-        if (res) {
-            rename(tmp_file, result_file);
-        } else {
-            remove(tmp_file);
-            std::cerr << "\tFailed to download: " << url.full() << endl;
+    if (options.writeManifest) {
+        if (!write_manifest(*options.writeManifest, files)) {
+            cerr << "Failed to write the manifest " << *options.writeManifest << endl;
+            return 1;
         }
+        cout << "Manifest with " << files.size() << " files written: " << *options.writeManifest << endl;
+        return 0;
+    }
+    // All shards must see the same list: files converted since the manifest has been written (eg by another shard)
+    // are skipped after the sharding
+    files = shard(std::move(files), options.shard, options.shards);
+    if (options.manifest) {
+        files.erase(std::remove_if(files.begin(), files.end(), [](const ScannedFile &file) {
+            auto target = file.path;
+            return exists(target.concat(".new.jpg"));
+        }), files.end());
+    }
+
+    // Small files are grouped into one job, the biggest jobs start first
+    std::uint64_t total = 0;
+    for (auto &file: files) total += file.size;
+    auto chunks = balance_chunks(files, std::max<std::uint64_t>(1u << 20u, total / (8 * encoder.threads())));
+    cout << files.size() << " files to convert in " << chunks.size() << " jobs" << endl;
+
+    // The files are read ahead of the encoder, outputs are written in the background
+    std::vector<path> paths;
+    paths.reserve(files.size());
+    for (auto &file: files) paths.push_back(std::move(file.path));
+    // output buffers of about the writes in flight, declared first: the writes of the engine return to it
+    BufferPool buffers(2 * encoder.threads());
+    IoEngine io;
+    ReadAhead inputs(io, std::move(paths), 2 * encoder.threads());
+    for (auto chunk: chunks)
+        encoder.submit([&inputs, &io, &buffers, &options, chunk](TooJpeg17::BatchEncoder::Scratch &scratch) {
+            bool ok = true;
+            for (auto i = chunk.begin; i < chunk.end; i++) {
+                scratch.output.clear();
+                ok = process_file(inputs, i, chunk.end, io, buffers, scratch, options.convert) && ok;
+            }
+            return ok;
+        });
+    encoder.wait();
+    io.wait();
+    cout << "Batch: " << encoder.statistics() << " (I/O: " << (io.uses_io_uring() ? "io_uring" : "threads") << ")"
+         << endl;
+    return 0;
+}
+
+/// A convert or encode request of the daemon, see serve_file()
+struct DaemonFile {
+    JobServer::Request request;
+    /// The converted file, empty to reply the jpeg in shared memory
+    path output;
+    std::uint64_t size = 0;
+    /// The thumbnails are written next to the output, see write_thumbnails()
+    ConvertOptions convert;
+};
 
-        page = match.suffix();
+/**
+ * Convert the input file of a daemon request with encode_image() and reply: `ok <bytes> converted|copied` after the
+ * output has been written, or the jpeg in shared memory (see {@link JobServer::Request::ok_shared}).
+ * @return Returns false if the file could not be converted
+ */
+bool serve_file(const DaemonFile &file, TooJpeg17::BatchEncoder::Scratch &scratch) {
+    Metrics::ScopedTimer timer(Metrics::Timer::ProcessFile);
+    auto &request = file.request;
+    scratch.output.clear();
+    MappedFile input(request.arguments[0].c_str());
+    std::vector<std::vector<std::uint8_t>> thumbnails;
+    auto conversion = input.is_valid() ? encode_image(ByteView(input.data(), input.size()), scratch, file.convert,
+                                                      thumbnails)
+                                       : Conversion::Failed;
+    if (conversion == Conversion::Failed) {
+        Metrics::add(Metrics::Counter::Failed);
+        request.error("Failed to convert " + request.arguments[0]);
+        return false;
+    }
+    std::string_view how = conversion == Conversion::Copied ? "copied" : "converted";
+    if (file.output.empty()) {
+        Metrics::add(Metrics::Counter::Converted);
+        Metrics::add(Metrics::Counter::OutputBytes, scratch.output.size());
+        request.ok_shared(ByteView(scratch.output.data(), scratch.output.size()), how);
+        return true;
+    }
+    if (!write_thumbnails(file.output, file.convert.thumbnails, thumbnails) ||
+        !write_file(file.output, ByteView(scratch.output.data(), scratch.output.size()))) {
+        request.error("Failed to write " + file.output.string());
+        return false;
     }
+    report(conversion, file.output, scratch.output.size());
+    request.ok(std::to_string(scratch.output.size()) + " " + std::string(how));
     return true;
 }
 
+/**
+ * Serve requests on a Unix domain socket until a shutdown request, see {@link JobServer} for the protocol.
+ * The worker pool, the connection pool (and TLS sessions), the DNS cache and the per worker buffers stay warm
+ * across requests, so a small job costs about its encode time instead of a process start.
+ *
+ * Commands:
+ *  - `<id> convert <input> [<output>]`: convert the file, the output defaults to `<input>.new.jpg`
+ *  - `<id> encode <input>`: reply the jpeg in shared memory
+ *  - `<id> crawl <url> <output_dir>`: see webpage_crawler(), replied when all images are converted
+ *  - `<id> metrics`: the Prometheus metrics in shared memory
+ *  - `<id> shutdown`: replied when all pending jobs are done, then the daemon exits
+ *
+ * A last argument `--thumbnails=WxH,...` of convert and crawl replaces the thumbnail sizes of the daemon.
+ *
+ * @param convert The settings of the conversions, see encode_image()
+ * @return Returns the process exit code
+ */
+int run_daemon(const path &socket, TooJpeg17::BatchEncoder &encoder, const ConvertOptions &convert) {
+    // A connection closed by a client or server must not terminate the daemon
+    std::signal(SIGPIPE, SIG_IGN);
+    Socket::DownloadScheduler::Limits limits;
+    Socket::ConnectionPool<WITH_HTTPS> pool(limits.perHost);
+    struct Crawl {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    std::vector<Crawl> crawls;
+    std::optional<JobServer::Request> shutdown;
+
+    std::optional<JobServer> server;
+    server.emplace(socket, [&](std::vector<JobServer::Request> &&requests) {
+        // The files of all requests that arrived together are converted in size-balanced chunks, like a directory
+        std::vector<DaemonFile> batch;
+        for (auto &request: requests) {
+            auto &command = request.command;
+            auto settings = convert;
+            if (!request.arguments.empty() && utils::startsWith(request.arguments.back(), "--thumbnails=") &&
+                (command == "convert" || command == "crawl")) {
+                auto value = std::string_view(request.arguments.back()).substr(sizeof("--thumbnails=") - 1);
+                auto parsed = TooJpeg17::parse_thumbnail_sizes(value);
+                if (!parsed) {
+                    request.error("Invalid thumbnail sizes: " + std::string(value));
+                    continue;
+                }
+                settings.thumbnails = std::move(*parsed);
+                request.arguments.pop_back();
+            }
+            auto arguments = request.arguments.size();
+            if ((command == "convert" && (arguments == 1 || arguments == 2)) || (command == "encode" && arguments == 1)) {
+                std::error_code error;
+                auto size = file_size(request.arguments[0], error);
+                if (error) {
+                    request.error("Can't read " + request.arguments[0] + ": " + error.message());
+                    continue;
+                }
+                path output;
+                if (command == "convert")
+                    output = arguments == 2 ? request.arguments[1] : request.arguments[0] + ".new.jpg";
+                // the jpeg of an encode request is the whole reply
+                if (command == "encode") settings.thumbnails.clear();
+                batch.push_back({std::move(request), std::move(output), size, std::move(settings)});
+            } else if (command == "crawl" && arguments == 2) {
+                // on its own thread: downloads block, and submit_bounded() must not be called from a job
+                auto done = std::make_shared<std::atomic<bool>>(false);
+                crawls.push_back({std::thread([&pool, &encoder, limits, done, request = std::move(request),
+                                                       settings = std::move(settings)] {
+                    try {
+                        Socket::Url url(request.arguments[0]);
+                        const path output(request.arguments[1]);
+                        create_directories(output);
+                        if (webpage_crawler(url, output, limits, pool, encoder, 2 * encoder.threads(), settings))
+                            request.ok();
+                        else request.error("Failed to crawl " + request.arguments[0]);
+                    } catch (const std::exception &e) {
+                        request.error(e.what());
+                    }
+                    *done = true;
+                }), done});
+            } else if (command == "metrics" && arguments == 0) {
+                std::ostringstream out;
+                Metrics::write_prometheus(out, Metrics::snapshot());
+                auto text = out.str();
+                request.ok_shared(ByteView(reinterpret_cast<const std::uint8_t *>(text.data()), text.size()));
+            } else if (command == "shutdown" && arguments == 0) {
+                shutdown = std::move(request);
+                server->stop();
+            } else request.error("Unknown command or wrong arguments: " + command);
+        }
+
+        // Sorted like balance_chunks() sorts, so the chunks index the batch. The biggest jobs start first.
+        std::stable_sort(batch.begin(), batch.end(), [](auto &a, auto &b) { return a.size > b.size; });
+        std::vector<ScannedFile> sizes;
+        std::uint64_t total = 0;
+        for (auto &file: batch) {
+            sizes.push_back({file.request.arguments[0], file.size});
+            total += file.size;
+        }
+        auto chunks = balance_chunks(sizes, std::max<std::uint64_t>(1u << 20u, total / (8 * encoder.threads())));
+        auto files = std::make_shared<std::vector<DaemonFile>>(std::move(batch));
+        for (auto chunk: chunks)
+            encoder.submit([files, chunk](TooJpeg17::BatchEncoder::Scratch &scratch) {
+                bool ok = true;
+                for (auto i = chunk.begin; i < chunk.end; i++) ok = serve_file((*files)[i], scratch) && ok;
+                return ok;
+            });
+
+        // finished crawls are joined (an exited thread keeps its stack until then)
+        crawls.erase(std::remove_if(crawls.begin(), crawls.end(), [](Crawl &crawl) {
+            if (!*crawl.done) return false;
+            crawl.thread.join();
+            return true;
+        }), crawls.end());
+    });
+    cout << "Serving jobs on " << socket << " with " << encoder.threads() << " workers" << endl;
+    server->run();
+
+    for (auto &crawl: crawls) crawl.thread.join();
+    encoder.wait();
+    cout << "Daemon: " << encoder.statistics() << endl;
+    if (shutdown) shutdown->ok();
+    return 0;
+}
+
+/**
+ * Write the collected metrics (Prometheus text, or a JSON summary for a ".json" file) and the Chrome trace.
+ * @return Returns the exit code, 1 if a file could not be written
+ */
+int write_metrics(int code, const std::optional<path> &metrics, const std::optional<path> &trace) {
+    if (metrics) {
+        std::ofstream out(*metrics, std::ios_base::trunc | std::ios_base::out);
+        if (metrics->extension() == ".json") Metrics::write_json(out, Metrics::snapshot());
+        else Metrics::write_prometheus(out, Metrics::snapshot());
+        if (!out) {
+            cerr << "Failed to write the metrics " << *metrics << endl;
+            code = code ? code : 1;
+        }
+    }
+    if (trace) {
+        std::ofstream out(*trace, std::ios_base::trunc | std::ios_base::out);
+        Metrics::write_trace(out);
+        if (!out) {
+            cerr << "Failed to write the trace " << *trace << endl;
+            code = code ? code : 1;
+        }
+    }
+    return code;
+}
+
 int main(int argc, char *argv[]) {
+    // Options (--name or --name=value) may be anywhere, the remaining arguments are positional
+    DirectoryOptions options;
+    std::optional<path> metrics, trace, daemon;
+    std::vector<char *> positional{argv[0]};
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg(argv[i]);
+        auto value = std::string(arg.substr(std::min(arg.size(), arg.find('=') + 1)));
+        if (arg == "--recursive") options.scan.recursive = true;
+        else if (utils::startsWith(arg, "--manifest=")) options.manifest = value;
+        else if (utils::startsWith(arg, "--write-manifest=")) options.writeManifest = value;
+        else if (utils::startsWith(arg, "--shard=") && value.find('/') != std::string::npos) {
+            options.shard = unsigned(std::stoul(value));
+            options.shards = unsigned(std::stoul(value.substr(value.find('/') + 1)));
+        } else if (utils::startsWith(arg, "--metrics=")) metrics = value;
+        else if (utils::startsWith(arg, "--trace=")) trace = value;
+        else if (utils::startsWith(arg, "--daemon=")) daemon = value;
+        else if (utils::startsWith(arg, "--thumbnails=")) {
+            auto sizes = TooJpeg17::parse_thumbnail_sizes(value);
+            if (!sizes) {
+                cerr << "Invalid thumbnail sizes, expected WxH[,WxH...]: " << value << endl;
+                return 1;
+            }
+            options.convert.thumbnails = std::move(*sizes);
+        } else if (arg == "--optimize-huffman") options.convert.optimizeHuffman = true;
+        else positional.push_back(argv[i]);
+    }
+    argc = int(positional.size());
+    argv = positional.data();
+    if (metrics) Metrics::enable_histograms();
+    if (trace) Metrics::enable_tracing();
+
+    // Serve jobs on a socket instead of converting once, see run_daemon()
+    if (daemon) {
+        TooJpeg17::BatchEncoder encoder;
+        return write_metrics(run_daemon(*daemon, encoder, options.convert), metrics, trace);
+    }
+
     // Argument parsing
     if (argc < 2) {
         cerr << "No input directory provided" << endl;
@@ -122,13 +691,26 @@ int main(int argc, char *argv[]) {
     if (!exists(input)) throw std::runtime_error("Input directory does not exist!");
     if (!exists(output) && !create_directories(output)) throw std::runtime_error("Output directory not writeable!");
 
+    // Work-stealing pool: balances skewed file sizes, buffers are reused per worker
+    TooJpeg17::BatchEncoder encoder;
+
     if (is_url) {
+        // A connection closed by the server must not terminate the crawler (openSSL writes with write(2))
+        std::signal(SIGPIPE, SIG_IGN);
+        // Optional: concurrent downloads in total [3] and per host [4]
+        Socket::DownloadScheduler::Limits limits;
+        if (argc > 3) limits.global = unsigned(std::stoul(argv[3]));
+        if (argc > 4) limits.perHost = unsigned(std::stoul(argv[4]));
         Socket::Url url(argv[1]);
-        if (!webpage_crawler(url, output)) return -1;
+        // The page and all images share persistent connections (and TLS sessions) per host
+        Socket::ConnectionPool<WITH_HTTPS> pool(limits.perHost);
+        if (!webpage_crawler(url, output, limits, pool, encoder, 2 * encoder.threads(), options.convert)) {
+            encoder.wait();
+            return write_metrics(-1, metrics, trace);
+        }
+        // downloaded images are converted already, the directory pass below skips them
+        encoder.wait();
     }
 
-    auto files = directory_iterator(input);
-    std::for_each(std::execution::par, std::filesystem::begin(files), std::filesystem::end(files), process_file);
-
-    return 0;
+    return write_metrics(convert_directory(input, options, encoder), metrics, trace);
 }
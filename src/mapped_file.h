@@ -0,0 +1,77 @@
+//! Read-only memory mapped files for zero-copy image decoding
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Maps a whole file read-only into memory. The file descriptor is closed right after mapping.
+ *
+ * The mapping is advised as sequential (MADV_SEQUENTIAL), so the kernel reads ahead aggressively and
+ * drops pages behind the decoder. Move-only, unmaps on destruction.
+ * Errors are reported by is_valid(), like {@link ImageLoader}.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(char const *filename) noexcept: MappedFile(::open(filename, O_RDONLY | O_CLOEXEC)) {}
+
+    /// Map an open file (closed afterwards), eg a shared memory file received from a {@link JobServer}
+    explicit MappedFile(int fd) noexcept {
+        if (fd < 0) return;
+        struct stat info{};
+        // empty files can't be mapped (and are not an image anyway)
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            auto memory = ::mmap(nullptr, std::size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (memory != MAP_FAILED) {
+                data_ = static_cast<const std::uint8_t *>(memory);
+                size_ = std::size_t(info.st_size);
+                ::madvise(memory, size_, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+    }
+
+    MappedFile(MappedFile &&other) noexcept
+            : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+    MappedFile &operator=(MappedFile &&other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    MappedFile(MappedFile const &) = delete;
+
+    MappedFile &operator=(MappedFile const &) = delete;
+
+    ~MappedFile() {
+        if (data_) ::munmap(const_cast<std::uint8_t *>(data_), size_);
+    }
+
+    /// Return true if the file is mapped
+    [[nodiscard]] bool is_valid() const noexcept { return data_ != nullptr; }
+
+    [[nodiscard]] const std::uint8_t *data() const noexcept { return data_; }
+
+    [[nodiscard]] std::size_t size() const noexcept { return size_; }
+
+    /**
+     * Hint the kernel to start reading the given file into the page cache, eg the next file of a batch.
+     * Returns immediately, errors are ignored.
+     */
+    static void prefetch(char const *filename) noexcept {
+        auto fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        ::close(fd);
+    }
+
+private:
+    const std::uint8_t *data_ = nullptr;
+    std::size_t size_ = 0;
+};
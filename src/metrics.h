@@ -0,0 +1,368 @@
+//! Low-overhead instrumentation: scoped stage timers, counters, histograms and Chrome trace events.
+//! Compiled out completely with TOOJPEG17_METRICS=0 (cmake -DTOOJPEG17_METRICS=OFF).
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef TOOJPEG17_METRICS
+#define TOOJPEG17_METRICS 1
+#endif
+
+namespace Metrics {
+
+/// False if the instrumentation is compiled out: timers and counters are empty inline functions then
+constexpr bool Enabled = TOOJPEG17_METRICS != 0;
+
+/// Timed stages. The names are used by the exporters.
+enum class Timer : unsigned {
+    /// One input file of a directory conversion: read wait, decode, encode and write submission
+    ProcessFile,
+    /// stb_image decoding
+    Decode,
+    /// Resizing a decoded image to all its output sizes, see TooJpeg17::Resizer
+    Resize,
+    /// writeJpeg(): colour conversion, DCT and entropy coding of one image
+    Encode,
+    /// Colour conversion of an MCU row, sampled (one of SampleRows MCU rows is timed)
+    EncodeColor,
+    /// DCT and quantisation (and Huffman coding, unless optimized tables are built) of the blocks of an MCU row,
+    /// sampled like EncodeColor
+    EncodeBlocks,
+    /// Writing an output file, from the submission to the completion for background writes
+    Write,
+    /// Host name resolution, mostly cache hits (see Socket::Resolver)
+    Dns,
+    /// TCP connect (happy eyeballs)
+    Connect,
+    /// TLS handshake of https connections
+    TlsHandshake,
+    /// Sending a request and receiving the response
+    Transfer,
+    /// Downloading and scanning the crawled page
+    CrawlPage,
+    /// Downloading an image of the crawled page
+    Download,
+    Count
+};
+
+enum class Counter : unsigned {
+    /// Images encoded by writeJpeg() and their pixels and 8x8 blocks
+    Images, Pixels, Blocks,
+    /// Files converted (encoded or copied) and failed, bytes written to output files
+    Converted, Failed, OutputBytes,
+    /// HTTP connections opened, requests sent, response bytes received (headers and body)
+    HttpConnections, HttpRequests, HttpBytes,
+    /// Crawled images that were not modified (304) or whose content was known
+    CacheHits,
+    Count
+};
+
+constexpr std::array<std::string_view, std::size_t(Timer::Count)> TimerNames{
+        "process_file", "decode", "resize", "encode", "encode_color", "encode_blocks", "write", "dns", "connect",
+        "tls_handshake", "transfer", "crawl_page", "download"};
+
+constexpr std::array<std::string_view, std::size_t(Counter::Count)> CounterNames{
+        "images", "pixels", "blocks", "converted", "failed", "output_bytes", "http_connections", "http_requests",
+        "http_bytes", "cache_hits"};
+
+constexpr std::string_view name(Timer timer) { return TimerNames[std::size_t(timer)]; }
+
+constexpr std::string_view name(Counter counter) { return CounterNames[std::size_t(counter)]; }
+
+/// Histogram buckets: bucket i counts durations below 2^i ns (bucket 0: 0 ns). The last one is open ended.
+constexpr std::size_t Buckets = 40;
+
+/// One of SampleRows MCU rows is split into colour conversion and block coding time
+constexpr unsigned SampleRows = 32;
+
+/// Trace events recorded per thread at most, further events are dropped (and counted)
+constexpr std::size_t MaxTraceEvents = 1u << 20u;
+
+using Clock = std::chrono::steady_clock;
+
+/// The merged values of all threads, see snapshot()
+struct Snapshot {
+    struct Stage {
+        std::uint64_t count = 0, nanoseconds = 0, max = 0;
+        std::array<std::uint64_t, Buckets> buckets{};
+    };
+    std::array<std::uint64_t, std::size_t(Counter::Count)> counters{};
+    std::array<Stage, std::size_t(Timer::Count)> timers{};
+    bool histograms = false;
+
+    [[nodiscard]] std::uint64_t operator[](Counter counter) const { return counters[std::size_t(counter)]; }
+
+    [[nodiscard]] const Stage &operator[](Timer timer) const { return timers[std::size_t(timer)]; }
+};
+
+namespace detail {
+
+/**
+ * The values of one thread. Only the owning thread writes, with plain (relaxed) loads and stores instead of atomic
+ * read-modify-write instructions. The exporters read concurrently.
+ */
+struct ThreadData {
+    struct Stage {
+        std::atomic<std::uint64_t> count{0}, nanoseconds{0}, max{0};
+        std::array<std::atomic<std::uint64_t>, Buckets> buckets{};
+    };
+    struct TraceEvent {
+        Timer timer;
+        std::int64_t begin, duration;
+    };
+    std::array<std::atomic<std::uint64_t>, std::size_t(Counter::Count)> counters{};
+    std::array<Stage, std::size_t(Timer::Count)> timers{};
+    /// Chrome trace thread id
+    unsigned tid = 0;
+    /// Guards trace and dropped, uncontended except while a trace is written
+    std::mutex traceMutex;
+    std::vector<TraceEvent> trace;
+    std::size_t dropped = 0;
+    /// Rows since the last sampled MCU row
+    unsigned rows = 0;
+};
+
+inline void increment(std::atomic<std::uint64_t> &value, std::uint64_t by) noexcept {
+    value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+/**
+ * All thread data ever created. The data of finished threads is kept (it is part of the totals) and handed to the
+ * next new thread, so short-lived threads do not grow the registry.
+ */
+class Registry {
+public:
+    static Registry &instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    std::atomic<bool> histograms{false}, tracing{false};
+    const Clock::time_point epoch = Clock::now();
+
+    ThreadData *acquire() {
+        std::lock_guard lock(mutex_);
+        if (!free_.empty()) {
+            auto *data = free_.back();
+            free_.pop_back();
+            return data;
+        }
+        threads_.push_back(std::make_unique<ThreadData>());
+        threads_.back()->tid = unsigned(threads_.size());
+        return threads_.back().get();
+    }
+
+    void release(ThreadData *data) {
+        std::lock_guard lock(mutex_);
+        free_.push_back(data);
+    }
+
+    template<typename F>
+    void for_each(F &&f) {
+        std::lock_guard lock(mutex_);
+        for (auto &data: threads_) f(*data);
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<ThreadData>> threads_;
+    std::vector<ThreadData *> free_;
+};
+
+/// The data of the calling thread
+inline ThreadData &local() {
+    struct Handle {
+        ThreadData *data = Registry::instance().acquire();
+
+        ~Handle() { Registry::instance().release(data); }
+    };
+    thread_local Handle handle;
+    return *handle.data;
+}
+
+inline std::size_t bucket(std::uint64_t nanoseconds) noexcept {
+    std::size_t bits = 0;
+    while (nanoseconds) {
+        nanoseconds >>= 1u;
+        bits++;
+    }
+    return std::min(bits, Buckets - 1);
+}
+
+} // namespace detail
+
+/// Add to a counter of the calling thread
+inline void add([[maybe_unused]] Counter counter, [[maybe_unused]] std::uint64_t value = 1) noexcept {
+    if constexpr (Enabled) detail::increment(detail::local().counters[std::size_t(counter)], value);
+}
+
+/// Record a duration of a stage, without a trace event
+inline void record([[maybe_unused]] Timer timer, [[maybe_unused]] std::chrono::nanoseconds duration) noexcept {
+    if constexpr (Enabled) {
+        auto nanoseconds = std::uint64_t(std::max<std::int64_t>(0, duration.count()));
+        auto &stage = detail::local().timers[std::size_t(timer)];
+        detail::increment(stage.count, 1);
+        detail::increment(stage.nanoseconds, nanoseconds);
+        if (nanoseconds > stage.max.load(std::memory_order_relaxed))
+            stage.max.store(nanoseconds, std::memory_order_relaxed);
+        detail::increment(stage.buckets[detail::bucket(nanoseconds)], 1);
+    }
+}
+
+/// Record a stage that ran from begin to end (possibly on another thread), with a trace event if tracing
+inline void record([[maybe_unused]] Timer timer, [[maybe_unused]] Clock::time_point begin,
+                   [[maybe_unused]] Clock::time_point end) noexcept {
+    if constexpr (Enabled) {
+        record(timer, end - begin);
+        auto &registry = detail::Registry::instance();
+        if (!registry.tracing.load(std::memory_order_relaxed)) return;
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+        auto &data = detail::local();
+        std::lock_guard lock(data.traceMutex);
+        if (data.trace.size() >= MaxTraceEvents) {
+            data.dropped++;
+            return;
+        }
+        try {
+            data.trace.push_back({timer, duration_cast<microseconds>(begin - registry.epoch).count(),
+                                  duration_cast<microseconds>(end - begin).count()});
+        } catch (const std::bad_alloc &) { data.dropped++; }
+    }
+}
+
+/// Returns true for one of SampleRows calls per thread, see Timer::EncodeColor
+inline bool sample_row() noexcept {
+    if constexpr (Enabled) return detail::local().rows++ % SampleRows == 0;
+    return false;
+}
+
+/// Time the enclosing scope as one stage
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Timer timer) noexcept: timer_(timer) {
+        if constexpr (Enabled) begin_ = Clock::now();
+    }
+
+    ScopedTimer(ScopedTimer const &) = delete;
+
+    ScopedTimer &operator=(ScopedTimer const &) = delete;
+
+    ~ScopedTimer() {
+        if constexpr (Enabled) record(timer_, begin_, Clock::now());
+    }
+
+private:
+    Timer timer_;
+    Clock::time_point begin_;
+};
+
+/// Export the histogram buckets of the timers (always collected, but off by default: a lot of series)
+inline void enable_histograms(bool enable = true) noexcept {
+    detail::Registry::instance().histograms = enable;
+}
+
+/// Record a trace event for every timed scope from now on, see write_trace()
+inline void enable_tracing(bool enable = true) noexcept {
+    detail::Registry::instance().tracing = enable;
+}
+
+/// Merge the values of all threads
+inline Snapshot snapshot() {
+    Snapshot result;
+    result.histograms = detail::Registry::instance().histograms;
+    detail::Registry::instance().for_each([&result](detail::ThreadData &data) {
+        for (std::size_t i = 0; i < result.counters.size(); i++)
+            result.counters[i] += data.counters[i].load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < result.timers.size(); i++) {
+            auto &stage = result.timers[i];
+            auto &source = data.timers[i];
+            stage.count += source.count.load(std::memory_order_relaxed);
+            stage.nanoseconds += source.nanoseconds.load(std::memory_order_relaxed);
+            stage.max = std::max(stage.max, source.max.load(std::memory_order_relaxed));
+            for (std::size_t b = 0; b < Buckets; b++) stage.buckets[b] += source.buckets[b].load(std::memory_order_relaxed);
+        }
+    });
+    return result;
+}
+
+/**
+ * Prometheus text exposition format (eg for the node_exporter textfile collector): one `toojpeg17_<counter>_total`
+ * counter each, the stages as `toojpeg17_stage_seconds{stage="..."}` summary, or histogram if enabled.
+ */
+inline void write_prometheus(std::ostream &out, const Snapshot &snapshot) {
+    for (std::size_t i = 0; i < snapshot.counters.size(); i++)
+        out << "# TYPE toojpeg17_" << CounterNames[i] << "_total counter\ntoojpeg17_" << CounterNames[i] << "_total "
+            << snapshot.counters[i] << "\n";
+    out << "# TYPE toojpeg17_stage_seconds " << (snapshot.histograms ? "histogram" : "summary") << "\n";
+    for (std::size_t i = 0; i < snapshot.timers.size(); i++) {
+        auto &stage = snapshot.timers[i];
+        auto label = std::string("stage=\"") + std::string(TimerNames[i]) + "\"";
+        if (snapshot.histograms) {
+            std::uint64_t cumulative = 0;
+            for (std::size_t b = 0; b + 1 < Buckets; b++) {
+                cumulative += stage.buckets[b];
+                out << "toojpeg17_stage_seconds_bucket{" << label << ",le=\"" << double(1ull << b) / 1e9 << "\"} "
+                    << cumulative << "\n";
+            }
+            out << "toojpeg17_stage_seconds_bucket{" << label << ",le=\"+Inf\"} " << stage.count << "\n";
+        }
+        out << "toojpeg17_stage_seconds_sum{" << label << "} " << double(stage.nanoseconds) / 1e9 << "\n"
+            << "toojpeg17_stage_seconds_count{" << label << "} " << stage.count << "\n";
+    }
+}
+
+/// JSON summary: `{"counters": {"images": 1, ...}, "stages": {"encode": {"count": 1, "seconds": ..., ...}, ...}}`
+inline void write_json(std::ostream &out, const Snapshot &snapshot) {
+    out << "{\"counters\": {";
+    for (std::size_t i = 0; i < snapshot.counters.size(); i++)
+        out << (i ? ", " : "") << "\"" << CounterNames[i] << "\": " << snapshot.counters[i];
+    out << "}, \"stages\": {";
+    for (std::size_t i = 0; i < snapshot.timers.size(); i++) {
+        auto &stage = snapshot.timers[i];
+        out << (i ? ", " : "") << "\"" << TimerNames[i] << "\": {\"count\": " << stage.count << ", \"seconds\": "
+            << double(stage.nanoseconds) / 1e9 << ", \"mean_seconds\": "
+            << (stage.count ? double(stage.nanoseconds) / 1e9 / double(stage.count) : 0.0) << ", \"max_seconds\": "
+            << double(stage.max) / 1e9;
+        if (snapshot.histograms) {
+            out << ", \"buckets\": [";
+            for (std::size_t b = 0; b < Buckets; b++) out << (b ? ", " : "") << stage.buckets[b];
+            out << "]";
+        }
+        out << "}";
+    }
+    out << "}}\n";
+}
+
+/**
+ * Chrome trace event format (load it in chrome://tracing or https://ui.perfetto.dev): one complete event ("X") per
+ * timed scope since enable_tracing(), in microseconds. Sampled encode stages are not traced.
+ */
+inline void write_trace(std::ostream &out) {
+    out << "{\"traceEvents\": [";
+    bool first = true;
+    std::size_t dropped = 0;
+    detail::Registry::instance().for_each([&](detail::ThreadData &data) {
+        std::lock_guard lock(data.traceMutex);
+        dropped += data.dropped;
+        for (auto &event: data.trace) {
+            out << (first ? "\n" : ",\n") << "{\"name\": \"" << name(event.timer)
+                << "\", \"cat\": \"toojpeg17\", \"ph\": \"X\", \"ts\": " << event.begin << ", \"dur\": "
+                << event.duration << ", \"pid\": 1, \"tid\": " << data.tid << "}";
+            first = false;
+        }
+    });
+    out << "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped_events\": " << dropped << "}}\n";
+}
+
+} // namespace Metrics
@@ -0,0 +1,107 @@
+//! Output sinks for the TooJpeg17 BitWriter.
+//! A sink is any type with a `void write(const std::uint8_t *data, std::size_t size)` member. The BitWriter stages encoded
+//! bytes in a fixed-size buffer and only hands over whole chunks, so sinks are called a few times per image.
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <unistd.h>
+
+#include "byte_view.h"
+#include "stream_utils.h"
+
+namespace TooJpeg17 {
+
+using WRITE_BACK = std::function<void(ByteView)>;
+
+/// Adapter for existing std::function based callers. The callback is invoked once per staged chunk.
+struct FunctionSink {
+    WRITE_BACK output;
+
+    explicit FunctionSink(WRITE_BACK output_) : output(std::move(output_)) {}
+
+    void write(const std::uint8_t *data, std::size_t size) { output(ByteView{data, size}); }
+};
+
+/// Appends to a (non-owned) vector. Reserve the expected capacity upfront to avoid reallocations.
+struct VectorSink {
+    std::vector<std::uint8_t> &output;
+
+    explicit VectorSink(std::vector<std::uint8_t> &output_) noexcept: output(output_) {}
+
+    void write(const std::uint8_t *data, std::size_t size) { output.insert(output.end(), data, data + size); }
+};
+
+/**
+ * Writes into a caller provided, fixed size memory area.
+ * Bytes that do not fit are dropped, but counted. Check overflowed() after encoding.
+ */
+struct MemorySink {
+    std::uint8_t *const memory;
+    const std::size_t capacity;
+    /// Bytes written so far (including dropped bytes)
+    std::size_t size = 0;
+
+    MemorySink(void *memory_, std::size_t capacity_) noexcept
+            : memory(reinterpret_cast<std::uint8_t *>(memory_)), capacity(capacity_) {}
+
+    void write(const std::uint8_t *data, std::size_t size_) noexcept {
+        if (size < capacity) std::memcpy(memory + size, data, std::min(size_, capacity - size));
+        size += size_;
+    }
+
+    /// Returns true if the output did not fit into the memory area
+    [[nodiscard]] bool overflowed() const noexcept { return size > capacity; }
+};
+
+/// Drops the bytes and only counts them, eg to measure the size of an encoding without storing it
+struct CountingSink {
+    std::size_t size = 0;
+
+    void write(const std::uint8_t *, std::size_t size_) noexcept { size += size_; }
+};
+
+/**
+ * Writes to a (non-owned) POSIX file descriptor, eg an opened file, pipe or socket.
+ *
+ * Exceptions: Throws on write errors.
+ */
+struct FdSink {
+    const int fd;
+
+    explicit FdSink(int fd_) noexcept: fd(fd_) {}
+
+    void write(const std::uint8_t *data, std::size_t size) {
+        while (size) {
+            auto written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(utils::from_parts("FdSink::", __func__, ": ", strerror(errno)));
+            }
+            data += written;
+            size -= std::size_t(written);
+        }
+    }
+};
+
+/// CPP17: Detect the sink interface via SFINAE and std::void_t
+template<typename T, typename = void>
+struct is_sink : std::false_type {
+};
+
+template<typename T>
+struct is_sink<T, std::void_t<decltype(std::declval<T &>().write(std::declval<const std::uint8_t *>(),
+                                                                 std::declval<std::size_t>()))>> : std::true_type {
+};
+
+template<typename T>
+constexpr bool is_sink_v = is_sink<std::decay_t<T>>::value;
+
+} // namespace TooJpeg17
@@ -0,0 +1,285 @@
+//! Thread-safe host name resolution with a process-wide TTL cache, and happy eyeballs connects (IPv6 and IPv4)
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "stream_utils.h"
+
+namespace Socket {
+
+/// A resolved socket address (IPv4 or IPv6)
+struct Address {
+    sockaddr_storage storage{};
+    socklen_t length = 0;
+
+    [[nodiscard]] int family() const noexcept { return storage.ss_family; }
+
+    [[nodiscard]] const sockaddr *sockaddr_ptr() const noexcept { return reinterpret_cast<const sockaddr *>(&storage); }
+
+    void set_port(uint16_t port) noexcept {
+        if (family() == AF_INET6) reinterpret_cast<sockaddr_in6 *>(&storage)->sin6_port = htons(port);
+        else reinterpret_cast<sockaddr_in *>(&storage)->sin_port = htons(port);
+    }
+
+    /// The numeric IP address, without the port
+    [[nodiscard]] std::string ip() const {
+        char buffer[INET6_ADDRSTRLEN] = {};
+        const void *addr = family() == AF_INET6
+                           ? static_cast<const void *>(&reinterpret_cast<const sockaddr_in6 *>(&storage)->sin6_addr)
+                           : static_cast<const void *>(&reinterpret_cast<const sockaddr_in *>(&storage)->sin_addr);
+        return inet_ntop(family(), addr, buffer, sizeof(buffer)) ? buffer : "";
+    }
+};
+
+/**
+ * Split "host:port", "[v6]:port" or "host" into the host name and the port.
+ * @param fallback The port if none is given
+ */
+inline std::pair<std::string, uint16_t> split_host_port(std::string_view host, uint16_t fallback) {
+    auto portAt = std::string_view::npos;
+    if (!host.empty() && host.front() == '[') {
+        // IPv6 literal
+        auto end = host.find(']');
+        if (end != std::string_view::npos && end + 1 < host.size() && host[end + 1] == ':') portAt = end + 1;
+        auto name = host.substr(1, end == std::string_view::npos ? std::string_view::npos : end - 1);
+        return {std::string(name), portAt == std::string_view::npos ? fallback : uint16_t(
+                std::strtoul(std::string(host.substr(portAt + 1)).c_str(), nullptr, 10))};
+    }
+    portAt = host.rfind(':');
+    if (portAt == std::string_view::npos) return {std::string(host), fallback};
+    return {std::string(host.substr(0, portAt)),
+            uint16_t(std::strtoul(std::string(host.substr(portAt + 1)).c_str(), nullptr, 10))};
+}
+
+/**
+ * Resolves host names with getaddrinfo (thread-safe, IPv4 and IPv6) and caches the addresses for a fixed time.
+ *
+ * getaddrinfo does not report the record TTL, the cache time is therefore a fixed setting.
+ * Concurrent lookups of the same host are done once, all callers wait for the same result. Failed lookups are not
+ * cached. A host whose addresses could not be connected to should be invalidated.
+ *
+ * Thread-safe. The lock is never held during a lookup.
+ */
+class Resolver {
+public:
+    using Addresses = std::vector<Address>;
+
+    explicit Resolver(std::chrono::seconds ttl = std::chrono::seconds(60)) : ttl_(ttl) {}
+
+    /// The process-wide resolver used by {@link HttpSocket}
+    static Resolver &shared() {
+        static Resolver resolver;
+        return resolver;
+    }
+
+    /**
+     * Returns the addresses of the host, alternating between the address families (IPv6 first if the system
+     * prefers it), see connect_happy_eyeballs().
+     * Exceptions: Throws if the host can not be resolved.
+     */
+    Addresses resolve(const std::string &host, uint16_t port) {
+        std::promise<Addresses> promise;
+        std::shared_future<Addresses> result;
+        bool lookup = false;
+        {
+            std::lock_guard lock(mutex_);
+            auto now = std::chrono::steady_clock::now();
+            auto entry = cache_.find(host);
+            if (entry != cache_.end() && entry->second.expires > now) {
+                result = entry->second.result;
+                hits_++;
+            } else {
+                result = promise.get_future().share();
+                cache_[host] = {result, now + ttl_};
+                lookup = true;
+                lookups_++;
+            }
+        }
+        if (lookup) {
+            try {
+                promise.set_value(lookup_interleaved(host));
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+                invalidate(host, result);
+            }
+        }
+        auto addresses = result.get();
+        for (auto &address: addresses) address.set_port(port);
+        return addresses;
+    }
+
+    /// Drop the cached addresses of the host, eg because connecting failed
+    void invalidate(const std::string &host) {
+        std::lock_guard lock(mutex_);
+        cache_.erase(host);
+    }
+
+    /// Number of getaddrinfo calls
+    [[nodiscard]] std::size_t lookups() const {
+        std::lock_guard lock(mutex_);
+        return lookups_;
+    }
+
+    /// Number of resolve() calls answered from the cache
+    [[nodiscard]] std::size_t hits() const {
+        std::lock_guard lock(mutex_);
+        return hits_;
+    }
+
+private:
+    struct Entry {
+        std::shared_future<Addresses> result;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    const std::chrono::seconds ttl_;
+    /// Guards all of the following members
+    mutable std::mutex mutex_;
+    std::map<std::string, Entry, std::less<>> cache_;
+    std::size_t lookups_ = 0, hits_ = 0;
+
+    /// Erase the entry only if it still refers to the given (failed) lookup
+    void invalidate(const std::string &host, const std::shared_future<Addresses> &result) {
+        std::lock_guard lock(mutex_);
+        auto entry = cache_.find(host);
+        if (entry != cache_.end() && entry->second.result.valid() &&
+            entry->second.result.wait_for(std::chrono::seconds(0)) == std::future_status::ready &&
+            result.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            cache_.erase(entry);
+    }
+
+    static Addresses lookup_interleaved(const std::string &host) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        addrinfo *resolved = nullptr;
+        if (int err = ::getaddrinfo(host.c_str(), nullptr, &hints, &resolved); err != 0 || !resolved)
+            throw std::runtime_error(utils::from_parts("Resolver::", __func__, ": The host was not found:", host,
+                                                       err ? gai_strerror(err) : ""));
+
+        // getaddrinfo sorts by preference (RFC 6724). Keep that order per family, but alternate the families
+        // (RFC 8305), so that a broken IPv6 route costs one attempt delay only.
+        Addresses preferred, other;
+        for (auto *info = resolved; info; info = info->ai_next) {
+            if (info->ai_family != AF_INET && info->ai_family != AF_INET6) continue;
+            Address address;
+            std::memcpy(&address.storage, info->ai_addr, info->ai_addrlen);
+            address.length = info->ai_addrlen;
+            (preferred.empty() || preferred.front().family() == info->ai_family ? preferred : other).push_back(address);
+        }
+        ::freeaddrinfo(resolved);
+
+        Addresses addresses;
+        for (std::size_t i = 0; i < std::max(preferred.size(), other.size()); i++) {
+            if (i < preferred.size()) addresses.push_back(preferred[i]);
+            if (i < other.size()) addresses.push_back(other[i]);
+        }
+        if (addresses.empty())
+            throw std::runtime_error(utils::from_parts("Resolver::", __func__, ": No IP address for", host));
+        return addresses;
+    }
+};
+
+/**
+ * Connect to the first reachable address, happy eyeballs style (RFC 8305): the next address is tried if the
+ * previous attempt did not succeed within attemptDelay, or as soon as it failed. All attempts race, the first
+ * established connection wins and the others are closed.
+ * @return A connected, blocking stream socket, or -1 with errno set if no address could be connected to
+ */
+inline int connect_happy_eyeballs(const std::vector<Address> &addresses,
+                                  std::chrono::milliseconds attemptDelay = std::chrono::milliseconds(250),
+                                  std::chrono::milliseconds timeout = std::chrono::seconds(10)) {
+    using clock = std::chrono::steady_clock;
+    const auto deadline = clock::now() + timeout;
+    std::vector<pollfd> attempts;
+    std::size_t next = 0;
+    int lastError = ETIMEDOUT;
+
+    // Returns a connected socket if the connect succeeded right away, -1 otherwise
+    auto start_next = [&]() -> int {
+        while (next < addresses.size()) {
+            const auto &address = addresses[next++];
+            int fd = ::socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                lastError = errno;
+                continue;
+            }
+            if (::connect(fd, address.sockaddr_ptr(), address.length) == 0) return fd;
+            if (errno == EINPROGRESS) {
+                attempts.push_back({fd, POLLOUT, 0});
+                return -1;
+            }
+            lastError = errno;
+            ::close(fd);
+        }
+        return -1;
+    };
+    auto finish = [&](int winner) {
+        for (auto &attempt: attempts) if (attempt.fd != winner) ::close(attempt.fd);
+        if (winner < 0) {
+            errno = lastError;
+            return -1;
+        }
+        ::fcntl(winner, F_SETFL, ::fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+        return winner;
+    };
+
+    while (clock::now() < deadline) {
+        if (attempts.empty()) {
+            if (next >= addresses.size()) break;
+            if (int fd = start_next(); fd >= 0) return finish(fd);
+            continue;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now());
+        auto wait = next < addresses.size() ? std::min(attemptDelay, remaining) : remaining;
+        int ready = ::poll(attempts.data(), attempts.size(), int(std::max<long>(0, wait.count())));
+        if (ready < 0 && errno != EINTR) {
+            lastError = errno;
+            break;
+        }
+        if (ready <= 0) {
+            // the attempt delay passed without a connection: race the next address
+            if (int fd = start_next(); fd >= 0) return finish(fd);
+            continue;
+        }
+        for (auto attempt = attempts.begin(); attempt != attempts.end();) {
+            if (!attempt->revents) {
+                ++attempt;
+                continue;
+            }
+            int error = 0;
+            socklen_t length = sizeof(error);
+            ::getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error == 0) return finish(attempt->fd);
+            lastError = error;
+            ::close(attempt->fd);
+            attempt = attempts.erase(attempt);
+        }
+        // a failed attempt starts the next one right away
+        if (next < addresses.size()) {
+            if (int fd = start_next(); fd >= 0) return finish(fd);
+        }
+    }
+    return finish(-1);
+}
+
+} // namespace Socket
@@ -29,7 +29,7 @@ constexpr bool endsWith(const std::string_view &str, const std::string_view &suf
     return str.size() >= suffix.size() && 0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
 }
 
-void replace_all(std::string &data, std::string_view toSearch, std::string_view replaceStr) {
+inline void replace_all(std::string &data, std::string_view toSearch, std::string_view replaceStr) {
     // Get the first occurrence
     size_t pos = data.find(toSearch);
 
@@ -1,6 +1,20 @@
 //! Originally based on TooJpeg, written by Stephan Brumme, 2018-2019 see https://create.stephan-brumme.com/toojpeg/.
 //! This is a C++17 modified variant using std::char, constexpr to precompute certain constants and lookup tables.
 #include "toojpeg_17.h"
+#include "toojpeg_17_dct.h"
+#include "metrics.h"
+
+#include <limits>
+#include <tuple>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
 
 namespace TooJpeg17 {
 
@@ -11,89 +25,6 @@ inline float rgb2cb(float r, float g, float b) { return -0.16874f * r - 0.33126f
 
 inline float rgb2cr(float r, float g, float b) { return +0.5f * r - 0.41869f * g - 0.08131f * b; }
 
-template<typename T>
-constexpr bool is_close(T a, T b) {
-    return std::abs(a - b) <=
-           std::numeric_limits<T>::epsilon() * std::abs(a + b)
-           || std::abs(a - b) < std::numeric_limits<T>::min();
-}
-
-// CPP(14): Compute the square root during compile time for consts.
-constexpr double sqrt_helper(double x, double curr, double prev) {
-    return is_close(curr, prev) ? curr : sqrt_helper(x, 0.5 * (curr + x / curr), curr);
-}
-
-/*
-* Constexpr version of the square root
-* Returns an approximation for the square root of "x"
-* Invariant: finite and non-negative value of "x"
-*/
-constexpr double sqrt(double x) { return sqrt_helper(x, x, 0); }
-
-/**
- * 8-point discrete cosine transform (DCT)
- *
- * Based on https://dev.w3.org/Amaya/libjpeg/jfdctflt.c.
- * Forward DCT computation "in one dimension" (fast AAN algorithm by Arai, Agui and Nakajima: "A fast DCT-SQ scheme for images")
- * With 5 multiplications and 28 additions.
- * @tparam horizontal True if computing rows, false for columns
- * @param block Input/Output block. Changes values in-place.
- */
-void DCT(float block[8 * 8], bool horizontal) noexcept {
-    constexpr double SqrtHalfSqrt = sqrt((2 + sqrt(2)) / 2);
-    constexpr double InvSqrt = 1.0 / sqrt(2);
-    constexpr double HalfSqrtSqrt = sqrt(2 - sqrt(2)) / 2.0;
-    constexpr double InvSqrtSqrt = 1.0 / sqrt(2 + sqrt(2));
-    uint8_t stride = horizontal ? 1 : 8;
-
-    // modify in-place
-    auto &block0 = block[0];
-    auto &block1 = block[1 * stride];
-    auto &block2 = block[2 * stride];
-    auto &block3 = block[3 * stride];
-    auto &block4 = block[4 * stride];
-    auto &block5 = block[5 * stride];
-    auto &block6 = block[6 * stride];
-    auto &block7 = block[7 * stride];
-
-    auto add07 = block0 + block7;
-    auto sub07 = block0 - block7;
-    auto add16 = block1 + block6;
-    auto sub16 = block1 - block6;
-    auto add25 = block2 + block5;
-    auto sub25 = block2 - block5;
-    auto add34 = block3 + block4;
-    auto sub34 = block3 - block4;
-
-    auto add0347 = add07 + add34;
-    auto sub07_34 = add07 - add34; // "even part" / "phase 2"
-    auto add1256 = add16 + add25;
-    auto sub16_25 = add16 - add25;
-
-    block[0] = add0347 + add1256;
-    block4 = add0347 - add1256; // "phase 3"
-
-    auto z1 = (sub16_25 + sub07_34) * InvSqrt;
-    block2 = sub07_34 + z1;
-    block6 = sub07_34 - z1; // "phase 5"
-
-    auto sub23_45 = sub25 + sub34; // "odd part" / "phase 2"
-    auto sub12_56 = sub16 + sub25;
-    auto sub01_67 = sub16 + sub07;
-
-    auto z5 = (sub23_45 - sub01_67) * HalfSqrtSqrt;
-    auto z2 = sub23_45 * InvSqrtSqrt + z5;
-    auto z3 = sub12_56 * InvSqrt;
-    auto z4 = sub01_67 * SqrtHalfSqrt + z5;
-    auto z6 = sub07 + z3; // "phase 5"
-    auto z7 = sub07 - z3;
-    block1 = z6 + z4;
-    block7 = z6 - z4; // "phase 6"
-    block5 = z7 + z2;
-    block3 = z7 - z2;
-}
-
-
 // CPP: Compile time huffman table computation
 constexpr std::array<BitCode, 256> generateHuffmanTable(const uint8_t numCodes[16], const uint8_t *values) {
     std::array<BitCode, 256> result{};
@@ -134,47 +65,139 @@ constexpr std::tuple<const BitCode *, const BitCode *> huffman(bool luminance) {
 
 constexpr std::array<BitCode, 2 * CodeWordLimit> codewordsArray = codewords_for_quantized_dct();
 
+/// Symbol frequencies of one Huffman table. The extra entry 256 is reserved, see build_huffman_table().
+using SymbolCounts = std::array<uint32_t, 257>;
+
+/// Huffman table as defined in a DHT segment, and its codes
+struct HuffmanTable {
+    /// number of codes per bit size 1..16
+    uint8_t counts[16]{};
+    /// symbols ordered by code size
+    uint8_t values[256]{};
+    int numValues = 0;
+    std::array<BitCode, 256> codes{};
+};
+
+/// Per image Huffman tables, index 0 for luminance and 1 for chrominance
+struct HuffmanTables {
+    HuffmanTable dc[2], ac[2];
+};
+
 /**
- * Run DCT, quantize and write Huffman bit codes
- *
- * @param writer Output writer
- * @param block64 A 8*8 block
- * @param scaled scaled luminance / chrominance.
- * @param lastDC
- * @param huffmanDC
- * @param huffmanAC
- * @param codewords
- * @return
+ * Build an optimal Huffman table with code lengths limited to 16 bits, see JPEG standard Annex K.2 and K.3.
+ * A reserved symbol with frequency 1 ensures that no code consists of 1-bits only.
  */
-template<bool luminance>
-int16_t encode_block(BitWriter<> &writer, float *block64, const float* scaled, int16_t lastDC) noexcept {
+HuffmanTable build_huffman_table(const SymbolCounts &counts) {
+    constexpr auto Symbols = 257;
+    std::array<uint64_t, Symbols> freq{};
+    std::copy(counts.begin(), counts.end(), freq.begin());
+    freq[256] = 1;
+    // a table needs at least one real symbol
+    if (std::all_of(counts.begin(), counts.end(), [](auto count) { return count == 0; })) freq[0] = 1;
+
+    // Only the used symbols take part, usually far fewer than 257. Ascending, so the sorted values need no sort.
+    std::array<int, Symbols> used{};
+    auto numUsed = 0;
+    for (auto i = 0; i < Symbols; i++)
+        if (freq[i]) used[numUsed++] = i;
+
+    std::array<int, Symbols> codeSize{}, others{};
+    others.fill(-1);
+
+    // K.2: merge the two least frequent trees until only one is left. A tree is identified by one of its symbols,
+    // the heap has the least frequent tree on top. Ties pick the larger symbol, like libjpeg, so the tables are the
+    // same as those of a linear search for the two smallest.
+    auto later = [&freq](int a, int b) { return freq[a] != freq[b] ? freq[a] > freq[b] : a < b; };
+    std::array<int, Symbols> heap = used;
+    auto trees = numUsed;
+    std::make_heap(heap.begin(), heap.begin() + trees, later);
+    while (trees > 1) {
+        std::pop_heap(heap.begin(), heap.begin() + trees--, later);
+        auto c1 = heap[trees];
+        std::pop_heap(heap.begin(), heap.begin() + trees--, later);
+        auto c2 = heap[trees];
+
+        freq[c1] += freq[c2];
+        heap[trees++] = c1;
+        std::push_heap(heap.begin(), heap.begin() + trees, later);
+        // both subtrees get one level deeper
+        for (codeSize[c1]++; others[c1] >= 0; codeSize[c1]++) c1 = others[c1];
+        others[c1] = c2;
+        for (codeSize[c2]++; others[c2] >= 0; codeSize[c2]++) c2 = others[c2];
+    }
 
+    // number of codes per length, a skewed tree may be up to 256 levels deep
+    std::array<int, Symbols + 1> bits{};
+    for (auto i = 0; i < numUsed; i++) bits[codeSize[used[i]]]++;
+
+    // K.3: move codes longer than 16 bits up, by splitting a shorter code
+    for (auto i = Symbols; i > 16; i--)
+        while (bits[i] > 0) {
+            auto j = i - 2;
+            while (bits[j] == 0) j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    // remove the reserved symbol, it has the longest code
+    auto longest = 16;
+    while (bits[longest] == 0) longest--;
+    bits[longest]--;
+
+    HuffmanTable table;
+    for (auto i = 0; i < 16; i++) table.counts[i] = uint8_t(bits[i + 1]);
+    // symbols sorted by their (unlimited) code size, the limited code sizes keep that order. The reserved symbol is
+    // the last of the used ones.
+    std::stable_sort(used.begin(), used.begin() + numUsed - 1,
+                     [&codeSize](int a, int b) { return codeSize[a] < codeSize[b]; });
+    for (auto i = 0; i + 1 < numUsed; i++) table.values[table.numValues++] = uint8_t(used[i]);
+    table.codes = generateHuffmanTable(table.counts, table.values);
+    return table;
+}
+
+/// Count the Huffman symbols write_block() would emit for a block
+void count_block(SymbolCounts &dc, SymbolCounts &ac, const int16_t *quantized, int posNonZero,
+                 int16_t lastDC) noexcept {
     const BitCode *codewords = &codewordsArray[CodeWordLimit];
-    constexpr auto h = huffman(luminance);
-    auto[huffmanDC, huffmanAC] = h;
+    auto diff = quantized[0] - lastDC;
+    dc[diff == 0 ? 0 : codewords[diff].numBits]++;
 
-    // DCT: rows
-    for (auto offset = 0; offset < 8; offset++) DCT(block64 + offset * 8, true);
-    // DCT: columns
-    for (auto offset = 0; offset < 8; offset++) DCT(block64 + offset * 1, false);
+    auto offset = 0;
+    for (auto i = 1; i <= posNonZero; i++) {
+        while (quantized[i] == 0) {
+            offset += 0x10;
+            if (offset > 0xF0) {
+                ac[0xF0]++;
+                offset = 0;
+            }
+            i++;
+        }
+        ac[offset + codewords[quantized[i]].numBits]++;
+        offset = 0;
+    }
+    if (posNonZero < 8 * 8 - 1)
+        ac[0x00]++;
+}
 
-    // Scale
-    for (auto i = 0; i < 8 * 8; i++) block64[i] *= scaled[i];
+/**
+ * Write the Huffman bit codes of a quantized block
+ *
+ * @param writer Output writer
+ * @param quantized Quantized coefficients in zigzag order, see DctQuantizeKernel
+ * @param posNonZero Zigzag position of the last non-zero AC coefficient
+ * @param lastDC DC coefficient of the previous block of the same component
+ * @param huffmanDC Huffman codes of the DC categories
+ * @param huffmanAC Huffman codes of the AC run/size symbols
+ * @return The DC coefficient of this block
+ */
+template<typename Sink>
+int16_t write_block(BitWriter<Sink> &writer, const int16_t *quantized, int posNonZero, int16_t lastDC,
+                    const BitCode *huffmanDC, const BitCode *huffmanAC) noexcept {
+    const BitCode *codewords = &codewordsArray[CodeWordLimit];
 
     // Encode DC (the first coefficient is the "average color" of the 8x8 block)
-    auto DC = int(std::nearbyint(block64[0]));
-
-    // quantize and zigzag the other 63 coefficients
-    auto posNonZero = 0; // find last coefficient which is not zero (because trailing zeros are encoded differently)
-    int16_t quantized[8 * 8];
-    for (auto i = 1; i < 8 * 8; i++) // start at 1 because block64[0]=DC was already processed
-    {
-        auto value = block64[ZigZagInv[i]];
-        quantized[i] = int(std::nearbyint(value));
-        // remember offset of last non-zero coefficient
-        if (quantized[i] != 0)
-            posNonZero = i;
-    }
+    int DC = quantized[0];
 
     // same "average color" as previous block ?
     auto diff = DC - lastDC;
@@ -182,7 +205,7 @@ int16_t encode_block(BitWriter<> &writer, float *block64, const float* scaled, i
         writer << huffmanDC[0x00];   // yes, write a special short symbol
     else {
         auto bits = codewords[diff]; // nope, encode the difference to previous block's average color
-        writer << huffmanDC[bits.numBits] << bits;
+        writer.writeCodes(huffmanDC[bits.numBits], bits);
     }
 
     // encode ACs (quantized[1..63])
@@ -204,7 +227,7 @@ int16_t encode_block(BitWriter<> &writer, float *block64, const float* scaled, i
 
         auto encoded = codewords[quantized[i]];
         // combine number of zeros with the number of bits of the next non-zero value
-        writer << huffmanAC[offset + encoded.numBits] << encoded; // and the value itself
+        writer.writeCodes(huffmanAC[offset + encoded.numBits], encoded); // and the value itself
         offset = 0;
     }
 
@@ -215,41 +238,131 @@ int16_t encode_block(BitWriter<> &writer, float *block64, const float* scaled, i
     return DC;
 }
 
-bool writeJpegQuality(WRITE_BACK output, const uint8_t *pixels, unsigned short width, unsigned short height,
-                      bool downsample, bool isRGB, unsigned char quality_,
-                      const std::string_view comment) {
+/**
+ * Run DCT, quantize and write Huffman bit codes with the standard tables
+ *
+ * @param writer Output writer
+ * @param block64 A 8*8 block
+ * @param scaled scaled luminance / chrominance.
+ * @param lastDC DC coefficient of the previous block of the same component
+ * @param dct_quantize DCT + quantisation kernel, see dct_quantize_kernel()
+ * @return The DC coefficient of this block
+ */
+template<bool luminance, typename Sink>
+int16_t encode_block(BitWriter<Sink> &writer, float *block64, const float *scaled, int16_t lastDC,
+                     DctQuantizeKernel dct_quantize) noexcept {
+    constexpr auto h = huffman(luminance);
+    auto[huffmanDC, huffmanAC] = h;
 
-    // grayscale images can't be downsampled (because there are no Cb + Cr channels)
-    if (!isRGB) downsample = false;
+    // DCT, scale, quantize and zigzag
+    int16_t quantized[8 * 8];
+    auto posNonZero = dct_quantize(block64, scaled, quantized);
+    return write_block(writer, quantized, posNonZero, lastDC, huffmanDC, huffmanAC);
+}
 
-    if (!(quality_ > 1 && quality_ <= 100)) { throw std::runtime_error("Quality must be in [1..100]"); }
+namespace {
+template<std::size_t... Q>
+constexpr std::array<QuantTables, sizeof...(Q)> quality_bank(std::index_sequence<Q...>) {
+    return {quality_tables((unsigned char) (Q + 1))...};
+}
 
-    // convert to an internal JPEG quality factor, formula taken from libjpeg
-    auto quality = quality_ < 50 ? 5000 / quality_ : 200 - quality_ * 2;
+// CPP(14): the tables of all 100 qualities, computed at compile time
+constexpr auto QualityBank = quality_bank(std::make_index_sequence<100>{});
 
-    // reject invalid pointers
-    if (pixels == nullptr)
-        return false;
-    // check image format
-    if (width == 0 || height == 0)
-        return false;
+/// Custom tables by name. Entries are never removed, the cached tables keep their address.
+struct TableRegistry {
+    std::shared_mutex mutex;
+    std::map<std::string, std::unique_ptr<const QuantTables>, std::less<>> tables;
+};
 
-    // CPP(14): Compile time compute quantisation tables for the given quality level
-    std::array<uint8_t, 8 * 8> quantLuminance = quant_table(DefaultQuantLuminance_A, quality);
-    std::array<uint8_t, 8 * 8> quantChrominance = quant_table(DefaultQuantChrominance_A, quality);
-    auto scaledLuminance = scaled_luminance(quantLuminance);
-    auto scaledChrominance = scaled_chrominance(quantChrominance);
+TableRegistry &table_registry() {
+    static TableRegistry registry;
+    return registry;
+}
 
-    return writeJpegIntern(BitWriter(std::move(output)), pixels, width, height, downsample, isRGB, quantLuminance, quantChrominance,
-                           scaledLuminance.data(), scaledChrominance.data(), comment);
+bool same_tables(const QuantTables &a, const QuantTables &b) {
+    return a.luminance == b.luminance && a.chrominance == b.chrominance && a.scaledLuminance == b.scaledLuminance &&
+           a.scaledChrominance == b.scaledChrominance;
+}
 }
 
-bool writeJpegIntern(BitWriter<> bitWriter, const uint8_t *pixels, unsigned short width, unsigned short height,
-                     bool downsample, bool isRGB, const std::array<uint8_t, 8 * 8> &quantLuminance,
-                     const std::array<uint8_t, 8 * 8> &quantChrominance,
-                     const float* scaled_luminance, const float* scaled_chrominance,
-                     const std::string_view comment) {
+const QuantTables &quant_tables(unsigned char quality) {
+    if (quality < 1 || quality > 100) { throw std::runtime_error("Quality must be in [1..100]"); }
+    return QualityBank[quality - 1];
+}
+
+const QuantTables &register_quant_tables(std::string_view name, const QuantTables &tables) {
+    auto &registry = table_registry();
+    std::unique_lock lock(registry.mutex);
+    auto found = registry.tables.find(name);
+    if (found != registry.tables.end()) {
+        if (!same_tables(*found->second, tables))
+            throw std::invalid_argument(utils::from_parts("register_quant_tables: Other tables registered as", name));
+        return *found->second;
+    }
+    auto &cached = registry.tables[std::string(name)];
+    cached = std::make_unique<const QuantTables>(tables);
+    return *cached;
+}
+
+const QuantTables *find_quant_tables(std::string_view name) {
+    auto &registry = table_registry();
+    std::shared_lock lock(registry.mutex);
+    auto found = registry.tables.find(name);
+    return found == registry.tables.end() ? nullptr : found->second.get();
+}
+
+bool writeJpegQuality(WRITE_BACK output, const uint8_t *pixels, uint32_t width, uint32_t height,
+                      bool downsample, bool isRGB, unsigned char quality_,
+                      const std::string_view comment, const EncodeOptions &options) {
+    return writeJpegQuality(FunctionSink(std::move(output)), pixels, width, height, downsample, isRGB, quality_,
+                            comment, options);
+}
+
+namespace {
+/// DC coefficients of the previous block of each component. Reset at the start of the scan and at each restart marker.
+struct DcPredictors {
+    int16_t y = 0, cb = 0, cr = 0;
+};
+
+/// Image format, quantisation and DCT kernel shared by all MCU rows of an image
+struct FrameInfo {
+    uint32_t width, height;
+    bool downsample, isRGB;
+    const float *scaled_luminance, *scaled_chrominance;
+    DctQuantizeKernel dct_quantize;
+
+    /// MCUs (minimum codes units) are either 8x8 or 16x16 tiles
+    [[nodiscard]] int mcuSize() const { return downsample ? 16 : 8; }
+
+    [[nodiscard]] int mcuRows() const { return int(height + mcuSize() - 1) / mcuSize(); }
 
+    [[nodiscard]] int mcusPerRow() const { return int(width + mcuSize() - 1) / mcuSize(); }
+
+    /// bytes per pixel row
+    [[nodiscard]] std::size_t stride() const { return std::size_t(width) * (isRGB ? 3 : 1); }
+
+    /// 8x8 blocks per MCU: Y (4 of them if downsampling), then Cb and Cr for color images
+    [[nodiscard]] int blocksPerMcu() const { return !isRGB ? 1 : downsample ? 6 : 3; }
+
+    /// The component of each block of a MCU, 0 is Y, 1 is Cb and 2 is Cr
+    [[nodiscard]] const int *mcuComponents() const {
+        static constexpr int Gray[] = {0}, Color[] = {0, 1, 2}, Downsampled[] = {0, 0, 0, 0, 1, 2};
+        return !isRGB ? Gray : downsample ? Downsampled : Color;
+    }
+
+    [[nodiscard]] std::size_t blocks() const { return std::size_t(mcuRows()) * mcusPerRow() * blocksPerMcu(); }
+};
+}
+
+/**
+ * Write the headers up to and including the start of frame segment: SOF0 (baseline) or SOF2 (progressive)
+ */
+template<typename Sink>
+void write_frame_headers(BitWriter<Sink> &bitWriter, uint32_t width, uint32_t height,
+                         bool downsample, bool isRGB, const std::array<uint8_t, 8 * 8> &quantLuminance,
+                         const std::array<uint8_t, 8 * 8> &quantChrominance, const std::string_view comment,
+                         bool progressive) {
     // number of components
     const uint8_t numComponents = isRGB ? 3 : 1;
 
@@ -284,15 +397,15 @@ bool writeJpegIntern(BitWriter<> bitWriter, const uint8_t *pixels, unsigned shor
     if (isRGB) bitWriter << 0x01_bn << quantChrominance;
 
     // ////////////////////////////////////////
-    // write image infos (SOF0 - start of frame)
+    // write image infos (SOF0 - start of frame, SOF2 for progressive jpegs)
     // length: 6 bytes general info + 3 per channel + 2 bytes for this length field
-    bitWriter.addMarker(0xC0_bn, 2 + 6 + 3 * numComponents);
+    bitWriter.addMarker(progressive ? 0xC2_bn : 0xC0_bn, 2 + 6 + 3 * numComponents);
 
     // 8 bits per channel
     bitWriter << 0x08_bn
               // image dimensions (big-endian)
-              << (height >> 8u) << (height & 0xFFu)
-              << (width >> 8u) << (width & 0xFFu);
+              << uint8_t(height >> 8u) << uint8_t(height & 0xFFu)
+              << uint8_t(width >> 8u) << uint8_t(width & 0xFFu);
 
     // sampling and quantization tables for each component
     bitWriter << numComponents;       // 1 component (grayscale, Y only) or 3 components (Y,Cb,Cr)
@@ -302,32 +415,75 @@ bool writeJpegIntern(BitWriter<> bitWriter, const uint8_t *pixels, unsigned shor
                   << (id == 1 && downsample ? 0x22
                                             : 0x11) // 0x11 is default YCbCr 4:4:4 and 0x22 stands for YCbCr 4:2:0
                   << (id == 1 ? 0 : 1); // use quantization table 0 for Y, table 1 for Cb and Cr
+}
+
+/// A table of a DHT segment. Class and id: highest 4 bits: 0 => DC, 1 => AC, lowest 4 bits: 0 => Y, 1 => Cb,Cr
+struct DefinedTable {
+    uint8_t classAndId;
+    const HuffmanTable *table;
+};
+
+/// Write a DHT segment with optimized tables: 1 byte class/id + 16 bytes counts + the symbols per table
+template<typename Sink>
+void write_huffman_tables(BitWriter<Sink> &bitWriter, const DefinedTable *tables, int count) {
+    auto length = 2;
+    for (auto i = 0; i < count; i++) length += 1 + 16 + tables[i].table->numValues;
+    bitWriter.addMarker(0xC4_bn, uint16_t(length));
+    for (auto i = 0; i < count; i++) {
+        auto &table = *tables[i].table;
+        bitWriter << tables[i].classAndId << ByteView(table.counts) << ByteView(table.values, table.numValues);
+    }
+}
+
+/**
+ * Write all headers up to and including the start of scan (SOS) segment
+ * @param tables Optimized Huffman tables, or nullptr for the standard tables
+ */
+template<typename Sink>
+void write_headers(BitWriter<Sink> &bitWriter, uint32_t width, uint32_t height,
+                   bool downsample, bool isRGB, const std::array<uint8_t, 8 * 8> &quantLuminance,
+                   const std::array<uint8_t, 8 * 8> &quantChrominance, const std::string_view comment,
+                   uint16_t restartInterval, const HuffmanTables *tables = nullptr) {
+    write_frame_headers(bitWriter, width, height, downsample, isRGB, quantLuminance, quantChrominance, comment, false);
+    const uint8_t numComponents = isRGB ? 3 : 1;
 
     // ////////////////////////////////////////
     // Huffman tables
 
-    constexpr auto len = 1 + 16 + 12 +  // for the DC luminance (chrominance)
-                         1 + 16 + 162; // for the AC luminance (chrominance)
-    // DHT marker - define Huffman tables; 2 bytes for the length field, store chrominance only if needed
-    bitWriter.addMarker(0xC4_bn, isRGB ? (2 + len + len) : (2 + len));
-
-    // store luminance's DC+AC Huffman table definitions
-    bitWriter << 0x00_bn // highest 4 bits: 0 => DC, lowest 4 bits: 0 => Y (baseline)
-              << DcLuminanceCodesPerBitsize
-              << DcLuminanceValues;
-    bitWriter << 0x10_bn // highest 4 bits: 1 => AC, lowest 4 bits: 0 => Y (baseline)
-              << AcLuminanceCodesPerBitsize
-              << AcLuminanceValues;
-
-    // chrominance is only relevant for color images
-    if (isRGB) {
+    if (tables) {
+        const DefinedTable defined[] = {{0x00, &tables->dc[0]}, {0x10, &tables->ac[0]},
+                                        {0x01, &tables->dc[1]}, {0x11, &tables->ac[1]}};
+        write_huffman_tables(bitWriter, defined, isRGB ? 4 : 2);
+    } else {
+        constexpr auto len = 1 + 16 + 12 +  // for the DC luminance (chrominance)
+                             1 + 16 + 162; // for the AC luminance (chrominance)
+        // DHT marker - define Huffman tables; 2 bytes for the length field, store chrominance only if needed
+        bitWriter.addMarker(0xC4_bn, isRGB ? (2 + len + len) : (2 + len));
+
         // store luminance's DC+AC Huffman table definitions
-        bitWriter << 0x01_bn // highest 4 bits: 0 => DC, lowest 4 bits: 1 => Cr,Cb (baseline)
-                  << DcChrominanceCodesPerBitsize
-                  << DcChrominanceValues;
-        bitWriter << 0x11_bn // highest 4 bits: 1 => AC, lowest 4 bits: 1 => Cr,Cb (baseline)
-                  << AcChrominanceCodesPerBitsize
-                  << AcChrominanceValues;
+        bitWriter << 0x00_bn // highest 4 bits: 0 => DC, lowest 4 bits: 0 => Y (baseline)
+                  << DcLuminanceCodesPerBitsize
+                  << DcLuminanceValues;
+        bitWriter << 0x10_bn // highest 4 bits: 1 => AC, lowest 4 bits: 0 => Y (baseline)
+                  << AcLuminanceCodesPerBitsize
+                  << AcLuminanceValues;
+
+        // chrominance is only relevant for color images
+        if (isRGB) {
+            // store luminance's DC+AC Huffman table definitions
+            bitWriter << 0x01_bn // highest 4 bits: 0 => DC, lowest 4 bits: 1 => Cr,Cb (baseline)
+                      << DcChrominanceCodesPerBitsize
+                      << DcChrominanceValues;
+            bitWriter << 0x11_bn // highest 4 bits: 1 => AC, lowest 4 bits: 1 => Cr,Cb (baseline)
+                      << AcChrominanceCodesPerBitsize
+                      << AcChrominanceValues;
+        }
+    }
+
+    // define restart interval (optional): number of MCUs between two RSTn markers
+    if (restartInterval) {
+        bitWriter.addMarker(0xDD_bn, 2 + 2);
+        bitWriter << uint8_t(restartInterval >> 8u) << uint8_t(restartInterval & 0xFFu);
     }
 
     // ////////////////////////////////////////
@@ -347,129 +503,999 @@ bool writeJpegIntern(BitWriter<> bitWriter, const uint8_t *pixels, unsigned shor
     // spectral selection: must be from 0 to 63; successive approximation must be 0
     constexpr uint8_t Spectral[3] = {0, 63, 0};
     bitWriter << Spectral;
+}
 
-    // the next two variables are frequently used when checking for image borders
-    const auto maxWidth = width - 1; // "last row"
-    const auto maxHeight = height - 1; // "bottom line"
-
-    // process MCUs (minimum codes units) => image is subdivided into a grid of 8x8 or 16x16 tiles
-    const auto sampling = downsample ? 2 : 1; // 1x1 or 2x2 sampling
-    const auto mcuSize = 8 * sampling;
-
-    // average color of the previous MCU
-    int16_t lastYDC = 0, lastCbDC = 0, lastCrDC = 0;
-    // convert from RGB to YCbCr
-    // Unsafe: Explicitly not initialize those variables, they will be filled completely.
-    std::array<std::array<float, 8>, 8> Y, Cb, Cr;
-    // Multi-dimensional size == one-dimensional size? Check mem layout (no padding)
-    static_assert(sizeof(Y) == sizeof(std::array<float, 8 * 8>));
-
-    for (auto mcuY = 0; mcuY < height; mcuY += mcuSize) // each step is either 8 or 16 (=mcuSize)
-        for (auto mcuX = 0; mcuX < width; mcuX += mcuSize) {
-            // YCbCr 4:4:4 format: each MCU is a 8x8 block - the same applies to grayscale images, too
-            // YCbCr 4:2:0 format: each MCU represents a 16x16 block, stored as 4x 8x8 Y-blocks plus 1x 8x8 Cb and 1x 8x8 Cr block)
-            // iterate once (YCbCr444 and grayscale) or twice (YCbCr420)
-            for (auto blockY = 0; blockY < mcuSize; blockY += 8)
-                for (auto blockX = 0; blockX < mcuSize; blockX += 8) {
-                    // now we finally have an 8x8 block ...
-                    for (auto deltaY = 0; deltaY < 8; deltaY++) {
-                        // must not exceed image borders, replicate last row/column if needed
-                        auto column = std::min(mcuX + blockX, maxWidth);
-                        auto row = std::min(mcuY + blockY + deltaY, maxHeight);
-                        for (auto deltaX = 0; deltaX < 8; deltaX++) {
-                            // find actual pixel position within the current image
-                            // the cast ensures that we don't run into multiplication overflows
-                            auto pixelPos = row * int(width) + column;
-                            if (column < maxWidth) column++;
-
-                            // grayscale images have solely a Y channel which can be easily derived from the input pixel by shifting it by 128
-                            if (!isRGB) {
-                                Y[deltaY][deltaX] = float(pixels[pixelPos]) - 128.f;
-                                continue;
-                            }
-
-                            // RGB: 3 bytes per pixel (whereas grayscale images have only 1 byte per pixel)
-                            auto r = pixels[3 * pixelPos];
-                            auto g = pixels[3 * pixelPos + 1];
-                            auto b = pixels[3 * pixelPos + 2];
-
-                            Y[deltaY][deltaX] = rgb2y(r, g, b) -
-                                                128; // again, the JPEG standard requires Y to be shifted by 128
-                            // YCbCr444 is easy - the more complex YCbCr420 has to be computed about 20 lines below in a second pass
-                            if (!downsample) {
-                                Cb[deltaY][deltaX] = rgb2cb(r, g, b); // standard RGB-to-YCbCr conversion
-                                Cr[deltaY][deltaX] = rgb2cr(r, g, b);
-                            }
-                        }
-                    }
-
-                    // encode Y channel
-                    lastYDC = encode_block<true>(bitWriter, reinterpret_cast<float *>(Y.data()),
-                                                 scaled_luminance, lastYDC);
-                    // Cb and Cr are encoded about 50 lines below
-                }
+namespace {
+/// Pixels per strip of convert_mcu_row(), a multiple of both MCU sizes. A PlanarStrip (about 40 KB: 32 KB of blocks
+/// and 7.5 KB of rows) stays in the L2 cache.
+constexpr int StripWidth = 256;
 
-            // grayscale images don't need any Cb and Cr information
-            if (!isRGB)
+/**
+ * Level shifted YCbCr samples of a strip of MCUs. They are stored block by block, 64 floats each in the order the
+ * blocks are encoded, so that the DCT reads them in place.
+ */
+struct PlanarStrip {
+    alignas(64) std::array<float, 16 * StripWidth> y;
+    alignas(64) std::array<float, 8 * StripWidth> cb, cr;
+    /// One pixel row of the strip, deinterleaved. The last column of the image is replicated up to the strip width.
+    /// Floats, so that no store of the conversion may alias them (unlike bytes) and the loops vectorize.
+    alignas(64) std::array<float, StripWidth> r, g, b;
+    /// The converted pixel row, copied to the blocks 8 samples at a time
+    alignas(64) std::array<float, StripWidth> lineY, lineCb, lineCr;
+    /// YCbCr 4:2:0: the sums of the 2x2 areas of a pair of pixel rows, exact (at most 4 * 255)
+    alignas(64) std::array<float, StripWidth / 2> sumR, sumG, sumB;
+};
+}
+
+/**
+ * Convert one row of MCUs to level shifted YCbCr blocks
+ *
+ * The row is converted in strips of StripWidth pixels: each pixel row of a strip is deinterleaved and padded once,
+ * then converted by loops without any border checks (which the compiler vectorizes). The 4:2:0 chrominance is
+ * computed from the same deinterleaved rows, each pixel is read only once. The samples are bit-identical to a
+ * per pixel conversion with the borders replicated.
+ *
+ * @param pixels The first pixel row of this MCU row
+ * @param validRows Number of pixel rows that are available, the last one is replicated up to the MCU size
+ * @param handler Called as handler(component, block64) for each 8x8 block in scan order, component 0 is Y,
+ *        1 is Cb and 2 is Cr. The block may be clobbered.
+ */
+template<typename BlockHandler>
+void convert_mcu_row(const FrameInfo &frame, const uint8_t *pixels, int validRows, BlockHandler &&handler) {
+    // at most 65535 pixels, but the pixel offsets are computed in std::size_t
+    const auto width = int(frame.width);
+    const auto isRGB = frame.isRGB;
+    const auto downsample = frame.downsample;
+
+    const auto maxHeight = validRows - 1; // "bottom line" of this MCU row
+    const auto mcuSize = frame.mcuSize();
+    const auto paddedWidth = frame.mcusPerRow() * mcuSize;
+    // YCbCr 4:4:4 format: each MCU is a 8x8 block - the same applies to grayscale images, too
+    // YCbCr 4:2:0 format: each MCU represents a 16x16 block, stored as 4x 8x8 Y-blocks plus 1x 8x8 Cb and 1x 8x8 Cr block)
+    const auto blocksY = downsample ? 4 : 1;
+
+    // first sample of the `group`th 8 pixels of a pixel row of the strip
+    auto lumaOffset = [downsample](int line, int group) {
+        // the four Y blocks of a 4:2:0 MCU: top left, top right, bottom left, bottom right
+        auto block = downsample ? (group / 2) * 4 + (line / 8) * 2 + group % 2 : group;
+        return std::size_t(block) * 64 + std::size_t(line % 8) * 8;
+    };
+
+    // Unsafe: Explicitly not initialized, each sample of a strip is written before it is read
+    PlanarStrip strip;
+    auto &r = strip.r, &g = strip.g, &b = strip.b;
+
+    for (auto stripX = 0; stripX < paddedWidth; stripX += StripWidth) {
+        const auto columns = std::min(StripWidth, paddedWidth - stripX);
+        // the image columns of this strip, the remaining ones replicate the last column
+        const auto valid = std::min(columns, width - stripX);
+        const auto groups = columns / 8;
+
+        for (auto line = 0; line < mcuSize; line++) {
+            // must not exceed the image borders, replicate the last row if needed
+            const auto *source = pixels + (std::size_t(std::min(line, maxHeight)) * width + stripX) * (isRGB ? 3 : 1);
+
+            // grayscale images have solely a Y channel which can be easily derived from the input pixel by shifting it by 128
+            if (!isRGB) {
+                std::copy_n(source, valid, r.begin());
+                std::fill(r.begin() + valid, r.begin() + columns, r[valid - 1]);
+                for (auto x = 0; x < columns; x++) strip.lineY[x] = r[x] - 128.f;
+                for (auto group = 0; group < groups; group++)
+                    std::copy_n(strip.lineY.begin() + group * 8, 8, strip.y.begin() + lumaOffset(line, group));
                 continue;
+            }
+
+            // RGB: 3 bytes per pixel (whereas grayscale images have only 1 byte per pixel)
+            for (auto x = 0; x < valid; x++) {
+                r[x] = source[3 * x];
+                g[x] = source[3 * x + 1];
+                b[x] = source[3 * x + 2];
+            }
+            std::fill(r.begin() + valid, r.begin() + columns, r[valid - 1]);
+            std::fill(g.begin() + valid, g.begin() + columns, g[valid - 1]);
+            std::fill(b.begin() + valid, b.begin() + columns, b[valid - 1]);
+
+            // again, the JPEG standard requires Y to be shifted by 128
+            for (auto x = 0; x < columns; x++) strip.lineY[x] = rgb2y(r[x], g[x], b[x]) - 128;
+            for (auto group = 0; group < groups; group++)
+                std::copy_n(strip.lineY.begin() + group * 8, 8, strip.y.begin() + lumaOffset(line, group));
+
+            // YCbCr444 is easy, the blocks are at the same place as the Y blocks
+            if (!downsample) {
+                for (auto x = 0; x < columns; x++) {
+                    strip.lineCb[x] = rgb2cb(r[x], g[x], b[x]);
+                    strip.lineCr[x] = rgb2cr(r[x], g[x], b[x]);
+                }
+                for (auto group = 0; group < groups; group++) {
+                    std::copy_n(strip.lineCb.begin() + group * 8, 8, strip.cb.begin() + lumaOffset(line, group));
+                    std::copy_n(strip.lineCr.begin() + group * 8, 8, strip.cr.begin() + lumaOffset(line, group));
+                }
+                continue;
+            }
 
             // ////////////////////////////////////////
             // the following lines are only relevant for YCbCr420:
-            // average/downsample chrominance of four pixels while respecting the image borders
-            if (downsample)
-                // iterating loop in reverse increases cache read efficiency
-                for (short deltaY = 7; deltaY >= 0; deltaY--) {
-                    auto row = std::min(mcuY + 2 * deltaY, maxHeight); // each deltaX/Y step covers a 2x2 area
-                    auto column = mcuX;                        // column is updated inside next loop
-                    auto pixelPos = (row * int(width) + column) * 3;     // numComponents = 3
-
-                    // deltas (in bytes) to next row / column, must not exceed image borders
-                    auto rowStep = (row < maxHeight) ? 3 * int(width)
-                                                     : 0; // always numComponents*width except for bottom    line
-                    auto columnStep = (column < maxWidth) ? 3
-                                                          : 0; // always numComponents       except for rightmost pixel
-
-                    for (short deltaX = 0; deltaX < 8; deltaX++) {
-                        // let's add all four samples (2x2 area)
-                        auto right = pixelPos + columnStep;
-                        auto down = pixelPos + rowStep;
-                        auto downRight = pixelPos + columnStep + rowStep;
-
-                        // note: cast from 8 bits to >8 bits to avoid overflows when adding
-                        auto r = short(pixels[pixelPos]) + pixels[right] + pixels[down] + pixels[downRight];
-                        auto g = short(pixels[pixelPos + 1]) + pixels[right + 1] + pixels[down + 1] +
-                                 pixels[downRight + 1];
-                        auto b = short(pixels[pixelPos + 2]) + pixels[right + 2] + pixels[down + 2] +
-                                 pixels[downRight + 2];
-
-                        // convert to Cb and Cr
-                        Cb[deltaY][deltaX] = rgb2cb(r, g, b) /
-                                             4; // I still have to divide r,g,b by 4 to get their average values
-                        Cr[deltaY][deltaX] = rgb2cr(r, g, b) / 4; // it's a bit faster if done AFTER CbCr conversion
-
-                        // step forward to next 2x2 area
-                        pixelPos += 2 * 3; // 2 pixels => 6 bytes (2*numComponents)
-                        column += 2;
-
-                        // reached right border ?
-                        if (column >= maxWidth) {
-                            columnStep = 0;
-                            pixelPos = ((row + 1) * int(width) - 1) *
-                                       3; // same as (row * width + maxWidth) * numComponents => current's row last pixel
-                        }
-                    }
-                } // end of YCbCr420 code for Cb and Cr
-
-            // encode Cb and Cr
-            // reinterpret_cast necessary to go from multi-dimensional std::array to a flat view one-dimensional array
-            lastCbDC = encode_block<false>(bitWriter, reinterpret_cast<float *>(Cb.data()), scaled_chrominance, lastCbDC);
-            lastCrDC = encode_block<false>(bitWriter, reinterpret_cast<float *>(Cr.data()), scaled_chrominance, lastCrDC);
+            // average/downsample chrominance of 2x2 pixels, the first row of a pair starts the sums
+            const auto pairs = columns / 2;
+            if (line % 2 == 0) {
+                for (auto x = 0; x < pairs; x++) {
+                    strip.sumR[x] = r[2 * x] + r[2 * x + 1];
+                    strip.sumG[x] = g[2 * x] + g[2 * x + 1];
+                    strip.sumB[x] = b[2 * x] + b[2 * x + 1];
+                }
+                continue;
+            }
+            for (auto x = 0; x < pairs; x++) {
+                strip.sumR[x] += r[2 * x] + r[2 * x + 1];
+                strip.sumG[x] += g[2 * x] + g[2 * x + 1];
+                strip.sumB[x] += b[2 * x] + b[2 * x + 1];
+            }
+            for (auto x = 0; x < pairs; x++) {
+                // I still have to divide r,g,b by 4 to get their average values
+                // it's a bit faster if done AFTER CbCr conversion
+                strip.lineCb[x] = rgb2cb(strip.sumR[x], strip.sumG[x], strip.sumB[x]) / 4;
+                strip.lineCr[x] = rgb2cr(strip.sumR[x], strip.sumG[x], strip.sumB[x]) / 4;
+            }
+            // one Cb and one Cr block per MCU, this is their row line / 2
+            for (auto mcu = 0; mcu < pairs / 8; mcu++) {
+                const auto offset = std::size_t(mcu) * 64 + std::size_t(line / 2) * 8;
+                std::copy_n(strip.lineCb.begin() + mcu * 8, 8, strip.cb.begin() + offset);
+                std::copy_n(strip.lineCr.begin() + mcu * 8, 8, strip.cr.begin() + offset);
+            }
+        }
+
+        // encode the blocks of the MCUs of this strip: Y, then Cb and Cr
+        for (auto mcu = 0; mcu < columns / mcuSize; mcu++) {
+            for (auto block = 0; block < blocksY; block++)
+                handler(0, strip.y.data() + std::size_t(mcu * blocksY + block) * 64);
+            // grayscale images don't need any Cb and Cr information
+            if (!isRGB) continue;
+            handler(1, strip.cb.data() + std::size_t(mcu) * 64);
+            handler(2, strip.cr.data() + std::size_t(mcu) * 64);
+        }
+    }
+}
+
+/**
+ * convert_mcu_row(), but one of Metrics::SampleRows rows is timed: the time spent in the handler is recorded as
+ * Metrics::Timer::EncodeBlocks, the rest as Metrics::Timer::EncodeColor. All other rows run without any clock reads.
+ */
+template<typename BlockHandler>
+void sampled_mcu_row(const FrameInfo &frame, const uint8_t *pixels, int validRows, BlockHandler &&handler) {
+    if (!Metrics::sample_row()) {
+        convert_mcu_row(frame, pixels, validRows, handler);
+        return;
+    }
+    using Metrics::Clock;
+    Clock::duration blocks{};
+    auto begin = Clock::now();
+    convert_mcu_row(frame, pixels, validRows, [&](int component, float *block64) {
+        auto start = Clock::now();
+        handler(component, block64);
+        blocks += Clock::now() - start;
+    });
+    Metrics::record(Metrics::Timer::EncodeBlocks, blocks);
+    Metrics::record(Metrics::Timer::EncodeColor, Clock::now() - begin - blocks);
+}
+
+/**
+ * Convert and encode one row of MCUs with the standard Huffman tables
+ *
+ * @param dc DC predictors, updated while encoding
+ * See convert_mcu_row() for the other parameters.
+ */
+template<typename Sink>
+void encode_mcu_row(BitWriter<Sink> &bitWriter, const FrameInfo &frame, const uint8_t *pixels, int validRows,
+                    DcPredictors &dc) {
+    auto encode = [&](int component, float *block64) {
+        if (component == 0)
+            dc.y = encode_block<true>(bitWriter, block64, frame.scaled_luminance, dc.y, frame.dct_quantize);
+        else if (component == 1)
+            dc.cb = encode_block<false>(bitWriter, block64, frame.scaled_chrominance, dc.cb, frame.dct_quantize);
+        else
+            dc.cr = encode_block<false>(bitWriter, block64, frame.scaled_chrominance, dc.cr, frame.dct_quantize);
+    };
+    sampled_mcu_row(frame, pixels, validRows, encode);
+}
+
+double convertColors(const uint8_t *pixels, uint32_t width, uint32_t height, bool downsample, bool isRGB) {
+    if (pixels == nullptr || width == 0 || height == 0 || width > MaxDimension || height > MaxDimension) return 0;
+    const FrameInfo frame{width, height, isRGB && downsample, isRGB, nullptr, nullptr, nullptr};
+    const auto mcuSize = frame.mcuSize();
+    double sum = 0;
+    for (auto mcuY = 0; mcuY < int(height); mcuY += mcuSize)
+        convert_mcu_row(frame, pixels + std::size_t(mcuY) * frame.stride(), std::min(mcuSize, int(height) - mcuY),
+                        [&sum](int, const float *block64) { sum += block64[0]; });
+    return sum;
+}
+
+/**
+ * Encode a range of MCU rows, starting with fresh DC predictors
+ * @param restartMarker If not negative, the bit stream is padded and the RSTn marker with n = restartMarker % 8 is appended
+ */
+template<typename Sink>
+void encode_interval(BitWriter<Sink> &bitWriter, const FrameInfo &frame, const uint8_t *pixels,
+                     int mcuRowBegin, int mcuRowEnd, int restartMarker) {
+    DcPredictors dc;
+    const auto mcuSize = frame.mcuSize();
+    for (auto mcuRow = mcuRowBegin; mcuRow < mcuRowEnd; mcuRow++) {
+        auto mcuY = mcuRow * mcuSize;
+        encode_mcu_row(bitWriter, frame, pixels + std::size_t(mcuY) * frame.stride(),
+                       std::min(mcuSize, int(frame.height) - mcuY), dc);
+    }
+    if (restartMarker >= 0) {
+        bitWriter.flush();
+        bitWriter << 0xFF_bn << uint8_t(0xD0 + restartMarker % 8);
+    }
+}
+
+/**
+ * Encode restart intervals of a scan in parallel, each into its own buffer. Buffers are joined in order.
+ * Starts at most one thread per interval, exceptions of the workers are rethrown.
+ */
+template<typename Sink>
+void encode_intervals_parallel(BitWriter<Sink> &bitWriter, const FrameInfo &frame, const uint8_t *pixels,
+                               int rowsPerInterval, unsigned threads) {
+    const auto intervals = (frame.mcuRows() + rowsPerInterval - 1) / rowsPerInterval;
+    std::vector<std::vector<uint8_t>> buffers(intervals);
+    std::atomic<int> next{0};
+    // a thread without an interval would only be started and joined
+    threads = std::min<unsigned>(threads, intervals);
+    std::vector<std::exception_ptr> errors(threads);
+
+    auto worker = [&](unsigned id) {
+        try {
+            for (auto interval = next++; interval < intervals; interval = next++) {
+                auto &buffer = buffers[interval];
+                // rough guess: a few bytes per pixel row and MCU
+                buffer.reserve(std::size_t(frame.width) * rowsPerInterval * 2);
+                VectorSink sink(buffer);
+                BitWriter<VectorSink> intervalWriter(sink);
+                auto begin = interval * rowsPerInterval;
+                auto end = std::min(begin + rowsPerInterval, frame.mcuRows());
+                encode_interval(intervalWriter, frame, pixels, begin, end, interval + 1 < intervals ? interval : -1);
+                if (interval + 1 == intervals) intervalWriter.flush();
+                intervalWriter.drain();
+            }
+        } catch (...) {
+            errors[id] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned id = 1; id < threads; id++) workers.emplace_back(worker, id);
+    worker(0);
+    for (auto &thread: workers) thread.join();
+    for (auto &error: errors) if (error) std::rethrow_exception(error);
+
+    for (auto &buffer: buffers) bitWriter << ByteView(buffer.data(), buffer.size());
+}
+
+/**
+ * Visit the blocks of a coefficient buffer in scan order, see encode_two_pass()
+ * @param visit Called as visit(component, quantized, posNonZero, lastDC) for each block
+ * @param restart Called as restart(n) before the first block of each restart interval but the first one
+ */
+template<typename Visit, typename Restart>
+void for_each_block(const FrameInfo &frame, int restartInterval, const std::vector<int16_t> &coefficients,
+                    Visit &&visit, Restart &&restart) {
+    // block order within an MCU
+    const int *components = frame.mcuComponents();
+    const int blocksPerMcu = frame.blocksPerMcu();
+
+    const auto mcus = frame.mcuRows() * frame.mcusPerRow();
+    int16_t lastDC[3] = {0, 0, 0};
+    const int16_t *block = coefficients.data();
+    for (auto mcu = 0; mcu < mcus; mcu++) {
+        if (restartInterval && mcu && mcu % restartInterval == 0) {
+            restart(mcu / restartInterval - 1);
+            lastDC[0] = lastDC[1] = lastDC[2] = 0;
+        }
+        for (auto i = 0; i < blocksPerMcu; i++) {
+            auto component = components[i];
+            auto posNonZero = block[0];
+            visit(component, block + 1, posNonZero, lastDC[component]);
+            lastDC[component] = block[1];
+            block += posNonZero + 2;
+        }
+    }
+}
+
+/// Append a quantized block to a coefficient buffer, see encode_two_pass()
+void append_block(std::vector<int16_t> &coefficients, const int16_t *quantized, int posNonZero) {
+    coefficients.push_back(int16_t(posNonZero));
+    coefficients.insert(coefficients.end(), quantized, quantized + posNonZero + 1);
+}
+
+/**
+ * Write the headers and the scan of a coefficient buffer, but not the end of image marker
+ * @param optimizeHuffman Per image Huffman tables (counted from the buffer) instead of the standard tables
+ */
+template<typename Sink>
+void write_scan(BitWriter<Sink> &bitWriter, const FrameInfo &frame, const std::vector<int16_t> &coefficients,
+                const std::array<uint8_t, 8 * 8> &quantLuminance, const std::array<uint8_t, 8 * 8> &quantChrominance,
+                const std::string_view comment, int rowsPerInterval, bool optimizeHuffman) {
+    const auto restartInterval = rowsPerInterval * frame.mcusPerRow();
+    const BitCode *huffmanDC[2], *huffmanAC[2];
+    std::tie(huffmanDC[0], huffmanAC[0]) = huffman_luminance();
+    std::tie(huffmanDC[1], huffmanAC[1]) = huffman_chrominance();
+
+    HuffmanTables tables;
+    if (optimizeHuffman) {
+        SymbolCounts dcCounts[2]{}, acCounts[2]{};
+        for_each_block(frame, restartInterval, coefficients,
+                       [&](int component, const int16_t *quantized, int posNonZero, int16_t lastDC) {
+                           auto id = component ? 1 : 0;
+                           count_block(dcCounts[id], acCounts[id], quantized, posNonZero, lastDC);
+                       }, [](int) {});
+        for (auto id = 0; id < (frame.isRGB ? 2 : 1); id++) {
+            tables.dc[id] = build_huffman_table(dcCounts[id]);
+            tables.ac[id] = build_huffman_table(acCounts[id]);
+            huffmanDC[id] = tables.dc[id].codes.data();
+            huffmanAC[id] = tables.ac[id].codes.data();
+        }
+    }
+
+    write_headers(bitWriter, frame.width, frame.height, frame.downsample, frame.isRGB, quantLuminance,
+                  quantChrominance, comment, uint16_t(restartInterval), optimizeHuffman ? &tables : nullptr);
+    for_each_block(frame, restartInterval, coefficients,
+                   [&](int component, const int16_t *quantized, int posNonZero, int16_t lastDC) {
+                       auto id = component ? 1 : 0;
+                       write_block(bitWriter, quantized, posNonZero, lastDC, huffmanDC[id], huffmanAC[id]);
+                   }, [&](int marker) {
+                bitWriter.flush();
+                bitWriter << 0xFF_bn << uint8_t(0xD0 + marker % 8);
+            });
+}
+
+std::vector<ProgressiveScan> default_scan_script(bool isRGB) {
+    constexpr uint8_t Y = 1, Cb = 2, Cr = 4;
+    if (!isRGB)
+        return {{Y, 0, 0, 0, 1},
+                {Y, 1, 5, 0, 2}, {Y, 6, 63, 0, 2},
+                {Y, 1, 63, 2, 1},
+                {Y, 0, 0, 1, 0}, {Y, 1, 63, 1, 0}};
+    // luma gets a few bands right away, chroma is too small to be worth many scans
+    return {{Y | Cb | Cr, 0, 0, 0, 1},
+            {Y, 1, 5, 0, 2}, {Cr, 1, 63, 0, 1}, {Cb, 1, 63, 0, 1}, {Y, 6, 63, 0, 2},
+            {Y, 1, 63, 2, 1},
+            {Y | Cb | Cr, 0, 0, 1, 0}, {Cr, 1, 63, 1, 0}, {Cb, 1, 63, 1, 0}, {Y, 1, 63, 1, 0}};
+}
+
+namespace {
+/// Throws if the scans do not send each coefficient of each component exactly once, DC before AC (G.1.1.1)
+void check_scan_script(const std::vector<ProgressiveScan> &script, bool isRGB) {
+    // per component and zigzag position: the next expected bitHigh, -1 before the first scan
+    int sent[3][64];
+    std::fill(&sent[0][0], &sent[0][0] + 3 * 64, -1);
+    const auto components = isRGB ? 7u : 1u;
+    for (std::size_t i = 0; i < script.size(); i++) {
+        auto &scan = script[i];
+        auto fail = [i](const char *reason) {
+            throw std::runtime_error(utils::from_parts("Invalid progressive scan", i, ":", reason));
+        };
+        if (!scan.components || (scan.components & ~components)) fail("no or unknown components");
+        if (scan.spectralStart > scan.spectralEnd || scan.spectralEnd > 63 ||
+            (scan.spectralStart == 0) != (scan.spectralEnd == 0))
+            fail("invalid band");
+        if (scan.spectralStart && (scan.components & (scan.components - 1))) fail("AC scan with several components");
+        if (scan.bitLow > 13) fail("bitLow above 13");
+        for (auto component = 0; component < 3; component++) {
+            if (!(scan.components & (1u << component))) continue;
+            if (scan.spectralStart && sent[component][0] < 0) fail("AC scan before the DC scan");
+            for (auto k = scan.spectralStart; k <= scan.spectralEnd; k++) {
+                auto &bit = sent[component][k];
+                if (bit < 0 ? scan.bitHigh != 0 : bit == 0 || scan.bitHigh != bit || scan.bitLow + 1 != bit)
+                    fail("bits sent twice or with a gap");
+                bit = scan.bitLow;
+            }
+        }
+    }
+    for (auto component = 0; component < (isRGB ? 3 : 1); component++)
+        if (std::any_of(sent[component], sent[component] + 64, [](int bit) { return bit != 0; }))
+            throw std::runtime_error(utils::from_parts("Invalid progressive scans: component", component,
+                                                       "is not sent completely"));
+}
+
+/// Collects the symbols of a progressive scan for its Huffman tables, see ProgressiveCoder
+struct ScanCounter {
+    SymbolCounts dc[2]{}, ac[2]{};
+
+    void dcSymbol(int table, uint8_t symbol, BitCode) noexcept { dc[table][symbol]++; }
+
+    void acSymbol(int table, uint8_t symbol, BitCode) noexcept { ac[table][symbol]++; }
+
+    void bits(BitCode) noexcept {}
+};
+
+/// Writes the symbols of a progressive scan with the tables counted by a ScanCounter, see ProgressiveCoder
+template<typename Sink>
+struct ScanWriter {
+    BitWriter<Sink> &writer;
+    const BitCode *dc[2], *ac[2];
+
+    void dcSymbol(int table, uint8_t symbol, BitCode value) { writer.writeCodes(dc[table][symbol], value); }
+
+    void acSymbol(int table, uint8_t symbol, BitCode value) { writer.writeCodes(ac[table][symbol], value); }
+
+    void bits(BitCode value) { writer << value; }
+};
+
+/**
+ * Entropy coding of a progressive scan (G.1.2), the output either counts or writes the symbols.
+ * AC scans end blocks with runs of end of blocks (EOBRUN). Refinement scans send one correction bit per coefficient
+ * that was non-zero already, those of an EOBRUN are buffered until the run is written, like libjpeg does.
+ */
+template<typename Output>
+class ProgressiveCoder {
+public:
+    ProgressiveCoder(Output &output, const ProgressiveScan &scan) noexcept: output_(output), scan_(scan) {}
+
+    /// Code a block of the coefficient buffer, see append_block()
+    void block(int component, const int16_t *quantized, int posNonZero) {
+        const BitCode *codewords = &codewordsArray[CodeWordLimit];
+        auto table = component ? 1 : 0;
+        if (scan_.spectralStart == 0) {
+            if (scan_.bitHigh) return output_.bits(BitCode((quantized[0] >> scan_.bitLow) & 1, 1));
+            // the point transform of DC is an arithmetic shift
+            int16_t dc = int16_t(quantized[0] >> scan_.bitLow);
+            auto diff = dc - lastDC_[component];
+            lastDC_[component] = dc;
+            return output_.dcSymbol(table, diff == 0 ? 0 : codewords[diff].numBits,
+                                    diff == 0 ? BitCode(0, 0) : codewords[diff]);
+        }
+
+        // the coefficients after posNonZero are zeros, they end up in the end of block
+        auto last = std::min(int(scan_.spectralEnd), posNonZero);
+        if (scan_.bitHigh == 0) first(table, quantized, last);
+        else refine(table, quantized, last);
+    }
+
+    /// Write the pending EOBRUN, at the end of the scan
+    void finish() { flush(scan_.spectralStart ? (scan_.components & 1 ? 0 : 1) : 0); }
+
+private:
+    /// libjpeg's limit of buffered correction bits
+    static constexpr std::size_t MaxCorrections = 1000;
+
+    /// The magnitude of a coefficient at the bit position of the scan (the point transform of AC)
+    [[nodiscard]] int magnitude(int16_t value) const noexcept { return (value < 0 ? -value : value) >> scan_.bitLow; }
+
+    void first(int table, const int16_t *quantized, int last) {
+        const BitCode *codewords = &codewordsArray[CodeWordLimit];
+        auto run = 0;
+        for (auto k = int(scan_.spectralStart); k <= last; k++) {
+            auto value = magnitude(quantized[k]);
+            if (value == 0) {
+                run++;
+                continue;
+            }
+            flush(table);
+            for (; run > 15; run -= 16) output_.acSymbol(table, 0xF0, BitCode(0, 0));
+            auto code = codewords[quantized[k] < 0 ? -value : value];
+            output_.acSymbol(table, uint8_t((run << 4) + code.numBits), code);
+            run = 0;
         }
+        if ((run || last < scan_.spectralEnd) && ++eobRun_ == 0x7FFF) flush(table);
+    }
+
+    void refine(int table, const int16_t *quantized, int last) {
+        // runs of 16 zeros are only written before a new coefficient, otherwise the end of block covers them
+        auto lastNew = 0;
+        for (auto k = int(scan_.spectralStart); k <= last; k++)
+            if (magnitude(quantized[k]) == 1) lastNew = k;
+
+        // correction bits of this block not sent yet
+        uint8_t pending[64];
+        auto count = 0;
+        auto send_pending = [&] {
+            for (auto i = 0; i < count; i++) output_.bits(BitCode(pending[i], 1));
+            count = 0;
+        };
+        auto run = 0;
+        for (auto k = int(scan_.spectralStart); k <= last; k++) {
+            auto value = magnitude(quantized[k]);
+            if (value == 0) {
+                run++;
+                continue;
+            }
+            for (; run > 15 && k <= lastNew; run -= 16) {
+                flush(table);
+                output_.acSymbol(table, 0xF0, BitCode(0, 0));
+                send_pending();
+            }
+            if (value > 1) {
+                pending[count++] = uint8_t(value & 1);
+                continue;
+            }
+            // a new coefficient: its sign follows the symbol, then the correction bits in front of it
+            flush(table);
+            output_.acSymbol(table, uint8_t((run << 4) + 1), BitCode(quantized[k] < 0 ? 0 : 1, 1));
+            send_pending();
+            run = 0;
+        }
+        if (run || count || last < scan_.spectralEnd) {
+            eobRun_++;
+            corrections_.insert(corrections_.end(), pending, pending + count);
+            if (eobRun_ == 0x7FFF || corrections_.size() > MaxCorrections - 63) flush(table);
+        }
+    }
+
+    /// Write the EOBRUN (symbol 16 * log2(run), then the low bits of the run) and its correction bits
+    void flush(int table) {
+        if (!eobRun_) return;
+        auto bits = 0;
+        while ((eobRun_ >> (bits + 1)) != 0) bits++;
+        output_.acSymbol(table, uint8_t(bits << 4), BitCode(uint16_t(eobRun_ & ((1u << bits) - 1)), uint8_t(bits)));
+        eobRun_ = 0;
+        for (auto bit: corrections_) output_.bits(BitCode(bit, 1));
+        corrections_.clear();
+    }
+
+    Output &output_;
+    const ProgressiveScan &scan_;
+    int16_t lastDC_[3] = {0, 0, 0};
+    unsigned eobRun_ = 0;
+    std::vector<uint8_t> corrections_;
+};
+
+/**
+ * Visit the blocks of a progressive scan, see write_progressive(). A scan of several components visits the blocks of
+ * the MCUs like for_each_block(), a scan of a single component its blocks row by row. Those rows do not include the
+ * padding blocks of a 4:2:0 MCU beyond the right and bottom edge of the image (A.2.2).
+ * @param offsets Start of each block in the coefficient buffer in MCU order, see append_block()
+ * @param visit Called as visit(component, quantized, posNonZero) for each block
+ */
+template<typename Visit>
+void for_each_scan_block(const FrameInfo &frame, const std::vector<int16_t> &coefficients,
+                         const std::vector<std::size_t> &offsets, unsigned components, Visit &&visit) {
+    auto at = [&](int component, std::size_t block) {
+        auto *data = coefficients.data() + offsets[block];
+        visit(component, data + 1, data[0]);
+    };
+    const auto blocksPerMcu = std::size_t(frame.blocksPerMcu());
+    const auto mcusPerRow = std::size_t(frame.mcusPerRow());
+    if (components & (components - 1)) {
+        const int *mcuComponents = frame.mcuComponents();
+        for (std::size_t block = 0; block < offsets.size(); block++)
+            if (components & (1u << unsigned(mcuComponents[block % blocksPerMcu])))
+                at(mcuComponents[block % blocksPerMcu], block);
+        return;
+    }
+
+    const auto component = components == 1 ? 0 : components == 2 ? 1 : 2;
+    if (component == 0 && frame.downsample && frame.isRGB) {
+        // four Y blocks per MCU: top left, top right, bottom left, bottom right
+        const auto rows = (std::size_t(frame.height) + 7) / 8, columns = (std::size_t(frame.width) + 7) / 8;
+        for (std::size_t row = 0; row < rows; row++)
+            for (std::size_t column = 0; column < columns; column++)
+                at(0, ((row / 2) * mcusPerRow + column / 2) * blocksPerMcu + (row % 2) * 2 + column % 2);
+        return;
+    }
+    // one block of the component per MCU
+    const auto index = component == 0 ? 0 : blocksPerMcu - 3 + std::size_t(component);
+    for (std::size_t mcu = 0; mcu * blocksPerMcu < offsets.size(); mcu++) at(component, mcu * blocksPerMcu + index);
+}
+
+/**
+ * Write the headers and the scans of a progressive jpeg from a coefficient buffer, but not the end of image marker.
+ * Each scan is coded twice, first only counted for its optimized Huffman tables (defined right before the scan).
+ */
+template<typename Sink>
+void write_progressive(BitWriter<Sink> &bitWriter, const FrameInfo &frame, const std::vector<int16_t> &coefficients,
+                       const std::array<uint8_t, 8 * 8> &quantLuminance,
+                       const std::array<uint8_t, 8 * 8> &quantChrominance, const std::string_view comment,
+                       const std::vector<ProgressiveScan> &script) {
+    check_scan_script(script, frame.isRGB);
+    std::vector<std::size_t> offsets;
+    offsets.reserve(frame.blocks());
+    for (std::size_t offset = 0; offset < coefficients.size(); offset += std::size_t(coefficients[offset]) + 2)
+        offsets.push_back(offset);
+
+    write_frame_headers(bitWriter, frame.width, frame.height, frame.downsample, frame.isRGB, quantLuminance,
+                        quantChrominance, comment, true);
+    for (auto &scan: script) {
+        const bool dc = scan.spectralStart == 0;
+        auto code = [&](auto &output) {
+            ProgressiveCoder coder(output, scan);
+            for_each_scan_block(frame, coefficients, offsets, scan.components,
+                                [&coder](int component, const int16_t *quantized, int posNonZero) {
+                                    coder.block(component, quantized, posNonZero);
+                                });
+            coder.finish();
+        };
+
+        // DC refinements are plain bits, the other scans define the tables of their components
+        ScanCounter counter;
+        HuffmanTable tables[2];
+        DefinedTable defined[2];
+        auto numTables = 0;
+        if (!dc || !scan.bitHigh) {
+            code(counter);
+            for (auto id = 0; id < 2; id++) {
+                if (!(scan.components & (id ? 6u : 1u))) continue;
+                tables[id] = build_huffman_table(dc ? counter.dc[id] : counter.ac[id]);
+                defined[numTables++] = {uint8_t((dc ? 0x00 : 0x10) | id), &tables[id]};
+            }
+            write_huffman_tables(bitWriter, defined, numTables);
+        }
+
+        // SOS: the components and their tables (Y: 0, Cb + Cr: 1), band and bit positions
+        uint8_t numComponents = 0;
+        for (auto component = 0; component < 3; component++) numComponents += (scan.components >> component) & 1u;
+        bitWriter.addMarker(0xDA_bn, 2 + 1 + 2 * numComponents + 3);
+        bitWriter << numComponents;
+        for (uint8_t component = 0; component < 3; component++)
+            if (scan.components & (1u << component))
+                bitWriter << uint8_t(component + 1) << uint8_t(component == 0 ? 0x00 : dc ? 0x10 : 0x01);
+        bitWriter << scan.spectralStart << scan.spectralEnd << uint8_t((scan.bitHigh << 4u) | scan.bitLow);
+
+        ScanWriter<Sink> writer{bitWriter, {tables[0].codes.data(), tables[1].codes.data()},
+                                {tables[0].codes.data(), tables[1].codes.data()}};
+        code(writer);
+        bitWriter.flush();
+    }
+}
+
+/**
+ * Write the headers and scans of a coefficient buffer: progressive (see write_progressive()) or a single scan
+ * (see write_scan()), but not the end of image marker
+ */
+template<typename Sink>
+void write_coefficients(BitWriter<Sink> &bitWriter, const FrameInfo &frame, const std::vector<int16_t> &coefficients,
+                        const std::array<uint8_t, 8 * 8> &quantLuminance,
+                        const std::array<uint8_t, 8 * 8> &quantChrominance, const std::string_view comment,
+                        int rowsPerInterval, const EncodeOptions &options) {
+    if (!options.progressive)
+        return write_scan(bitWriter, frame, coefficients, quantLuminance, quantChrominance, comment, rowsPerInterval,
+                          options.optimizeHuffman);
+    write_progressive(bitWriter, frame, coefficients, quantLuminance, quantChrominance, comment,
+                      options.scanScript.empty() ? default_scan_script(frame.isRGB) : options.scanScript);
+}
+}
+
+/**
+ * Encode the scan with per image Huffman tables (or the scans of a progressive jpeg), including the headers
+ *
+ * Pass 1 converts and quantizes all blocks once into a compact buffer (per block the position of the last non-zero
+ * coefficient, followed by the coefficients up to that position) and counts the Huffman symbols.
+ * Pass 2 only entropy codes the buffer with the optimal tables, see write_coefficients().
+ */
+template<typename Sink>
+void encode_two_pass(BitWriter<Sink> &bitWriter, const FrameInfo &frame, const uint8_t *pixels,
+                     const std::array<uint8_t, 8 * 8> &quantLuminance,
+                     const std::array<uint8_t, 8 * 8> &quantChrominance, const std::string_view comment,
+                     int rowsPerInterval, const EncodeOptions &options) {
+    std::vector<int16_t> coefficients;
+    // rough guess: a few coefficients per block survive quantisation
+    coefficients.reserve(std::size_t(frame.width) * frame.height / 8);
+    const auto mcuSize = frame.mcuSize();
+    for (auto mcuRow = 0; mcuRow < frame.mcuRows(); mcuRow++) {
+        auto mcuY = mcuRow * mcuSize;
+        sampled_mcu_row(frame, pixels + std::size_t(mcuY) * frame.stride(), std::min(mcuSize, int(frame.height) - mcuY),
+                        [&](int component, float *block64) {
+                            int16_t quantized[8 * 8];
+                            auto posNonZero = frame.dct_quantize(block64, component ? frame.scaled_chrominance
+                                                                                    : frame.scaled_luminance,
+                                                                 quantized);
+                            append_block(coefficients, quantized, posNonZero);
+                        });
+    }
+    write_coefficients(bitWriter, frame, coefficients, quantLuminance, quantChrominance, comment, rowsPerInterval,
+                       options);
+}
+
+/// MCU rows per restart interval, 0 if disabled. Restart intervals cover whole MCU rows, but must not exceed 65535 MCUs.
+int restart_rows(const FrameInfo &frame, const EncodeOptions &options) {
+    if (!options.restartRows) return 0;
+    return std::clamp(int(options.restartRows), 1, std::max(1, 0xFFFF / frame.mcusPerRow()));
+}
+
+template<typename Sink>
+bool writeJpegIntern(BitWriter<Sink> &bitWriter, const uint8_t *pixels, uint32_t width, uint32_t height,
+                     bool downsample, bool isRGB, const std::array<uint8_t, 8 * 8> &quantLuminance,
+                     const std::array<uint8_t, 8 * 8> &quantChrominance,
+                     const float *scaled_luminance, const float *scaled_chrominance,
+                     const std::string_view comment, const EncodeOptions &options) {
+
+    Metrics::ScopedTimer timer(Metrics::Timer::Encode);
+    // DCT kernel picked by the CPU features
+    const FrameInfo frame{width, height, downsample, isRGB, scaled_luminance, scaled_chrominance,
+                          dct_quantize_kernel()};
+    Metrics::add(Metrics::Counter::Images);
+    Metrics::add(Metrics::Counter::Pixels, std::uint64_t(width) * height);
+    Metrics::add(Metrics::Counter::Blocks, frame.blocks());
+
+    const auto rowsPerInterval = restart_rows(frame, options);
+    const auto restartInterval = uint16_t(rowsPerInterval * frame.mcusPerRow());
+
+    if (options.optimizeHuffman || options.progressive) {
+        encode_two_pass(bitWriter, frame, pixels, quantLuminance, quantChrominance, comment, rowsPerInterval, options);
+        bitWriter.flush();
+        bitWriter << 0xFF_bn << 0xD9_bn;
+        bitWriter.drain();
+        return true;
+    }
+
+    write_headers(bitWriter, width, height, downsample, isRGB, quantLuminance, quantChrominance, comment,
+                  restartInterval);
+
+    auto threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    if (!rowsPerInterval) {
+        encode_interval(bitWriter, frame, pixels, 0, frame.mcuRows(), -1);
+    } else if (threads > 1) {
+        encode_intervals_parallel(bitWriter, frame, pixels, rowsPerInterval, threads);
+    } else {
+        for (auto begin = 0, interval = 0; begin < frame.mcuRows(); begin += rowsPerInterval, interval++) {
+            auto end = std::min(begin + rowsPerInterval, frame.mcuRows());
+            encode_interval(bitWriter, frame, pixels, begin, end, end < frame.mcuRows() ? interval : -1);
+        }
+    }
 
     bitWriter.flush(); // now image is completely encoded, write any bits still left in the buffer
 
     bitWriter << 0xFF_bn << 0xD9_bn; // this marker has no length, therefore I can't use addMarker()
+    bitWriter.drain();
     return true;
 }
 
+/**
+ * Quantize the coefficients of forward_dct() (64 per block, in scan order) into a coefficient buffer,
+ * see encode_two_pass()
+ */
+void quantize_coefficients(const FrameInfo &frame, const std::vector<float> &dct, const QuantTables &tables,
+                           std::vector<int16_t> &coefficients) {
+    coefficients.clear();
+    const int *components = frame.mcuComponents();
+    const auto blocksPerMcu = frame.blocksPerMcu();
+    int16_t quantized[8 * 8];
+    for (std::size_t block = 0; block * 64 < dct.size(); block++) {
+        auto *scaled = components[block % blocksPerMcu] ? tables.scaledChrominance.data()
+                                                        : tables.scaledLuminance.data();
+        append_block(coefficients, quantized, quantize_block(dct.data() + block * 64, scaled, quantized));
+    }
+}
+
+/**
+ * A lower bound of the size of the encoding of cached coefficients (see quantize_coefficients()) with the given
+ * tables, without writing it: the exact headers, Huffman and magnitude bits, computed from the symbol counts.
+ * Only the byte stuffing (about one in 256 bytes) and the padding before restart markers are missing.
+ */
+std::size_t estimate_size(const FrameInfo &frame, const std::vector<float> &dct, const QuantTables &tables,
+                          const std::string_view comment, int rowsPerInterval, bool optimizeHuffman) {
+    const int *components = frame.mcuComponents();
+    const auto blocksPerMcu = frame.blocksPerMcu();
+    const auto restartInterval = std::size_t(rowsPerInterval) * frame.mcusPerRow();
+    SymbolCounts dcCounts[2]{}, acCounts[2]{};
+    int16_t lastDC[3] = {0, 0, 0};
+    int16_t quantized[8 * 8];
+    for (std::size_t block = 0; block * 64 < dct.size(); block++) {
+        auto mcu = block / blocksPerMcu;
+        auto component = components[block % blocksPerMcu];
+        // same as for_each_block(): the DC predictors start over in each restart interval
+        if (restartInterval && mcu && block % blocksPerMcu == 0 && mcu % restartInterval == 0)
+            lastDC[0] = lastDC[1] = lastDC[2] = 0;
+        auto posNonZero = quantize_block(dct.data() + block * 64, component ? tables.scaledChrominance.data()
+                                                                             : tables.scaledLuminance.data(),
+                                         quantized);
+        auto id = component ? 1 : 0;
+        count_block(dcCounts[id], acCounts[id], quantized, posNonZero, lastDC[component]);
+        lastDC[component] = quantized[0];
+    }
+
+    HuffmanTables optimized;
+    const BitCode *huffmanDC[2], *huffmanAC[2];
+    std::tie(huffmanDC[0], huffmanAC[0]) = huffman_luminance();
+    std::tie(huffmanDC[1], huffmanAC[1]) = huffman_chrominance();
+    std::uint64_t bits = 0;
+    for (auto id = 0; id < (frame.isRGB ? 2 : 1); id++) {
+        if (optimizeHuffman) {
+            optimized.dc[id] = build_huffman_table(dcCounts[id]);
+            optimized.ac[id] = build_huffman_table(acCounts[id]);
+            huffmanDC[id] = optimized.dc[id].codes.data();
+            huffmanAC[id] = optimized.ac[id].codes.data();
+        }
+        // each symbol is followed by its magnitude bits: the DC category, the lower 4 bits of the AC run/size
+        for (auto symbol = 0; symbol < 256; symbol++) {
+            bits += std::uint64_t(dcCounts[id][symbol]) * (huffmanDC[id][symbol].numBits + symbol);
+            bits += std::uint64_t(acCounts[id][symbol]) * (huffmanAC[id][symbol].numBits + (symbol & 0x0F));
+        }
+    }
+
+    CountingSink headers;
+    BitWriter<CountingSink> writer(headers);
+    write_headers(writer, frame.width, frame.height, frame.downsample, frame.isRGB, tables.luminance,
+                  tables.chrominance, comment, uint16_t(restartInterval), optimizeHuffman ? &optimized : nullptr);
+    writer.drain();
+    const auto intervals = rowsPerInterval ? (frame.mcuRows() + rowsPerInterval - 1) / rowsPerInterval : 1;
+    // RSTn markers between the intervals and the end of image marker
+    return headers.size + std::size_t(bits / 8) + 2 * (intervals - 1) + 2;
+}
+
+template<typename Sink>
+std::optional<TargetSizeResult>
+writeJpegTargetSizeIntern(BitWriter<Sink> &bitWriter, const uint8_t *pixels, uint32_t width, uint32_t height,
+                          bool downsample, bool isRGB, const TargetSize &target, const std::string_view comment,
+                          const EncodeOptions &options) {
+    if (target.minQuality <= 1 || target.maxQuality > 100 || target.minQuality > target.maxQuality)
+        throw std::runtime_error(utils::from_parts("writeJpegTargetSize: Invalid quality range", int(target.minQuality),
+                                                   "..", int(target.maxQuality)));
+
+    Metrics::ScopedTimer timer(Metrics::Timer::Encode);
+    const FrameInfo frame{width, height, downsample, isRGB, nullptr, nullptr, nullptr};
+    Metrics::add(Metrics::Counter::Images);
+    Metrics::add(Metrics::Counter::Pixels, std::uint64_t(width) * height);
+    Metrics::add(Metrics::Counter::Blocks, frame.blocks());
+
+    // colour conversion and DCT run once, the unquantized coefficients are kept
+    std::vector<float> dct;
+    dct.reserve(frame.blocks() * 64);
+    const auto mcuSize = frame.mcuSize();
+    for (auto mcuY = 0; mcuY < int(height); mcuY += mcuSize)
+        sampled_mcu_row(frame, pixels + std::size_t(mcuY) * frame.stride(), std::min(mcuSize, int(height) - mcuY),
+                        [&dct](int, float *block64) {
+                            forward_dct(block64);
+                            dct.insert(dct.end(), block64, block64 + 64);
+                        });
+    const auto rowsPerInterval = restart_rows(frame, options);
+
+    // binary search for the highest quality whose lower bound fits, the size grows with the quality
+    TargetSizeResult result;
+    unsigned low = target.minQuality, high = target.maxQuality, best = 0;
+    while (low <= high) {
+        auto quality = (low + high) / 2;
+        result.probes++;
+        if (estimate_size(frame, dct, quant_tables((unsigned char) quality), comment, rowsPerInterval,
+                          options.optimizeHuffman) <= target.maxBytes) {
+            best = quality;
+            low = quality + 1;
+        } else {
+            high = quality - 1;
+        }
+    }
+
+    // the real encoding is at most a few bytes larger, if it doesn't fit the next lower quality does (usually).
+    // Nothing fits: the smallest encoding.
+    std::vector<uint8_t> encoded;
+    std::vector<int16_t> coefficients;
+    coefficients.reserve(frame.blocks() * 8);
+    for (auto quality = std::max(best, unsigned(target.minQuality));; quality--) {
+        auto &tables = quant_tables((unsigned char) quality);
+        quantize_coefficients(frame, dct, tables, coefficients);
+        encoded.clear();
+        VectorSink sink(encoded);
+        BitWriter<VectorSink> writer(sink);
+        write_coefficients(writer, frame, coefficients, tables.luminance, tables.chrominance, comment,
+                           rowsPerInterval, options);
+        writer.flush();
+        writer << 0xFF_bn << 0xD9_bn;
+        writer.drain();
+        result.quality = (unsigned char) quality;
+        result.bytes = encoded.size();
+        result.fits = best && encoded.size() <= target.maxBytes;
+        if (result.fits || !best || quality == target.minQuality) break;
+        result.probes++;
+    }
+    bitWriter << ByteView(encoded.data(), encoded.size());
+    bitWriter.drain();
+    return result;
+}
+
+/// The tables of a quality, which must be within [2..100] like for writeJpegQuality()
+const QuantTables &checked_quality_tables(unsigned char quality) {
+    if (!(quality > 1 && quality <= 100)) { throw std::runtime_error("Quality must be in [1..100]"); }
+    return quant_tables(quality);
+}
+
+template<typename Sink>
+ScanlineEncoder<Sink>::ScanlineEncoder(Sink &output, uint32_t width, uint32_t height, bool downsample,
+                                       bool isRGB, unsigned char quality_, const std::string_view comment,
+                                       const EncodeOptions &options)
+        : ScanlineEncoder(output, width, height, downsample, isRGB, checked_quality_tables(quality_), comment,
+                          options) {}
+
+template<typename Sink>
+ScanlineEncoder<Sink>::ScanlineEncoder(Sink &output, uint32_t width, uint32_t height, bool downsample,
+                                       bool isRGB, const QuantTables &tables, const std::string_view comment,
+                                       const EncodeOptions &options)
+        : bitWriter_(output), width_(width), height_(height), downsample_(isRGB && downsample), isRGB_(isRGB),
+          scaledLuminance_(tables.scaledLuminance), scaledChrominance_(tables.scaledChrominance) {
+    if (width == 0 || height == 0 || width > MaxDimension || height > MaxDimension)
+        throw std::runtime_error(utils::from_parts("ScanlineEncoder: invalid image size ", width, "x", height));
+
+    const FrameInfo frame{width_, height_, downsample_, isRGB_, nullptr, nullptr, nullptr};
+    restartRows_ = restart_rows(frame, options);
+    write_headers(bitWriter_, width_, height_, downsample_, isRGB_, tables.luminance, tables.chrominance, comment,
+                  uint16_t(restartRows_ * frame.mcusPerRow()));
+    bitWriter_.drain();
+
+    rowBuffer_.resize(mcuRows() * stride());
+}
+
+template<typename Sink>
+void ScanlineEncoder<Sink>::push(const uint8_t *rows, unsigned count) {
+    if (count > unsigned(height_) - rowsWritten_)
+        throw std::runtime_error(utils::from_parts("ScanlineEncoder::", __func__, ": ", count,
+                                                   " rows exceed the image height of ", height_));
+    while (count) {
+        // the last MCU row may be incomplete
+        auto needed = std::min(mcuRows(), unsigned(height_) - mcuRow_ * mcuRows());
+        // fast path: a whole MCU row is available, no need to copy it
+        if (!buffered_ && count >= needed) {
+            rowsWritten_ += needed;
+            encode_row(rows, needed);
+            rows += needed * stride();
+            count -= needed;
+            continue;
+        }
+        auto copied = std::min(count, needed - buffered_);
+        std::copy(rows, rows + copied * stride(), rowBuffer_.data() + buffered_ * stride());
+        buffered_ += copied;
+        rowsWritten_ += copied;
+        rows += copied * stride();
+        count -= copied;
+        if (buffered_ == needed) encode_buffered();
+    }
+}
+
+template<typename Sink>
+void ScanlineEncoder<Sink>::encode_row(const uint8_t *pixels, unsigned rows) {
+    const FrameInfo frame{width_, height_, downsample_, isRGB_, scaledLuminance_.data(), scaledChrominance_.data(),
+                          dct_quantize_kernel()};
+
+    // same as encode_interval(): the previous interval ends with a RSTn marker, the DC predictors start over
+    if (restartRows_ && mcuRow_ > 0 && mcuRow_ % restartRows_ == 0) {
+        bitWriter_.flush();
+        bitWriter_ << 0xFF_bn << uint8_t(0xD0 + (mcuRow_ / restartRows_ - 1) % 8);
+        lastDC_[0] = lastDC_[1] = lastDC_[2] = 0;
+    }
+
+    DcPredictors dc{lastDC_[0], lastDC_[1], lastDC_[2]};
+    encode_mcu_row(bitWriter_, frame, pixels, int(rows), dc);
+    lastDC_[0] = dc.y;
+    lastDC_[1] = dc.cb;
+    lastDC_[2] = dc.cr;
+    mcuRow_++;
+
+    if (finished()) {
+        bitWriter_.flush();
+        bitWriter_ << 0xFF_bn << 0xD9_bn;
+    }
+    bitWriter_.drain();
+}
+
+// CPP: Explicit template instantiation for all sinks shipped with output_sinks.h
+template class ScanlineEncoder<FunctionSink>;
+template class ScanlineEncoder<VectorSink>;
+template class ScanlineEncoder<MemorySink>;
+template class ScanlineEncoder<FdSink>;
+template std::optional<TargetSizeResult>
+writeJpegTargetSizeIntern(BitWriter<FunctionSink> &, const uint8_t *, uint32_t, uint32_t, bool, bool,
+                          const TargetSize &, std::string_view, const EncodeOptions &);
+template std::optional<TargetSizeResult>
+writeJpegTargetSizeIntern(BitWriter<VectorSink> &, const uint8_t *, uint32_t, uint32_t, bool, bool,
+                          const TargetSize &, std::string_view, const EncodeOptions &);
+template std::optional<TargetSizeResult>
+writeJpegTargetSizeIntern(BitWriter<MemorySink> &, const uint8_t *, uint32_t, uint32_t, bool, bool,
+                          const TargetSize &, std::string_view, const EncodeOptions &);
+template std::optional<TargetSizeResult>
+writeJpegTargetSizeIntern(BitWriter<FdSink> &, const uint8_t *, uint32_t, uint32_t, bool, bool,
+                          const TargetSize &, std::string_view, const EncodeOptions &);
+template bool writeJpegIntern(BitWriter<FunctionSink> &, const uint8_t *, uint32_t, uint32_t, bool, bool,
+                              const std::array<uint8_t, 8 * 8> &, const std::array<uint8_t, 8 * 8> &,
+                              const float *, const float *, std::string_view,
+                              const EncodeOptions &);
+template bool writeJpegIntern(BitWriter<VectorSink> &, const uint8_t *, uint32_t, uint32_t, bool, bool,
+                              const std::array<uint8_t, 8 * 8> &, const std::array<uint8_t, 8 * 8> &,
+                              const float *, const float *, std::string_view,
+                              const EncodeOptions &);
+template bool writeJpegIntern(BitWriter<MemorySink> &, const uint8_t *, uint32_t, uint32_t, bool, bool,
+                              const std::array<uint8_t, 8 * 8> &, const std::array<uint8_t, 8 * 8> &,
+                              const float *, const float *, std::string_view,
+                              const EncodeOptions &);
+template bool writeJpegIntern(BitWriter<FdSink> &, const uint8_t *, uint32_t, uint32_t, bool, bool,
+                              const std::array<uint8_t, 8 * 8> &, const std::array<uint8_t, 8 * 8> &,
+                              const float *, const float *, std::string_view,
+                              const EncodeOptions &);
+
 } // namespace TooJpeg
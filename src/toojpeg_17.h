@@ -8,18 +8,23 @@
 #include <type_traits>
 #include <cstddef>
 #include <memory>
+#include <optional>
+#include <array>
+#include <algorithm>
+#include <string_view>
+#include <stdexcept>
+#include <vector>
 
 /// A template parameterizable variant of TooJpeg via C++14/17 features. Used features are documented throughout the
 /// this source code file with comment blocks or lines starting with CPP:.
 #include "jpeg_constants.h"
 #include "byte_view.h"
+#include "output_sinks.h"
 
 namespace TooJpeg17 {
 /// CPP14: user-defined literal for the std::byte type. Usage: 0xff_bn
 constexpr uint8_t operator "" _bn(unsigned long long v) { return v; }
 
-using WRITE_BACK = std::function<void(ByteView)>;
-
 // represent a single Huffman code
 struct BitCode {
     /// undefined state, must be initialized at a later time
@@ -37,84 +42,173 @@ struct BitCode {
 
 /**
  * wrapper for bit output operations
+ *
+ * Encoded bytes are collected in a fixed-size staging buffer and handed over to the sink in whole chunks,
+ * so that the Huffman hot loop never calls into the sink (or a type-erased callback) per byte.
+ * Call drain() after the last write to hand over the remaining bytes.
+ * @tparam Sink Any type with a write(const uint8_t*, std::size_t) member, see output_sinks.h
  * @tparam clear_upper_bits buffer.bits may contain garbage in the high bits
  *          if you really want to "clean up" (e.g. for debugging purposes) then set this to true
  */
-template<bool clear_upper_bits = false>
+template<typename Sink = FunctionSink, bool clear_upper_bits = false>
 struct BitWriter {
-    WRITE_BACK output;
+    static_assert(is_sink_v<Sink>, "Sink must provide write(const uint8_t *, std::size_t)");
+    static constexpr std::size_t StagingSize = 4096;
+
+    Sink &output;
+
+    // initialize writer. The sink must outlive the writer.
+    explicit BitWriter(Sink &output_) noexcept: output(output_) {}
+
+    BitWriter(BitWriter const &) = delete;
 
-    // initialize writer
-    explicit BitWriter(WRITE_BACK &&output_) : output(std::move(output_)) {}
+    BitWriter &operator=(BitWriter const &) = delete;
 
     // store the most recently encoded bits that are not written yet
     struct BitBuffer {
-        uint32_t data = 0; // actually only at most 24 bits are used
-        uint8_t numBits = 0; // number of valid bits (the right-most bits)
+        uint64_t data = 0; // actually only the right-most numBits bits are used
+        uint8_t numBits = 0; // number of valid bits, less than 32 between two writes
     } buffer;
 
+    // bytes ready to be handed over to the sink
+    std::array<uint8_t, StagingSize> staging;
+    std::size_t staged = 0;
+
     // write Huffman bits stored in BitCode, keep excess bits in BitBuffer
     BitWriter &operator<<(const BitCode &data) {
-        // append the new bits to those bits leftover from previous call(s)
-        buffer.numBits += data.numBits;
-        buffer.data <<= data.numBits;
-        buffer.data |= data.code;
+        write(data.code, data.numBits);
+        return *this;
+    }
 
-        // write all "full" bytes
-        while (buffer.numBits >= 8) {
-            // extract highest 8 bits
-            buffer.numBits -= 8;
-            auto oneByte = uint8_t(buffer.data >> buffer.numBits);
-            *this << oneByte;
-            // 0xFF has a special meaning for JPEGs (it's a block marker)
-            if (oneByte == 0xFF)
-                // therefore pad a zero to indicate "nope, this one ain't a marker, it's just a coincidence"
-                *this << 0_bn;
-
-            if constexpr (clear_upper_bits) {
-                buffer.data &= (1u << buffer.numBits) - 1;
-            }
-        }
+    /**
+     * Write a Huffman code followed by the bits of a value (eg a run/size symbol and the coefficient) with a single
+     * buffer update. Both are at most 16 bits.
+     */
+    BitWriter &writeCodes(const BitCode &symbol, const BitCode &value) {
+        write((uint32_t(symbol.code) << value.numBits) | value.code, uint8_t(symbol.numBits + value.numBits));
         return *this;
     }
 
     // write all non-yet-written bits, fill gaps with 1s (that's a strange JPEG thing)
     void flush() {
         // at most seven set bits needed to "fill" the last byte: 0x7F = binary 0111 1111
-        // I should set buffer.numBits = 0 but since there are no single bits written after flush() I can safely ignore it
         *this << BitCode(0x7F, 7);
+        writeFullBytes();
+        // the remaining bits are padding, too. Bits written after a restart marker start with an empty buffer.
+        buffer.numBits = 0;
     }
 
-    // NOTE: all the following BitWriter functions IGNORE the BitBuffer and write straight to output !
+    // hand over all staged bytes to the sink
+    void drain() {
+        if (staged) output.write(staging.data(), staged);
+        staged = 0;
+    }
+
+    // NOTE: all the following BitWriter functions IGNORE the bits of an incomplete byte in the BitBuffer and write
+    // straight to the staging buffer (after the complete bytes of the BitBuffer) !
     // write a single byte
     inline BitWriter &operator<<(std::uint8_t oneByte) {
-        output(oneByte);
+        writeFullBytes();
+        put(oneByte);
         return *this;
     }
 
     inline BitWriter &operator<<(const std::array<uint8_t, 64> &data) {
-        output(ByteView{data.data(), data.size()});
+        writeFullBytes();
+        put(data.data(), data.size());
         return *this;
     }
 
     inline BitWriter &operator<<(std::string_view data) {
-        output(ByteView{data.data(), data.size()});
+        writeFullBytes();
+        put(reinterpret_cast<const uint8_t *>(data.data()), data.size());
         return *this;
     }
 
     inline BitWriter &operator<<(ByteView data) {
-        output(data);
+        writeFullBytes();
+        put(data.ptr_, data.size());
         return *this;
     }
 
     // start a new JFIF block
     void addMarker(std::uint8_t id, uint16_t length) {
+        writeFullBytes();
         // ID, always preceded by 0xFF
         // length of the block (big-endian, includes the 2 length bytes as well)
-        output(0xFF);
-        output(id);
-        output(uint8_t(length >> 8u));
-        output(uint8_t(length & 0xFFu));
+        put(0xFF);
+        put(id);
+        put(uint8_t(length >> 8u));
+        put(uint8_t(length & 0xFFu));
+    }
+
+private:
+    /// Word-wide test for 0xFF bytes: a byte of ~word is zero, see "Determine if a word has a zero byte" in
+    /// https://graphics.stanford.edu/~seander/bithacks.html
+    static constexpr bool hasFFByte(uint32_t word) noexcept {
+        const auto inverted = ~word;
+        return ((inverted - 0x01010101u) & ~inverted & 0x80808080u) != 0;
+    }
+
+    /// Append at most 32 bits. Whenever 32 bits are complete they are written as one word.
+    inline void write(uint32_t code, uint8_t numBits) {
+        // append the new bits to those bits leftover from previous call(s), at most 31 + 32 bits
+        buffer.numBits += numBits;
+        buffer.data = (buffer.data << numBits) | code;
+        if (buffer.numBits < 32) return;
+
+        buffer.numBits -= 32;
+        auto word = uint32_t(buffer.data >> buffer.numBits);
+        if constexpr (clear_upper_bits) {
+            buffer.data &= (uint64_t(1) << buffer.numBits) - 1;
+        }
+        // room for the worst case: four 0xFF bytes, each followed by a stuffed zero. The buffer is never left full.
+        if (staged + 8 >= StagingSize) drain();
+        // 0xFF has a special meaning for JPEGs (it's a block marker), these are rare: all four bytes at once otherwise
+        if (!hasFFByte(word)) {
+            staging[staged] = uint8_t(word >> 24u);
+            staging[staged + 1] = uint8_t(word >> 16u);
+            staging[staged + 2] = uint8_t(word >> 8u);
+            staging[staged + 3] = uint8_t(word);
+            staged += 4;
+            return;
+        }
+        for (auto shift = 24; shift >= 0; shift -= 8) {
+            auto oneByte = uint8_t(word >> unsigned(shift));
+            staging[staged++] = oneByte;
+            // therefore pad a zero to indicate "nope, this one ain't a marker, it's just a coincidence"
+            if (oneByte == 0xFF) staging[staged++] = 0;
+        }
+    }
+
+    /// Write the complete bytes of the BitBuffer, at most 7 bits remain
+    inline void writeFullBytes() {
+        while (buffer.numBits >= 8) {
+            // extract highest 8 bits
+            buffer.numBits -= 8;
+            auto oneByte = uint8_t(buffer.data >> buffer.numBits);
+            put(oneByte);
+            if (oneByte == 0xFF) put(0_bn);
+        }
+        if constexpr (clear_upper_bits) {
+            buffer.data &= (uint64_t(1) << buffer.numBits) - 1;
+        }
+    }
+
+    inline void put(std::uint8_t oneByte) {
+        staging[staged++] = oneByte;
+        if (staged == StagingSize) drain();
+    }
+
+    inline void put(const std::uint8_t *data, std::size_t size) {
+        if (size >= StagingSize - staged) drain();
+        // large blocks bypass the staging buffer
+        if (size >= StagingSize) {
+            output.write(data, size);
+            return;
+        }
+        std::copy(data, data + size, staging.data() + staged);
+        staged += size;
     }
 };
 
@@ -181,55 +275,410 @@ constexpr auto scaled_chrominance(std::array<uint8_t, 8 * 8> quantChrominance)
     return scaledChrominance;
 }
 
-bool writeJpegIntern(BitWriter<> bitWriter, const uint8_t *pixels, unsigned short width, unsigned short height,
+/// The quantisation tables of an image: as stored in the file (DQT) and AAN scaled for the DCT kernels
+struct QuantTables {
+    /// zigzag order, see quant_table()
+    std::array<uint8_t, 8 * 8> luminance, chrominance;
+    /// natural order, see scaled_luminance()
+    std::array<float, 8 * 8> scaledLuminance, scaledChrominance;
+};
+
+/// The standard tables scaled to the given quality in [1..100] with the libjpeg formula, as writeJpeg() uses them
+constexpr QuantTables quality_tables(unsigned char quality_) {
+    // convert to an internal JPEG quality factor, formula taken from libjpeg
+    auto quality = quality_ < 50 ? 5000 / quality_ : 200 - quality_ * 2;
+    auto luminance = quant_table(DefaultQuantLuminance_A, quality);
+    auto chrominance = quant_table(DefaultQuantChrominance_A, quality);
+    return {luminance, chrominance, scaled_luminance(luminance), scaled_chrominance(chrominance)};
+}
+
+/**
+ * Tables of custom quantisation matrices, eg perceptually tuned ones
+ * @param luminance, chrominance Quantisation steps in natural order (row by row), zeros are raised to 1
+ */
+constexpr QuantTables make_quant_tables(const std::array<uint8_t, 8 * 8> &luminance,
+                                        const std::array<uint8_t, 8 * 8> &chrominance) {
+    // a quality factor of 100 keeps the steps, quant_table() reorders and clamps them
+    auto zigzagLuminance = quant_table(luminance, 100);
+    auto zigzagChrominance = quant_table(chrominance, 100);
+    return {zigzagLuminance, zigzagChrominance, scaled_luminance(zigzagLuminance),
+            scaled_chrominance(zigzagChrominance)};
+}
+
+/**
+ * The precomputed tables of a quality in [1..100], from a bank that is generated at compile time.
+ * Runtime qualities cost a lookup instead of the table computation, the tables are the very same as writeJpeg<quality>()
+ * computes.
+ * Exceptions: Throws if the quality is not within [1..100].
+ */
+[[nodiscard]] const QuantTables &quant_tables(unsigned char quality);
+
+/**
+ * Add custom tables to the cache, so that all encoder threads and requests can use them by name (see
+ * make_quant_tables()). Registering the same tables twice is fine. Thread-safe.
+ * @return The cached tables, valid until the end of the program
+ * Exceptions: Throws if different tables have been registered under the name.
+ */
+const QuantTables &register_quant_tables(std::string_view name, const QuantTables &tables);
+
+/// The tables registered under the name, nullptr if there are none. Thread-safe.
+[[nodiscard]] const QuantTables *find_quant_tables(std::string_view name);
+
+/**
+ * Call f with a runtime quality as compile time constant: f(std::integral_constant<unsigned char, quality>{}), eg to
+ * call a writeJpeg<quality>() instantiation or another template of the quality. f is instantiated for all qualities
+ * in [2..100], the call is a lookup in a table of function pointers.
+ * Exceptions: Throws if the quality is not within [2..100], like writeJpegQuality().
+ */
+template<typename F>
+decltype(auto) dispatch_quality(unsigned char quality, F &&f);
+
+/// Largest width and height a JPEG file can store
+constexpr uint32_t MaxDimension = 0xFFFF;
+
+/**
+ * One scan of a progressive jpeg (JPEG standard G.1): a band of zigzag positions of some components, and the bits
+ * of the band from bitLow upwards (successive approximation). A decoder can show the image after each scan.
+ */
+struct ProgressiveScan {
+    /// Components of the scan: bit 0 is Y, bit 1 Cb and bit 2 Cr. Only DC scans may have more than one component.
+    uint8_t components = 1;
+    /// The band: 0..0 for a DC scan, within 1..63 for an AC scan
+    uint8_t spectralStart = 0, spectralEnd = 0;
+    /// bitLow of the previous scan of the band, 0 for its first scan. A refinement scan sends one more bit.
+    uint8_t bitHigh = 0;
+    /// The lowest bit sent, every band must end with a scan down to bit 0. At most 13.
+    uint8_t bitLow = 0;
+};
+
+/**
+ * The scans of libjpeg's jpeg_simple_progression(): DC first, then a few luma bands, chroma at lower precision,
+ * and the lowest bits last. 10 scans for colour images (6 for grayscale).
+ */
+std::vector<ProgressiveScan> default_scan_script(bool isRGB);
+
+/// Optional encoder features. The defaults produce a plain baseline jpeg without restart markers.
+struct EncodeOptions {
+    /// MCU rows per restart interval (DRI segment, RSTn markers), 0 disables restart markers.
+    /// Clamped so that an interval does not exceed 65535 MCUs.
+    unsigned restartRows = 0;
+    /// Worker threads that entropy code restart intervals in parallel, 0 for std::thread::hardware_concurrency().
+    /// Only used if restartRows is set. The output does not depend on the number of threads.
+    unsigned threads = 1;
+    /// Two pass encoding with per image Huffman tables instead of the standard tables: usually 5-10% smaller files.
+    /// Keeps the quantized coefficients of the whole image in memory. Restart intervals are encoded serially,
+    /// ScanlineEncoder ignores this option.
+    bool optimizeHuffman = false;
+    /// Progressive jpeg (SOF2) with the scans of scanScript, each one with its own optimized Huffman tables: a
+    /// browser shows a coarse image after the first few percent of the file, and the files are usually a bit smaller.
+    /// Two pass like optimizeHuffman (which it implies), no restart markers. ScanlineEncoder ignores this option.
+    bool progressive = false;
+    /// The scans of a progressive jpeg, default_scan_script() if empty. Each coefficient of each component must be
+    /// sent exactly once down to bit 0, DC before AC. The encoder throws for an invalid script.
+    std::vector<ProgressiveScan> scanScript;
+};
+
+/**
+ * Encode pixels as a baseline jpeg into the given bit writer. See writeJpeg() for the parameters.
+ * Instantiated for all sinks found in output_sinks.h; wrap other sinks in a FunctionSink.
+ */
+template<typename Sink>
+bool writeJpegIntern(BitWriter<Sink> &bitWriter, const uint8_t *pixels, uint32_t width, uint32_t height,
                      bool downsample, bool isRGB, const std::array<uint8_t, 8 * 8> &quantLuminance,
                      const std::array<uint8_t, 8 * 8> &quantChrominance,
                      const float *scaled_luminance, const float *scaled_chrominance,
-                     std::string_view comment = "");
+                     std::string_view comment = "", const EncodeOptions &options = {});
 
 /**
  * Takes input pixels and writes a jpeg output
  * @tparam quality_ between 1 (worst) and 100 (best)
+ * @param output Sink that receives the encoded bytes in chunks (see output_sinks.h)
+ * @param pixels_ stored in RGB format or grayscale, stored from upper-left to lower-right. Must be as long as width*height.
+ * @param width Width pixels, at most MaxDimension
+ * @param height Height pixels, at most MaxDimension
  * @param downsample if true then YCbCr 4:2:0 format is used (smaller size, minor quality loss) instead of 4:4:4, not relevant for grayscale
  * @param isRGB true if RGB format (3 bytes per pixel); false if grayscale (1 byte per pixel)
- * @param output callback that stores a single byte (writes to disk, memory, ...)
- * @param pixels_ stored in RGB format or grayscale, stored from upper-left to lower-right. Must be as long as width*height.
- * @param width Width pixels
- * @param height Height pixels
  * @param comment optional JPEG comment (0/NULL if no comment), must not contain ASCII code 0xFF
+ * @param options optional features like parallel encoding of restart intervals
  * @return Returns the output stream back on success and false otherwise
  */
-template<unsigned char quality_>
-bool writeJpeg(WRITE_BACK output, const uint8_t *pixels, unsigned short width, unsigned short height,
+template<unsigned char quality_, typename Sink, typename = std::enable_if_t<is_sink_v<Sink>>>
+bool writeJpeg(Sink &&output, const uint8_t *pixels, uint32_t width, uint32_t height,
                bool downsample, bool isRGB,
-               const std::string_view comment = "") {
+               const std::string_view comment = "", const EncodeOptions &options = {}) {
 
     // grayscale images can't be downsampled (because there are no Cb + Cr channels)
     if (!isRGB) downsample = false;
 
     static_assert(quality_ > 1 && quality_ <= 100, "Quality must be in [1..100]");
 
-    // convert to an internal JPEG quality factor, formula taken from libjpeg
-    constexpr auto quality = quality_ < 50 ? 5000 / quality_ : 200 - quality_ * 2;
-
     // reject invalid pointers
     if (pixels == nullptr)
         return false;
-    // check image format
-    if (width == 0 || height == 0)
+    // check image format, JPEG stores the dimensions in 16 bits
+    if (width == 0 || height == 0 || width > MaxDimension || height > MaxDimension)
         return false;
 
     // CPP(14): Compile time compute quantisation tables for the given quality level
-    constexpr std::array<uint8_t, 8 * 8> quantLuminance = quant_table(DefaultQuantLuminance_A, quality);
-    constexpr std::array<uint8_t, 8 * 8> quantChrominance = quant_table(DefaultQuantChrominance_A, quality);
-    constexpr auto scaledLuminance = scaled_luminance(quantLuminance);
-    constexpr auto scaledChrominance = scaled_chrominance(quantChrominance);
+    static constexpr QuantTables tables = quality_tables(quality_);
+
+    BitWriter<std::decay_t<Sink>> bitWriter(output);
+    return writeJpegIntern(bitWriter, pixels, width, height, downsample, isRGB, tables.luminance, tables.chrominance,
+                           tables.scaledLuminance.data(), tables.scaledChrominance.data(), comment, options);
+}
 
-    return writeJpegIntern(BitWriter(std::move(output)), pixels, width, height, downsample, isRGB, quantLuminance, quantChrominance,
-                           scaledLuminance.data(), scaledChrominance.data(), comment);
+/**
+ * Takes input pixels and writes a jpeg output
+ * @param output callback that stores a chunk of bytes (writes to disk, memory, ...)
+ * See the sink overload for all other parameters.
+ */
+template<unsigned char quality_>
+bool writeJpeg(WRITE_BACK output, const uint8_t *pixels, uint32_t width, uint32_t height,
+               bool downsample, bool isRGB,
+               const std::string_view comment = "", const EncodeOptions &options = {}) {
+    return writeJpeg<quality_>(FunctionSink(std::move(output)), pixels, width, height, downsample, isRGB, comment,
+                               options);
+}
+
+/**
+ * writeJpeg() with the given quantisation tables, eg from make_quant_tables() or find_quant_tables().
+ * See writeJpeg() for the other parameters.
+ */
+template<typename Sink, typename = std::enable_if_t<is_sink_v<Sink>>>
+bool writeJpegTables(Sink &&output, const uint8_t *pixels, uint32_t width, uint32_t height,
+                     bool downsample, bool isRGB, const QuantTables &tables,
+                     const std::string_view comment = "", const EncodeOptions &options = {}) {
+
+    // grayscale images can't be downsampled (because there are no Cb + Cr channels)
+    if (!isRGB) downsample = false;
+
+    // reject invalid pointers
+    if (pixels == nullptr)
+        return false;
+    // check image format, JPEG stores the dimensions in 16 bits
+    if (width == 0 || height == 0 || width > MaxDimension || height > MaxDimension)
+        return false;
+
+    BitWriter<std::decay_t<Sink>> bitWriter(output);
+    return writeJpegIntern(bitWriter, pixels, width, height, downsample, isRGB, tables.luminance, tables.chrominance,
+                           tables.scaledLuminance.data(), tables.scaledChrominance.data(), comment, options);
+}
+
+/**
+ * Runtime quality variant of writeJpeg(). Throws if the quality is not within [1..100].
+ * The tables come from the precomputed bank (see quant_tables()), there is no per call setup.
+ */
+template<typename Sink, typename = std::enable_if_t<is_sink_v<Sink>>>
+bool writeJpegQuality(Sink &&output, const uint8_t *pixels, uint32_t width, uint32_t height,
+                      bool downsample, bool isRGB, unsigned char quality_,
+                      const std::string_view comment = "", const EncodeOptions &options = {}) {
+    if (!(quality_ > 1 && quality_ <= 100)) { throw std::runtime_error("Quality must be in [1..100]"); }
+    return writeJpegTables(std::forward<Sink>(output), pixels, width, height, downsample, isRGB,
+                           quant_tables(quality_), comment, options);
 }
 
-bool writeJpegQuality(WRITE_BACK output, const uint8_t *pixels, unsigned short width, unsigned short height,
+bool writeJpegQuality(WRITE_BACK output, const uint8_t *pixels, uint32_t width, uint32_t height,
                       bool downsample, bool isRGB, unsigned char quality_,
-                      std::string_view comment = "");
+                      std::string_view comment = "", const EncodeOptions &options = {});
+
+/// Byte budget of writeJpegTargetSize()
+struct TargetSize {
+    /// The encoded image must not be larger
+    std::size_t maxBytes = 0;
+    /// The searched qualities, within [2..100]
+    unsigned char minQuality = 2, maxQuality = 100;
+
+    /// A budget in bits per pixel, eg 1.0 for a thumbnail
+    static TargetSize bitsPerPixel(double bits, uint32_t width, uint32_t height) noexcept {
+        return {std::size_t(bits * double(width) * double(height) / 8)};
+    }
+};
+
+/// Result of writeJpegTargetSize()
+struct TargetSizeResult {
+    /// Quality of the written image
+    unsigned char quality = 0;
+    /// Size of the written image in bytes
+    std::size_t bytes = 0;
+    /// Qualities encoded (but only counted, not written) while searching
+    unsigned probes = 0;
+    /// False if the image does not fit even with TargetSize::minQuality. It is written with that quality anyway.
+    bool fits = false;
+};
+
+/**
+ * Encode pixels with the highest quality whose output fits into a byte budget. See writeJpegTargetSize().
+ * Instantiated for all sinks found in output_sinks.h.
+ */
+template<typename Sink>
+std::optional<TargetSizeResult>
+writeJpegTargetSizeIntern(BitWriter<Sink> &bitWriter, const uint8_t *pixels, uint32_t width, uint32_t height,
+                          bool downsample, bool isRGB, const TargetSize &target, std::string_view comment = "",
+                          const EncodeOptions &options = {});
+
+/**
+ * writeJpegQuality() with the highest quality whose output fits into target.maxBytes, eg for byte budgets per
+ * thumbnail: colour conversion and DCT run once, and the unquantized coefficients are kept (256 bytes per 8x8
+ * block). The quality is binary searched; each probe only quantizes and entropy codes the coefficients into a
+ * CountingSink, only the final encoding is written to the output. The output is byte-identical to
+ * writeJpegQuality() with the returned quality. EncodeOptions::threads is ignored.
+ * A progressive output is searched with the size of the baseline encoding: it fits, but it usually could have
+ * had a slightly higher quality.
+ *
+ * Throws if the quality range is not within [2..100].
+ * @return The chosen quality and the size, std::nullopt if the image format is invalid
+ */
+template<typename Sink, typename = std::enable_if_t<is_sink_v<Sink>>>
+std::optional<TargetSizeResult>
+writeJpegTargetSize(Sink &&output, const uint8_t *pixels, uint32_t width, uint32_t height, bool downsample,
+                    bool isRGB, const TargetSize &target, const std::string_view comment = "",
+                    const EncodeOptions &options = {}) {
+    // grayscale images can't be downsampled (because there are no Cb + Cr channels)
+    if (!isRGB) downsample = false;
+    if (pixels == nullptr || width == 0 || height == 0 || width > MaxDimension || height > MaxDimension)
+        return std::nullopt;
+    BitWriter<std::decay_t<Sink>> bitWriter(output);
+    return writeJpegTargetSizeIntern(bitWriter, pixels, width, height, downsample, isRGB, target, comment, options);
+}
+
+/**
+ * Only the colour conversion stage of the encoder, for benchmarks: converts the pixels to level shifted YCbCr 8x8
+ * blocks (4:2:0 if downsampling) exactly like writeJpeg(), but neither transforms nor encodes them.
+ * @return The sum of the first sample of all blocks, so that the conversion can't be optimized away.
+ *         0 if the image format is invalid.
+ */
+double convertColors(const uint8_t *pixels, uint32_t width, uint32_t height, bool downsample, bool isRGB);
+
+/**
+ * Streaming variant of writeJpegQuality(): the image is handed over a few pixel rows at a time,
+ * and the encoded bytes of each MCU row are passed to the sink as soon as the row is complete.
+ * Only one MCU row (8 pixel rows, 16 if downsampling) of pixels is kept, instead of the whole image.
+ *
+ * The headers are written by the constructor, the end of image marker after the last row.
+ * The output is byte-identical to writeJpegQuality() with the same parameters. Restart intervals are supported,
+ * but always encoded serially (EncodeOptions::threads is ignored). Huffman tables can't be optimized in a single
+ * pass, EncodeOptions::optimizeHuffman and EncodeOptions::progressive are ignored as well.
+ *
+ * Push mode: call push() with any number of rows until all rows are written.
+ * Pull mode: call pull() with a row source, eg a streaming decoder.
+ *
+ * Instantiated for all sinks found in output_sinks.h. The sink must outlive the encoder.
+ * Exceptions: Throws if the quality or the image format is invalid, and if more rows than the image height are pushed.
+ */
+template<typename Sink>
+class ScanlineEncoder {
+public:
+    ScanlineEncoder(Sink &output, uint32_t width, uint32_t height, bool downsample, bool isRGB,
+                    unsigned char quality, std::string_view comment = "", const EncodeOptions &options = {});
+
+    /// Encode with the given quantisation tables, see writeJpegTables()
+    ScanlineEncoder(Sink &output, uint32_t width, uint32_t height, bool downsample, bool isRGB,
+                    const QuantTables &tables, std::string_view comment = "", const EncodeOptions &options = {});
+
+    ScanlineEncoder(ScanlineEncoder const &) = delete;
+
+    ScanlineEncoder &operator=(ScanlineEncoder const &) = delete;
+
+    /// Pixel rows per MCU row: 8, or 16 if downsampled
+    [[nodiscard]] unsigned mcuRows() const noexcept { return downsample_ ? 16 : 8; }
+
+    [[nodiscard]] uint32_t width() const noexcept { return width_; }
+
+    [[nodiscard]] uint32_t height() const noexcept { return height_; }
+
+    /// Bytes per pixel row
+    [[nodiscard]] std::size_t stride() const noexcept { return std::size_t(width_) * (isRGB_ ? 3 : 1); }
+
+    /// Pixel rows that have been pushed so far
+    [[nodiscard]] unsigned rowsWritten() const noexcept { return rowsWritten_; }
+
+    /// True once all rows have been written and the end of image marker was emitted
+    [[nodiscard]] bool finished() const noexcept { return rowsWritten_ == height_; }
+
+    /**
+     * Add pixel rows (RGB or grayscale, see writeJpeg()), stored top to bottom without padding.
+     * Whole MCU rows are encoded in-place without copying them, incomplete ones are buffered.
+     */
+    void push(const uint8_t *rows, unsigned count);
+
+    /**
+     * Let the encoder request pixel rows until the image is complete.
+     * @param source Callable `bool(uint8_t *rows, unsigned count)`, storing the next count rows.
+     *        Returns false if no more rows are available.
+     * @return False if the source ended before all rows were written.
+     */
+    template<typename Source>
+    bool pull(Source &&source) {
+        while (!finished()) {
+            auto count = std::min(mcuRows(), unsigned(height_) - rowsWritten_);
+            if (!source(rowBuffer_.data(), count)) return false;
+            buffered_ = count;
+            rowsWritten_ += count;
+            encode_buffered();
+        }
+        return true;
+    }
+
+private:
+    BitWriter<Sink> bitWriter_;
+    const uint32_t width_, height_;
+    const bool downsample_, isRGB_;
+    std::array<float, 8 * 8> scaledLuminance_, scaledChrominance_;
+    /// MCU rows per restart interval, 0 if disabled
+    int restartRows_ = 0;
+    int mcuRow_ = 0;
+    int16_t lastDC_[3] = {0, 0, 0};
+    /// one MCU row of pixels
+    std::vector<uint8_t> rowBuffer_;
+    unsigned buffered_ = 0, rowsWritten_ = 0;
+
+    /// Encode the next MCU row, stored at pixels. Writes the restart markers and the end of image marker.
+    void encode_row(const uint8_t *pixels, unsigned rows);
+
+    void encode_buffered() {
+        encode_row(rowBuffer_.data(), buffered_);
+        buffered_ = 0;
+    }
+};
+/**
+ * Encode an image that is only available in tiles (eg a mosaic or a tiled scan) without materialising the frame.
+ * Buffers one row of tiles, that is tileHeight pixel rows of the full width, and pushes it to the encoder.
+ * @param encoder A ScanlineEncoder without any rows pushed yet, it defines the image size and format
+ * @param fetchTile Callable `bool(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t *pixels,
+ *        std::size_t stride)` that stores the tile at pixel position x, y. Tiles at the right and bottom border are
+ *        clipped (width, height). Pixel rows of the tile are stride bytes apart. Returns false on errors.
+ * @return False if fetchTile failed
+ */
+template<typename Sink, typename FetchTile>
+bool encodeTiles(ScanlineEncoder<Sink> &encoder, uint32_t tileWidth, uint32_t tileHeight, FetchTile &&fetchTile) {
+    if (tileWidth == 0 || tileHeight == 0) throw std::runtime_error("encodeTiles: tiles must not be empty");
+    const auto bytesPerPixel = encoder.stride() / encoder.width();
+    std::vector<uint8_t> band(std::size_t(std::min(tileHeight, encoder.height())) * encoder.stride());
+    for (uint32_t y = 0; y < encoder.height(); y += tileHeight) {
+        auto rows = std::min(tileHeight, encoder.height() - y);
+        for (uint32_t x = 0; x < encoder.width(); x += tileWidth)
+            if (!fetchTile(x, y, std::min(tileWidth, encoder.width() - x), rows, band.data() + x * bytesPerPixel,
+                           encoder.stride()))
+                return false;
+        encoder.push(band.data(), rows);
+    }
+    return true;
+}
+namespace detail {
+template<typename F, std::size_t... Q>
+decltype(auto) dispatch_quality(unsigned char quality, F &f, std::index_sequence<Q...>) {
+    using Result = decltype(f(std::integral_constant<unsigned char, 2>{}));
+    using Call = Result (*)(F &);
+    // qualities 2, 3, ..., 100
+    static constexpr Call calls[] = {
+            [](F &g) -> Result { return g(std::integral_constant<unsigned char, (unsigned char) (Q + 2)>{}); }...};
+    return calls[quality - 2](f);
+}
+} // namespace detail
+
+template<typename F>
+decltype(auto) dispatch_quality(unsigned char quality, F &&f) {
+    if (!(quality > 1 && quality <= 100)) { throw std::runtime_error("Quality must be in [1..100]"); }
+    return detail::dispatch_quality(quality, f, std::make_index_sequence<99>{});
+}
 } // namespace TooJpeg
@@ -0,0 +1,322 @@
+//! Forward DCT + quantization kernels: scalar reference, SSE2 and NEON variants, and the runtime kernel selection.
+//! The AVX2 kernel lives in toojpeg_17_dct_avx2.cpp, because it requires different code generation flags.
+#include "toojpeg_17_dct.h"
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+#endif
+
+namespace TooJpeg17 {
+using namespace detail;
+
+/**
+ * 8-point discrete cosine transform (DCT)
+ *
+ * Based on https://dev.w3.org/Amaya/libjpeg/jfdctflt.c.
+ * Forward DCT computation "in one dimension" (fast AAN algorithm by Arai, Agui and Nakajima: "A fast DCT-SQ scheme for images")
+ * With 5 multiplications and 28 additions.
+ * @tparam horizontal True if computing rows, false for columns
+ * @param block Input/Output block. Changes values in-place.
+ */
+template<bool horizontal>
+void DCT(float block[8 * 8]) noexcept {
+    constexpr uint8_t stride = horizontal ? 1 : 8;
+
+    // modify in-place
+    auto &block0 = block[0];
+    auto &block1 = block[1 * stride];
+    auto &block2 = block[2 * stride];
+    auto &block3 = block[3 * stride];
+    auto &block4 = block[4 * stride];
+    auto &block5 = block[5 * stride];
+    auto &block6 = block[6 * stride];
+    auto &block7 = block[7 * stride];
+
+    auto add07 = block0 + block7;
+    auto sub07 = block0 - block7;
+    auto add16 = block1 + block6;
+    auto sub16 = block1 - block6;
+    auto add25 = block2 + block5;
+    auto sub25 = block2 - block5;
+    auto add34 = block3 + block4;
+    auto sub34 = block3 - block4;
+
+    auto add0347 = add07 + add34;
+    auto sub07_34 = add07 - add34; // "even part" / "phase 2"
+    auto add1256 = add16 + add25;
+    auto sub16_25 = add16 - add25;
+
+    block[0] = add0347 + add1256;
+    block4 = add0347 - add1256; // "phase 3"
+
+    auto z1 = (sub16_25 + sub07_34) * InvSqrt;
+    block2 = sub07_34 + z1;
+    block6 = sub07_34 - z1; // "phase 5"
+
+    auto sub23_45 = sub25 + sub34; // "odd part" / "phase 2"
+    auto sub12_56 = sub16 + sub25;
+    auto sub01_67 = sub16 + sub07;
+
+    auto z5 = (sub23_45 - sub01_67) * HalfSqrtSqrt;
+    auto z2 = sub23_45 * InvSqrtSqrt + z5;
+    auto z3 = sub12_56 * InvSqrt;
+    auto z4 = sub01_67 * SqrtHalfSqrt + z5;
+    auto z6 = sub07 + z3; // "phase 5"
+    auto z7 = sub07 - z3;
+    block1 = z6 + z4;
+    block7 = z6 - z4; // "phase 6"
+    block5 = z7 + z2;
+    block3 = z7 - z2;
+}
+
+/// Both passes of the scalar DCT
+static void dct_scalar(float *block64) noexcept {
+    // DCT: rows
+    for (auto offset = 0; offset < 8; offset++) DCT<true>(block64 + offset * 8);
+    // DCT: columns
+    for (auto offset = 0; offset < 8; offset++) DCT<false>(block64 + offset * 1);
+}
+
+int dct_quantize_scalar(float *block64, const float *scaled, int16_t *quantized) noexcept {
+    dct_scalar(block64);
+
+    // Scale
+    for (auto i = 0; i < 8 * 8; i++) block64[i] *= scaled[i];
+
+    // the first coefficient is the "average color" of the 8x8 block
+    quantized[0] = int16_t(std::nearbyint(block64[0]));
+
+    // quantize and zigzag the other 63 coefficients
+    auto posNonZero = 0; // find last coefficient which is not zero (because trailing zeros are encoded differently)
+    for (auto i = 1; i < 8 * 8; i++) // start at 1 because block64[0]=DC was already processed
+    {
+        auto value = block64[ZigZagInv[i]];
+        quantized[i] = int16_t(std::nearbyint(value));
+        // remember offset of last non-zero coefficient
+        if (quantized[i] != 0)
+            posNonZero = i;
+    }
+    return posNonZero;
+}
+
+#if defined(__SSE2__)
+namespace sse2 {
+/// 4 float lanes
+struct F {
+    static constexpr int Lanes = 4;
+    __m128 v;
+
+    static F load(const float *p) noexcept { return {_mm_loadu_ps(p)}; }
+
+    void store(float *p) const noexcept { _mm_storeu_ps(p, v); }
+
+    friend F operator+(F a, F b) noexcept { return {_mm_add_ps(a.v, b.v)}; }
+
+    friend F operator-(F a, F b) noexcept { return {_mm_sub_ps(a.v, b.v)}; }
+};
+
+/// 4 double lanes
+struct D {
+    __m128d lo, hi;
+
+    friend D operator+(D a, D b) noexcept { return {_mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi)}; }
+
+    friend D operator-(D a, D b) noexcept { return {_mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi)}; }
+
+    friend D operator*(D a, double b) noexcept {
+        return {_mm_mul_pd(a.lo, _mm_set1_pd(b)), _mm_mul_pd(a.hi, _mm_set1_pd(b))};
+    }
+};
+
+inline D widen(F a) noexcept { return {_mm_cvtps_pd(a.v), _mm_cvtps_pd(_mm_movehl_ps(a.v, a.v))}; }
+
+inline F narrow(D a) noexcept { return {_mm_movelh_ps(_mm_cvtpd_ps(a.lo), _mm_cvtpd_ps(a.hi))}; }
+
+inline void transpose(float *block) noexcept {
+    // transpose the four 4x4 quadrants, swapping the upper right and lower left ones
+    __m128 r[16];
+    for (auto i = 0; i < 16; i++) r[i] = _mm_loadu_ps(block + i * 4);
+    for (auto quadrant = 0; quadrant < 4; quadrant++) {
+        auto base = (quadrant / 2) * 8 + (quadrant % 2); // row block * 4 rows * 2 vectors + column block
+        _MM_TRANSPOSE4_PS(r[base], r[base + 2], r[base + 4], r[base + 6]);
+    }
+    for (auto row = 0; row < 8; row++) {
+        auto upper = row < 4;
+        // rows 0..3 of the left half stay, the right half of row r becomes the left half of row r+4
+        _mm_storeu_ps(block + row * 8, r[upper ? row * 2 : (row - 4) * 2 + 1]);
+        _mm_storeu_ps(block + row * 8 + 4, r[upper ? (row + 4) * 2 : row * 2 + 1]);
+    }
+}
+
+void dct(float *block64) noexcept {
+    // DCT rows as columns of the transposed block, then the columns
+    transpose(block64);
+    dct_columns<F, D>(block64);
+    transpose(block64);
+    dct_columns<F, D>(block64);
+}
+
+int quantize(const float *block64, const float *scaled, int16_t *quantized) noexcept {
+    // Scale and round to nearest (even), just like std::nearbyint with the default rounding mode
+    alignas(16) int16_t natural[8 * 8];
+    for (auto i = 0; i < 8 * 8; i += 8) {
+        auto a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(block64 + i), _mm_loadu_ps(scaled + i)));
+        auto b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(block64 + i + 4), _mm_loadu_ps(scaled + i + 4)));
+        _mm_store_si128(reinterpret_cast<__m128i *>(natural + i), _mm_packs_epi32(a, b));
+    }
+    return zigzag(natural, quantized);
+}
+
+int dct_quantize(float *block64, const float *scaled, int16_t *quantized) noexcept {
+    dct(block64);
+    return quantize(block64, scaled, quantized);
+}
+} // namespace sse2
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+namespace neon {
+/// 4 float lanes
+struct F {
+    static constexpr int Lanes = 4;
+    float32x4_t v;
+
+    static F load(const float *p) noexcept { return {vld1q_f32(p)}; }
+
+    void store(float *p) const noexcept { vst1q_f32(p, v); }
+
+    friend F operator+(F a, F b) noexcept { return {vaddq_f32(a.v, b.v)}; }
+
+    friend F operator-(F a, F b) noexcept { return {vsubq_f32(a.v, b.v)}; }
+};
+
+/// 4 double lanes
+struct D {
+    float64x2_t lo, hi;
+
+    friend D operator+(D a, D b) noexcept { return {vaddq_f64(a.lo, b.lo), vaddq_f64(a.hi, b.hi)}; }
+
+    friend D operator-(D a, D b) noexcept { return {vsubq_f64(a.lo, b.lo), vsubq_f64(a.hi, b.hi)}; }
+
+    friend D operator*(D a, double b) noexcept { return {vmulq_n_f64(a.lo, b), vmulq_n_f64(a.hi, b)}; }
+};
+
+inline D widen(F a) noexcept { return {vcvt_f64_f32(vget_low_f32(a.v)), vcvt_high_f64_f32(a.v)}; }
+
+inline F narrow(D a) noexcept { return {vcvt_high_f32_f64(vcvt_f32_f64(a.lo), a.hi)}; }
+
+inline void transpose(float *block) noexcept {
+    float32x4_t r[16];
+    for (auto i = 0; i < 16; i++) r[i] = vld1q_f32(block + i * 4);
+    for (auto quadrant = 0; quadrant < 4; quadrant++) {
+        auto base = (quadrant / 2) * 8 + (quadrant % 2);
+        auto &r0 = r[base], &r1 = r[base + 2], &r2 = r[base + 4], &r3 = r[base + 6];
+        auto t01 = vtrnq_f32(r0, r1);
+        auto t23 = vtrnq_f32(r2, r3);
+        r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+        r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+        r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+        r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+    }
+    for (auto row = 0; row < 8; row++) {
+        auto upper = row < 4;
+        vst1q_f32(block + row * 8, r[upper ? row * 2 : (row - 4) * 2 + 1]);
+        vst1q_f32(block + row * 8 + 4, r[upper ? (row + 4) * 2 : row * 2 + 1]);
+    }
+}
+
+void dct(float *block64) noexcept {
+    transpose(block64);
+    dct_columns<F, D>(block64);
+    transpose(block64);
+    dct_columns<F, D>(block64);
+}
+
+int quantize(const float *block64, const float *scaled, int16_t *quantized) noexcept {
+    alignas(16) int16_t natural[8 * 8];
+    for (auto i = 0; i < 8 * 8; i += 8) {
+        // vcvtnq: round to nearest, ties to even
+        auto a = vcvtnq_s32_f32(vmulq_f32(vld1q_f32(block64 + i), vld1q_f32(scaled + i)));
+        auto b = vcvtnq_s32_f32(vmulq_f32(vld1q_f32(block64 + i + 4), vld1q_f32(scaled + i + 4)));
+        vst1q_s16(natural + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+    }
+    return zigzag(natural, quantized);
+}
+
+int dct_quantize(float *block64, const float *scaled, int16_t *quantized) noexcept {
+    dct(block64);
+    return quantize(block64, scaled, quantized);
+}
+} // namespace neon
+#endif
+
+DctQuantizeKernel dct_quantize_kernel(DctKernel kernel) noexcept {
+    switch (kernel) {
+        case DctKernel::Scalar:
+            return dct_quantize_scalar;
+        case DctKernel::SSE2:
+#if defined(__SSE2__)
+            return sse2::dct_quantize;
+#else
+            return nullptr;
+#endif
+        case DctKernel::AVX2:
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+            if (dct_quantize_avx2 && __builtin_cpu_supports("avx2")) return dct_quantize_avx2;
+#endif
+            return nullptr;
+        case DctKernel::NEON:
+#if defined(__ARM_NEON) && defined(__aarch64__)
+            return neon::dct_quantize;
+#else
+            return nullptr;
+#endif
+    }
+    return nullptr;
+}
+
+void forward_dct(float *block64) noexcept {
+#if defined(__SSE2__)
+    sse2::dct(block64);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    neon::dct(block64);
+#else
+    dct_scalar(block64);
+#endif
+}
+
+int quantize_block(const float *coefficients, const float *scaled, int16_t *quantized) noexcept {
+#if defined(__SSE2__)
+    return sse2::quantize(coefficients, scaled, quantized);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    return neon::quantize(coefficients, scaled, quantized);
+#else
+    alignas(16) int16_t natural[8 * 8];
+    for (auto i = 0; i < 8 * 8; i++) natural[i] = int16_t(std::nearbyint(coefficients[i] * scaled[i]));
+    return zigzag(natural, quantized);
+#endif
+}
+
+DctKernel dct_kernel_kind() noexcept {
+    // CPP11: thread-safe, one time initialisation of function local statics
+    static const DctKernel kind = [] {
+        for (auto kernel: {DctKernel::AVX2, DctKernel::SSE2, DctKernel::NEON})
+            if (dct_quantize_kernel(kernel)) return kernel;
+        return DctKernel::Scalar;
+    }();
+    return kind;
+}
+
+DctQuantizeKernel dct_quantize_kernel() noexcept {
+    static const DctQuantizeKernel kernel = dct_quantize_kernel(dct_kernel_kind());
+    return kernel;
+}
+
+} // namespace TooJpeg17
@@ -0,0 +1,151 @@
+//! Forward DCT + quantization + zigzag kernels of TooJpeg17.
+//! A scalar kernel is always available. SSE2/AVX2 (x86) and NEON (aarch64) kernels are selected at runtime
+//! via CPU feature detection. All kernels produce bit-identical output: the vector kernels run the very same
+//! AAN operations (including the double precision steps of the scalar code) on several columns at once.
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <limits>
+
+#include "jpeg_constants.h"
+
+namespace TooJpeg17 {
+
+/**
+ * DCT, scale and quantize a single 8x8 block.
+ * @param block64 Input block (level shifted samples) in natural order. Clobbered by the kernel.
+ * @param scaled AAN scaled quantisation table in natural order, see scaled_luminance().
+ * @param quantized Output coefficients in zigzag order, quantized[0] is the DC coefficient.
+ * @return The zigzag position of the last non-zero AC coefficient, 0 if all AC coefficients are zero.
+ */
+using DctQuantizeKernel = int (*)(float *block64, const float *scaled, int16_t *quantized) noexcept;
+
+enum class DctKernel {
+    Scalar, SSE2, AVX2, NEON
+};
+
+/// Returns the requested kernel or nullptr if it is not compiled in or not supported by this CPU.
+[[nodiscard]] DctQuantizeKernel dct_quantize_kernel(DctKernel kernel) noexcept;
+
+/// Returns the fastest kernel supported by this CPU. Detected once, the result is cached.
+[[nodiscard]] DctQuantizeKernel dct_quantize_kernel() noexcept;
+
+/// Returns the kind of kernel that dct_quantize_kernel() picks on this CPU.
+[[nodiscard]] DctKernel dct_kernel_kind() noexcept;
+
+/// Scalar reference kernel.
+int dct_quantize_scalar(float *block64, const float *scaled, int16_t *quantized) noexcept;
+
+/**
+ * The first half of a DctQuantizeKernel: only the DCT, so that the coefficients can be quantized with several tables.
+ * quantize_block(forward_dct(block)) is bit-identical to the kernels. Uses the SSE2/NEON code if compiled in.
+ * @param block64 Input block (level shifted samples), replaced by its unscaled DCT coefficients in natural order.
+ */
+void forward_dct(float *block64) noexcept;
+
+/**
+ * The second half of a DctQuantizeKernel: scale, quantize and zigzag the coefficients of forward_dct().
+ * See DctQuantizeKernel for the parameters and the return value.
+ */
+int quantize_block(const float *coefficients, const float *scaled, int16_t *quantized) noexcept;
+
+namespace detail {
+template<typename T>
+constexpr bool is_close(T a, T b) {
+    return std::abs(a - b) <=
+           std::numeric_limits<T>::epsilon() * std::abs(a + b)
+           || std::abs(a - b) < std::numeric_limits<T>::min();
+}
+
+// CPP(14): Compute the square root during compile time for consts.
+constexpr double sqrt_helper(double x, double curr, double prev) {
+    return is_close(curr, prev) ? curr : sqrt_helper(x, 0.5 * (curr + x / curr), curr);
+}
+
+/*
+* Constexpr version of the square root
+* Returns an approximation for the square root of "x"
+* Invariant: finite and non-negative value of "x"
+*/
+constexpr double sqrt(double x) { return sqrt_helper(x, x, 0); }
+
+// AAN constants, shared by all kernels
+constexpr double SqrtHalfSqrt = sqrt((2 + sqrt(2)) / 2);
+constexpr double InvSqrt = 1.0 / sqrt(2);
+constexpr double HalfSqrtSqrt = sqrt(2 - sqrt(2)) / 2.0;
+constexpr double InvSqrtSqrt = 1.0 / sqrt(2 + sqrt(2));
+
+/**
+ * AAN DCT over all 8 columns of a block, F::Lanes columns at once.
+ *
+ * Mirrors DCT() of the scalar kernel operation by operation: F is a float vector type, D a double vector type
+ * of the same lane count. widen()/narrow() convert between them where the scalar code promotes to double.
+ * @param block Input/Output block in natural order. Changes values in-place.
+ */
+template<typename F, typename D>
+inline void dct_columns(float *block) noexcept {
+    for (auto offset = 0; offset < 8; offset += F::Lanes) {
+        float *column = block + offset;
+        F block0 = F::load(column + 0 * 8), block1 = F::load(column + 1 * 8);
+        F block2 = F::load(column + 2 * 8), block3 = F::load(column + 3 * 8);
+        F block4 = F::load(column + 4 * 8), block5 = F::load(column + 5 * 8);
+        F block6 = F::load(column + 6 * 8), block7 = F::load(column + 7 * 8);
+
+        F add07 = block0 + block7;
+        F sub07 = block0 - block7;
+        F add16 = block1 + block6;
+        F sub16 = block1 - block6;
+        F add25 = block2 + block5;
+        F sub25 = block2 - block5;
+        F add34 = block3 + block4;
+        F sub34 = block3 - block4;
+
+        F add0347 = add07 + add34;
+        F sub07_34 = add07 - add34; // "even part" / "phase 2"
+        F add1256 = add16 + add25;
+        F sub16_25 = add16 - add25;
+
+        (add0347 + add1256).store(column + 0 * 8);
+        (add0347 - add1256).store(column + 4 * 8); // "phase 3"
+
+        D z1 = widen(sub16_25 + sub07_34) * InvSqrt;
+        narrow(widen(sub07_34) + z1).store(column + 2 * 8);
+        narrow(widen(sub07_34) - z1).store(column + 6 * 8); // "phase 5"
+
+        F sub23_45 = sub25 + sub34; // "odd part" / "phase 2"
+        F sub12_56 = sub16 + sub25;
+        F sub01_67 = sub16 + sub07;
+
+        D z5 = widen(sub23_45 - sub01_67) * HalfSqrtSqrt;
+        D z2 = widen(sub23_45) * InvSqrtSqrt + z5;
+        D z3 = widen(sub12_56) * InvSqrt;
+        D z4 = widen(sub01_67) * SqrtHalfSqrt + z5;
+        D z6 = widen(sub07) + z3; // "phase 5"
+        D z7 = widen(sub07) - z3;
+        narrow(z6 + z4).store(column + 1 * 8);
+        narrow(z6 - z4).store(column + 7 * 8); // "phase 6"
+        narrow(z7 + z2).store(column + 5 * 8);
+        narrow(z7 - z2).store(column + 3 * 8);
+    }
+}
+
+/**
+ * Reorder quantized coefficients from natural to zigzag order
+ * @return The zigzag position of the last non-zero AC coefficient
+ */
+inline int zigzag(const int16_t *natural, int16_t *quantized) noexcept {
+    auto posNonZero = 0;
+    quantized[0] = natural[0];
+    for (auto i = 1; i < 8 * 8; i++) {
+        quantized[i] = natural[ZigZagInv[i]];
+        posNonZero = quantized[i] != 0 ? i : posNonZero;
+    }
+    return posNonZero;
+}
+
+/// AVX2 kernel, compiled in its own translation unit with AVX2 code generation enabled. nullptr if not compiled in.
+extern const DctQuantizeKernel dct_quantize_avx2;
+} // namespace detail
+
+} // namespace TooJpeg17
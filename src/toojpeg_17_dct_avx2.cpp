@@ -0,0 +1,111 @@
+//! AVX2 forward DCT + quantization kernel. This file is compiled with AVX2 code generation (see CMakeLists.txt),
+//! it must therefore not contain any code that is executed before the CPU feature check in dct_quantize_kernel().
+//! Only intrinsics and functions of this translation unit are used to not emit AVX2 variants of shared inline functions.
+#include "toojpeg_17_dct.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+namespace TooJpeg17 {
+using namespace detail;
+
+namespace {
+/// 8 float lanes
+struct F {
+    static constexpr int Lanes = 8;
+    __m256 v;
+
+    static F load(const float *p) noexcept { return {_mm256_loadu_ps(p)}; }
+
+    void store(float *p) const noexcept { _mm256_storeu_ps(p, v); }
+
+    friend F operator+(F a, F b) noexcept { return {_mm256_add_ps(a.v, b.v)}; }
+
+    friend F operator-(F a, F b) noexcept { return {_mm256_sub_ps(a.v, b.v)}; }
+};
+
+/// 8 double lanes
+struct D {
+    __m256d lo, hi;
+
+    friend D operator+(D a, D b) noexcept { return {_mm256_add_pd(a.lo, b.lo), _mm256_add_pd(a.hi, b.hi)}; }
+
+    friend D operator-(D a, D b) noexcept { return {_mm256_sub_pd(a.lo, b.lo), _mm256_sub_pd(a.hi, b.hi)}; }
+
+    friend D operator*(D a, double b) noexcept {
+        return {_mm256_mul_pd(a.lo, _mm256_set1_pd(b)), _mm256_mul_pd(a.hi, _mm256_set1_pd(b))};
+    }
+};
+
+inline D widen(F a) noexcept {
+    return {_mm256_cvtps_pd(_mm256_castps256_ps128(a.v)), _mm256_cvtps_pd(_mm256_extractf128_ps(a.v, 1))};
+}
+
+inline F narrow(D a) noexcept {
+    return {_mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(a.lo)), _mm256_cvtpd_ps(a.hi), 1)};
+}
+
+inline void transpose(float *block) noexcept {
+    __m256 r0 = _mm256_loadu_ps(block + 0 * 8), r1 = _mm256_loadu_ps(block + 1 * 8);
+    __m256 r2 = _mm256_loadu_ps(block + 2 * 8), r3 = _mm256_loadu_ps(block + 3 * 8);
+    __m256 r4 = _mm256_loadu_ps(block + 4 * 8), r5 = _mm256_loadu_ps(block + 5 * 8);
+    __m256 r6 = _mm256_loadu_ps(block + 6 * 8), r7 = _mm256_loadu_ps(block + 7 * 8);
+
+    // interleave pairs of rows, then pairs of pairs within each 128 bit lane
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, 0x44), s1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, 0x44), s3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, 0x44), s5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, 0x44), s7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+
+    // finally swap the 128 bit lanes
+    _mm256_storeu_ps(block + 0 * 8, _mm256_permute2f128_ps(s0, s4, 0x20));
+    _mm256_storeu_ps(block + 1 * 8, _mm256_permute2f128_ps(s1, s5, 0x20));
+    _mm256_storeu_ps(block + 2 * 8, _mm256_permute2f128_ps(s2, s6, 0x20));
+    _mm256_storeu_ps(block + 3 * 8, _mm256_permute2f128_ps(s3, s7, 0x20));
+    _mm256_storeu_ps(block + 4 * 8, _mm256_permute2f128_ps(s0, s4, 0x31));
+    _mm256_storeu_ps(block + 5 * 8, _mm256_permute2f128_ps(s1, s5, 0x31));
+    _mm256_storeu_ps(block + 6 * 8, _mm256_permute2f128_ps(s2, s6, 0x31));
+    _mm256_storeu_ps(block + 7 * 8, _mm256_permute2f128_ps(s3, s7, 0x31));
+}
+
+int dct_quantize(float *block64, const float *scaled, int16_t *quantized) noexcept {
+    // DCT rows as columns of the transposed block, then the columns
+    transpose(block64);
+    dct_columns<F, D>(block64);
+    transpose(block64);
+    dct_columns<F, D>(block64);
+
+    // Scale and round to nearest (even), just like std::nearbyint with the default rounding mode
+    alignas(32) int16_t natural[8 * 8];
+    for (auto i = 0; i < 8 * 8; i += 16) {
+        auto a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(block64 + i), _mm256_loadu_ps(scaled + i)));
+        auto b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(block64 + i + 8), _mm256_loadu_ps(scaled + i + 8)));
+        // packs works per 128 bit lane, restore the order afterwards
+        auto packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(natural + i), packed);
+    }
+
+    auto posNonZero = 0;
+    quantized[0] = natural[0];
+    for (auto i = 1; i < 8 * 8; i++) {
+        quantized[i] = natural[ZigZagInv[i]];
+        posNonZero = quantized[i] != 0 ? i : posNonZero;
+    }
+    return posNonZero;
+}
+} // namespace
+
+const DctQuantizeKernel detail::dct_quantize_avx2 = dct_quantize;
+
+} // namespace TooJpeg17
+
+#else
+
+const TooJpeg17::DctQuantizeKernel TooJpeg17::detail::dct_quantize_avx2 = nullptr;
+
+#endif
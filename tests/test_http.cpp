@@ -0,0 +1,585 @@
+//! HTTP keep-alive tests against a local server thread, no network required
+#include "tests.h"
+#include "http.h"
+#include "download_scheduler.h"
+#include "http_cache.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include <netinet/in.h>
+
+using namespace Socket;
+
+/// Headers and body with "transfer-encoding: chunked", growing chunk sizes, an extension and a trailer
+std::string chunked_response(std::string_view body) {
+    std::ostringstream out;
+    out << "Transfer-Encoding: chunked\r\n\r\n";
+    for (std::size_t pos = 0, size = 1; pos < body.size(); pos += size, size = size * 3 + 1) {
+        auto chunk = body.substr(pos, size);
+        out << std::hex << chunk.size() << (size == 4 ? ";name=value" : "") << "\r\n" << chunk << "\r\n";
+    }
+    out << "0\r\nx-trailer: 1\r\n\r\n";
+    return out.str();
+}
+
+/**
+ * A minimal HTTP/1.1 server on 127.0.0.1 (any free port). Answers GET requests with "path:" repeated to the
+ * requested length ("/<length>"), "/close" responds with "connection: close".
+ * "/c<length>" sends the body chunked, "/h<length>" adds a 40 kB header, "/e<length>" adds validators and responds
+ * 304 (not modified) to a request with the matching If-None-Match. "/t<length>" announces the length but closes the
+ * connection after 10 bytes of the body.
+ * Serves at most requestsPerConnection requests per connection, then closes it.
+ */
+class LocalServer {
+public:
+    explicit LocalServer(int requestsPerConnection = 100) : requestsPerConnection_(requestsPerConnection) {
+        listen_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+        if (::bind(listen_, reinterpret_cast<sockaddr *>(&addr), length) != 0 || ::listen(listen_, 8) != 0 ||
+            ::getsockname(listen_, reinterpret_cast<sockaddr *>(&addr), &length) != 0)
+            BAIL("Failed to listen on 127.0.0.1");
+        port_ = ntohs(addr.sin_port);
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~LocalServer() {
+        ::shutdown(listen_, SHUT_RDWR);
+        ::close(listen_);
+        thread_.join();
+    }
+
+    [[nodiscard]] std::string url(std::string_view path) const {
+        return "http://127.0.0.1:" + std::to_string(port_) + std::string(path);
+    }
+
+    [[nodiscard]] int accepted() const { return accepted_; }
+
+private:
+    int listen_ = -1;
+    uint16_t port_ = 0;
+    const int requestsPerConnection_;
+    std::atomic<int> accepted_{0};
+    std::thread thread_;
+
+    void run() {
+        while (true) {
+            int connection = ::accept(listen_, nullptr, nullptr);
+            if (connection < 0) return;
+            accepted_++;
+            serve(connection);
+            ::close(connection);
+        }
+    }
+
+    void serve(int connection) {
+        std::string request;
+        char buffer[1024];
+        for (int served = 0; served < requestsPerConnection_;) {
+            auto end = request.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                auto get = ::read(connection, buffer, sizeof(buffer));
+                if (get <= 0) return;
+                request.append(buffer, std::size_t(get));
+                continue;
+            }
+            auto path = request.substr(4, request.find(' ', 4) - 4);
+            auto headers = request.substr(0, end);
+            request.erase(0, end + 4);
+            served++;
+
+            bool close = path == "/close", chunked = path[1] == 'c' && !close, bigHeader = path[1] == 'h',
+                    validated = path[1] == 'e', truncated = path[1] == 't';
+            std::string body;
+            auto length = close ? 5 : std::stoul(path.substr(chunked || bigHeader || validated || truncated ? 2 : 1));
+            while (body.size() < length) body += path + ":";
+            body.resize(length);
+            auto etag = "\"v" + path + "\"";
+            std::string response;
+            if (validated && headers.find("if-none-match: " + etag + "\r\n") != std::string::npos)
+                response = "HTTP/1.1 304 Not Modified\r\nETag: " + etag + "\r\n\r\n";
+            else
+                // lowercase header names are valid as well
+                response = "HTTP/1.1 200 OK\r\n" + (bigHeader ? "x-padding: " + std::string(40000, 'x') + "\r\n" : "") +
+                           (validated ? "ETag: " + etag + "\r\nLast-Modified: Wed, 21 Oct 2015 07:28:00 GMT\r\n" : "") +
+                           (chunked ? chunked_response(body) : "content-length: " + std::to_string(body.size()) +
+                                                               (close ? "\r\nConnection: close" : "") + "\r\n\r\n" + body);
+            if (truncated) response.resize(response.size() - body.size() + std::min<std::size_t>(body.size(), 10));
+            if (::send(connection, response.data(), response.size(), MSG_NOSIGNAL) != ssize_t(response.size()))
+                return;
+            if (close || truncated) return;
+        }
+    }
+};
+
+std::string expected_body(std::string_view path, std::size_t length) {
+    std::string body;
+    while (body.size() < length) body += std::string(path) + ":";
+    body.resize(length);
+    return body;
+}
+
+std::string get(ConnectionPool<false> &pool, const std::string &url) {
+    std::stringstream stream;
+    auto result = writeHttpResponseTo(stream, Url(url), pool);
+    ASSERT_THROW(result.has_value());
+    return stream.str();
+}
+
+void testHeaderValue() {
+    ASSERT_EQUAL(std::string(header_value("Content-Length: 42\r", "content-length").value()), "42");
+    ASSERT_EQUAL(std::string(header_value("content-length:7", "Content-Length").value()), "7");
+    ASSERT_EQUAL(std::string(header_value("connection:  close \r", "Connection").value()), "close");
+    ASSERT_THROW(!header_value("content-type: text/html\r", "content-length"));
+    ASSERT_THROW(!header_value("content-lengthy: 1\r", "content-length"));
+    ASSERT_THROW(iequals("Close", "close") && !iequals("closed", "close"));
+}
+
+void testKeepAlive() {
+    LocalServer server;
+    ConnectionPool<false> pool;
+    // a body larger than the socket buffer and several requests on the same connection
+    ASSERT_EQUAL(get(pool, server.url("/5")), expected_body("/5", 5));
+    ASSERT_EQUAL(get(pool, server.url("/40000")), expected_body("/40000", 40000));
+    ASSERT_EQUAL(get(pool, server.url("/1")), expected_body("/1", 1));
+    ASSERT_EQUAL(server.accepted(), 1);
+    ASSERT_EQUAL(pool.connections(), 1u);
+}
+
+void testConnectionClose() {
+    LocalServer server;
+    ConnectionPool<false> pool;
+    ASSERT_EQUAL(get(pool, server.url("/close")), "/clos");
+    ASSERT_EQUAL(get(pool, server.url("/3")), "/3:");
+    ASSERT_EQUAL(get(pool, server.url("/4")), "/4:/");
+    ASSERT_EQUAL(server.accepted(), 2);
+}
+
+void testServerClosedIdleConnection() {
+    // The server closes each connection after one response without announcing it: the pool has to reconnect
+    LocalServer server(1);
+    ConnectionPool<false> pool;
+    ASSERT_EQUAL(get(pool, server.url("/6")), expected_body("/6", 6));
+    ASSERT_EQUAL(get(pool, server.url("/7")), expected_body("/7", 7));
+    ASSERT_EQUAL(get(pool, server.url("/8")), expected_body("/8", 8));
+    ASSERT_EQUAL(server.accepted(), 3);
+}
+
+void testReadIntoMemory() {
+    LocalServer server;
+    ConnectionPool<false> pool;
+    std::vector<std::uint8_t> body{1, 2, 3};
+    auto size = readHttpResponse(body, Url(server.url("/30000")), pool);
+    ASSERT_THROW(size.has_value());
+    ASSERT_EQUAL(*size, std::size_t(30000));
+    ASSERT_THROW(std::string(body.begin(), body.end()) == expected_body("/30000", 30000));
+    // sized once from the content-length
+    ASSERT_EQUAL(body.capacity(), std::size_t(30000));
+    size = readHttpResponse(body, Url(server.url("/2")), pool);
+    ASSERT_THROW(size && std::string(body.begin(), body.end()) == "/2");
+    ASSERT_EQUAL(server.accepted(), 1);
+}
+
+/// Feed a response to the parser in pieces of the given size, like HttpSocket does. Returns the body.
+std::string parse_in_pieces(std::string_view response, std::size_t piece, HttpParsedResponse &parsed) {
+    HttpHeaderParser parser;
+    std::string received, body;
+    for (std::size_t pos = 0; pos < response.size() && !parser.receive_done(); pos += piece) {
+        received += response.substr(pos, piece);
+        if (parser.parse(reinterpret_cast<std::byte *>(received.data()), received.size(),
+                         [&](HttpParsedResponse, ByteView data) {
+                             body.append(reinterpret_cast<const char *>(data.ptr_), data.size_);
+                         }))
+            received.clear();
+    }
+    ASSERT_THROW(parser.receive_done());
+    parsed = parser.parsed_header();
+    return body;
+}
+
+void testChunkedParser() {
+    const auto body = expected_body("/c", 1000);
+    const auto response = "HTTP/1.1 200 OK\r\ncontent-type: image/png\r\n" + chunked_response(body);
+    for (std::size_t piece = 1; piece < response.size(); piece += piece < 20 ? 1 : 97) {
+        HttpParsedResponse parsed;
+        ASSERT_THROW(parse_in_pieces(response, piece, parsed) == body);
+        ASSERT_THROW(parsed.chunked && parsed.keep_alive);
+        ASSERT_EQUAL(parsed.received_bytes, body.size());
+    }
+
+    // an invalid chunk size is an error
+    HttpHeaderParser parser;
+    std::string invalid = "HTTP/1.1 200 OK\r\ntransfer-encoding: chunked\r\n\r\nzz\r\n";
+    bool threw = false;
+    try {
+        parser.parse(reinterpret_cast<std::byte *>(invalid.data()), invalid.size(), [](HttpParsedResponse, ByteView) {});
+    } catch (const std::runtime_error &) {
+        threw = true;
+    }
+    ASSERT_THROW(threw);
+}
+
+void testChunkedAndBigHeaders() {
+    LocalServer server;
+    ConnectionPool<false> pool;
+    ASSERT_EQUAL(get(pool, server.url("/c100000")), expected_body("/c100000", 100000));
+    // headers bigger than the initial receive buffer
+    ASSERT_EQUAL(get(pool, server.url("/h20")), expected_body("/h20", 20));
+    ASSERT_EQUAL(get(pool, server.url("/c3")), expected_body("/c3", 3));
+    ASSERT_EQUAL(get(pool, server.url("/h70000")), expected_body("/h70000", 70000));
+    // the chunked responses were read exactly up to their end, the connection stayed in sync
+    ASSERT_EQUAL(server.accepted(), 1);
+}
+
+void testResolverCache() {
+    Resolver resolver;
+    auto first = resolver.resolve("localhost", 8080);
+    ASSERT_THROW(!first.empty());
+    auto second = resolver.resolve("localhost", 9090);
+    ASSERT_EQUAL(resolver.lookups(), std::size_t(1));
+    ASSERT_EQUAL(resolver.hits(), std::size_t(1));
+    ASSERT_EQUAL(second.size(), first.size());
+    ASSERT_EQUAL(ntohs(reinterpret_cast<const sockaddr_in *>(&second[0].storage)->sin_port), 9090);
+
+    // concurrent lookups of one host are done once
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) threads.emplace_back([&] { (void) resolver.resolve("127.0.0.1", 80); });
+    for (auto &thread: threads) thread.join();
+    ASSERT_EQUAL(resolver.lookups(), std::size_t(2));
+    ASSERT_EQUAL(resolver.resolve("127.0.0.1", 80)[0].ip(), "127.0.0.1");
+
+    resolver.invalidate("localhost");
+    (void) resolver.resolve("localhost", 80);
+    ASSERT_EQUAL(resolver.lookups(), std::size_t(3));
+
+    // an expired entry is looked up again, failures are not cached
+    Resolver uncached(std::chrono::seconds(0));
+    (void) uncached.resolve("127.0.0.1", 80);
+    (void) uncached.resolve("127.0.0.1", 80);
+    ASSERT_EQUAL(uncached.lookups(), std::size_t(2));
+    bool threw = false;
+    try { (void) resolver.resolve("invalid..host", 80); } catch (const std::runtime_error &) { threw = true; }
+    ASSERT_THROW(threw);
+
+    ASSERT_THROW(split_host_port("[::1]:81", 80) == std::make_pair(std::string("::1"), uint16_t(81)));
+    ASSERT_THROW(split_host_port("[::1]", 80) == std::make_pair(std::string("::1"), uint16_t(80)));
+    ASSERT_THROW(split_host_port("a.org:8443", 443) == std::make_pair(std::string("a.org"), uint16_t(8443)));
+    ASSERT_THROW(split_host_port("a.org", 443) == std::make_pair(std::string("a.org"), uint16_t(443)));
+}
+
+void testHappyEyeballs() {
+    LocalServer server;
+    auto port = uint16_t(std::stoul(server.url("").substr(std::string("http://127.0.0.1:").size())));
+    Resolver resolver;
+    auto working = resolver.resolve("127.0.0.1", port)[0];
+    // a port nobody listens on (the listening socket is closed right away)
+    auto refused = working;
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+        ::bind(fd, reinterpret_cast<sockaddr *>(&addr), length);
+        ::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &length);
+        ::close(fd);
+        refused.set_port(ntohs(addr.sin_port));
+    }
+
+    // refused attempts fall through to the next address right away, without waiting for the attempt delay
+    auto start = std::chrono::steady_clock::now();
+    int fd = connect_happy_eyeballs({refused, refused, working}, std::chrono::seconds(5));
+    ASSERT_THROW(fd >= 0);
+    ASSERT_THROW(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+    ASSERT_THROW((::fcntl(fd, F_GETFL) & O_NONBLOCK) == 0);
+    ::close(fd);
+
+    errno = 0;
+    ASSERT_EQUAL(connect_happy_eyeballs({refused}), -1);
+    ASSERT_EQUAL(errno, ECONNREFUSED);
+
+    // "localhost" may resolve to ::1 first, where the server does not listen
+    ConnectionPool<false> pool;
+    ASSERT_EQUAL(get(pool, "http://localhost:" + std::to_string(port) + "/4"), "/4:/");
+}
+
+void testConditionalRequest() {
+    LocalServer server;
+    ConnectionPool<false> pool;
+    std::vector<std::uint8_t> body;
+    HttpValidators validators;
+    auto [status, size] = readHttpResponse(body, Url(server.url("/e500")), pool, nullptr, &validators);
+    ASSERT_EQUAL(status, 200);
+    ASSERT_THROW(size && *size == 500 && std::string(body.begin(), body.end()) == expected_body("/e500", 500));
+    ASSERT_EQUAL(validators.etag, std::string("\"v/e500\""));
+    ASSERT_EQUAL(validators.last_modified, std::string("Wed, 21 Oct 2015 07:28:00 GMT"));
+
+    // not modified: no body, the connection stays usable
+    HttpValidators revalidated;
+    std::tie(status, size) = readHttpResponse(body, Url(server.url("/e500")), pool, &validators, &revalidated);
+    ASSERT_EQUAL(status, 304);
+    ASSERT_THROW(!size);
+    ASSERT_EQUAL(revalidated.etag, validators.etag);
+    // other validators: full response
+    HttpValidators stale{"\"v/old\"", ""};
+    std::tie(status, size) = readHttpResponse(body, Url(server.url("/e500")), pool, &stale, nullptr);
+    ASSERT_THROW(status == 200 && size && *size == 500);
+    ASSERT_EQUAL(get(pool, server.url("/3")), "/3:");
+    ASSERT_EQUAL(server.accepted(), 1);
+
+    // an empty body with content-length: 0 is a complete response
+    HttpParsedResponse parsed;
+    ASSERT_THROW(parse_in_pieces("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", 7, parsed).empty());
+    ASSERT_THROW(parsed.keep_alive);
+}
+
+void testHttpCache() {
+    auto directory = std::filesystem::temp_directory_path() / ("test_http_cache_" + std::to_string(::getpid()));
+    std::filesystem::remove_all(directory);
+    {
+        HttpCache cache(directory / "cache");
+        const std::string content = "image data";
+        auto hash = HttpCache::content_hash(ByteView(reinterpret_cast<const std::uint8_t *>(content.data()),
+                                                     content.size()));
+        ASSERT_EQUAL(hash, std::string("b41b86dcfdc6219bc2fb987591ad9995bcf3a1e40c2bdd3fdbec622371e6e1af"));
+        ASSERT_THROW(!cache.lookup("http://a.org/a.png"));
+        ASSERT_THROW(!cache.has_object(hash));
+
+        auto output = directory / "a.new.jpg";
+        std::ofstream(output) << "jpeg";
+        ASSERT_THROW(cache.add_object(hash, output));
+        ASSERT_THROW(cache.has_object(hash));
+        ASSERT_THROW(cache.store("http://a.org/a.png", {{"\"1\"", "Wed, 21 Oct 2015 07:28:00 GMT"}, hash}));
+        auto entry = cache.lookup("http://a.org/a.png");
+        ASSERT_THROW(entry && entry->content == hash && entry->validators.etag == "\"1\"" &&
+                     entry->validators.last_modified == "Wed, 21 Oct 2015 07:28:00 GMT");
+        ASSERT_THROW(!cache.lookup("http://a.org/b.png"));
+
+        // replaced entries, restored outputs
+        ASSERT_THROW(cache.store("http://a.org/a.png", {{"", "Thu, 22 Oct 2015 07:28:00 GMT"}, hash}));
+        entry = cache.lookup("http://a.org/a.png");
+        ASSERT_THROW(entry && entry->validators.etag.empty() && !entry->validators.empty());
+        std::filesystem::remove(output);
+        ASSERT_THROW(cache.restore(hash, output));
+        std::string restored;
+        std::getline(std::ifstream(output), restored);
+        ASSERT_EQUAL(restored, std::string("jpeg"));
+        ASSERT_THROW(!cache.restore(std::string(64, '0'), directory / "missing.jpg"));
+    }
+    // persistent
+    ASSERT_THROW(HttpCache(directory / "cache").lookup("http://a.org/a.png").has_value());
+    std::filesystem::remove_all(directory);
+}
+
+std::string read_file(const std::filesystem::path &file) {
+    std::ifstream in(file, std::ios_base::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void testDownloadToFile() {
+    auto directory = std::filesystem::temp_directory_path() / ("test_http_file_" + std::to_string(::getpid()));
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    LocalServer server;
+    ConnectionPool<false> pool;
+
+    // most of the body is spliced from the socket into the file
+    auto size = downloadToFile(directory / "big", Url(server.url("/3000000")), pool);
+    ASSERT_THROW(size && *size == 3000000);
+    ASSERT_THROW(read_file(directory / "big") == expected_body("/3000000", 3000000));
+    // chunked bodies are written block by block, the connection stayed in sync
+    size = downloadToFile(directory / "chunked", Url(server.url("/c70000")), pool);
+    ASSERT_THROW(size && read_file(directory / "chunked") == expected_body("/c70000", 70000));
+    ASSERT_EQUAL(get(pool, server.url("/5")), "/5:/5");
+    ASSERT_EQUAL(server.accepted(), 1);
+
+    // any file descriptor, eg a pipe
+    int out[2];
+    ASSERT_THROW(::pipe(out) == 0);
+    size = writeHttpResponseTo(out[1], Url(server.url("/20000")), pool);
+    ::close(out[1]);
+    std::string piped;
+    char buffer[4096];
+    for (ssize_t get; (get = ::read(out[0], buffer, sizeof(buffer))) > 0;) piped.append(buffer, std::size_t(get));
+    ::close(out[0]);
+    ASSERT_THROW(size && *size == 20000 && piped == expected_body("/20000", 20000));
+
+    // a failed download leaves neither the target nor a temporary file
+    ASSERT_THROW(!downloadToFile(directory / "failed", Url(server.url("/e0")), pool));
+    bool threw = false;
+    try { (void) downloadToFile(directory / "failed", Url("http://127.0.0.1:1/x"), pool); }
+    catch (const std::runtime_error &) { threw = true; }
+    ASSERT_THROW(threw);
+    ASSERT_EQUAL(std::distance(std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator{}),
+                 2l);
+    std::filesystem::remove_all(directory);
+}
+
+void testAtomicFile() {
+    auto directory = std::filesystem::temp_directory_path() / ("test_atomic_file_" + std::to_string(::getpid()));
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    auto target = directory / "out.jpg";
+    {
+        AtomicFile file(target);
+        ASSERT_THROW(file.is_valid());
+        ASSERT_THROW(file.write(ByteView("abc", 3)));
+        ASSERT_THROW(file.write({ByteView("de", 2), ByteView(), ByteView("fgh", 3)}));
+        // not visible before the commit
+        ASSERT_THROW(!std::filesystem::exists(target));
+        ASSERT_THROW(file.commit());
+        ASSERT_THROW(!file.is_valid() && !file.write(ByteView("x", 1)));
+    }
+    ASSERT_EQUAL(read_file(target), std::string("abcdefgh"));
+    {
+        // an uncommitted replacement is discarded, the old content stays
+        AtomicFile file(target, true);
+        ASSERT_THROW(file.write(ByteView("new", 3)));
+    }
+    ASSERT_EQUAL(read_file(target), std::string("abcdefgh"));
+    {
+        AtomicFile file(target, true);
+        AtomicFile moved(std::move(file));
+        ASSERT_THROW(!file.is_valid() && moved.write(ByteView("new", 3)) && moved.commit());
+    }
+    ASSERT_EQUAL(read_file(target), std::string("new"));
+
+    // partial writes of a writev are continued: a pipe accepts at most its capacity per call
+    int out[2];
+    ASSERT_THROW(::pipe(out) == 0);
+    std::string a(100000, 'a'), b(50000, 'b');
+    std::thread reader([&] {
+        std::string piped;
+        char buffer[4096];
+        for (ssize_t get; (get = ::read(out[0], buffer, sizeof(buffer))) > 0;) piped.append(buffer, std::size_t(get));
+        ASSERT_THROW(piped == a + b);
+    });
+    iovec buffers[2] = {{a.data(), a.size()}, {b.data(), b.size()}};
+    ASSERT_THROW(write_fully(out[1], buffers, 2));
+    ::close(out[1]);
+    reader.join();
+    ::close(out[0]);
+    ASSERT_EQUAL(std::distance(std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator{}),
+                 1l);
+    std::filesystem::remove_all(directory);
+}
+
+void testDownloadLimits() {
+    std::atomic<unsigned> running{0}, maxRunning{0}, done{0};
+    std::atomic<unsigned> runningA{0}, maxRunningA{0};
+    {
+        DownloadScheduler downloads({4, 2});
+        Url a("http://a.org/"), b("http://b.org/");
+        auto job = [&](bool isA) {
+            return [&, isA] {
+                auto now = ++running;
+                for (auto max = maxRunning.load(); now > max && !maxRunning.compare_exchange_weak(max, now);) {}
+                if (isA) {
+                    auto nowA = ++runningA;
+                    for (auto max = maxRunningA.load(); nowA > max && !maxRunningA.compare_exchange_weak(max, nowA);) {}
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                if (isA) runningA--;
+                running--;
+                done++;
+            };
+        };
+        // hosts a gets most jobs, b jobs overtake the ones of a waiting for a slot
+        for (int i = 0; i < 24; i++) downloads.submit(i % 4 ? a : b, job(i % 4 != 0));
+        downloads.submit(a, [] { throw std::runtime_error("dropped"); });
+        downloads.wait();
+        ASSERT_EQUAL(done.load(), 24u);
+        ASSERT_THROW(downloads.maxActivePerHost() <= 2);
+        // the scheduler is reusable after wait()
+        downloads.submit(b, job(false));
+    }
+    ASSERT_EQUAL(done.load(), 25u);
+    ASSERT_THROW(maxRunning <= 4 && maxRunning >= 2);
+    ASSERT_THROW(maxRunningA <= 2);
+}
+
+void testTruncatedBody() {
+    auto directory = std::filesystem::temp_directory_path() / ("test_http_truncated_" + std::to_string(::getpid()));
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    LocalServer server;
+    ConnectionPool<false> pool;
+    auto throws = [](auto &&download) {
+        try { (void) download(); }
+        catch (const std::runtime_error &) { return true; }
+        return false;
+    };
+
+    // the body ends with the connection instead of after content-length bytes: neither a result nor a file
+    std::vector<std::uint8_t> body;
+    ASSERT_THROW(throws([&] { return readHttpResponse(body, Url(server.url("/t1000")), pool); }));
+    ASSERT_THROW(throws([&] { return downloadToFile(directory / "truncated", Url(server.url("/t5000")), pool); }));
+    std::stringstream stream;
+    ASSERT_THROW(throws([&] { return writeHttpResponseTo(stream, Url(server.url("/t1000")), pool); }));
+    ASSERT_THROW(std::filesystem::is_empty(directory));
+    // the broken connections are not reused
+    ASSERT_EQUAL(get(pool, server.url("/5")), "/5:/5");
+    ASSERT_EQUAL(server.accepted(), 4);
+    std::filesystem::remove_all(directory);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) return -1;
+    switch (std::stoi(argv[1])) {
+        case 0:
+            testHeaderValue();
+            break;
+        case 1:
+            testKeepAlive();
+            break;
+        case 2:
+            testConnectionClose();
+            break;
+        case 3:
+            testServerClosedIdleConnection();
+            break;
+        case 4:
+            testDownloadLimits();
+            break;
+        case 5:
+            testReadIntoMemory();
+            break;
+        case 6:
+            testChunkedParser();
+            break;
+        case 7:
+            testChunkedAndBigHeaders();
+            break;
+        case 8:
+            testResolverCache();
+            break;
+        case 9:
+            testHappyEyeballs();
+            break;
+        case 10:
+            testConditionalRequest();
+            break;
+        case 11:
+            testHttpCache();
+            break;
+        case 12:
+            testDownloadToFile();
+            break;
+        case 13:
+            testAtomicFile();
+            break;
+        case 14:
+            testTruncatedBody();
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
@@ -1,11 +1,32 @@
 //! Integration test for C++17 variant of the toojpeg implementation
 #include <iostream>
 #include "toojpeg_17.h"
+#include "toojpeg_17_dct.h"
 #include "vendor/sha2.h"
+#include "decode_arena.h"
+#include "image_loader.h"
+#include "image_resize.h"
+#include "batch_encoder.h"
+#include "jpeg_passthrough.h"
+#include "io_engine.h"
+#include "directory_scanner.h"
+#include "metrics.h"
+#include "job_server.h"
 #include "tests.h"
 
 #include <filesystem>
 #include <array>
+#include <fstream>
+#include <vector>
+#include <tuple>
+#include <random>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <thread>
 
 using std::cout;
 using std::endl;
@@ -90,17 +111,1343 @@ void testGrayscale() {
     ASSERT_THROW(std::equal(hash.begin(), hash.end(), expected.begin()));
 }
 
+void testSinks() {
+    const auto bytesPerPixel = 3;
+    auto image = std::vector<unsigned char>(width * height * bytesPerPixel);
+    for (std::size_t i = 0; i < image.size(); i++) image[i] = (i * 7) % 251;
+
+    // reference: the std::function adapter
+    std::vector<std::uint8_t> expected;
+    bool ok = TooJpeg17::writeJpeg<90>(
+            [&expected](ByteView v) { expected.insert(expected.end(), v.ptr_, v.ptr_ + v.size_); }, image.data(),
+            width, height, false, true, "TooJpeg17 example image");
+    ASSERT_EQUAL(ok, true);
+
+    std::vector<std::uint8_t> output;
+    ok = TooJpeg17::writeJpeg<90>(TooJpeg17::VectorSink(output), image.data(), width, height, false, true,
+                                  "TooJpeg17 example image");
+    ASSERT_EQUAL(ok, true);
+    ASSERT_THROW(output == expected);
+
+    std::vector<std::uint8_t> memory(expected.size());
+    TooJpeg17::MemorySink memorySink(memory.data(), memory.size());
+    ok = TooJpeg17::writeJpegQuality(memorySink, image.data(), width, height, false, true, 90,
+                                     "TooJpeg17 example image");
+    ASSERT_EQUAL(ok, true);
+    ASSERT_EQUAL(memorySink.overflowed(), false);
+    ASSERT_THROW(memory == expected);
+
+    // a too small memory area is detected
+    TooJpeg17::MemorySink smallSink(memory.data(), 100);
+    ok = TooJpeg17::writeJpeg<90>(smallSink, image.data(), width, height, false, true, "TooJpeg17 example image");
+    ASSERT_EQUAL(ok, true);
+    ASSERT_EQUAL(smallSink.overflowed(), true);
+    ASSERT_EQUAL(smallSink.size, expected.size());
+}
+
+void testDctKernels() {
+    using namespace TooJpeg17;
+    const auto scaled = scaled_luminance(quant_table(DefaultQuantLuminance_A, 20));
+    std::mt19937 random(17);
+    std::uniform_real_distribution<float> sample(-128.f, 127.f);
+
+    for (auto kind: {DctKernel::SSE2, DctKernel::AVX2, DctKernel::NEON}) {
+        auto kernel = dct_quantize_kernel(kind);
+        if (!kernel) continue;
+        for (auto run = 0; run < 10000; run++) {
+            std::array<float, 8 * 8> block{}, reference{};
+            for (auto &v: block) v = sample(random);
+            reference = block;
+            std::array<int16_t, 8 * 8> expected{}, quantized{};
+            auto expectedPos = dct_quantize_scalar(reference.data(), scaled.data(), expected.data());
+            auto pos = kernel(block.data(), scaled.data(), quantized.data());
+            ASSERT_EQUAL(pos, expectedPos);
+            ASSERT_THROW(quantized == expected);
+        }
+    }
+}
+
+/// Decode a jpeg with stb_image, returns an empty vector on failure
+std::vector<unsigned char> decode(const std::vector<std::uint8_t> &jpeg, int channels) {
+    int w = 0, h = 0, c = 0;
+    auto pixels = stbi_load_from_memory(jpeg.data(), int(jpeg.size()), &w, &h, &c, channels);
+    if (!pixels) return {};
+    std::vector<unsigned char> result(pixels, pixels + std::size_t(w) * h * channels);
+    stbi_image_free(pixels);
+    return result;
+}
+
+void testRestartIntervals() {
+    // odd dimensions to cover partial MCUs
+    const auto w = 803, h = 397;
+    auto image = std::vector<unsigned char>(w * h * 3);
+    for (std::size_t i = 0; i < image.size(); i++) image[i] = (i * 13 + i / 2400) % 256;
+
+    for (auto downsample: {false, true}) {
+        std::vector<std::uint8_t> baseline, serial, parallel;
+        ASSERT_THROW(TooJpeg17::writeJpeg<90>(TooJpeg17::VectorSink(baseline), image.data(), w, h, downsample, true));
+
+        TooJpeg17::EncodeOptions options;
+        options.restartRows = 2;
+        ASSERT_THROW(TooJpeg17::writeJpeg<90>(TooJpeg17::VectorSink(serial), image.data(), w, h, downsample, true,
+                                              "", options));
+        options.threads = 4;
+        ASSERT_THROW(TooJpeg17::writeJpeg<90>(TooJpeg17::VectorSink(parallel), image.data(), w, h, downsample, true,
+                                              "", options));
+
+        // the thread count does not change the output, restart markers are present
+        ASSERT_THROW(serial == parallel);
+        ASSERT_THROW(serial.size() > baseline.size());
+        std::array<std::uint8_t, 2> dri = {0xFF, 0xDD};
+        ASSERT_THROW(std::search(serial.begin(), serial.end(), dri.begin(), dri.end()) != serial.end());
+
+        // restart markers do not change the decoded image
+        auto expected = decode(baseline, 3);
+        ASSERT_EQUAL(expected.size(), image.size());
+        ASSERT_THROW(decode(parallel, 3) == expected);
+    }
+}
+
+void testBatchEncoder() {
+    const auto jobs = 40;
+    std::vector<std::vector<unsigned char>> images(jobs);
+    std::vector<std::vector<std::uint8_t>> results(jobs);
+    for (auto i = 0; i < jobs; i++) {
+        // skewed sizes: every 8th image is large
+        auto side = i % 8 ? 16 + i : 400;
+        images[i].resize(side * side * 3);
+        for (std::size_t p = 0; p < images[i].size(); p++) images[i][p] = (p * (i + 1)) % 256;
+    }
+
+    {
+        TooJpeg17::BatchEncoder encoder(4);
+        ASSERT_EQUAL(encoder.threads(), 4u);
+        for (auto i = 0; i < jobs; i++) {
+            encoder.submit([&, i](TooJpeg17::BatchEncoder::Scratch &scratch) {
+                auto side = i % 8 ? 16 + i : 400;
+                if (!scratch.encode(images[i].data(), side, side, i % 2, true, 80)) return false;
+                results[i] = scratch.output;
+                return true;
+            });
+        }
+        // a failing job is counted, but does not stop the batch
+        encoder.submit([](TooJpeg17::BatchEncoder::Scratch &) -> bool { throw std::runtime_error("broken"); });
+        encoder.wait();
+
+        auto stats = encoder.statistics();
+        ASSERT_EQUAL(stats.jobs, std::size_t(jobs + 1));
+        ASSERT_EQUAL(stats.failed, std::size_t(1));
+        ASSERT_THROW(stats.pixels > 0 && stats.bytes > 0);
+        ASSERT_THROW(stats.minLatency <= stats.p50Latency && stats.p50Latency <= stats.p99Latency &&
+                     stats.p99Latency <= stats.maxLatency && stats.minLatency <= stats.meanLatency);
+        cout << "Batch: " << stats << endl;
+    }
+
+    for (auto i = 0; i < jobs; i++) {
+        auto side = i % 8 ? 16 + i : 400;
+        std::vector<std::uint8_t> expected;
+        TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(expected), images[i].data(), side, side, i % 2, true, 80);
+        ASSERT_THROW(results[i] == expected);
+    }
+
+    // a job encoding several images counts the bytes of all of them, not only of the last output
+    TooJpeg17::BatchEncoder encoder(1);
+    std::size_t bytes = 0;
+    encoder.submit([&](TooJpeg17::BatchEncoder::Scratch &scratch) {
+        for (auto i: {1, 2}) {
+            if (!scratch.encode(images[i].data(), 16 + i, 16 + i, false, true, 80)) return false;
+            bytes += scratch.output.size();
+        }
+        return true;
+    });
+    encoder.wait();
+    ASSERT_EQUAL(encoder.statistics().bytes, std::uint64_t(bytes));
+}
+
+void testScanlineEncoder() {
+    const auto w = 803, h = 397;
+    auto image = std::vector<unsigned char>(w * h * 3);
+    for (std::size_t i = 0; i < image.size(); i++) image[i] = (i * 7 + i / 1600) % 256;
+
+    for (auto isRGB: {true, false})
+        for (auto downsample: {false, true})
+            for (auto restartRows: {0u, 3u}) {
+                const std::size_t stride = w * (isRGB ? 3 : 1);
+                TooJpeg17::EncodeOptions options;
+                options.restartRows = restartRows;
+                std::vector<std::uint8_t> expected;
+                TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(expected), image.data(), w, h, downsample, isRGB,
+                                            85, "comment", options);
+
+                // push with chunks that do not align with MCU rows
+                for (auto chunk: {1u, 5u, 16u, 40u, unsigned(h)}) {
+                    std::vector<std::uint8_t> output;
+                    TooJpeg17::VectorSink sink(output);
+                    TooJpeg17::ScanlineEncoder encoder(sink, w, h, downsample, isRGB, 85, "comment", options);
+                    for (unsigned row = 0; row < h; row += chunk) {
+                        encoder.push(image.data() + row * stride, std::min(chunk, h - row));
+                        // finished MCU rows are emitted right away
+                        if (row >= 2 * encoder.mcuRows()) ASSERT_THROW(output.size() > 1000);
+                    }
+                    ASSERT_THROW(encoder.finished());
+                    ASSERT_THROW(output == expected);
+                    // all rows written already
+                    auto threw = false;
+                    try { encoder.push(image.data(), 1); } catch (const std::runtime_error &) { threw = true; }
+                    ASSERT_THROW(threw);
+                }
+
+                // pull
+                std::vector<std::uint8_t> output;
+                TooJpeg17::VectorSink sink(output);
+                TooJpeg17::ScanlineEncoder encoder(sink, w, h, downsample, isRGB, 85, "comment", options);
+                unsigned next = 0;
+                ASSERT_THROW(encoder.pull([&](std::uint8_t *rows, unsigned count) {
+                    ASSERT_THROW(count <= encoder.mcuRows());
+                    std::copy(image.data() + next * stride, image.data() + (next + count) * stride, rows);
+                    next += count;
+                    return true;
+                }));
+                ASSERT_THROW(output == expected);
+            }
+
+    // a source that ends early
+    std::vector<std::uint8_t> output;
+    TooJpeg17::VectorSink sink(output);
+    TooJpeg17::ScanlineEncoder encoder(sink, w, h, false, true, 85);
+    unsigned calls = 0;
+    ASSERT_THROW(!encoder.pull([&](std::uint8_t *, unsigned) { return ++calls < 3; }));
+    ASSERT_EQUAL(encoder.rowsWritten(), 16u);
+}
+
+void testMappedLoader() {
+    const auto w = 123, h = 45;
+    auto image = std::vector<unsigned char>(w * h * 3);
+    for (std::size_t i = 0; i < image.size(); i++) image[i] = (i * 5) % 256;
+    std::vector<std::uint8_t> jpeg;
+    ASSERT_THROW(TooJpeg17::writeJpeg<90>(TooJpeg17::VectorSink(jpeg), image.data(), w, h, false, true));
+
+    auto file = std::filesystem::temp_directory_path() / "toojpeg17_mapped_test.jpg";
+    std::ofstream(file, std::ios::binary).write(reinterpret_cast<const char *>(jpeg.data()), jpeg.size());
+
+    MappedFile::prefetch(file.c_str());
+    MappedFile mapped{file.c_str()};
+    ASSERT_THROW(mapped.is_valid());
+    ASSERT_EQUAL(mapped.size(), jpeg.size());
+    ASSERT_THROW(std::equal(jpeg.begin(), jpeg.end(), mapped.data()));
+
+    // ownership moves, the mapping stays valid
+    MappedFile moved = std::move(mapped);
+    ASSERT_THROW(!mapped.is_valid());
+    ASSERT_THROW(moved.is_valid());
+
+    // same pixels as the stdio loader
+    ImageLoader viaStdio{file.c_str()};
+    ImageLoader viaMapping{moved};
+    ASSERT_THROW(viaStdio.is_valid() && viaMapping.is_valid());
+    ASSERT_EQUAL(viaMapping.width, w);
+    ASSERT_EQUAL(viaMapping.height, h);
+    ASSERT_THROW(std::equal(*viaStdio, *viaStdio + w * h * 3, *viaMapping));
+
+    // missing and empty files
+    std::filesystem::remove(file);
+    ASSERT_THROW(!MappedFile{file.c_str()}.is_valid());
+    std::ofstream{file};
+    ASSERT_THROW(!MappedFile{file.c_str()}.is_valid());
+    std::filesystem::remove(file);
+    ASSERT_THROW(!ImageLoader(nullptr, 0).is_valid());
+}
+
+void testJpegPassthrough() {
+    const auto w = 99, h = 61;
+    auto image = std::vector<unsigned char>(w * h * 3);
+    for (std::size_t i = 0; i < image.size(); i++) image[i] = (i * 3 + i / 300) % 256;
+
+    for (unsigned quality: {10u, 50u, 75u, 90u, 97u}) {
+        for (auto isRGB: {true, false}) {
+            std::vector<std::uint8_t> jpeg;
+            TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(jpeg), image.data(), w, h, false, isRGB, quality,
+                                        "old comment");
+            auto info = TooJpeg17::inspect_jpeg(ByteView(jpeg.data(), jpeg.size()));
+            ASSERT_THROW(info.valid && info.baseline);
+            ASSERT_EQUAL(info.width, unsigned(w));
+            ASSERT_EQUAL(info.height, unsigned(h));
+            ASSERT_EQUAL(info.components, isRGB ? 3u : 1u);
+            ASSERT_EQUAL(info.quality, quality);
+            ASSERT_THROW(info.within_quality(quality) && info.within_quality(100) &&
+                         !info.within_quality(quality - 1));
+
+            // without its DQT segments (like an abbreviated stream) the quality is unknown, it is never copied
+            auto abbreviated = jpeg;
+            for (std::size_t pos = 2; pos + 4 <= abbreviated.size() && abbreviated[pos + 1] != 0xDA;) {
+                std::size_t length = 2 + (abbreviated[pos + 2] << 8u | abbreviated[pos + 3]);
+                if (abbreviated[pos + 1] == 0xDB) abbreviated.erase(abbreviated.begin() + pos, abbreviated.begin() + pos + length);
+                else pos += length;
+            }
+            auto unknown = TooJpeg17::inspect_jpeg(ByteView(abbreviated.data(), abbreviated.size()));
+            ASSERT_THROW(unknown.valid && unknown.baseline && unknown.quality == 0 && !unknown.within_quality(100));
+
+            std::vector<std::uint8_t> copy;
+            ASSERT_THROW(TooJpeg17::rewriteJpegComment(TooJpeg17::VectorSink(copy), ByteView(jpeg.data(), jpeg.size()),
+                                                       "new"));
+            ASSERT_EQUAL(copy.size(), jpeg.size() - std::string_view("old comment").size() + 3);
+            std::string_view text(reinterpret_cast<const char *>(copy.data()), copy.size());
+            ASSERT_THROW(text.find("new") != std::string_view::npos);
+            ASSERT_THROW(text.find("old comment") == std::string_view::npos);
+            ASSERT_THROW(decode(copy, isRGB ? 3 : 1) == decode(jpeg, isRGB ? 3 : 1));
+
+            // truncated files are rejected
+            ASSERT_THROW(!TooJpeg17::inspect_jpeg(ByteView(jpeg.data(), 100)).valid);
+        }
+    }
+    std::array<std::uint8_t, 4> notJpeg = {'P', '6', '\n', '1'};
+    ASSERT_THROW(!TooJpeg17::inspect_jpeg(ByteView(notJpeg.data(), notJpeg.size())).valid);
+}
+
+/// Uncompressed, top-left origin TGA with 8 bit/pixel gray, 16 bit/pixel gray + alpha, 24 bit BGR or 32 bit BGRA
+std::vector<std::uint8_t> tga(int w, int h, int channels, const std::vector<std::uint8_t> &pixels) {
+    std::vector<std::uint8_t> file = {0, 0, std::uint8_t(channels <= 2 ? 3 : 2), 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                      std::uint8_t(w), std::uint8_t(w >> 8), std::uint8_t(h), std::uint8_t(h >> 8),
+                                      std::uint8_t(channels * 8), std::uint8_t(0x20 | (channels % 2 ? 0 : 8))};
+    for (std::size_t i = 0; i < pixels.size(); i += channels) {
+        if (channels >= 3) file.insert(file.end(), {pixels[i + 2], pixels[i + 1], pixels[i]});
+        else file.push_back(pixels[i]);
+        if (channels % 2 == 0) file.push_back(pixels[i + channels - 1]);
+    }
+    return file;
+}
+
+void testNativeChannels() {
+    const auto w = 37, h = 21;
+    for (auto channels: {1, 2, 3, 4}) {
+        std::vector<std::uint8_t> pixels(w * h * channels);
+        for (std::size_t i = 0; i < pixels.size(); i++) pixels[i] = (i * 11) % 256;
+        auto file = tga(w, h, channels, pixels);
+
+        ImageLoader image(file.data(), file.size());
+        ASSERT_THROW(image.is_valid());
+        ASSERT_EQUAL(image.sourceChannels, channels);
+        // alpha is stripped, gray stays gray
+        const auto expected = channels <= 2 ? 1 : 3;
+        ASSERT_EQUAL(image.channels, expected);
+        ASSERT_THROW(image.is_rgb() == (expected == 3));
+        for (std::size_t i = 0; i < std::size_t(w * h); i++)
+            for (auto c = 0; c < expected; c++) ASSERT_EQUAL((*image)[i * expected + c], pixels[i * channels + c]);
+
+        // grayscale is encoded with a single component
+        std::vector<std::uint8_t> jpeg;
+        ASSERT_THROW(TooJpeg17::writeJpeg<90>(TooJpeg17::VectorSink(jpeg), *image, w, h, false, image.is_rgb()));
+        auto info = TooJpeg17::inspect_jpeg(ByteView(jpeg.data(), jpeg.size()));
+        ASSERT_EQUAL(info.components, unsigned(expected));
+    }
+}
+
+void testLargeDimensions() {
+    // dimensions beyond the JPEG limit are rejected
+    std::vector<std::uint8_t> output, pixels(3);
+    ASSERT_THROW(!TooJpeg17::writeJpeg<90>(TooJpeg17::VectorSink(output), pixels.data(), 65536, 1, false, true));
+    ASSERT_THROW(!TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(output), pixels.data(), 1, 70000, false, true, 90));
+    auto threw = false;
+    try {
+        TooJpeg17::VectorSink sink(output);
+        TooJpeg17::ScanlineEncoder encoder(sink, 65536, 8, false, true, 90);
+    } catch (const std::runtime_error &) { threw = true; }
+    ASSERT_THROW(threw);
+
+    // tiled source with clipped border tiles, the generator never holds the whole frame
+    auto pixel = [](std::uint32_t x, std::uint32_t y, int c) { return std::uint8_t((x * 3 + y * 5 + c * 70) % 256); };
+    for (auto [w, h, isRGB, downsample]: {std::tuple{1000u, 700u, true, true}, std::tuple{65535u, 40u, false, false}}) {
+        const auto channels = isRGB ? 3 : 1;
+        std::vector<std::uint8_t> tiled;
+        TooJpeg17::VectorSink sink(tiled);
+        TooJpeg17::ScanlineEncoder encoder(sink, w, h, downsample, isRGB, 80);
+        auto fetched = std::size_t(0);
+        ASSERT_THROW(TooJpeg17::encodeTiles(encoder, 300, 17, [&](std::uint32_t x, std::uint32_t y, std::uint32_t tw,
+                                                                    std::uint32_t th, std::uint8_t *tile,
+                                                                    std::size_t stride) {
+            for (std::uint32_t row = 0; row < th; row++)
+                for (std::uint32_t column = 0; column < tw; column++)
+                    for (auto c = 0; c < channels; c++)
+                        tile[row * stride + column * channels + c] = pixel(x + column, y + row, c);
+            fetched += std::size_t(tw) * th;
+            return true;
+        }));
+        ASSERT_THROW(encoder.finished());
+        ASSERT_EQUAL(fetched, std::size_t(w) * h);
+
+        std::vector<std::uint8_t> image(std::size_t(w) * h * channels), direct;
+        for (std::uint32_t y = 0; y < h; y++)
+            for (std::uint32_t x = 0; x < w; x++)
+                for (auto c = 0; c < channels; c++) image[(std::size_t(y) * w + x) * channels + c] = pixel(x, y, c);
+        ASSERT_THROW(TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(direct), image.data(), w, h, downsample, isRGB,
+                                                 80));
+        ASSERT_THROW(tiled == direct);
+        auto info = TooJpeg17::inspect_jpeg(ByteView(tiled.data(), tiled.size()));
+        ASSERT_EQUAL(info.width, w);
+        ASSERT_EQUAL(info.height, h);
+    }
+}
+
+void testOptimizedHuffman() {
+    const auto w = 640, h = 480;
+    std::mt19937 random(17);
+    auto image = std::vector<unsigned char>(w * h * 3);
+    // smooth gradients plus some noise, similar to photos
+    for (auto y = 0; y < h; y++)
+        for (auto x = 0; x < w; x++)
+            for (auto c = 0; c < 3; c++)
+                image[(y * w + x) * 3 + c] = std::uint8_t((x * (c + 1) / 5 + y / (c + 2) + random() % 8) % 256);
+    auto uniform = std::vector<unsigned char>(w * h * 3, 128);
+
+    for (auto pixels: {&image, &uniform})
+        for (auto isRGB: {true, false})
+            for (auto downsample: {false, true})
+                for (auto restartRows: {0u, 5u})
+                    for (auto [width, height]: {std::pair{w, h}, std::pair{1, 1}, std::pair{17, 9}}) {
+                        TooJpeg17::EncodeOptions options;
+                        options.restartRows = restartRows;
+                        std::vector<std::uint8_t> standard, optimized;
+                        ASSERT_THROW(TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(standard), pixels->data(), width,
+                                                                 height, downsample, isRGB, 90, "", options));
+                        options.optimizeHuffman = true;
+                        ASSERT_THROW(TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(optimized), pixels->data(),
+                                                                 width, height, downsample, isRGB, 90, "", options));
+
+                        // same coefficients, different entropy coding
+                        auto channels = isRGB ? 3 : 1;
+                        ASSERT_THROW(decode(optimized, channels) == decode(standard, channels));
+                        if (width == w) ASSERT_THROW(optimized.size() < standard.size());
+                    }
+}
+
+void testBoundedSubmit() {
+    const std::size_t capacity = 3;
+    std::atomic<std::size_t> running{0}, maxRunning{0}, done{0}, submitted{0};
+    std::atomic<bool> release{false};
+    TooJpeg17::BatchEncoder encoder(2);
+    // the producer runs on its own thread and has to wait whenever `capacity` jobs are pending
+    std::thread producer([&] {
+        for (auto i = 0; i < 20; i++, submitted++)
+            encoder.submit_bounded([&](TooJpeg17::BatchEncoder::Scratch &) {
+                auto now = ++running;
+                for (auto max = maxRunning.load(); now > max && !maxRunning.compare_exchange_weak(max, now);) {}
+                while (!release) std::this_thread::yield();
+                running--;
+                done++;
+                return true;
+            }, capacity);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    // the workers are blocked, so the producer stalls at the capacity
+    ASSERT_EQUAL(done.load(), std::size_t(0));
+    ASSERT_EQUAL(submitted.load(), capacity);
+    release = true;
+    producer.join();
+    encoder.wait();
+    ASSERT_EQUAL(done.load(), std::size_t(20));
+    ASSERT_THROW(maxRunning <= 2);
+}
+
+/// Reads and writes with the given backend, more operations than the queue depth
+void testIoEngine(IoEngine::Backend backend) {
+    auto directory = std::filesystem::temp_directory_path() / ("toojpeg17_io_" + std::to_string(::getpid()));
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    const std::size_t files = 40;
+    auto content = [](std::size_t i) {
+        std::vector<std::uint8_t> data(i * 7919 + (i == 3 ? 5 << 20 : 0));
+        for (std::size_t j = 0; j < data.size(); j++) data[j] = std::uint8_t(j * 31 + i);
+        return data;
+    };
+    {
+        IoEngine io(4, backend);
+        if (backend == IoEngine::Backend::Threads) ASSERT_THROW(!io.uses_io_uring());
+        std::atomic<std::size_t> written{0};
+        for (std::size_t i = 0; i < files; i++)
+            io.write(directory / std::to_string(i), content(i), [&](int error) { if (!error) written++; });
+        // the target directory does not exist
+        std::atomic<int> failed{0};
+        io.write(directory / "missing" / "file", content(1), [&](int error) { failed = error; });
+        io.wait();
+        ASSERT_EQUAL(written.load(), files);
+        ASSERT_EQUAL(failed.load(), ENOENT);
+        // no temporary files are left behind
+        ASSERT_EQUAL(std::size_t(std::distance(std::filesystem::directory_iterator(directory),
+                                               std::filesystem::directory_iterator{})), files);
+
+        std::vector<std::future<IoEngine::File>> reads;
+        for (std::size_t i = 0; i < files; i++) reads.push_back(io.read(directory / std::to_string(i)));
+        for (std::size_t i = 0; i < files; i++) {
+            auto file = reads[i].get();
+            ASSERT_THROW(file.ok() && file.data == content(i));
+        }
+        auto missing = io.read(directory / "missing").get();
+        ASSERT_THROW(!missing.ok() && missing.error == ENOENT && missing.data.empty());
+
+        // an existing file is replaced
+        io.write(directory / "0", content(2));
+        io.wait();
+        ASSERT_THROW(io.read(directory / "0").get().data == content(2));
+
+        // the written buffer is handed back, a pool keeps it (up to its capacity) for the next output
+        BufferPool buffers(1);
+        ASSERT_THROW(buffers.take().empty());
+        for (auto i: {4, 5})
+            io.write(directory / ("pooled" + std::to_string(i)), content(i), [&, i](IoEngine::File &&written) {
+                ASSERT_THROW(written.ok() && written.data == content(i));
+                buffers.give_back(std::move(written.data));
+            });
+        io.wait();
+        ASSERT_EQUAL(buffers.size(), std::size_t(1));
+        auto buffer = buffers.take();
+        ASSERT_THROW(buffer.empty() && buffer.capacity() >= content(4).size() && buffers.size() == 0);
+        ASSERT_THROW(io.read(directory / "pooled5").get().data == content(5));
+        std::filesystem::remove(directory / "pooled4");
+        std::filesystem::remove(directory / "pooled5");
+
+        // files taken in any order, each read once
+        std::vector<std::filesystem::path> paths;
+        for (std::size_t i = 0; i < files; i++) paths.push_back(directory / std::to_string(i));
+        paths.push_back(directory / "missing");
+        ReadAhead inputs(io, paths, 3);
+        ASSERT_EQUAL(inputs.size(), files + 1);
+        // nothing is read before the first take, then only the window after the taken file
+        ASSERT_EQUAL(inputs.ahead(), std::size_t(0));
+        ASSERT_THROW(inputs.take(5).data == content(5));
+        ASSERT_EQUAL(inputs.ahead(), std::size_t(3));
+        ASSERT_THROW(inputs.take(1).data == content(1));
+        ASSERT_THROW(!inputs.take(files).ok());
+        std::vector<std::thread> takers;
+        std::atomic<std::size_t> matched{0};
+        for (std::size_t t = 0; t < 4; t++)
+            takers.emplace_back([&, t] {
+                for (std::size_t i = t; i < files; i += 4) {
+                    if (i == 1 || i == 5) continue;
+                    if (inputs.take(i).data == (i ? content(i) : content(2))) matched++;
+                }
+            });
+        for (auto &taker: takers) taker.join();
+        ASSERT_EQUAL(matched.load(), files - 2);
+        ASSERT_THROW(!inputs.take(5).ok());
+        ASSERT_EQUAL(inputs.ahead(), std::size_t(0));
+
+        // the reads ahead end with the caller's range
+        ReadAhead chunked(io, paths, 4);
+        ASSERT_THROW(chunked.take(2, 4).data == content(2));
+        ASSERT_EQUAL(chunked.ahead(), std::size_t(1));
+        ASSERT_THROW(chunked.take(3, 4).data == content(3));
+        ASSERT_EQUAL(chunked.ahead(), std::size_t(0));
+    }
+    std::filesystem::remove_all(directory);
+}
+
+void testDirectoryScanner() {
+    auto directory = std::filesystem::temp_directory_path() / ("toojpeg17_scan_" + std::to_string(::getpid()));
+    std::filesystem::remove_all(directory);
+    for (auto sub: {"a/b", "c", ".hidden"}) std::filesystem::create_directories(directory / sub);
+    auto touch = [&](const std::string &name, std::size_t size) {
+        std::ofstream(directory / name, std::ios::binary) << std::string(size, 'x');
+    };
+    touch("1.png", 10);
+    touch("2.JPG", 20);
+    touch("2.JPG.new.jpg", 5);
+    touch("3.gif", 30);
+    touch("notes.txt", 1);
+    touch("noextension", 1);
+    touch("a/4.bmp", 40);
+    touch("a/b/5.jpeg", 50);
+    touch("c/6.png", 60);
+    touch(".hidden/7.png", 70);
+    std::filesystem::create_symlink(directory / "1.png", directory / "link.png");
+    std::filesystem::create_directory_symlink(directory / "a", directory / "c/loop");
+
+    auto names = [&](const std::vector<ScannedFile> &files) {
+        std::vector<std::string> result;
+        for (auto &file: files) result.push_back(file.path.lexically_relative(directory).string());
+        return result;
+    };
+    auto flat = DirectoryScanner().scan(directory);
+    ASSERT_THROW(names(flat) == std::vector<std::string>({"1.png", "3.gif", "link.png"}));
+    ASSERT_EQUAL(flat[1].size, std::uint64_t(30));
+
+    ScanOptions options;
+    options.recursive = true;
+    options.threads = 3;
+    auto all = DirectoryScanner(options).scan(directory);
+    ASSERT_THROW(names(all) == std::vector<std::string>({"1.png", "3.gif", "a/4.bmp", "a/b/5.jpeg", "c/6.png",
+                                                         "link.png"}));
+    options.extensions.clear();
+    options.convertedSuffix.clear();
+    ASSERT_EQUAL(DirectoryScanner(options).scan(directory).size(), std::size_t(10));
+    bool threw = false;
+    try { (void) DirectoryScanner().scan(directory / "missing"); }
+    catch (const std::runtime_error &) { threw = true; }
+    ASSERT_THROW(threw);
+
+    // chunks of about 60 bytes, largest files first
+    auto chunked = all;
+    auto chunks = balance_chunks(chunked, 60);
+    ASSERT_EQUAL(chunked.front().size, std::uint64_t(60));
+    ASSERT_EQUAL(chunks.size(), std::size_t(4));
+    ASSERT_THROW(chunks[0].begin == 0 && chunks[0].end == 1 && chunks[0].bytes == 60);
+    ASSERT_THROW(chunks.back().end == chunked.size());
+    std::uint64_t bytes = 0;
+    for (auto &chunk: chunks) bytes += chunk.bytes;
+    ASSERT_EQUAL(bytes, std::uint64_t(10 + 30 + 40 + 50 + 60 + 10));
+    ASSERT_EQUAL(balance_chunks(chunked, 1000, 2).size(), std::size_t(3));
+
+    // every file in exactly one shard, balanced by bytes, independent of the order of the list
+    auto manifest = directory / "manifest";
+    ASSERT_THROW(write_manifest(manifest, all));
+    auto read = read_manifest(manifest);
+    ASSERT_THROW(names(read) == names(all) && read[2].size == 40);
+    std::reverse(read.begin(), read.end());
+    std::vector<std::string> covered;
+    for (unsigned i = 0; i < 3; i++) {
+        auto part = names(shard(read, i, 3));
+        ASSERT_THROW(part == names(shard(all, i, 3)));
+        covered.insert(covered.end(), part.begin(), part.end());
+    }
+    std::sort(covered.begin(), covered.end());
+    ASSERT_THROW(covered == names(all));
+    ASSERT_EQUAL(shard(all, 0, 1).size(), all.size());
+
+    std::filesystem::remove_all(directory);
+}
+
+void testMetrics() {
+    if constexpr (!Metrics::Enabled) return;
+    const uint32_t w = 64, h = 48;
+    std::vector<uint8_t> pixels(w * h * 3, 100);
+    auto encode = [&] {
+        std::vector<uint8_t> output;
+        ASSERT_THROW(TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(output), pixels.data(), w, h, false, true, 90));
+    };
+    encode();
+    // counters of other threads are merged, also after the thread finished
+    std::thread(encode).join();
+    auto snapshot = Metrics::snapshot();
+    ASSERT_EQUAL(snapshot[Metrics::Counter::Images], std::uint64_t(2));
+    ASSERT_EQUAL(snapshot[Metrics::Counter::Pixels], std::uint64_t(2 * w * h));
+    ASSERT_EQUAL(snapshot[Metrics::Counter::Blocks], std::uint64_t(2 * (w / 8) * (h / 8) * 3));
+    ASSERT_EQUAL(snapshot[Metrics::Timer::Encode].count, std::uint64_t(2));
+    ASSERT_THROW(snapshot[Metrics::Timer::Encode].nanoseconds > 0);
+    // the first MCU row of each thread is sampled
+    ASSERT_EQUAL(snapshot[Metrics::Timer::EncodeColor].count, std::uint64_t(2));
+    ASSERT_EQUAL(snapshot[Metrics::Timer::EncodeBlocks].count, std::uint64_t(2));
+
+    Metrics::enable_histograms();
+    Metrics::enable_tracing();
+    encode();
+    std::stringstream prometheus, json, trace;
+    Metrics::write_prometheus(prometheus, Metrics::snapshot());
+    Metrics::write_json(json, Metrics::snapshot());
+    Metrics::write_trace(trace);
+    ASSERT_THROW(prometheus.str().find("toojpeg17_images_total 3\n") != std::string::npos);
+    ASSERT_THROW(prometheus.str().find("# TYPE toojpeg17_stage_seconds histogram") != std::string::npos);
+    ASSERT_THROW(prometheus.str().find("toojpeg17_stage_seconds_bucket{stage=\"encode\",le=\"+Inf\"} 3\n") !=
+                 std::string::npos);
+    ASSERT_THROW(json.str().find("\"images\": 3") != std::string::npos);
+    ASSERT_THROW(json.str().find("\"encode\": {\"count\": 3") != std::string::npos);
+    // only the scope timed while tracing
+    auto events = trace.str();
+    ASSERT_THROW(events.find("\"name\": \"encode\"") != std::string::npos);
+    ASSERT_THROW(events.find("\"name\": \"encode\"") == events.rfind("\"name\": \"encode\""));
+    ASSERT_THROW(events.find("\"dropped_events\": 0") != std::string::npos);
+}
+
+void testQuantTables() {
+    using namespace TooJpeg17;
+    // the bank holds the very tables that writeJpeg<quality>() computes at compile time
+    for (unsigned quality = 1; quality <= 100; quality++) {
+        auto expected = quality_tables((unsigned char) quality);
+        auto &cached = quant_tables((unsigned char) quality);
+        ASSERT_THROW(cached.luminance == expected.luminance && cached.chrominance == expected.chrominance);
+        ASSERT_THROW(cached.scaledLuminance == expected.scaledLuminance);
+        ASSERT_THROW(cached.scaledChrominance == expected.scaledChrominance);
+    }
+    auto throws = [](auto &&f) {
+        try { f(); } catch (const std::exception &) { return true; }
+        return false;
+    };
+    ASSERT_THROW(throws([] { (void) quant_tables(0); }));
+    ASSERT_THROW(throws([] { (void) quant_tables(101); }));
+
+    const auto w = 61, h = 35;
+    std::vector<uint8_t> pixels(w * h * 3);
+    for (std::size_t i = 0; i < pixels.size(); i++) pixels[i] = (i * 13 + i / 97) % 256;
+    for (unsigned quality: {2u, 37u, 90u, 100u}) {
+        std::vector<uint8_t> dynamic, fixed;
+        ASSERT_THROW(writeJpegQuality(VectorSink(dynamic), pixels.data(), w, h, true, true, quality));
+        // runtime quality to a writeJpeg<quality>() instantiation
+        ASSERT_THROW(dispatch_quality((unsigned char) quality, [&](auto q) {
+            ASSERT_EQUAL(unsigned(decltype(q)::value), quality);
+            return writeJpeg<decltype(q)::value>(VectorSink(fixed), pixels.data(), w, h, true, true);
+        }));
+        ASSERT_THROW(dynamic == fixed);
+    }
+    ASSERT_THROW(throws([] { dispatch_quality(1, [](auto) { return 0; }); }));
+
+    // custom tables: flat steps, registered by name
+    std::array<uint8_t, 8 * 8> flat{};
+    flat.fill(12);
+    flat[63] = 0;
+    auto &registered = register_quant_tables("flat", make_quant_tables(flat, flat));
+    ASSERT_THROW(&register_quant_tables("flat", make_quant_tables(flat, flat)) == &registered);
+    ASSERT_THROW(find_quant_tables("flat") == &registered);
+    ASSERT_THROW(find_quant_tables("missing") == nullptr);
+    ASSERT_THROW(throws([] { register_quant_tables("flat", quant_tables(50)); }));
+    ASSERT_EQUAL(unsigned(registered.luminance[0]), 12u);
+    // zigzag position 63 is the last coefficient, raised to 1
+    ASSERT_EQUAL(unsigned(registered.luminance[63]), 1u);
+
+    std::vector<uint8_t> custom, streamed;
+    ASSERT_THROW(writeJpegTables(VectorSink(custom), pixels.data(), w, h, false, true, *find_quant_tables("flat")));
+    // DQT segment: marker, length, table id, then the luminance steps
+    const uint8_t marker[] = {0xFF, 0xDB};
+    auto dqt = std::search(custom.begin(), custom.end(), std::begin(marker), std::end(marker));
+    ASSERT_THROW(dqt != custom.end() && dqt[5] == 12 && dqt[4 + 64] == 1);
+    VectorSink sink(streamed);
+    ScanlineEncoder encoder(sink, w, h, false, true, registered);
+    encoder.push(pixels.data(), h);
+    ASSERT_THROW(streamed == custom);
+}
+
+void testColorFrontEnd() {
+    // the hashes of the per pixel conversion: image borders within and across strips, all modes
+    struct Case {
+        uint32_t width, height;
+        int mode; // 0 grayscale, 1 YCbCr 4:4:4, 2 YCbCr 4:2:0
+        const char *sha256;
+    };
+    const Case cases[] = {
+            {1, 1, 0, "6de2a10cb8bbbb48b97b390e43b2b83610cb3a5628cd4f78f574cd665262e11b"},
+            {1, 1, 1, "57d1c02f9c5affcb22946494e8db76ab8733751d53613518e1142f5ddcd5df8c"},
+            {1, 1, 2, "fde23e593fc032ca79c91af440af3433b113b6c45fa6cd45875b836e239a14a9"},
+            {17, 13, 0, "6f3f0a67be651a02c0448fdef083d59098a920b215286517b668705d92029396"},
+            {17, 13, 1, "f95f3f7ee5d49f61db5fa9f0a33cc3643d4f928547bb3387b0ef16ce417ae9cc"},
+            {17, 13, 2, "5f7c34cc5dc6e11509cc506e570dc1742a35090e8a90f447e51b793259a34c34"},
+            {300, 37, 0, "678f36d2d73f7cd838bbeb84995747ab424013f73e7eafcee7bd349f51bfcdb9"},
+            {300, 37, 1, "ce78b434f98bfec48f1f491f0984dc5216c369569396cc0da03abea78b55eca9"},
+            {300, 37, 2, "8ff6386cbbb38930c054c209e02a9d84ab8839ad76b0f89f71424793bb00e4d7"},
+            {513, 19, 0, "b96a9ba1f182c939928b5ffb04e751872749f2433d10b2b063de7a9b7e74184c"},
+            {513, 19, 1, "34edd13a4f8d7f53460dfd3d82c6bce568da48fd28419e1df6f602e5a63aecc7"},
+            {513, 19, 2, "cf5f35387498f8d48dc432a151d9aefb169acc84b7723468f750581e616ad6ba"},
+            {1031, 40, 0, "f78ac266a08a3cb75d3e34ced5d9584de428be65e6be8f1b4b72bf79f4f5c8d7"},
+            {1031, 40, 1, "d7b684e4160003dc4906e33aec28eb6e79a07631466bde35ca050919dd87cde6"},
+            {1031, 40, 2, "fdb98608a3e4e0d6806a6e39f86b356ed8ab1ddc9586e90ec6dce297ffd58a0b"}};
+    for (auto &c: cases) {
+        const bool isRGB = c.mode > 0;
+        std::vector<unsigned char> image(std::size_t(c.width) * c.height * (isRGB ? 3 : 1));
+        for (std::size_t i = 0; i < image.size(); i++) image[i] = (i * 7 + i / 97) % 251;
+        std::vector<std::uint8_t> output;
+        ASSERT_THROW(TooJpeg17::writeJpeg<85>(TooJpeg17::VectorSink(output), image.data(), c.width, c.height,
+                                              c.mode == 2, isRGB));
+        ASSERT_EQUAL(picosha2::hash256_hex_string(output), std::string(c.sha256));
+    }
+}
+
+void testBitWriter() {
+    using namespace TooJpeg17;
+    // reference: one bit at a time, stuffing a zero after each 0xFF
+    std::vector<std::uint8_t> expected;
+    unsigned current = 0, bits = 0;
+    auto referenceBit = [&](unsigned bit) {
+        current = (current << 1u) | bit;
+        if (++bits < 8) return;
+        expected.push_back(uint8_t(current));
+        if (uint8_t(current) == 0xFF) expected.push_back(0);
+        current = bits = 0;
+    };
+    auto reference = [&](const BitCode &code) {
+        for (auto bit = int(code.numBits) - 1; bit >= 0; bit--) referenceBit((code.code >> unsigned(bit)) & 1u);
+    };
+
+    // many 0xFF bytes (mostly set bits) and enough output to cross the staging buffer several times
+    std::mt19937 random(7);
+    std::vector<std::uint8_t> output;
+    VectorSink sink(output);
+    BitWriter<VectorSink> writer(sink);
+    for (auto i = 0; i < 20000; i++) {
+        auto numBits = uint8_t(1 + random() % 16);
+        auto code = uint16_t(random() % 4 == 0 ? random() : 0xFFFF);
+        BitCode symbol(uint16_t(code & ((1u << numBits) - 1)), numBits);
+        if (i % 3) {
+            writer << symbol;
+            reference(symbol);
+            continue;
+        }
+        auto valueBits = uint8_t(1 + random() % 11);
+        BitCode value(uint16_t(random() & ((1u << valueBits) - 1)), valueBits);
+        writer.writeCodes(symbol, value);
+        reference(symbol);
+        reference(value);
+        // bytes written directly follow the complete bytes of the bit buffer
+        if (i % 1000 == 0) {
+            writer.flush();
+            while (bits) referenceBit(1);
+            writer << uint8_t(0xFF) << uint8_t(0xD0);
+            expected.push_back(0xFF);
+            expected.push_back(0xD0);
+        }
+    }
+    writer.flush();
+    writer.drain();
+    while (bits) referenceBit(1);
+    ASSERT_EQUAL(output.size(), expected.size());
+    ASSERT_THROW(output == expected);
+}
+
+void testTargetSize() {
+    using namespace TooJpeg17;
+    const uint32_t w = 173, h = 91;
+    std::vector<unsigned char> pixels(w * h * 3);
+    for (std::size_t i = 0; i < pixels.size(); i++) pixels[i] = uint8_t((i * 13 + (i / 519) * 7) % 256);
+    auto encode = [&](unsigned char quality, const EncodeOptions &options) {
+        std::vector<std::uint8_t> out;
+        ASSERT_THROW(writeJpegQuality(VectorSink(out), pixels.data(), w, h, true, true, quality, "c", options));
+        return out;
+    };
+
+    EncodeOptions optimized;
+    optimized.optimizeHuffman = true;
+    optimized.restartRows = 2;
+    for (auto &options: {EncodeOptions{}, optimized}) {
+        // a budget between two qualities: the higher one does not fit
+        auto budget = (encode(60, options).size() + encode(61, options).size()) / 2;
+        std::vector<std::uint8_t> output;
+        auto result = writeJpegTargetSize(VectorSink(output), pixels.data(), w, h, true, true, TargetSize{budget},
+                                          "c", options);
+        ASSERT_THROW(result && result->fits);
+        ASSERT_EQUAL(output.size(), result->bytes);
+        ASSERT_THROW(result->bytes <= budget);
+        ASSERT_THROW(result->probes <= 8);
+        // byte-identical to a direct encoding with the chosen quality
+        ASSERT_THROW(output == encode(result->quality, options));
+        ASSERT_THROW(result->quality == 100 || encode((unsigned char) (result->quality + 1), options).size() > budget);
+    }
+
+    // too small: the lowest quality of the range, marked as not fitting
+    std::vector<std::uint8_t> output;
+    auto result = writeJpegTargetSize(VectorSink(output), pixels.data(), w, h, false, true, TargetSize{100, 10, 90});
+    ASSERT_THROW(result && !result->fits);
+    ASSERT_EQUAL(int(result->quality), 10);
+    ASSERT_EQUAL(output.size(), result->bytes);
+
+    // a generous budget in bits per pixel
+    output.clear();
+    result = writeJpegTargetSize(VectorSink(output), pixels.data(), w, h, false, false,
+                                 TargetSize::bitsPerPixel(16, w, h));
+    ASSERT_THROW(result && result->fits);
+    ASSERT_EQUAL(int(result->quality), 100);
+
+    ASSERT_THROW(!writeJpegTargetSize(VectorSink(output), nullptr, w, h, false, true, TargetSize{1000}));
+    bool thrown = false;
+    try {
+        (void) writeJpegTargetSize(VectorSink(output), pixels.data(), w, h, false, true, TargetSize{1000, 1, 100});
+    } catch (const std::runtime_error &) { thrown = true; }
+    ASSERT_THROW(thrown);
+}
+
+void testResize() {
+    using namespace TooJpeg17;
+    const uint32_t w = 203, h = 117;
+    std::vector<unsigned char> gradient(w * h * 3), flat(w * h, 77);
+    for (uint32_t y = 0; y < h; y++)
+        for (uint32_t x = 0; x < w; x++)
+            for (uint32_t c = 0; c < 3; c++) gradient[(y * w + x) * 3 + c] = uint8_t(x + c * 20);
+    const ResizeFilter filters[] = {ResizeFilter::Box, ResizeFilter::Bilinear, ResizeFilter::Lanczos3};
+
+    // the same size is a copy, a flat image stays flat with and without the box pyramid, at any size
+    for (auto filter: filters) {
+        auto same = resize_image(gradient.data(), w, h, 3, {ResizeTarget{w, h, filter}});
+        ASSERT_THROW(same.size() == 1 && same[0].pixels == gradient);
+        for (float gap: {0.f, 3.f}) {
+            std::vector<ResizeTarget> targets{{w / 2, h / 2, filter, gap}, {9, 5, filter, gap}, {1, 1, filter, gap},
+                                              {w * 2 + 1, h + 3, filter, gap}, {w, 1, filter, gap}};
+            auto images = resize_image(flat.data(), w, h, 1, targets);
+            ASSERT_EQUAL(images.size(), targets.size());
+            for (std::size_t i = 0; i < images.size(); i++) {
+                ASSERT_EQUAL(images[i].width, targets[i].width);
+                ASSERT_EQUAL(images[i].height, targets[i].height);
+                ASSERT_EQUAL(images[i].pixels.size(), std::size_t(targets[i].width) * targets[i].height);
+                ASSERT_THROW(std::all_of(images[i].pixels.begin(), images[i].pixels.end(),
+                                         [](uint8_t value) { return value == 77; }));
+            }
+        }
+    }
+
+    // a horizontal gradient stays a gradient: the center of each output pixel, 1 off at most
+    for (auto filter: filters) {
+        auto images = resize_image(gradient.data(), w, h, 3, {ResizeTarget{31, 20, filter, 0}});
+        auto &image = images[0];
+        for (uint32_t y = 0; y < image.height; y++)
+            for (uint32_t x = 1; x + 1 < image.width; x++)
+                for (uint32_t c = 0; c < 3; c++) {
+                    auto expected = (x + 0.5) * w / image.width - 0.5 + c * 20;
+                    ASSERT_THROW(std::abs(image.pixels[(y * image.width + x) * 3 + c] - expected) <= 1);
+                }
+    }
+
+    // one pass for several sizes gives the same pixels as one resize per size, and so does row by row input
+    std::vector<ResizeTarget> targets{{100, 58}, {50, 29, ResizeFilter::Bilinear}, {12, 7, ResizeFilter::Box},
+                                      {25, 14, ResizeFilter::Lanczos3, 0}};
+    auto together = resize_image(gradient.data(), w, h, 3, targets);
+    Resizer streaming(w, h, 3, targets);
+    for (uint32_t y = 0; y < h; y++) streaming.push_row(&gradient[y * w * 3]);
+    auto rows = streaming.finish();
+    for (std::size_t i = 0; i < targets.size(); i++) {
+        ASSERT_THROW(together[i].pixels == resize_image(gradient.data(), w, h, 3, {targets[i]})[0].pixels);
+        ASSERT_THROW(together[i].pixels == rows[i].pixels);
+    }
+
+    // a box halving is the rounded 2x2 average, exact or from the first pyramid level
+    std::vector<unsigned char> noise(64 * 48 * 3);
+    std::mt19937 random(5);
+    for (auto &value: noise) value = uint8_t(random());
+    auto exact = resize_image(noise.data(), 64, 48, 3, {ResizeTarget{32, 24, ResizeFilter::Box, 0}});
+    auto reduced = resize_image(noise.data(), 64, 48, 3, {ResizeTarget{32, 24, ResizeFilter::Box, 1}});
+    ASSERT_THROW(exact[0].pixels == reduced[0].pixels);
+    auto at = [&](uint32_t x, uint32_t y, uint32_t c) { return unsigned(noise[(y * 64 + x) * 3 + c]); };
+    for (uint32_t y = 0; y < 24; y++)
+        for (uint32_t x = 0; x < 32; x++)
+            for (uint32_t c = 0; c < 3; c++) {
+                auto sum = at(2 * x, 2 * y, c) + at(2 * x + 1, 2 * y, c) + at(2 * x, 2 * y + 1, c) +
+                           at(2 * x + 1, 2 * y + 1, c);
+                ASSERT_EQUAL(unsigned(exact[0].pixels[(y * 32 + x) * 3 + c]), (sum + 2) / 4);
+            }
+
+    // thumbnail sizes keep the aspect ratio and never upscale
+    auto fit = ResizeTarget::fit(4000, 3000, 200, 200);
+    ASSERT_EQUAL(fit.width, 200u);
+    ASSERT_EQUAL(fit.height, 150u);
+    fit = ResizeTarget::fit(100, 40, 200, 200);
+    ASSERT_EQUAL(fit.width, 100u);
+    ASSERT_EQUAL(fit.height, 40u);
+
+    // thumbnails are ready for the encoder
+    std::vector<std::uint8_t> jpeg;
+    ASSERT_THROW(writeJpegQuality(VectorSink(jpeg), together[1].pixels.data(), together[1].width, together[1].height,
+                                  true, true, 80));
+
+    bool thrown = false;
+    try { Resizer(w, h, 2, targets); } catch (const std::invalid_argument &) { thrown = true; }
+    ASSERT_THROW(thrown);
+    thrown = false;
+    try { Resizer(w, h, 3, {ResizeTarget{0, 10}}); } catch (const std::invalid_argument &) { thrown = true; }
+    ASSERT_THROW(thrown);
+    thrown = false;
+    try { Resizer(w, h, 3, targets).finish(); } catch (const std::logic_error &) { thrown = true; }
+    ASSERT_THROW(thrown);
+
+    // the sizes of --thumbnails
+    auto sizes = parse_thumbnail_sizes("160x120,1024x1");
+    ASSERT_THROW(sizes && sizes->size() == 2 && (*sizes)[0].width == 160 && (*sizes)[0].height == 120 &&
+                 (*sizes)[1].width == 1024 && (*sizes)[1].height == 1);
+    for (auto invalid: {"", "160", "160x", "x120", "0x10", "160x120,", "160x120x3", "70000x10", "-1x10", "16 x 9"})
+        ASSERT_THROW(!parse_thumbnail_sizes(invalid));
+}
+
+/// An uncompressed PNG (stored deflate blocks, no CRC or Adler checksums: stb skips them), in several IDAT chunks
+std::vector<std::uint8_t> png(int w, int h, int channels, const std::vector<std::uint8_t> &pixels) {
+    auto be32 = [](std::vector<std::uint8_t> &out, std::uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8) out.push_back(std::uint8_t(value >> shift));
+    };
+    std::vector<std::uint8_t> file = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    auto chunk = [&](const char *type, const std::vector<std::uint8_t> &data) {
+        be32(file, std::uint32_t(data.size()));
+        file.insert(file.end(), type, type + 4);
+        file.insert(file.end(), data.begin(), data.end());
+        be32(file, 0);
+    };
+    std::vector<std::uint8_t> header;
+    be32(header, std::uint32_t(w));
+    be32(header, std::uint32_t(h));
+    const std::uint8_t colorType[] = {0, 0, 4, 2, 6};
+    header.insert(header.end(), {8, colorType[channels], 0, 0, 0});
+    chunk("IHDR", header);
+
+    // filter type 0 per row
+    std::vector<std::uint8_t> raw;
+    for (int y = 0; y < h; y++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), pixels.begin() + y * w * channels, pixels.begin() + (y + 1) * w * channels);
+    }
+    std::vector<std::uint8_t> zlib = {0x78, 0x01};
+    for (std::size_t offset = 0; offset < raw.size(); offset += 0xFFFF) {
+        auto length = std::uint16_t(std::min<std::size_t>(0xFFFF, raw.size() - offset));
+        zlib.insert(zlib.end(), {std::uint8_t(offset + length == raw.size()), std::uint8_t(length),
+                                 std::uint8_t(length >> 8), std::uint8_t(~length), std::uint8_t(~length >> 8)});
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+    }
+    be32(zlib, 0);
+    for (std::size_t offset = 0; offset < zlib.size(); offset += 4096)
+        chunk("IDAT", std::vector<std::uint8_t>(zlib.begin() + offset,
+                                                zlib.begin() + std::min(zlib.size(), offset + 4096)));
+    chunk("IEND", {});
+    return file;
+}
+
+void testDecodeArena() {
+    // blocks are aligned, the latest one grows and shrinks in place
+    DecodeArena arena;
+    auto *a = arena.allocate(10);
+    auto *b = arena.allocate(100);
+    ASSERT_THROW(a && b && a != b && arena.owns(a) && arena.owns(b));
+    ASSERT_EQUAL(reinterpret_cast<std::uintptr_t>(b) % 16, std::uintptr_t(0));
+    std::memset(b, 7, 100);
+    ASSERT_THROW(arena.reallocate(b, 5000) == b);
+    ASSERT_EQUAL(static_cast<std::uint8_t *>(b)[99], 7);
+    auto *moved = arena.reallocate(a, 64);
+    ASSERT_THROW(moved != a && arena.owns(moved));
+    arena.release(moved);
+    ASSERT_THROW(arena.allocate(64) == moved);
+    // bigger than a chunk
+    auto *big = arena.allocate(3u << 20u);
+    ASSERT_THROW(big && arena.owns(big));
+    ASSERT_EQUAL(arena.system_allocations(), std::size_t(2));
+    int local = 0;
+    ASSERT_THROW(!arena.owns(&local));
+    // chunks are merged by reset, after which the same allocations fit
+    arena.reset();
+    ASSERT_EQUAL(arena.system_allocations(), std::size_t(3));
+    ASSERT_THROW(arena.allocate(3u << 20u));
+    ASSERT_EQUAL(arena.system_allocations(), std::size_t(3));
+
+    // decoded into the caller's buffer: same pixels as stb's own allocations
+    const int w = 123, h = 45;
+    std::vector<std::uint8_t> rgba(w * h * 4);
+    for (std::size_t i = 0; i < rgba.size(); i++) rgba[i] = std::uint8_t((i * 7 + i / 333) % 256);
+    std::vector<std::uint8_t> jpeg;
+    ASSERT_THROW(TooJpeg17::writeJpeg<90>(TooJpeg17::VectorSink(jpeg), rgba.data(), w, h, true, true));
+    const std::vector<std::vector<std::uint8_t>> files{jpeg, png(w, h, 4, rgba), png(w, h, 1, rgba), tga(w, h, 4, rgba)};
+    std::vector<std::uint8_t> pixels;
+    auto &threadArena = DecodeArena::current_thread();
+    std::size_t allocations = 0;
+    for (int round = 0; round < 4; round++) {
+        for (auto &file: files) {
+            ImageLoader reference(file.data(), file.size());
+            ImageLoader image(file.data(), file.size(), pixels);
+            ASSERT_THROW(reference.is_valid() && image.is_valid());
+            ASSERT_EQUAL(image.width, w);
+            ASSERT_EQUAL(image.height, h);
+            ASSERT_EQUAL(image.channels, reference.channels);
+            ASSERT_EQUAL(image.sourceChannels, reference.sourceChannels);
+            ASSERT_THROW(*image == pixels.data());
+            ASSERT_EQUAL(pixels.size(), std::size_t(w * h * image.channels));
+            ASSERT_THROW(std::equal(pixels.begin(), pixels.end(), *reference));
+        }
+        // the steady state does not allocate
+        if (round == 1) allocations = threadArena.system_allocations();
+        if (round > 1) ASSERT_EQUAL(threadArena.system_allocations(), allocations);
+    }
+    ASSERT_THROW(allocations > 0);
+    auto truncated = files[1];
+    truncated.resize(truncated.size() / 2);
+    ASSERT_THROW(!ImageLoader(truncated.data(), truncated.size(), pixels).is_valid());
+    ASSERT_THROW(!ImageLoader(nullptr, 0, pixels).is_valid());
+
+    // one arena per thread
+    std::vector<std::thread> threads;
+    std::atomic<int> failed{0};
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([&] {
+            std::vector<std::uint8_t> buffer;
+            for (int i = 0; i < 20; i++) {
+                auto &file = files[std::size_t(i) % files.size()];
+                ImageLoader reference(file.data(), file.size());
+                ImageLoader image(file.data(), file.size(), buffer);
+                if (!image.is_valid() || !std::equal(buffer.begin(), buffer.end(), *reference)) failed++;
+            }
+        });
+    for (auto &thread: threads) thread.join();
+    ASSERT_EQUAL(failed.load(), 0);
+}
+
+void testJobServer() {
+    // a group waits for its own jobs only, failed and throwing jobs are counted
+    TooJpeg17::BatchEncoder encoder(2);
+    TooJpeg17::JobGroup group;
+    std::atomic<int> ran{0};
+    for (int i = 0; i < 10; i++)
+        encoder.submit(group.add([&ran, i](TooJpeg17::BatchEncoder::Scratch &) {
+            ran++;
+            if (i == 3) throw std::runtime_error("job failed");
+            return i != 5;
+        }));
+    group.wait();
+    ASSERT_EQUAL(ran.load(), 10);
+    ASSERT_EQUAL(group.failed(), std::size_t(2));
+
+    auto image = [](unsigned w, unsigned h) {
+        std::vector<std::uint8_t> rgb(w * h * 3);
+        for (std::size_t i = 0; i < rgb.size(); i++) rgb[i] = std::uint8_t((i * 13 + i / 97) % 256);
+        return rgb;
+    };
+    auto socket = std::filesystem::temp_directory_path() / ("toojpeg17_test_" + std::to_string(::getpid()) + ".socket");
+    std::optional<JobServer> server;
+    server.emplace(socket, [&](std::vector<JobServer::Request> &&requests) {
+        for (auto &request: requests) {
+            if (request.command == "encode") {
+                auto w = unsigned(std::stoul(request.arguments.at(0))), h = unsigned(std::stoul(request.arguments.at(1)));
+                encoder.submit([request, w, h, &image](TooJpeg17::BatchEncoder::Scratch &scratch) {
+                    auto pixels = image(w, h);
+                    if (!scratch.encode(pixels.data(), w, h, true, true, 90)) return false;
+                    request.ok_shared(ByteView(scratch.output.data(), scratch.output.size()), "encoded");
+                    return true;
+                });
+            } else if (request.command == "echo") request.ok(request.arguments.empty() ? "" : request.arguments[0]);
+            else if (request.command == "stop") {
+                request.ok();
+                server->stop();
+            } else request.error("unknown");
+        }
+    });
+    std::thread serving([&] { server->run(); });
+
+    // pipelined requests, replies in any order
+    JobClient client(socket);
+    for (auto line: {"1 encode 64 32", "2 echo hello", "broken", "3 encode 17 9", "4 frobnicate", "5 encode 300 200"})
+        ASSERT_THROW(client.send(line));
+    std::map<std::string, JobClient::Reply> replies;
+    for (int i = 0; i < 6; i++) {
+        auto reply = client.receive();
+        ASSERT_THROW(reply.has_value());
+        auto id = reply->id;
+        replies.emplace(id, std::move(*reply));
+    }
+    ASSERT_EQUAL(replies.size(), std::size_t(6));
+    ASSERT_THROW(replies.at("2").ok() && !replies.at("2").shared.is_valid());
+    ASSERT_EQUAL(replies.at("2").text, "hello");
+    ASSERT_THROW(!replies.at("broken").ok());
+    ASSERT_THROW(!replies.at("4").ok() && !replies.at("4").shared.is_valid());
+    for (auto [id, w, h]: {std::tuple{"1", 64u, 32u}, {"3", 17u, 9u}, {"5", 300u, 200u}}) {
+        auto &reply = replies.at(id);
+        ASSERT_THROW(reply.ok() && reply.shared.is_valid());
+        std::vector<std::uint8_t> expected;
+        auto pixels = image(w, h);
+        ASSERT_THROW(TooJpeg17::writeJpegQuality(TooJpeg17::VectorSink(expected), pixels.data(), w, h, true, true, 90));
+        ASSERT_EQUAL(reply.text, std::to_string(expected.size()) + " encoded");
+        ASSERT_EQUAL(reply.shared.size(), expected.size());
+        ASSERT_THROW(std::equal(expected.begin(), expected.end(), reply.shared.data()));
+    }
+
+    // a second client, then shutdown
+    JobClient other(socket);
+    ASSERT_THROW(other.send("6 echo") && other.send("7 stop"));
+    auto echo = other.receive(), stop = other.receive();
+    ASSERT_THROW(echo && stop && echo->id == "6" && echo->ok() && echo->text.empty() && stop->id == "7" && stop->ok());
+    serving.join();
+    encoder.wait();
+    server.reset();
+    ASSERT_THROW(!std::filesystem::exists(socket));
+}
+
+void testProgressive() {
+    using namespace TooJpeg17;
+    auto image = [](uint32_t w, uint32_t h, unsigned channels) {
+        std::mt19937 random(w * h);
+        std::vector<unsigned char> pixels(w * h * channels);
+        for (uint32_t y = 0; y < h; y++)
+            for (uint32_t x = 0; x < w; x++)
+                for (uint32_t c = 0; c < channels; c++)
+                    pixels[(y * w + x) * channels + c] = uint8_t((x * 3 + y * (c + 1) + random() % 48) % 256);
+        return pixels;
+    };
+    auto encode = [](const std::vector<unsigned char> &pixels, uint32_t w, uint32_t h, bool downsample, bool isRGB,
+                     unsigned char quality, const EncodeOptions &options) {
+        std::vector<std::uint8_t> out;
+        ASSERT_THROW(writeJpegQuality(VectorSink(out), pixels.data(), w, h, downsample, isRGB, quality, "", options));
+        return out;
+    };
+    auto markers = [](const std::vector<std::uint8_t> &jpeg, std::uint8_t marker) {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i + 1 < jpeg.size(); i++) count += jpeg[i] == 0xFF && jpeg[i + 1] == marker;
+        return count;
+    };
+    auto decoded = [](const std::vector<std::uint8_t> &jpeg) {
+        ImageLoader loaded(jpeg.data(), jpeg.size());
+        ASSERT_THROW(loaded.is_valid());
+        return std::vector<std::uint8_t>(*loaded, *loaded + loaded.width * loaded.height * loaded.channels);
+    };
+
+    constexpr uint8_t Y = 1, Cb = 2, Cr = 4, All = Y | Cb | Cr;
+    const std::vector<ProgressiveScan> spectral{{All, 0, 0, 0, 0}, {Y, 1, 63, 0, 0}, {Cb, 1, 63, 0, 0},
+                                                {Cr, 1, 63, 0, 0}};
+    const std::vector<ProgressiveScan> approximation{
+            {All, 0, 0, 0, 3}, {All, 0, 0, 3, 2}, {Y, 1, 63, 0, 3}, {Y, 1, 63, 3, 2}, {Y, 1, 63, 2, 1},
+            {Cb, 1, 9, 0, 1}, {Cb, 10, 63, 0, 0}, {Cb, 1, 9, 1, 0}, {Cr, 1, 63, 0, 0}, {All, 0, 0, 2, 1},
+            {Y, 1, 63, 1, 0}, {All, 0, 0, 1, 0}};
+    const std::vector<ProgressiveScan> separateDC{{Cr, 0, 0, 0, 0}, {Y, 0, 0, 0, 1}, {Cb, 0, 0, 0, 0},
+                                                  {Y, 1, 63, 0, 0}, {Y, 0, 0, 1, 0}, {Cb, 1, 63, 0, 0},
+                                                  {Cr, 1, 63, 0, 0}};
+    const std::vector<ProgressiveScan> gray{{Y, 0, 0, 0, 2}, {Y, 1, 2, 0, 0}, {Y, 3, 63, 0, 1}, {Y, 0, 0, 2, 1},
+                                            {Y, 3, 63, 1, 0}, {Y, 0, 0, 1, 0}};
+
+    // the same coefficients as the baseline encoding: a decoder computes the very same pixels
+    for (auto [w, h, downsample, isRGB]: {std::tuple{123u, 45u, true, true}, {64u, 64u, false, true},
+                                          {203u, 117u, true, true}, {37u, 29u, false, false}}) {
+        auto pixels = image(w, h, isRGB ? 3 : 1);
+        for (unsigned char quality: {50, 95}) {
+            EncodeOptions baseline, optimized;
+            optimized.optimizeHuffman = true;
+            auto reference = encode(pixels, w, h, downsample, isRGB, quality, optimized);
+            auto expected = decoded(reference);
+            auto scripts = isRGB ? std::vector{std::vector<ProgressiveScan>{}, spectral, approximation, separateDC}
+                                 : std::vector{std::vector<ProgressiveScan>{}, gray};
+            for (auto &script: scripts) {
+                EncodeOptions progressive;
+                progressive.progressive = true;
+                progressive.scanScript = script;
+                auto jpeg = encode(pixels, w, h, downsample, isRGB, quality, progressive);
+                ASSERT_EQUAL(markers(jpeg, 0xC2), std::size_t(1));
+                ASSERT_EQUAL(markers(jpeg, 0xC0), std::size_t(0));
+                ASSERT_EQUAL(markers(jpeg, 0xDA), (script.empty() ? default_scan_script(isRGB) : script).size());
+                ASSERT_THROW(decoded(jpeg) == expected);
+            }
+            // the default script needs less than the standard tables
+            EncodeOptions progressive;
+            progressive.progressive = true;
+            ASSERT_THROW(encode(pixels, w, h, downsample, isRGB, quality, progressive).size() <
+                         encode(pixels, w, h, downsample, isRGB, quality, baseline).size());
+        }
+    }
+
+    // end of block runs longer than 0x7FFF blocks
+    {
+        const uint32_t w = 1600, h = 1600;
+        std::vector<unsigned char> pixels(w * h, 100);
+        pixels[w * h / 2] = 0;
+        EncodeOptions optimized, progressive;
+        optimized.optimizeHuffman = true;
+        progressive.progressive = true;
+        ASSERT_THROW(decoded(encode(pixels, w, h, false, false, 90, progressive)) ==
+                     decoded(encode(pixels, w, h, false, false, 90, optimized)));
+    }
+
+    // the byte budget search works on the same coefficients
+    {
+        const uint32_t w = 173, h = 91;
+        auto pixels = image(w, h, 3);
+        EncodeOptions progressive;
+        progressive.progressive = true;
+        std::vector<std::uint8_t> output;
+        auto result = writeJpegTargetSize(VectorSink(output), pixels.data(), w, h, true, true, TargetSize{4000}, "",
+                                          progressive);
+        ASSERT_THROW(result && result->fits && output.size() <= 4000);
+        ASSERT_THROW(output == encode(pixels, w, h, true, true, result->quality, progressive));
+    }
+
+    // incomplete or inconsistent scripts
+    const std::vector<std::vector<ProgressiveScan>> invalid{
+            {{All, 0, 0, 0, 0}, {Y, 1, 63, 0, 0}, {Cb, 1, 63, 0, 0}},
+            {{All, 0, 0, 0, 0}, {Y | Cb, 1, 63, 0, 0}, {Cr, 1, 63, 0, 0}},
+            {{Y, 1, 63, 0, 0}, {All, 0, 0, 0, 0}, {Cb, 1, 63, 0, 0}, {Cr, 1, 63, 0, 0}},
+            {{All, 0, 0, 0, 0}, {Y, 1, 63, 0, 2}, {Y, 1, 63, 1, 0}, {Cb, 1, 63, 0, 0}, {Cr, 1, 63, 0, 0}},
+            {{All, 0, 0, 0, 0}, {All, 0, 0, 0, 0}, {Y, 1, 63, 0, 0}, {Cb, 1, 63, 0, 0}, {Cr, 1, 63, 0, 0}},
+            {{All, 0, 5, 0, 0}, {Y, 6, 63, 0, 0}, {Cb, 6, 63, 0, 0}, {Cr, 6, 63, 0, 0}}};
+    auto pixels = image(16, 16, 3);
+    for (auto &script: invalid) {
+        EncodeOptions progressive;
+        progressive.progressive = true;
+        progressive.scanScript = script;
+        bool thrown = false;
+        std::vector<std::uint8_t> out;
+        try { writeJpegQuality(VectorSink(out), pixels.data(), 16, 16, false, true, 90, "", progressive); }
+        catch (const std::runtime_error &) { thrown = true; }
+        ASSERT_THROW(thrown);
+    }
+    // a grayscale image has only Y
+    EncodeOptions progressive;
+    progressive.progressive = true;
+    progressive.scanScript = spectral;
+    bool thrown = false;
+    std::vector<std::uint8_t> out;
+    try { writeJpegQuality(VectorSink(out), pixels.data(), 16, 16, false, false, 90, "", progressive); }
+    catch (const std::runtime_error &) { thrown = true; }
+    ASSERT_THROW(thrown);
+}
+
 int main(int argc, char *argv[]) {
     std::ios_base::sync_with_stdio(false);
 
     ASSERT_EQUAL(argc, 2);
-    switch (argv[1][0]) {
-        case '0':
+    switch (std::stoi(argv[1])) {
+        case 0:
             testColor();
             break;
-        case '1':
+        case 1:
             testGrayscale();
             break;
+        case 2:
+            testSinks();
+            break;
+        case 3:
+            testDctKernels();
+            break;
+        case 4:
+            testRestartIntervals();
+            break;
+        case 5:
+            testBatchEncoder();
+            break;
+        case 6:
+            testScanlineEncoder();
+            break;
+        case 7:
+            testMappedLoader();
+            break;
+        case 8:
+            testJpegPassthrough();
+            break;
+        case 9:
+            testNativeChannels();
+            break;
+        case 10:
+            testLargeDimensions();
+            break;
+        case 11:
+            testOptimizedHuffman();
+            break;
+        case 12:
+            testBoundedSubmit();
+            break;
+        case 13:
+            testIoEngine(IoEngine::Backend::Auto);
+            break;
+        case 14:
+            testIoEngine(IoEngine::Backend::Threads);
+            break;
+        case 15:
+            testDirectoryScanner();
+            break;
+        case 16:
+            testMetrics();
+            break;
+        case 17:
+            testQuantTables();
+            break;
+        case 18:
+            testColorFrontEnd();
+            break;
+        case 19:
+            testBitWriter();
+            break;
+        case 20:
+            testTargetSize();
+            break;
+        case 21:
+            testResize();
+            break;
+        case 22:
+            testDecodeArena();
+            break;
+        case 23:
+            testJobServer();
+            break;
+        case 24:
+            testProgressive();
+            break;
     }
     return 0;
 }
\ No newline at end of file
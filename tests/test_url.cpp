@@ -1,11 +1,14 @@
 //! A real test suite would use GTest etc
 #include "tests.h"
 #include "url.h"
+#include "image_url_scanner.h"
 
 #include <regex>
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <iterator>
+#include <vector>
 
 using namespace Socket;
 
@@ -52,8 +55,7 @@ void testRegex() {
     ASSERT_EQUAL("https://upload.wikimedia.org/wikipedia/en/thumb/9/9e/Flag_of_Japan.svg/30px-Flag_of_Japan.svg.png",
                  image_url.full());
 
-    auto filename = std::filesystem::current_path().parent_path().parent_path().append(
-            "tests/webcrawling_testpage.txt");
+    auto filename = std::filesystem::path(TEST_SOURCE_DIR).append("webcrawling_testpage.txt");
     std::fstream file(filename, std::ios::binary | std::ios::in);
     std::istream_iterator<char> start(file), end;
     std::string crawled_page_test_data(start, end);
@@ -73,6 +75,40 @@ void testRegex() {
     }
 }
 
+std::vector<std::string> scan(std::string_view page, std::size_t chunk_size) {
+    std::vector<std::string> urls;
+    ImageUrlScanner scanner;
+    for (std::size_t pos = 0; pos < page.size(); pos += chunk_size)
+        scanner.feed(page.substr(pos, chunk_size), [&](std::string_view url) { urls.emplace_back(url); });
+    return urls;
+}
+
+void testImageUrlScanner() {
+    const std::string_view page = R"(<img src="a.png"><img src='/b/c.JPG' alt=x>src="no.txt" src=d.gif<img src="">)"
+                                  R"(srcsrc="//e.org/f.bmp"<img src="g.pnm'>)";
+    const std::vector<std::string> expected{"a.png", "/b/c.JPG", "//e.org/f.bmp", "g.pnm"};
+    // the same urls for any chunking, urls across chunk boundaries are carried over
+    for (std::size_t chunk_size = 1; chunk_size <= page.size(); chunk_size++)
+        ASSERT_THROW(scan(page, chunk_size) == expected);
+
+    // overlong values are skipped, scanning continues after them
+    std::string overlong = "src=\"" + std::string(ImageUrlScanner::MaxUrlLength + 10, 'x') + ".png\" src='h.png'";
+    ASSERT_THROW(scan(overlong, 1000) == std::vector<std::string>{"h.png"});
+    ASSERT_THROW(scan(overlong, overlong.size()) == std::vector<std::string>{"h.png"});
+
+    // matches the crawler regex on a real page
+    auto filename = std::filesystem::path(TEST_SOURCE_DIR).append("webcrawling_testpage.txt");
+    std::fstream file(filename, std::ios::binary | std::ios::in);
+    std::string crawled_page((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_THROW(!crawled_page.empty());
+    static const std::regex url_regex(R"(src=["']([^"']*?(?:jpg|png|bmp|gif|pnm|JPG|PNG|BMP|GIF|PNM))["'])");
+    std::vector<std::string> regex_urls;
+    for (std::sregex_iterator i(crawled_page.begin(), crawled_page.end(), url_regex), end; i != end; ++i)
+        regex_urls.push_back((*i)[1].str());
+    ASSERT_THROW(!regex_urls.empty());
+    ASSERT_THROW(scan(crawled_page, 1500) == regex_urls);
+}
+
 int main(int argc, char *argv[]) {
     ASSERT_EQUAL(argc, 2);
     switch (argv[1][0]) {
@@ -91,5 +127,8 @@ int main(int argc, char *argv[]) {
         case '4':
             testRegex();
             break;
+        case '5':
+            testImageUrlScanner();
+            break;
     }
 }
\ No newline at end of file